@@ -17,6 +17,7 @@ import java.io.BufferedReader;
 import java.io.FileReader;
 import java.io.File;
 import java.io.IOException;
+import java.util.concurrent.atomic.AtomicInteger;
 
 public class LlamaContext {
   public static final String NAME = "RNLlamaContext";
@@ -80,6 +81,8 @@ public class LlamaContext {
       params.hasKey("n_batch") ? params.getInt("n_batch") : 512,
       // int n_ubatch,
       params.hasKey("n_ubatch") ? params.getInt("n_ubatch") : 512,
+      // int n_parallel,
+      params.hasKey("n_parallel") ? params.getInt("n_parallel") : 1,
       // int n_threads,
       params.hasKey("n_threads") ? params.getInt("n_threads") : 0,
       // int n_gpu_layers, // TODO: Support this
@@ -90,10 +93,14 @@ public class LlamaContext {
       params.hasKey("cache_type_k") ? params.getString("cache_type_k") : "f16",
       // String cache_type_v,
       params.hasKey("cache_type_v") ? params.getString("cache_type_v") : "f16",
+      // int kv_recent_window,
+      params.hasKey("kv_recent_window") ? params.getInt("kv_recent_window") : 0,
       // boolean use_mlock,
       params.hasKey("use_mlock") ? params.getBoolean("use_mlock") : true,
       // boolean use_mmap,
       params.hasKey("use_mmap") ? params.getBoolean("use_mmap") : true,
+      // boolean use_lazy_load,
+      params.hasKey("use_lazy_load") ? params.getBoolean("use_lazy_load") : false,
       //boolean vocab_only,
       params.hasKey("vocab_only") ? params.getBoolean("vocab_only") : false,
       // String lora,
@@ -110,6 +117,14 @@ public class LlamaContext {
       params.hasKey("pooling_type") ? params.getInt("pooling_type") : -1,
       // boolean ctx_shift,
       params.hasKey("ctx_shift") ? params.getBoolean("ctx_shift") : true,
+      // String ctx_shift_policy,
+      params.hasKey("ctx_shift_policy") ? params.getString("ctx_shift_policy") : "block",
+      // int ctx_shift_n_sink,
+      params.hasKey("ctx_shift_n_sink") ? params.getInt("ctx_shift_n_sink") : 4,
+      // int ctx_checkpoint_interval,
+      params.hasKey("ctx_checkpoint_interval") ? params.getInt("ctx_checkpoint_interval") : 256,
+      // int ctx_checkpoint_max,
+      params.hasKey("ctx_checkpoint_max") ? params.getInt("ctx_checkpoint_max") : 8,
       // LoadProgressCallback load_progress_callback
       params.hasKey("use_progress_callback") ? new LoadProgressCallback(this) : null
     );
@@ -118,6 +133,7 @@ public class LlamaContext {
     }
     this.modelDetails = loadModelDetails(this.context);
     this.reactContext = reactContext;
+    addJSIContext(this.context, id);
   }
 
   public void interruptLoad() {
@@ -187,15 +203,28 @@ public class LlamaContext {
   private static class PartialCompletionCallback {
     LlamaContext context;
     boolean emitNeeded;
+    // Partial completions emitted but not yet handled by JS, the native emitter coalesces meanwhile
+    final AtomicInteger pending = new AtomicInteger();
 
     public PartialCompletionCallback(LlamaContext context, boolean emitNeeded) {
       this.context = context;
       this.emitNeeded = emitNeeded;
     }
 
+    boolean isEmitNeeded() {
+      return emitNeeded;
+    }
+
+    boolean isBusy() {
+      return pending.get() > 0;
+    }
+
     void onPartialCompletion(WritableMap tokenResult) {
       if (!emitNeeded) return;
+      pending.incrementAndGet();
       context.emitPartialCompletion(tokenResult);
+      // Queued after the event on the JS thread, so it runs once JS has handled it
+      context.reactContext.runOnJSQueueThread(pending::decrementAndGet);
     }
   }
 
@@ -324,8 +353,20 @@ public class LlamaContext {
       params.hasKey("top_n_sigma") ? (float) params.getDouble("top_n_sigma") : -1.0f,
       // String[] dry_sequence_breakers, when undef, we use the default definition from common.h
       params.hasKey("dry_sequence_breakers") ? params.getArray("dry_sequence_breakers").toArrayList().toArray(new String[0]) : new String[]{"\n", ":", "\"", "*"},
+      // int n_branches,
+      params.hasKey("n_branches") ? params.getInt("n_branches") : 1,
+      // ReadableArray branch_lora
+      params.hasKey("branch_lora") ? params.getArray("branch_lora") : null,
+      // int deadline_ms
+      params.hasKey("deadline_ms") ? params.getInt("deadline_ms") : 0,
+      // int step_budget_ms
+      params.hasKey("step_budget_ms") ? params.getInt("step_budget_ms") : 0,
       // String[] media_paths
       params.hasKey("media_paths") ? params.getArray("media_paths").toArrayList().toArray(new String[0]) : new String[0],
+      // int emit_partial_interval
+      params.hasKey("emit_partial_interval") ? params.getInt("emit_partial_interval") : 0,
+      // int emit_partial_max_tokens
+      params.hasKey("emit_partial_max_tokens") ? params.getInt("emit_partial_max_tokens") : 0,
       // PartialCompletionCallback partial_completion_callback
       new PartialCompletionCallback(
         this,
@@ -366,7 +407,11 @@ public class LlamaContext {
       this.context,
       text,
       // int embd_normalize,
-      params.hasKey("embd_normalize") ? params.getInt("embd_normalize") : -1
+      params.hasKey("embd_normalize") ? params.getInt("embd_normalize") : -1,
+      // int embd_dims,
+      params.hasKey("embd_dims") ? params.getInt("embd_dims") : 0,
+      // int embd_quantize,
+      embeddingQuantType(params.hasKey("embd_quantize") ? params.getString("embd_quantize") : null)
     );
     if (result.hasKey("error")) {
       throw new IllegalStateException(result.getString("error"));
@@ -374,6 +419,12 @@ public class LlamaContext {
     return result;
   }
 
+  private static int embeddingQuantType(String type) {
+    if ("int8".equals(type)) return 1;
+    if ("binary".equals(type)) return 2;
+    return 0;
+  }
+
   public WritableArray getRerank(String query, ReadableArray documents, ReadableMap params) {
     if (isEmbeddingEnabled(this.context) == false) {
       throw new IllegalStateException("Embedding is not enabled but required for reranking");
@@ -411,6 +462,17 @@ public class LlamaContext {
     removeLoraAdapters(this.context);
   }
 
+  public void mergeLoraAdapters(ReadableArray loraAdapters, String cachePath) {
+    String error = mergeLoraAdapters(this.context, loraAdapters, cachePath == null ? "" : cachePath);
+    if (error != null) {
+      throw new IllegalStateException(error);
+    }
+  }
+
+  public void unmergeLoraAdapters() {
+    unmergeLoraAdapters(this.context);
+  }
+
   public WritableArray getLoadedLoraAdapters() {
     return getLoadedLoraAdapters(this.context);
   }
@@ -459,7 +521,7 @@ public class LlamaContext {
     return getAudioCompletionGuideTokens(this.context, textToSpeak);
   }
 
-  public WritableArray decodeAudioTokens(ReadableArray tokens) {
+  public WritableMap decodeAudioTokens(ReadableArray tokens) {
     int[] toks = new int[tokens.size()];
     for (int i = 0; i < tokens.size(); i++) {
       toks[i] = (int) tokens.getDouble(i);
@@ -471,6 +533,90 @@ public class LlamaContext {
     releaseVocoder(this.context);
   }
 
+  public WritableMap initVectorStore(String path, ReadableMap params) {
+    if (isEmbeddingEnabled(this.context) == false) {
+      throw new IllegalStateException("Embedding is not enabled but required for the vector store");
+    }
+    String quantize = params.hasKey("quantize") ? params.getString("quantize") : null;
+    WritableMap result = initVectorStore(
+      this.context,
+      path,
+      // int n_dims,
+      params.hasKey("n_dims") ? params.getInt("n_dims") : 0,
+      // int quant, -1 keeps the type of an existing store
+      quantize == null ? -1 : "float".equals(quantize) ? 0 : "binary".equals(quantize) ? 2 : 1
+    );
+    if (result.hasKey("error")) {
+      throw new IllegalStateException(result.getString("error"));
+    }
+    return result;
+  }
+
+  public WritableArray vectorStoreAdd(ReadableArray texts, ReadableMap params) {
+    String[] textsArray = new String[texts.size()];
+    for (int i = 0; i < texts.size(); i++) {
+      textsArray[i] = texts.getString(i);
+    }
+    double[] keys = null;
+    if (params.hasKey("keys")) {
+      ReadableArray keysArray = params.getArray("keys");
+      keys = new double[keysArray.size()];
+      for (int i = 0; i < keysArray.size(); i++) {
+        keys[i] = keysArray.getDouble(i);
+      }
+    }
+    WritableMap result = vectorStoreAdd(
+      this.context,
+      textsArray,
+      keys,
+      // boolean store_text,
+      params.hasKey("store_text") ? params.getBoolean("store_text") : true
+    );
+    if (result.hasKey("error")) {
+      throw new IllegalStateException(result.getString("error"));
+    }
+    return result.getArray("keys");
+  }
+
+  public WritableArray vectorStoreSearch(String query, ReadableMap params, LlamaContext rerankContext) {
+    WritableMap result = vectorStoreSearch(
+      this.context,
+      query,
+      // int k,
+      params.hasKey("k") ? params.getInt("k") : 10,
+      // int n_probe,
+      params.hasKey("n_probe") ? params.getInt("n_probe") : 0,
+      // long rerank_context,
+      rerankContext != null ? rerankContext.getContext() : 0,
+      // int n_rerank,
+      params.hasKey("n_rerank") ? params.getInt("n_rerank") : 0
+    );
+    if (result.hasKey("error")) {
+      throw new IllegalStateException(result.getString("error"));
+    }
+    return result.getArray("results");
+  }
+
+  public void vectorStoreBuildIndex(int nLists) {
+    String error = vectorStoreBuildIndex(this.context, nLists);
+    if (error != null) {
+      throw new IllegalStateException(error);
+    }
+  }
+
+  public void releaseVectorStore() {
+    releaseVectorStore(this.context);
+  }
+
+  public WritableMap getMemoryFootprint() {
+    return getMemoryFootprint(this.context);
+  }
+
+  public boolean releaseResidency(int level) {
+    File stateFile = new File(reactContext.getCacheDir(), "rnllama-state-" + id + ".bin");
+    return releaseResidency(this.context, level, stateFile.getAbsolutePath());
+  }
+
   public void release() {
     freeContext(context);
   }
@@ -527,6 +673,21 @@ public class LlamaContext {
     }
   }
 
+  // Empty when the bindings are installed, otherwise the reason they are not
+  static String installJSI(ReactApplicationContext reactContext) {
+    if (LlamaContext.isArchNotSupported()) {
+      return "Only 64-bit architectures are supported";
+    }
+    if (!isJSIBuilt()) {
+      return "The native library is built without JSI, build it from source (rnllamaBuildFromSource=true) to use the sync methods";
+    }
+    long runtimePtr = reactContext.getJavaScriptContextHolder().get();
+    if (runtimePtr == 0) {
+      return "The JS runtime is not reachable, e.g. remote debugging";
+    }
+    return installJSI(runtimePtr) ? "" : "Failed to install the JSI bindings";
+  }
+
   private static boolean isArm64V8a() {
     return Build.SUPPORTED_ABIS[0].equals("arm64-v8a");
   }
@@ -571,13 +732,16 @@ public class LlamaContext {
     int n_ctx,
     int n_batch,
     int n_ubatch,
+    int n_parallel,
     int n_threads,
     int n_gpu_layers, // TODO: Support this
     boolean flash_attn,
     String cache_type_k,
     String cache_type_v,
+    int kv_recent_window,
     boolean use_mlock,
     boolean use_mmap,
+    boolean use_lazy_load,
     boolean vocab_only,
     String lora,
     float lora_scaled,
@@ -586,6 +750,10 @@ public class LlamaContext {
     float rope_freq_scale,
     int pooling_type,
     boolean ctx_shift,
+    String ctx_shift_policy,
+    int ctx_shift_n_sink,
+    int ctx_checkpoint_interval,
+    int ctx_checkpoint_max,
     LoadProgressCallback load_progress_callback
   );
   protected static native boolean initMultimodal(long contextPtr, String mmproj_path, boolean MMPROJ_USE_GPU);
@@ -658,7 +826,13 @@ public class LlamaContext {
     int dry_penalty_last_n,
     float top_n_sigma,
     String[] dry_sequence_breakers,
+    int n_branches,
+    ReadableArray branch_lora,
+    int deadline_ms,
+    int step_budget_ms,
     String[] media_paths,
+    int emit_partial_interval,
+    int emit_partial_max_tokens,
     PartialCompletionCallback partial_completion_callback
   );
   protected static native void stopCompletion(long contextPtr);
@@ -669,12 +843,16 @@ public class LlamaContext {
   protected static native WritableMap embedding(
     long contextPtr,
     String text,
-    int embd_normalize
+    int embd_normalize,
+    int embd_dims,
+    int embd_quantize
   );
   protected static native WritableArray rerank(long contextPtr, String query, String[] documents, int normalize);
   protected static native String bench(long contextPtr, int pp, int tg, int pl, int nr);
   protected static native int applyLoraAdapters(long contextPtr, ReadableArray loraAdapters);
   protected static native void removeLoraAdapters(long contextPtr);
+  protected static native String mergeLoraAdapters(long contextPtr, ReadableArray loraAdapters, String cachePath);
+  protected static native void unmergeLoraAdapters(long contextPtr);
   protected static native WritableArray getLoadedLoraAdapters(long contextPtr);
   protected static native void freeContext(long contextPtr);
   protected static native void setupLog(NativeLogCallback logCallback);
@@ -683,7 +861,17 @@ public class LlamaContext {
   protected static native boolean isVocoderEnabled(long contextPtr);
   protected static native String getFormattedAudioCompletion(long contextPtr, String speakerJsonStr, String textToSpeak);
   protected static native WritableArray getAudioCompletionGuideTokens(long contextPtr, String textToSpeak);
-  protected static native WritableArray decodeAudioTokens(long contextPtr, int[] tokens);
+  protected static native WritableMap decodeAudioTokens(long contextPtr, int[] tokens);
   protected static native boolean initVocoder(long contextPtr, String vocoderModelPath);
   protected static native void releaseVocoder(long contextPtr);
+  protected static native WritableMap getMemoryFootprint(long contextPtr);
+  protected static native boolean releaseResidency(long contextPtr, int level, String statePath);
+  protected static native WritableMap initVectorStore(long contextPtr, String path, int n_dims, int quant);
+  protected static native WritableMap vectorStoreAdd(long contextPtr, String[] texts, double[] keys, boolean store_text);
+  protected static native WritableMap vectorStoreSearch(long contextPtr, String query, int k, int n_probe, long rerank_context, int n_rerank);
+  protected static native String vectorStoreBuildIndex(long contextPtr, int n_lists);
+  protected static native void releaseVectorStore(long contextPtr);
+  protected static native boolean isJSIBuilt();
+  protected static native boolean installJSI(long runtimePtr);
+  protected static native void addJSIContext(long contextPtr, int id);
 }
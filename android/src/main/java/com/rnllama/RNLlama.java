@@ -5,6 +5,8 @@ import android.util.Log;
 import android.os.Build;
 import android.os.Handler;
 import android.os.AsyncTask;
+import android.content.ComponentCallbacks2;
+import android.content.res.Configuration;
 
 import com.facebook.react.bridge.Promise;
 import com.facebook.react.bridge.ReactApplicationContext;
@@ -22,13 +24,14 @@ import java.io.File;
 import java.io.FileInputStream;
 import java.io.PushbackInputStream;
 
-public class RNLlama implements LifecycleEventListener {
+public class RNLlama implements LifecycleEventListener, ComponentCallbacks2 {
   public static final String NAME = "RNLlama";
 
   private ReactApplicationContext reactContext;
 
   public RNLlama(ReactApplicationContext reactContext) {
     reactContext.addLifecycleEventListener(this);
+    reactContext.registerComponentCallbacks(this);
     this.reactContext = reactContext;
   }
 
@@ -62,6 +65,20 @@ public class RNLlama implements LifecycleEventListener {
     }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
   }
 
+  // Empty when the bindings are installed, otherwise the reason, the bridge methods are used instead
+  public String installJSI() {
+    String reason;
+    try {
+      reason = LlamaContext.installJSI(reactContext);
+    } catch (UnsatisfiedLinkError e) {
+      reason = "The native library is not loaded: " + e.getMessage();
+    }
+    if (!reason.isEmpty()) {
+      Log.w(NAME, "JSI bindings are not available: " + reason);
+    }
+    return reason;
+  }
+
   private int llamaContextLimit = -1;
 
   public void setContextLimit(double limit, Promise promise) {
@@ -550,6 +567,74 @@ public class RNLlama implements LifecycleEventListener {
     tasks.put(task, "removeLoraAdapters-" + contextId);
   }
 
+  public void mergeLoraAdapters(double id, final ReadableArray loraAdapters, final String cachePath, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, Void>() {
+      private Exception exception;
+
+      @Override
+      protected Void doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          if (context.isPredicting()) {
+            throw new Exception("Context is busy");
+          }
+          context.mergeLoraAdapters(loraAdapters, cachePath);
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(Void result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(null);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "mergeLoraAdapters-" + contextId);
+  }
+
+  public void unmergeLoraAdapters(double id, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, Void>() {
+      private Exception exception;
+
+      @Override
+      protected Void doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          if (context.isPredicting()) {
+            throw new Exception("Context is busy");
+          }
+          context.unmergeLoraAdapters();
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(Void result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(null);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "unmergeLoraAdapters-" + contextId);
+  }
+
   public void getLoadedLoraAdapters(double id, final Promise promise) {
     final int contextId = (int) id;
     AsyncTask task = new AsyncTask<Void, Void, ReadableArray>() {
@@ -887,11 +972,11 @@ public class RNLlama implements LifecycleEventListener {
 
   public void decodeAudioTokens(double id, final ReadableArray tokens, final Promise promise) {
     final int contextId = (int) id;
-    AsyncTask task = new AsyncTask<Void, Void, WritableArray>() {
+    AsyncTask task = new AsyncTask<Void, Void, WritableMap>() {
       private Exception exception;
 
       @Override
-      protected WritableArray doInBackground(Void... voids) {
+      protected WritableMap doInBackground(Void... voids) {
         try {
           LlamaContext context = contexts.get(contextId);
           if (context == null) {
@@ -908,7 +993,7 @@ public class RNLlama implements LifecycleEventListener {
       }
 
       @Override
-      protected void onPostExecute(WritableArray result) {
+      protected void onPostExecute(WritableMap result) {
         if (exception != null) {
           promise.reject(exception);
           return;
@@ -920,6 +1005,321 @@ public class RNLlama implements LifecycleEventListener {
     tasks.put(task, "decodeAudioTokens-" + contextId);
   }
 
+  public void getMemoryFootprint(double id, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, WritableMap>() {
+      private Exception exception;
+
+      @Override
+      protected WritableMap doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          return context.getMemoryFootprint();
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(WritableMap result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(result);
+        tasks.remove(this);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "getMemoryFootprint-" + contextId);
+  }
+
+  public void releaseMemory(double id, double level, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, Boolean>() {
+      private Exception exception;
+
+      @Override
+      protected Boolean doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          if (hasRunningTask(contextId, this)) {
+            return false;
+          }
+          return context.releaseResidency((int) level);
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(Boolean result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(result);
+        tasks.remove(this);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "releaseMemory-" + contextId);
+  }
+
+  public void initVectorStore(double id, final String path, final ReadableMap params, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, WritableMap>() {
+      private Exception exception;
+
+      @Override
+      protected WritableMap doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          String storePath = path;
+          if (storePath.startsWith("file://")) {
+            storePath = storePath.substring(7);
+          }
+          return context.initVectorStore(storePath, params);
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(WritableMap result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(result);
+        tasks.remove(this);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "initVectorStore-" + contextId);
+  }
+
+  public void vectorStoreAdd(double id, final ReadableArray texts, final ReadableMap params, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, WritableArray>() {
+      private Exception exception;
+
+      @Override
+      protected WritableArray doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          if (context.isPredicting()) {
+            throw new Exception("Context is busy");
+          }
+          return context.vectorStoreAdd(texts, params);
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(WritableArray result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(result);
+        tasks.remove(this);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "vectorStoreAdd-" + contextId);
+  }
+
+  public void vectorStoreSearch(double id, final String query, final ReadableMap params, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, WritableArray>() {
+      private Exception exception;
+
+      @Override
+      protected WritableArray doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          if (context.isPredicting()) {
+            throw new Exception("Context is busy");
+          }
+          LlamaContext rerankContext = null;
+          if (params.hasKey("rerank_context_id")) {
+            rerankContext = contexts.get(params.getInt("rerank_context_id"));
+            if (rerankContext == null) {
+              throw new Exception("Rerank context not found");
+            }
+          }
+          return context.vectorStoreSearch(query, params, rerankContext);
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(WritableArray result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(result);
+        tasks.remove(this);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "vectorStoreSearch-" + contextId);
+  }
+
+  public void vectorStoreBuildIndex(double id, final double nLists, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, Void>() {
+      private Exception exception;
+
+      @Override
+      protected Void doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          context.vectorStoreBuildIndex((int) nLists);
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(Void result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(null);
+        tasks.remove(this);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "vectorStoreBuildIndex-" + contextId);
+  }
+
+  public void releaseVectorStore(double id, final Promise promise) {
+    final int contextId = (int) id;
+    AsyncTask task = new AsyncTask<Void, Void, Void>() {
+      private Exception exception;
+
+      @Override
+      protected Void doInBackground(Void... voids) {
+        try {
+          LlamaContext context = contexts.get(contextId);
+          if (context == null) {
+            throw new Exception("Context not found");
+          }
+          context.releaseVectorStore();
+        } catch (Exception e) {
+          exception = e;
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(Void result) {
+        if (exception != null) {
+          promise.reject(exception);
+          return;
+        }
+        promise.resolve(null);
+        tasks.remove(this);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "releaseVectorStore-" + contextId);
+  }
+
+  // Residency levels of rn-llama.h
+  private static final int RESIDENCY_TRIM = 1;
+  private static final int RESIDENCY_SUSPEND = 2;
+
+  // Called on the main thread, which owns tasks and contexts
+  private boolean hasRunningTask(int contextId) {
+    for (HashMap.Entry<AsyncTask, String> entry : tasks.entrySet()) {
+      if (entry.getKey().getStatus() != AsyncTask.Status.FINISHED && entry.getValue().endsWith("-" + contextId)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  private void releaseAllResidency(final int level) {
+    // Skip the contexts that are busy, they are trimmed on the next signal.
+    // The native side also skips a context another call still holds.
+    final HashMap<Integer, LlamaContext> idle = new HashMap<>();
+    for (HashMap.Entry<Integer, LlamaContext> entry : contexts.entrySet()) {
+      if (!hasRunningTask(entry.getKey())) {
+        idle.put(entry.getKey(), entry.getValue());
+      }
+    }
+    if (idle.isEmpty()) {
+      return;
+    }
+
+    AsyncTask task = new AsyncTask<Void, Void, Void>() {
+      @Override
+      protected Void doInBackground(Void... voids) {
+        for (HashMap.Entry<Integer, LlamaContext> entry : idle.entrySet()) {
+          try {
+            entry.getValue().releaseResidency(level);
+          } catch (Exception e) {
+            Log.e(NAME, "Failed to release memory of context " + entry.getKey(), e);
+          }
+        }
+        return null;
+      }
+
+      @Override
+      protected void onPostExecute(Void result) {
+        tasks.remove(this);
+      }
+    }.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR);
+    tasks.put(task, "releaseAllResidency");
+  }
+
+  @Override
+  public void onTrimMemory(int level) {
+    if (contexts.isEmpty()) {
+      return;
+    }
+    if (level == TRIM_MEMORY_RUNNING_CRITICAL || level >= TRIM_MEMORY_MODERATE) {
+      releaseAllResidency(RESIDENCY_SUSPEND);
+    } else if (level != TRIM_MEMORY_UI_HIDDEN) {
+      releaseAllResidency(RESIDENCY_TRIM);
+    }
+  }
+
+  @Override
+  public void onLowMemory() {
+    if (!contexts.isEmpty()) {
+      releaseAllResidency(RESIDENCY_SUSPEND);
+    }
+  }
+
+  @Override
+  public void onConfigurationChanged(@NonNull Configuration newConfig) {
+  }
+
   public void releaseContext(double id, Promise promise) {
     final int contextId = (int) id;
     AsyncTask task = new AsyncTask<Void, Void, Void>() {
@@ -989,6 +1389,12 @@ public class RNLlama implements LifecycleEventListener {
     tasks.put(task, "releaseAllContexts");
   }
 
+  // The module is torn down (e.g. on reload), stop receiving the app signals
+  public void invalidate() {
+    reactContext.removeLifecycleEventListener(this);
+    reactContext.unregisterComponentCallbacks(this);
+  }
+
   @Override
   public void onHostResume() {
   }
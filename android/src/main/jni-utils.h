@@ -22,6 +22,12 @@ jstring getString(JNIEnv *env, jobject readableArray, int index) {
     return (jstring) env->CallObjectMethod(readableArray, getStringMethod, index);
 }
 
+jobject getArray(JNIEnv *env, jobject readableArray, int index) {
+    jclass arrayClass = env->GetObjectClass(readableArray);
+    jmethodID getArrayMethod = env->GetMethodID(arrayClass, "getArray", "(I)Lcom/facebook/react/bridge/ReadableArray;");
+    return env->CallObjectMethod(readableArray, getArrayMethod, index);
+}
+
 // Other methods not used yet
 
 }
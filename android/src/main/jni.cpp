@@ -6,6 +6,8 @@
 #include <ctime>
 #include <sys/sysinfo.h>
 #include <string>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <unordered_map>
 #include <nlohmann/json.hpp>
@@ -15,16 +17,15 @@
 #include "ggml.h"
 #include "rn-llama.h"
 #include "jni-utils.h"
+#ifdef RNLLAMA_JSI
+#include "jsi/rn-llama-jsi.h"
+#endif
 #define UNUSED(x) (void)(x)
 #define TAG "RNLLAMA_ANDROID_JNI"
 
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO,     TAG, __VA_ARGS__)
 #define LOGW(...) __android_log_print(ANDROID_LOG_WARN,     TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR,    TAG, __VA_ARGS__)
-static inline int min(int a, int b) {
-    return (a < b) ? a : b;
-}
-
 static void rnllama_log_callback_default(lm_ggml_log_level level, const char * fmt, void * data) {
     if (level == LM_GGML_LOG_LEVEL_ERROR)     __android_log_print(ANDROID_LOG_ERROR, TAG, fmt, data);
     else if (level == LM_GGML_LOG_LEVEL_INFO) __android_log_print(ANDROID_LOG_INFO, TAG, fmt, data);
@@ -144,6 +145,18 @@ static inline void putArray(JNIEnv *env, jobject map, const char *key, jobject v
     env->CallVoidMethod(map, putArrayMethod, jKey, value);
 }
 
+// Method to create a tensor map { dtype, shape, data } with the raw values in base64,
+// so large buffers cross the bridge as one string instead of a boxed value per element
+static inline jobject createTensor(JNIEnv *env, const char *dtype, const void *data, size_t n, size_t elem_size) {
+    auto tensor = createWriteableMap(env);
+    putString(env, tensor, "dtype", dtype);
+    auto shape = createWritableArray(env);
+    pushInt(env, shape, (int) n);
+    putArray(env, tensor, "shape", shape);
+    putString(env, tensor, "data", rnllama::base64_encode(data, n * elem_size).c_str());
+    return tensor;
+}
+
 JNIEXPORT jobject JNICALL
 Java_com_rnllama_LlamaContext_modelInfo(
     JNIEnv *env,
@@ -216,7 +229,23 @@ struct callback_context {
     jobject callback;
 };
 
-std::unordered_map<long, rnllama::llama_rn_context *> context_map;
+// Contexts by the llama_context pointer handed to Java. A call holds a context_ref for its whole
+// duration, freeContext removes the context from the map and whichever holder is last deletes it.
+static std::mutex context_map_mutex;
+static std::unordered_map<long, std::shared_ptr<rnllama::llama_rn_context>> context_map;
+
+struct context_ref {
+    std::shared_ptr<rnllama::llama_rn_context> ptr;
+
+    rnllama::llama_rn_context *operator->() const { return ptr.get(); }
+    operator rnllama::llama_rn_context *() const { return ptr.get(); }
+};
+
+static context_ref get_context(jlong context_ptr) {
+    std::lock_guard<std::mutex> lock(context_map_mutex);
+    auto it = context_map.find((long) context_ptr);
+    return { it != context_map.end() ? it->second : nullptr };
+}
 
 JNIEXPORT jlong JNICALL
 Java_com_rnllama_LlamaContext_initContext(
@@ -229,13 +258,16 @@ Java_com_rnllama_LlamaContext_initContext(
     jint n_ctx,
     jint n_batch,
     jint n_ubatch,
+    jint n_parallel,
     jint n_threads,
     jint n_gpu_layers, // TODO: Support this
     jboolean flash_attn,
     jstring cache_type_k,
     jstring cache_type_v,
+    jint kv_recent_window,
     jboolean use_mlock,
     jboolean use_mmap,
+    jboolean use_lazy_load,
     jboolean vocab_only,
     jstring lora_str,
     jfloat lora_scaled,
@@ -244,10 +276,26 @@ Java_com_rnllama_LlamaContext_initContext(
     jfloat rope_freq_scale,
     jint pooling_type,
     jboolean ctx_shift,
+    jstring ctx_shift_policy,
+    jint ctx_shift_n_sink,
+    jint ctx_checkpoint_interval,
+    jint ctx_checkpoint_max,
     jobject load_progress_callback
 ) {
     UNUSED(thiz);
 
+    // parsed before anything is allocated, an unknown policy fails the load
+    const char *ctx_shift_policy_chars = env->GetStringUTFChars(ctx_shift_policy, nullptr);
+    rnllama::ctx_shift_policy shift_policy;
+    try {
+        shift_policy = rnllama::ctx_shift_policy_from_str(ctx_shift_policy_chars);
+    } catch (const std::exception &e) {
+        LOGI("[RNLlama] %s", e.what());
+        env->ReleaseStringUTFChars(ctx_shift_policy, ctx_shift_policy_chars);
+        return -1;
+    }
+    env->ReleaseStringUTFChars(ctx_shift_policy, ctx_shift_policy_chars);
+
     common_params defaultParams;
 
     defaultParams.vocab_only = vocab_only;
@@ -264,6 +312,7 @@ Java_com_rnllama_LlamaContext_initContext(
     defaultParams.n_ctx = n_ctx;
     defaultParams.n_batch = n_batch;
     defaultParams.n_ubatch = n_ubatch;
+    defaultParams.n_parallel = n_parallel > 0 ? n_parallel : 1;
     defaultParams.ctx_shift = ctx_shift;
 
     if (pooling_type != -1) {
@@ -279,10 +328,7 @@ Java_com_rnllama_LlamaContext_initContext(
         defaultParams.n_ubatch = defaultParams.n_batch;
     }
 
-    int max_threads = std::thread::hardware_concurrency();
-    // Use 2 threads by default on 4-core devices, 4 threads on more cores
-    int default_n_threads = max_threads == 4 ? 2 : min(4, max_threads);
-    defaultParams.cpuparams.n_threads = n_threads > 0 ? n_threads : default_n_threads;
+    rnllama::cpu_params_from_topology(defaultParams, n_threads);
 
     defaultParams.n_gpu_layers = n_gpu_layers;
     defaultParams.flash_attn = flash_attn;
@@ -291,9 +337,11 @@ Java_com_rnllama_LlamaContext_initContext(
     const char *cache_type_v_chars = env->GetStringUTFChars(cache_type_v, nullptr);
     defaultParams.cache_type_k = rnllama::kv_cache_type_from_str(cache_type_k_chars);
     defaultParams.cache_type_v = rnllama::kv_cache_type_from_str(cache_type_v_chars);
+    defaultParams.kv_recent = kv_recent_window > 0 ? kv_recent_window : 0;
 
     defaultParams.use_mlock = use_mlock;
     defaultParams.use_mmap = use_mmap;
+    defaultParams.use_lazy_load = use_lazy_load;
 
     defaultParams.rope_freq_base = rope_freq_base;
     defaultParams.rope_freq_scale = rope_freq_scale;
@@ -302,6 +350,11 @@ Java_com_rnllama_LlamaContext_initContext(
     llama->is_load_interrupted = false;
     llama->loading_progress = 0;
 
+    llama->shift_policy = shift_policy;
+    llama->shift_n_sink = ctx_shift_n_sink;
+    llama->checkpoint_interval = ctx_checkpoint_interval;
+    llama->checkpoint_max = ctx_checkpoint_max;
+
     if (load_progress_callback != nullptr) {
         defaultParams.progress_callback = [](float progress, void * user_data) {
             callback_context *cb_ctx = (callback_context *)user_data;
@@ -333,15 +386,20 @@ Java_com_rnllama_LlamaContext_initContext(
     env->ReleaseStringUTFChars(cache_type_v, cache_type_v_chars);
 
     LOGI("[RNLlama] is_model_loaded %s", (is_model_loaded ? "true" : "false"));
-    if (is_model_loaded) {
-        if (embedding && llama_model_has_encoder(llama->model) && llama_model_has_decoder(llama->model)) {
-            LOGI("[RNLlama] computing embeddings in encoder-decoder models is not supported");
-            llama_free(llama->ctx);
-            return -1;
-        }
-        context_map[(long) llama->ctx] = llama;
-    } else {
-        llama_free(llama->ctx);
+    // the model and the llama context are owned by llama->llama_init, deleting llama frees them
+    if (!is_model_loaded) {
+        delete llama;
+        return -1;
+    }
+    if (embedding && llama_model_has_encoder(llama->model) && llama_model_has_decoder(llama->model)) {
+        LOGI("[RNLlama] computing embeddings in encoder-decoder models is not supported");
+        delete llama;
+        return -1;
+    }
+    const long context_key = (long) llama->ctx;
+    {
+        std::lock_guard<std::mutex> lock(context_map_mutex);
+        context_map[context_key] = std::shared_ptr<rnllama::llama_rn_context>(llama);
     }
 
     std::vector<common_adapter_lora_info> lora;
@@ -373,7 +431,9 @@ Java_com_rnllama_LlamaContext_initContext(
     int result = llama->applyLoraAdapters(lora);
     if (result != 0) {
       LOGI("[RNLlama] Failed to apply lora adapters");
-      llama_free(llama->ctx);
+      // the map holds the only reference, erasing the entry deletes the context
+      std::lock_guard<std::mutex> lock(context_map_mutex);
+      context_map.erase(context_key);
       return -1;
     }
 
@@ -388,7 +448,7 @@ Java_com_rnllama_LlamaContext_interruptLoad(
     jlong context_ptr
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
     if (llama) {
         llama->is_load_interrupted = true;
     }
@@ -401,7 +461,7 @@ Java_com_rnllama_LlamaContext_loadModelDetails(
     jlong context_ptr
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
 
     int count = llama_model_meta_count(llama->model);
     auto meta = createWriteableMap(env);
@@ -479,7 +539,7 @@ Java_com_rnllama_LlamaContext_getFormattedChatWithJinja(
     jboolean enable_thinking
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
 
     const char *messages_chars = env->GetStringUTFChars(messages, nullptr);
     const char *tmpl_chars = env->GetStringUTFChars(chat_template, nullptr);
@@ -549,7 +609,7 @@ Java_com_rnllama_LlamaContext_getFormattedChat(
     jstring chat_template
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
 
     const char *messages_chars = env->GetStringUTFChars(messages, nullptr);
     const char *tmpl_chars = env->GetStringUTFChars(chat_template, nullptr);
@@ -570,11 +630,15 @@ Java_com_rnllama_LlamaContext_loadSession(
     jstring path
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     const char *path_chars = env->GetStringUTFChars(path, nullptr);
 
     auto result = createWriteableMap(env);
     size_t n_token_count_out = 0;
+    llama->evicted_spans.clear();
+    llama->checkpoints.clear();
     llama->embd.resize(llama->params.n_ctx);
     if (!llama_state_load_file(llama->ctx, path_chars, llama->embd.data(), llama->embd.capacity(), &n_token_count_out)) {
       env->ReleaseStringUTFChars(path, path_chars);
@@ -606,7 +670,9 @@ Java_com_rnllama_LlamaContext_saveSession(
     jint size
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
 
     const char *path_chars = env->GetStringUTFChars(path, nullptr);
 
@@ -707,11 +773,19 @@ Java_com_rnllama_LlamaContext_doCompletion(
     jint dry_penalty_last_n,
     jfloat top_n_sigma,
     jobjectArray dry_sequence_breakers,
+    jint n_branches,
+    jobject branch_lora,
+    jint deadline_ms,
+    jint step_budget_ms,
     jobjectArray media_paths,
+    jint emit_partial_interval,
+    jint emit_partial_max_tokens,
     jobject partial_completion_callback
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
 
     llama->rewind();
 
@@ -755,12 +829,10 @@ Java_com_rnllama_LlamaContext_doCompletion(
         }
     }
 
-    llama->params.sampling.seed = (seed == -1) ? time(NULL) : seed;
+    // the sampler picks a random seed for LLAMA_DEFAULT_SEED on every reset, so pooled samplers stay reusable
+    llama->params.sampling.seed = (seed == -1) ? LLAMA_DEFAULT_SEED : seed;
 
-    int max_threads = std::thread::hardware_concurrency();
-    // Use 2 threads by default on 4-core devices, 4 threads on more cores
-    int default_n_threads = max_threads == 4 ? 2 : min(4, max_threads);
-    llama->params.cpuparams.n_threads = n_threads > 0 ? n_threads : default_n_threads;
+    llama->setThreads(n_threads);
 
     llama->params.n_predict = n_predict;
     llama->params.sampling.ignore_eos = ignore_eos;
@@ -912,6 +984,7 @@ Java_com_rnllama_LlamaContext_doCompletion(
         return reinterpret_cast<jobject>(result);
     }
 
+    llama->setDeadline(deadline_ms, step_budget_ms);
     llama->beginCompletion();
     try {
         llama->loadPrompt(media_paths_vector);
@@ -934,65 +1007,65 @@ Java_com_rnllama_LlamaContext_doCompletion(
         return reinterpret_cast<jobject>(result);
     }
 
-    size_t sent_count = 0;
-    size_t sent_token_probs_index = 0;
-
-    while (llama->has_next_token && !llama->is_interrupted) {
-        const rnllama::completion_token_output token_with_probs = llama->doCompletion();
-        if (token_with_probs.tok == -1 || llama->incomplete) {
-            continue;
-        }
-        const std::string token_text = common_token_to_piece(llama->ctx, token_with_probs.tok);
-
-        size_t pos = std::min(sent_count, llama->generated_text.size());
-
-        const std::string str_test = llama->generated_text.substr(pos);
-        bool is_stop_full = false;
-        size_t stop_pos =
-            llama->findStoppingStrings(str_test, token_text.size(), rnllama::STOP_FULL);
-        if (stop_pos != std::string::npos) {
-            is_stop_full = true;
-            llama->generated_text.erase(
-                llama->generated_text.begin() + pos + stop_pos,
-                llama->generated_text.end());
-            pos = std::min(sent_count, llama->generated_text.size());
-        } else {
-            is_stop_full = false;
-            stop_pos = llama->findStoppingStrings(str_test, token_text.size(),
-                rnllama::STOP_PARTIAL);
+    std::vector<rnllama::completion_branch_output> branches;
+    if (n_branches > 1) {
+        // branch_lora: ReadableArray<ReadableArray<ReadableMap>>, extra adapters of each branch
+        std::vector<std::vector<common_adapter_lora_info>> branch_lora_vector;
+        int branch_lora_size = branch_lora != nullptr ? readablearray::size(env, branch_lora) : 0;
+        for (int i = 0; i < branch_lora_size; i++) {
+            std::vector<common_adapter_lora_info> adapters;
+            jobject lora_list = readablearray::getArray(env, branch_lora, i);
+            int lora_list_size = lora_list != nullptr ? readablearray::size(env, lora_list) : 0;
+            for (int j = 0; j < lora_list_size; j++) {
+                jobject lora_adapter = readablearray::getMap(env, lora_list, j);
+                jstring path = readablemap::getString(env, lora_adapter, "path", nullptr);
+                if (path != nullptr) {
+                    const char *path_chars = env->GetStringUTFChars(path, nullptr);
+                    common_adapter_lora_info la;
+                    la.path = path_chars;
+                    la.scale = readablemap::getFloat(env, lora_adapter, "scaled", 1.0f);
+                    adapters.push_back(la);
+                    env->ReleaseStringUTFChars(path, path_chars);
+                }
+            }
+            branch_lora_vector.push_back(adapters);
         }
 
-        if (
-            stop_pos == std::string::npos ||
-            // Send rest of the text if we are at the end of the generation
-            (!llama->has_next_token && !is_stop_full && stop_pos > 0)
-        ) {
-            const std::string to_send = llama->generated_text.substr(pos, std::string::npos);
-
-            sent_count += to_send.size();
-
-            std::vector<rnllama::completion_token_output> probs_output = {};
-
-            auto tokenResult = createWriteableMap(env);
-            putString(env, tokenResult, "token", to_send.c_str());
+        // Branches are decoded in lockstep, partial completions are not emitted
+        try {
+            branches = llama->doBranchedCompletion(n_branches, branch_lora_vector);
+        } catch (const std::exception &e) {
+            llama->endCompletion();
+            auto result = createWriteableMap(env);
+            putString(env, result, "error", e.what());
+            return reinterpret_cast<jobject>(result);
+        }
+    }
 
-            if (llama->params.sampling.n_probs > 0) {
-              const std::vector<llama_token> to_send_toks = common_tokenize(llama->ctx, to_send, false);
-              size_t probs_pos = std::min(sent_token_probs_index, llama->generated_token_probs.size());
-              size_t probs_stop_pos = std::min(sent_token_probs_index + to_send_toks.size(), llama->generated_token_probs.size());
-              if (probs_pos < probs_stop_pos) {
-                  probs_output = std::vector<rnllama::completion_token_output>(llama->generated_token_probs.begin() + probs_pos, llama->generated_token_probs.begin() + probs_stop_pos);
-              }
-              sent_token_probs_index = probs_stop_pos;
+    jclass cb_class = env->GetObjectClass(partial_completion_callback);
+    jmethodID isEmitNeeded = env->GetMethodID(cb_class, "isEmitNeeded", "()Z");
+    jmethodID isBusy = env->GetMethodID(cb_class, "isBusy", "()Z");
+    jmethodID onPartialCompletion = env->GetMethodID(cb_class, "onPartialCompletion", "(Lcom/facebook/react/bridge/WritableMap;)V");
 
-              putArray(env, tokenResult, "completion_probabilities", tokenProbsToMap(env, llama, probs_output));
-            }
-
-            jclass cb_class = env->GetObjectClass(partial_completion_callback);
-            jmethodID onPartialCompletion = env->GetMethodID(cb_class, "onPartialCompletion", "(Lcom/facebook/react/bridge/WritableMap;)V");
-            env->CallVoidMethod(partial_completion_callback, onPartialCompletion, tokenResult);
+    rnllama::partial_emitter emitter;
+    emitter.interval_us = (int64_t) emit_partial_interval * 1000;
+    emitter.max_tokens = emit_partial_max_tokens > 0 ? emit_partial_max_tokens : 0;
+    emitter.emit = [&](const rnllama::completion_partial &partial) {
+        auto tokenResult = createWriteableMap(env);
+        putString(env, tokenResult, "token", partial.text.c_str());
+        if (llama->params.sampling.n_probs > 0) {
+            putArray(env, tokenResult, "completion_probabilities", tokenProbsToMap(env, llama, partial.probs));
         }
-    }
+        env->CallVoidMethod(partial_completion_callback, onPartialCompletion, tokenResult);
+        env->DeleteLocalRef(tokenResult);
+    };
+    // Coalesce while the JS thread still has partial completions to handle
+    emitter.busy = [&]() {
+        return (bool) env->CallBooleanMethod(partial_completion_callback, isBusy);
+    };
+
+    const bool emit_needed = env->CallBooleanMethod(partial_completion_callback, isEmitNeeded);
+    llama->generate(emit_needed ? &emitter : nullptr);
 
     env->ReleaseStringUTFChars(grammar, grammar_chars);
 
@@ -1070,8 +1143,23 @@ Java_com_rnllama_LlamaContext_doCompletion(
     putInt(env, result, "stopped_eos", llama->stopped_eos);
     putInt(env, result, "stopped_word", llama->stopped_word);
     putInt(env, result, "stopped_limit", llama->stopped_limit);
+    putInt(env, result, "stopped_deadline", llama->stopped_deadline);
     putString(env, result, "stopping_word", llama->stopping_word.c_str());
     putInt(env, result, "tokens_cached", llama->n_past);
+    if (!branches.empty()) {
+        auto branchesResult = createWritableArray(env);
+        for (const auto &branch : branches) {
+            auto branchResult = createWriteableMap(env);
+            putString(env, branchResult, "text", branch.text.c_str());
+            putInt(env, branchResult, "tokens_predicted", branch.tokens.size());
+            putInt(env, branchResult, "stopped_eos", branch.stopped_eos);
+            putInt(env, branchResult, "stopped_word", branch.stopped_word);
+            putInt(env, branchResult, "stopped_limit", branch.stopped_limit);
+            putString(env, branchResult, "stopping_word", branch.stopping_word.c_str());
+            pushMap(env, branchesResult, branchResult);
+        }
+        putArray(env, result, "branches", branchesResult);
+    }
 
     const auto timings_token = llama_perf_context(llama -> ctx);
 
@@ -1084,6 +1172,7 @@ Java_com_rnllama_LlamaContext_doCompletion(
     putInt(env, timingsResult, "predicted_ms", timings_token.t_eval_ms);
     putInt(env, timingsResult, "predicted_per_token_ms", timings_token.t_eval_ms / timings_token.n_eval);
     putDouble(env, timingsResult, "predicted_per_second", 1e3 / timings_token.t_eval_ms * timings_token.n_eval);
+    putInt(env, timingsResult, "graphs_reused", timings_token.n_reused);
 
     putMap(env, result, "timings", timingsResult);
 
@@ -1095,7 +1184,7 @@ Java_com_rnllama_LlamaContext_stopCompletion(
         JNIEnv *env, jobject thiz, jlong context_ptr) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
     llama->is_interrupted = true;
 }
 
@@ -1104,7 +1193,7 @@ Java_com_rnllama_LlamaContext_isPredicting(
         JNIEnv *env, jobject thiz, jlong context_ptr) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
     return llama->is_predicting;
 }
 
@@ -1112,7 +1201,7 @@ JNIEXPORT jobject JNICALL
 Java_com_rnllama_LlamaContext_tokenize(
         JNIEnv *env, jobject thiz, jlong context_ptr, jstring text, jobjectArray media_paths) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
 
     const char *text_chars = env->GetStringUTFChars(text, nullptr);
     std::vector<std::string> media_paths_vector;
@@ -1126,11 +1215,8 @@ Java_com_rnllama_LlamaContext_tokenize(
 
     auto result = createWriteableMap(env);
 
-    auto tokens = createWritableArray(env);
-    for (const auto &tok : tokenize_result.tokens) {
-      pushInt(env, tokens, tok);
-    }
-    putArray(env, result, "tokens", tokens);
+    const auto &toks = tokenize_result.tokens;
+    putMap(env, result, "tokens", createTensor(env, "int32", toks.data(), toks.size(), sizeof(llama_token)));
 
     putBoolean(env, result, "has_media", tokenize_result.has_media);
 
@@ -1160,7 +1246,7 @@ JNIEXPORT jstring JNICALL
 Java_com_rnllama_LlamaContext_detokenize(
         JNIEnv *env, jobject thiz, jlong context_ptr, jintArray tokens) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
 
     jsize tokens_len = env->GetArrayLength(tokens);
     jint *tokens_ptr = env->GetIntArrayElements(tokens, 0);
@@ -1169,7 +1255,7 @@ Java_com_rnllama_LlamaContext_detokenize(
         toks.push_back(tokens_ptr[i]);
     }
 
-    auto text = rnllama::tokens_to_str(llama->ctx, toks.cbegin(), toks.cend());
+    auto text = rnllama::tokens_to_str(llama_model_get_vocab(llama->model), toks.cbegin(), toks.cend());
 
     env->ReleaseIntArrayElements(tokens, tokens_ptr, 0);
 
@@ -1181,7 +1267,7 @@ Java_com_rnllama_LlamaContext_isEmbeddingEnabled(
         JNIEnv *env, jobject thiz, jlong context_ptr) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
     return llama->params.embedding;
 }
 
@@ -1190,61 +1276,56 @@ Java_com_rnllama_LlamaContext_embedding(
         JNIEnv *env, jobject thiz,
         jlong context_ptr,
         jstring text,
-        jint embd_normalize
+        jint embd_normalize,
+        jint embd_dims,
+        jint embd_quantize
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
 
-    common_params embdParams;
-    embdParams.embedding = true;
-    embdParams.embd_normalize = llama->params.embd_normalize;
-    if (embd_normalize != -1) {
-      embdParams.embd_normalize = embd_normalize;
-    }
+    rnllama::embedding_params eparams;
+    eparams.normalize = embd_normalize != -1 ? embd_normalize : llama->params.embd_normalize;
+    eparams.n_dims = embd_dims;
+    eparams.quant = (rnllama::embedding_quant_type) embd_quantize;
 
     const char *text_chars = env->GetStringUTFChars(text, nullptr);
-
-    llama->rewind();
-
-    llama_perf_context_reset(llama->ctx);
-
-    llama->params.prompt = text_chars;
-
-    llama->params.n_predict = 0;
+    const std::string text_str(text_chars);
+    env->ReleaseStringUTFChars(text, text_chars);
 
     auto result = createWriteableMap(env);
-    if (!llama->initSampling()) {
-        putString(env, result, "error", "Failed to initialize sampling");
-        return reinterpret_cast<jobject>(result);
-    }
-
-    llama->beginCompletion();
+    std::vector<uint8_t> buf(llama->embeddingOutputSize(eparams));
+    rnllama::embedding_output output;
     try {
-        llama->loadPrompt({});
+        output = llama->embed(text_str, eparams, buf.data());
     } catch (const std::exception &e) {
         putString(env, result, "error", e.what());
         return reinterpret_cast<jobject>(result);
-    } catch (const std::runtime_error& e) {
-        putString(env, result, "error", e.what());
-        return reinterpret_cast<jobject>(result);
     }
-    llama->doCompletion();
 
-    std::vector<float> embedding = llama->getEmbedding(embdParams);
-
-    auto embeddings = createWritableArray(env);
-    for (const auto &val : embedding) {
-      pushDouble(env, embeddings, (double) val);
+    jobject embeddings;
+    switch (eparams.quant) {
+        case rnllama::EMBEDDING_QUANT_INT8:
+            embeddings = createTensor(env, "int8", buf.data(), buf.size(), 1);
+            putDouble(env, result, "embd_scale", output.scale);
+            break;
+        case rnllama::EMBEDDING_QUANT_BINARY:
+            embeddings = createTensor(env, "uint8", buf.data(), buf.size(), 1);
+            break;
+        default:
+            embeddings = createTensor(env, "float32", buf.data(), output.n_dims, sizeof(float));
+            break;
     }
-    putArray(env, result, "embedding", embeddings);
+    putMap(env, result, "embedding", embeddings);
+    putInt(env, result, "embd_dims", output.n_dims);
 
     auto promptTokens = createWritableArray(env);
-    for (const auto &tok : llama->embd) {
+    for (const auto &tok : output.tokens) {
       pushString(env, promptTokens, common_token_to_piece(llama->ctx, tok).c_str());
     }
     putArray(env, result, "prompt_tokens", promptTokens);
 
-    env->ReleaseStringUTFChars(text, text_chars);
     return result;
 }
 
@@ -1257,7 +1338,9 @@ Java_com_rnllama_LlamaContext_rerank(
         jint normalize
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
 
     const char *query_chars = env->GetStringUTFChars(query, nullptr);
 
@@ -1307,7 +1390,9 @@ Java_com_rnllama_LlamaContext_bench(
     jint nr
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     std::string result = llama->bench(pp, tg, pl, nr);
     return env->NewStringUTF(result.c_str());
 }
@@ -1316,7 +1401,9 @@ JNIEXPORT jint JNICALL
 Java_com_rnllama_LlamaContext_applyLoraAdapters(
     JNIEnv *env, jobject thiz, jlong context_ptr, jobjectArray loraAdapters) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
 
     // lora_adapters: ReadableArray<ReadableMap>
     std::vector<common_adapter_lora_info> lora_adapters;
@@ -1326,23 +1413,72 @@ Java_com_rnllama_LlamaContext_applyLoraAdapters(
         jstring path = readablemap::getString(env, lora_adapter, "path", nullptr);
         if (path != nullptr) {
           const char *path_chars = env->GetStringUTFChars(path, nullptr);
-          env->ReleaseStringUTFChars(path, path_chars);
           float scaled = readablemap::getFloat(env, lora_adapter, "scaled", 1.0f);
           common_adapter_lora_info la;
           la.path = path_chars;
           la.scale = scaled;
           lora_adapters.push_back(la);
+          env->ReleaseStringUTFChars(path, path_chars);
         }
     }
     return llama->applyLoraAdapters(lora_adapters);
 }
 
+JNIEXPORT jstring JNICALL
+Java_com_rnllama_LlamaContext_mergeLoraAdapters(
+    JNIEnv *env, jobject thiz, jlong context_ptr, jobjectArray loraAdapters, jstring cache_path) {
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+
+    // lora_adapters: ReadableArray<ReadableMap>
+    std::vector<common_adapter_lora_info> lora_adapters;
+    int lora_adapters_size = readablearray::size(env, loraAdapters);
+    for (int i = 0; i < lora_adapters_size; i++) {
+        jobject lora_adapter = readablearray::getMap(env, loraAdapters, i);
+        jstring path = readablemap::getString(env, lora_adapter, "path", nullptr);
+        if (path != nullptr) {
+          const char *path_chars = env->GetStringUTFChars(path, nullptr);
+          common_adapter_lora_info la;
+          la.path = path_chars;
+          la.scale = readablemap::getFloat(env, lora_adapter, "scaled", 1.0f);
+          lora_adapters.push_back(la);
+          env->ReleaseStringUTFChars(path, path_chars);
+        }
+    }
+    const char *cache_path_chars = env->GetStringUTFChars(cache_path, nullptr);
+    const std::string cache_path_str(cache_path_chars);
+    env->ReleaseStringUTFChars(cache_path, cache_path_chars);
+    try {
+        if (llama->mergeLoraAdapters(lora_adapters, cache_path_str) != 0) {
+            return env->NewStringUTF("Failed to merge lora adapters");
+        }
+    } catch (const std::exception &e) {
+        return env->NewStringUTF(e.what());
+    }
+    return nullptr;
+}
+
+JNIEXPORT void JNICALL
+Java_com_rnllama_LlamaContext_unmergeLoraAdapters(
+    JNIEnv *env, jobject thiz, jlong context_ptr) {
+    UNUSED(env);
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+    llama->unmergeLoraAdapters();
+}
+
 JNIEXPORT void JNICALL
 Java_com_rnllama_LlamaContext_removeLoraAdapters(
     JNIEnv *env, jobject thiz, jlong context_ptr) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     llama->removeLoraAdapters();
 }
 
@@ -1350,7 +1486,8 @@ JNIEXPORT jobject JNICALL
 Java_com_rnllama_LlamaContext_getLoadedLoraAdapters(
     JNIEnv *env, jobject thiz, jlong context_ptr) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
     auto loaded_lora_adapters = llama->getLoadedLoraAdapters();
     auto result = createWritableArray(env);
     for (common_adapter_lora_info &la : loaded_lora_adapters) {
@@ -1362,14 +1499,102 @@ Java_com_rnllama_LlamaContext_getLoadedLoraAdapters(
     return result;
 }
 
+JNIEXPORT jobject JNICALL
+Java_com_rnllama_LlamaContext_getMemoryFootprint(
+    JNIEnv *env, jobject thiz, jlong context_ptr) {
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    auto footprint = llama->getFootprint();
+    auto result = createWriteableMap(env);
+    putDouble(env, result, "weights", footprint.weights);
+    putDouble(env, result, "weightsResident", footprint.weights_resident);
+    putDouble(env, result, "kv", footprint.kv);
+    putDouble(env, result, "compute", footprint.compute);
+    putDouble(env, result, "multimodal", footprint.multimodal);
+    putDouble(env, result, "lora", footprint.lora);
+    putDouble(env, result, "vocoder", footprint.vocoder);
+    putBoolean(env, result, "suspended", footprint.suspended);
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_rnllama_LlamaContext_releaseResidency(
+    JNIEnv *env, jobject thiz, jlong context_ptr, jint level, jstring state_path) {
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    const char *state_path_chars = env->GetStringUTFChars(state_path, nullptr);
+    bool result = llama->releaseResidency((rnllama::residency_level) level, state_path_chars);
+    env->ReleaseStringUTFChars(state_path, state_path_chars);
+    return result;
+}
+
 JNIEXPORT void JNICALL
 Java_com_rnllama_LlamaContext_freeContext(
         JNIEnv *env, jobject thiz, jlong context_ptr) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
-    context_map.erase((long) llama->ctx);
-    delete llama;
+    std::shared_ptr<rnllama::llama_rn_context> llama;
+    {
+        // llama->ctx is recreated when a suspended context is restored, the map key stays the same
+        std::lock_guard<std::mutex> lock(context_map_mutex);
+        auto it = context_map.find((long) context_ptr);
+        if (it == context_map.end()) {
+            return;
+        }
+        llama = std::move(it->second);
+        context_map.erase(it);
+    }
+#ifdef RNLLAMA_JSI
+    rnllama_jsi::removeContext(llama.get());
+#endif
+    // no new call can find the context anymore, the last call still holding it deletes it
+    llama.reset();
+}
+
+// The prebuilt libraries are built without react-android, so only a build from source has JSI
+JNIEXPORT jboolean JNICALL
+Java_com_rnllama_LlamaContext_isJSIBuilt(
+        JNIEnv *env, jobject thiz) {
+    UNUSED(env);
+    UNUSED(thiz);
+#ifdef RNLLAMA_JSI
+    return true;
+#else
+    return false;
+#endif
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_rnllama_LlamaContext_installJSI(
+        JNIEnv *env, jobject thiz, jlong runtime_ptr) {
+    UNUSED(env);
+    UNUSED(thiz);
+#ifdef RNLLAMA_JSI
+    if (runtime_ptr == 0) {
+        return false;
+    }
+    return rnllama_jsi::install(*reinterpret_cast<facebook::jsi::Runtime *>(runtime_ptr));
+#else
+    UNUSED(runtime_ptr);
+    return false;
+#endif
+}
+
+JNIEXPORT void JNICALL
+Java_com_rnllama_LlamaContext_addJSIContext(
+        JNIEnv *env, jobject thiz, jlong context_ptr, jint id) {
+    UNUSED(env);
+    UNUSED(thiz);
+#ifdef RNLLAMA_JSI
+    auto llama = get_context(context_ptr);
+    if (llama) {
+        rnllama_jsi::addContext(id, llama);
+    }
+#else
+    UNUSED(context_ptr);
+    UNUSED(id);
+#endif
 }
 
 struct log_callback_context {
@@ -1453,7 +1678,9 @@ Java_com_rnllama_LlamaContext_initMultimodal(
     jboolean mmproj_use_gpu
 ) {
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
 
     const char *mmproj_path_chars = env->GetStringUTFChars(mmproj_path, nullptr);
     bool result = llama->initMultimodal(mmproj_path_chars, mmproj_use_gpu);
@@ -1470,7 +1697,7 @@ Java_com_rnllama_LlamaContext_isMultimodalEnabled(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
     return llama->isMultimodalEnabled();
 }
 
@@ -1482,7 +1709,7 @@ Java_com_rnllama_LlamaContext_getMultimodalSupport(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
     auto result = createWriteableMap(env);
     putBoolean(env, result, "vision", llama->isMultimodalSupportVision());
     putBoolean(env, result, "audio", llama->isMultimodalSupportAudio());
@@ -1497,7 +1724,8 @@ Java_com_rnllama_LlamaContext_releaseMultimodal(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
     llama->releaseMultimodal();
 }
 
@@ -1510,7 +1738,8 @@ Java_com_rnllama_LlamaContext_initVocoder(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
     const char *vocoder_model_path_chars = env->GetStringUTFChars(vocoder_model_path, nullptr);
     bool result = llama->initVocoder(vocoder_model_path_chars);
     env->ReleaseStringUTFChars(vocoder_model_path, vocoder_model_path_chars);
@@ -1525,7 +1754,8 @@ Java_com_rnllama_LlamaContext_releaseVocoder(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
     llama->releaseVocoder();
 }
 
@@ -1537,7 +1767,7 @@ Java_com_rnllama_LlamaContext_isVocoderEnabled(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
     return llama->isVocoderEnabled();
 }
 
@@ -1551,7 +1781,9 @@ Java_com_rnllama_LlamaContext_getFormattedAudioCompletion(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     const char *speaker_json_str_chars = env->GetStringUTFChars(speaker_json_str, nullptr);
     const char *text_to_speak_chars = env->GetStringUTFChars(text_to_speak, nullptr);
     std::string result = llama->getFormattedAudioCompletion(speaker_json_str_chars, text_to_speak_chars);
@@ -1569,7 +1801,9 @@ Java_com_rnllama_LlamaContext_getAudioCompletionGuideTokens(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     const char *text_to_speak_chars = env->GetStringUTFChars(text_to_speak, nullptr);
     std::vector<llama_token> guide_tokens = llama->getAudioCompletionGuideTokens(text_to_speak_chars);
     env->ReleaseStringUTFChars(text_to_speak, text_to_speak_chars);
@@ -1589,7 +1823,7 @@ Java_com_rnllama_LlamaContext_decodeAudioTokens(
 ) {
     UNUSED(env);
     UNUSED(thiz);
-    auto llama = context_map[(long) context_ptr];
+    auto llama = get_context(context_ptr);
     jsize tokens_size = env->GetArrayLength(tokens);
     jint *tokens_ptr = env->GetIntArrayElements(tokens, nullptr);
     std::vector<llama_token> tokens_vec(tokens_size);
@@ -1598,11 +1832,168 @@ Java_com_rnllama_LlamaContext_decodeAudioTokens(
     }
     env->ReleaseIntArrayElements(tokens, tokens_ptr, 0);
     std::vector<float> audio = llama->decodeAudioTokens(tokens_vec);
-    auto result = createWritableArray(env);
-    for (const auto &val : audio) {
-      pushDouble(env, result, (double) val);
+    return createTensor(env, "float32", audio.data(), audio.size(), sizeof(float));
+}
+
+
+JNIEXPORT jobject JNICALL
+Java_com_rnllama_LlamaContext_initVectorStore(
+    JNIEnv *env,
+    jobject thiz,
+    jlong context_ptr,
+    jstring path,
+    jint n_dims,
+    jint quant
+) {
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+
+    rnllama::vector_store_params vparams;
+    vparams.n_dims = n_dims;
+    vparams.quant = (rnllama::vector_store_quant) quant;
+
+    const char *path_chars = env->GetStringUTFChars(path, nullptr);
+    const std::string path_str(path_chars);
+    env->ReleaseStringUTFChars(path, path_chars);
+
+    auto result = createWriteableMap(env);
+    try {
+        llama->initVectorStore(path_str, vparams);
+    } catch (const std::exception &e) {
+        putString(env, result, "error", e.what());
+        return result;
+    }
+    putDouble(env, result, "size", (double) llama->vstore->size());
+    putInt(env, result, "n_dims", llama->vstore->n_dims());
+    putInt(env, result, "n_lists", llama->vstore->n_lists());
+    return result;
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_rnllama_LlamaContext_vectorStoreAdd(
+    JNIEnv *env,
+    jobject thiz,
+    jlong context_ptr,
+    jobjectArray texts,
+    jdoubleArray keys,
+    jboolean store_text
+) {
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+
+    std::vector<std::string> texts_vec;
+    jsize texts_size = env->GetArrayLength(texts);
+    for (jsize i = 0; i < texts_size; i++) {
+        jstring text = (jstring) env->GetObjectArrayElement(texts, i);
+        const char *text_chars = env->GetStringUTFChars(text, nullptr);
+        texts_vec.push_back(text_chars);
+        env->ReleaseStringUTFChars(text, text_chars);
+        env->DeleteLocalRef(text);
+    }
+    std::vector<int64_t> keys_vec;
+    if (keys != nullptr) {
+        jsize keys_size = env->GetArrayLength(keys);
+        jdouble *keys_ptr = env->GetDoubleArrayElements(keys, nullptr);
+        for (jsize i = 0; i < keys_size; i++) {
+            keys_vec.push_back((int64_t) keys_ptr[i]);
+        }
+        env->ReleaseDoubleArrayElements(keys, keys_ptr, JNI_ABORT);
+    }
+
+    auto result = createWriteableMap(env);
+    try {
+        std::vector<int64_t> added = llama->addToVectorStore(texts_vec, keys_vec, store_text);
+        auto added_keys = createWritableArray(env);
+        for (int64_t key : added) {
+            pushDouble(env, added_keys, (double) key);
+        }
+        putArray(env, result, "keys", added_keys);
+    } catch (const std::exception &e) {
+        putString(env, result, "error", e.what());
+    }
+    return result;
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_rnllama_LlamaContext_vectorStoreSearch(
+    JNIEnv *env,
+    jobject thiz,
+    jlong context_ptr,
+    jstring query,
+    jint k,
+    jint n_probe,
+    jlong rerank_context_ptr,
+    jint n_rerank
+) {
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+    context_ref rerank_ctx;
+    if (rerank_context_ptr != 0) {
+        rerank_ctx = get_context(rerank_context_ptr);
+    }
+
+    const char *query_chars = env->GetStringUTFChars(query, nullptr);
+    const std::string query_str(query_chars);
+    env->ReleaseStringUTFChars(query, query_chars);
+
+    auto result = createWriteableMap(env);
+    try {
+        std::vector<rnllama::vector_store_result> found = llama->searchVectorStore(query_str, k, n_probe, rerank_ctx, n_rerank);
+        auto items = createWritableArray(env);
+        for (const auto &res : found) {
+            auto item = createWriteableMap(env);
+            putDouble(env, item, "key", (double) res.key);
+            putDouble(env, item, "score", (double) res.score);
+            if (llama->vstore->hasText(res.row)) {
+                putString(env, item, "text", llama->vstore->text(res.row).c_str());
+            }
+            pushMap(env, items, item);
+        }
+        putArray(env, result, "results", items);
+    } catch (const std::exception &e) {
+        putString(env, result, "error", e.what());
     }
     return result;
 }
 
+JNIEXPORT jstring JNICALL
+Java_com_rnllama_LlamaContext_vectorStoreBuildIndex(
+    JNIEnv *env,
+    jobject thiz,
+    jlong context_ptr,
+    jint n_lists
+) {
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    if (llama->vstore == nullptr) {
+        return env->NewStringUTF("vector store is not initialized");
+    }
+    try {
+        llama->vstore->buildIndex(n_lists);
+    } catch (const std::exception &e) {
+        return env->NewStringUTF(e.what());
+    }
+    return nullptr;
+}
+
+JNIEXPORT void JNICALL
+Java_com_rnllama_LlamaContext_releaseVectorStore(
+    JNIEnv *env,
+    jobject thiz,
+    jlong context_ptr
+) {
+    UNUSED(env);
+    UNUSED(thiz);
+    auto llama = get_context(context_ptr);
+    rnllama::context_lock lock(llama);
+    llama->releaseVectorStore();
+}
+
 } // extern "C"
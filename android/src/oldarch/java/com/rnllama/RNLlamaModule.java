@@ -33,11 +33,22 @@ public class RNLlamaModule extends ReactContextBaseJavaModule {
     return NAME;
   }
 
+  @Override
+  public void invalidate() {
+    rnllama.invalidate();
+    super.invalidate();
+  }
+
   @ReactMethod
   public void toggleNativeLog(boolean enabled, Promise promise) {
     rnllama.toggleNativeLog(enabled, promise);
   }
 
+  @ReactMethod(isBlockingSynchronousMethod = true)
+  public String installJSI() {
+    return rnllama.installJSI();
+  }
+
   @ReactMethod
   public void setContextLimit(double limit, Promise promise) {
     rnllama.setContextLimit(limit, promise);
@@ -133,6 +144,16 @@ public class RNLlamaModule extends ReactContextBaseJavaModule {
     rnllama.removeLoraAdapters(id, promise);
   }
 
+  @ReactMethod
+  public void mergeLoraAdapters(double id, final ReadableArray loraAdapters, final String cachePath, final Promise promise) {
+    rnllama.mergeLoraAdapters(id, loraAdapters, cachePath, promise);
+  }
+
+  @ReactMethod
+  public void unmergeLoraAdapters(double id, final Promise promise) {
+    rnllama.unmergeLoraAdapters(id, promise);
+  }
+
   @ReactMethod
   public void getLoadedLoraAdapters(double id, final Promise promise) {
     rnllama.getLoadedLoraAdapters(id, promise);
@@ -168,6 +189,41 @@ public class RNLlamaModule extends ReactContextBaseJavaModule {
     rnllama.releaseVocoder(id, promise);
   }
 
+  @ReactMethod
+  public void getMemoryFootprint(double id, final Promise promise) {
+    rnllama.getMemoryFootprint(id, promise);
+  }
+
+  @ReactMethod
+  public void releaseMemory(double id, double level, final Promise promise) {
+    rnllama.releaseMemory(id, level, promise);
+  }
+
+  @ReactMethod
+  public void initVectorStore(double id, final String path, final ReadableMap params, final Promise promise) {
+    rnllama.initVectorStore(id, path, params, promise);
+  }
+
+  @ReactMethod
+  public void vectorStoreAdd(double id, final ReadableArray texts, final ReadableMap params, final Promise promise) {
+    rnllama.vectorStoreAdd(id, texts, params, promise);
+  }
+
+  @ReactMethod
+  public void vectorStoreSearch(double id, final String query, final ReadableMap params, final Promise promise) {
+    rnllama.vectorStoreSearch(id, query, params, promise);
+  }
+
+  @ReactMethod
+  public void vectorStoreBuildIndex(double id, final double nLists, final Promise promise) {
+    rnllama.vectorStoreBuildIndex(id, nLists, promise);
+  }
+
+  @ReactMethod
+  public void releaseVectorStore(double id, final Promise promise) {
+    rnllama.releaseVectorStore(id, promise);
+  }
+
   public void releaseContext(double id, Promise promise) {
     rnllama.releaseContext(id, promise);
   }
@@ -1115,6 +1115,7 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.use_lazy_load   = params.use_lazy_load;
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1174,6 +1175,8 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
 
+    cparams.n_kv_recent = params.kv_recent;
+
     return cparams;
 }
 
@@ -334,6 +334,7 @@ struct common_params {
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool use_mmap          = true;  // use mmap for faster loads
+    bool use_lazy_load     = false; // don't prefetch the mmap, weights are faulted in on first use
     bool use_mlock         = false; // use mlock to keep model in memory
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool display_prompt    = true;  // print prompt before generation
@@ -349,6 +350,7 @@ struct common_params {
 
     lm_ggml_type cache_type_k = LM_GGML_TYPE_F16; // KV cache data type for the K
     lm_ggml_type cache_type_v = LM_GGML_TYPE_F16; // KV cache data type for the V
+    uint32_t  kv_recent    = 0;                // number of recent cells also kept in F16 (0 = disabled)
 
     common_conversation_mode conversation_mode = COMMON_CONVERSATION_MODE_AUTO;
 
@@ -24,6 +24,9 @@ struct lm_ggml_compute_params {
     void * wdata;
 
     struct lm_ggml_threadpool * threadpool;
+
+    // sequence number of the node in the execution plan of the graph, -1 if there is none
+    int seq;
 };
 
 
@@ -512,6 +515,10 @@ void lm_ggml_barrier(struct lm_ggml_threadpool * tp);
 void lm_ggml_threadpool_chunk_set(struct lm_ggml_threadpool * tp, int value);
 int  lm_ggml_threadpool_chunk_add(struct lm_ggml_threadpool * tp, int value);
 
+// claims the next of n_chunks work items of the current node - *chunk must be -1 before the first call
+// returns false once all chunks are taken
+bool lm_ggml_threadpool_chunk_next(const struct lm_ggml_compute_params * params, int n_chunks, int * chunk);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,6 +1,10 @@
 #define _CRT_SECURE_NO_DEPRECATE // Disables "unsafe" warnings on Windows
 #define _USE_MATH_DEFINES // For M_PI on MSVC
 
+#if defined(__ANDROID__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // cpu_set_t and sched_setaffinity in bionic
+#endif
+
 #include "ggml-backend-impl.h"
 #include "ggml-backend.h"
 #include "traits.h"
@@ -431,6 +435,59 @@ typedef pthread_mutex_t    lm_ggml_mutex_t;
 
 #endif
 
+// Graph execution plan
+//
+// Instead of a full barrier after every node, each node waits only for the most recent earlier node it
+// conflicts with (reads its output, overwrites memory it reads or writes, or shares the work buffer).
+// Threads execute the nodes in graph order, so "node k is done on all threads" implies that all nodes
+// before k are done as well, and a single wait per node is enough. Completion is tracked in a small ring
+// of counters indexed by the sequence number of the executed nodes; nodes without work (views) are not
+// executed and not counted.
+
+#define LM_GGML_CPU_NODE_RING 32
+#define LM_GGML_CPU_MAX_FUSED 2
+
+// elementwise chains computed as a single node
+enum lm_ggml_cpu_fusion {
+    LM_GGML_CPU_FUSION_NONE,
+    LM_GGML_CPU_FUSION_RMS_NORM,    // [ADD ->] RMS_NORM [-> MUL], computed row by row
+    LM_GGML_CPU_FUSION_ROPE_ROWS,   // ROPE -> RESHAPE -> SET_ROWS, heads are stored in the KV cache right after rotation
+};
+
+struct lm_ggml_cpu_node_plan {
+    int32_t seq;                            // sequence number of the executed node, -1 if the node is skipped
+    int32_t dep;                            // sequence number that must be complete on all threads first, -1 if none
+    int32_t fused[LM_GGML_CPU_MAX_FUSED];      // later nodes computed together with this one, -1 if unused
+    int8_t  fusion;                         // enum lm_ggml_cpu_fusion
+    bool    sync;                           // uses shared scratch or internal barriers - waits for all previous nodes
+};
+
+// what the plan of a node depends on - a reused graph keeps its nodes, shapes and buffers, so its plan is kept too
+struct lm_ggml_cpu_plan_key {
+    const struct lm_ggml_tensor * node;
+    const void                 * data;
+    const struct lm_ggml_tensor * src[LM_GGML_MAX_SRC];
+    const void                 * src_data[LM_GGML_MAX_SRC];
+    size_t                       src_size[LM_GGML_MAX_SRC];
+    int64_t                      ne[LM_GGML_MAX_DIMS];
+    size_t                       nb[LM_GGML_MAX_DIMS];
+    int32_t                      op;
+    int32_t                      type;
+};
+
+// LM_GGML_CPU_NO_FUSION and LM_GGML_CPU_GRAPH_BARRIERS restore the plain executor with a barrier after every node
+static bool lm_ggml_cpu_graph_fusion = true;
+static bool lm_ggml_cpu_graph_deps   = true;
+
+struct lm_ggml_cpu_node_counter {
+    atomic_int LM_GGML_CACHE_ALIGN n_done;
+    atomic_int LM_GGML_CACHE_ALIGN n_chunk; // work items claimed, tagged with the use of the ring slot
+};
+
+// chunks of a node are counted in the low bits of n_chunk, the high bits tell apart the nodes sharing the slot
+#define LM_GGML_CPU_CHUNK_BITS 20
+#define LM_GGML_CPU_CHUNK_MASK ((1 << LM_GGML_CPU_CHUNK_BITS) - 1)
+
 // Threadpool def
 struct lm_ggml_threadpool {
     lm_ggml_mutex_t mutex;       // mutex for cond.var
@@ -450,6 +507,15 @@ struct lm_ggml_threadpool {
     atomic_bool pause;        // Used for pausing the threadpool or individual threads
     atomic_int abort;         // Used for aborting processing of a graph
 
+    // execution plan of the current graph, built by the main thread before the workers are kicked off
+    struct lm_ggml_cpu_node_plan    * plan;
+    struct lm_ggml_cpu_plan_key     * plan_keys;
+    int                            plan_size;
+    int                            plan_n_nodes; // nodes covered by plan_keys, -1 if there is no reusable plan
+    bool                           plan_deps; // use the dependency counters instead of per-node barriers
+    bool                           plan_fusion;
+    struct lm_ggml_cpu_node_counter   node_done[LM_GGML_CPU_NODE_RING];
+
     struct lm_ggml_compute_state * workers;   // per thread state
     int          n_threads_max; // number of threads in the pool
     atomic_int   n_threads_cur; // number of threads used in the current graph
@@ -566,6 +632,38 @@ int lm_ggml_threadpool_chunk_add(struct lm_ggml_threadpool * tp, int value) {
     return atomic_fetch_add_explicit(&tp->current_chunk, value, memory_order_relaxed);
 }
 
+// chunks go to whichever thread asks first, so that the faster cores of a heterogeneous CPU take more of them.
+// no reset is needed between nodes: a node starts only once all threads are done with the node that used the
+// ring slot before it, so a counter with a different tag means no chunk of this node was claimed yet
+bool lm_ggml_threadpool_chunk_next(const struct lm_ggml_compute_params * params, int n_chunks, int * chunk) {
+    LM_GGML_ASSERT(n_chunks <= LM_GGML_CPU_CHUNK_MASK);
+
+    if (params->seq < 0 || params->nth == 1) {
+        *chunk = *chunk < 0 ? params->ith : *chunk + params->nth;
+        return *chunk < n_chunks;
+    }
+
+    atomic_int * n_chunk = &params->threadpool->node_done[params->seq % LM_GGML_CPU_NODE_RING].n_chunk;
+
+    const int tag = (params->seq / LM_GGML_CPU_NODE_RING) % ((1 << (31 - LM_GGML_CPU_CHUNK_BITS)) - 1) + 1;
+
+    int cur = atomic_load_explicit(n_chunk, memory_order_relaxed);
+    while (true) {
+        const bool same = (cur >> LM_GGML_CPU_CHUNK_BITS) == tag;
+
+        if (same && (cur & LM_GGML_CPU_CHUNK_MASK) >= n_chunks) {
+            return false;
+        }
+
+        const int next = same ? cur + 1 : (tag << LM_GGML_CPU_CHUNK_BITS) | 1;
+
+        if (atomic_compare_exchange_weak_explicit(n_chunk, &cur, next, memory_order_relaxed, memory_order_relaxed)) {
+            *chunk = (next & LM_GGML_CPU_CHUNK_MASK) - 1;
+            return *chunk < n_chunks;
+        }
+    }
+}
+
 #if defined(__gnu_linux__)
 static cpu_set_t lm_ggml_get_numa_affinity(void) {
     cpu_set_t cpuset;
@@ -2461,8 +2559,9 @@ static bool lm_ggml_thread_apply_priority(int32_t prio) {
     return true;
 }
 
-#elif defined(__gnu_linux__)
+#elif defined(__gnu_linux__) || defined(__ANDROID__)
 // TODO: this may not work on BSD, to be verified
+// bionic has no pthread_setaffinity_np, but sched_setaffinity applies to the calling thread
 
 static bool lm_ggml_thread_apply_affinity(const bool * mask) {
     cpu_set_t cpuset;
@@ -2589,6 +2688,8 @@ void lm_ggml_threadpool_free(struct lm_ggml_threadpool* threadpool) {
 
     const size_t workers_size = sizeof(struct lm_ggml_compute_state) * n_threads;
     lm_ggml_aligned_free(threadpool->workers, workers_size);
+    free(threadpool->plan);
+    free(threadpool->plan_keys);
     lm_ggml_aligned_free(threadpool, sizeof(struct lm_ggml_threadpool));
 }
 
@@ -2777,6 +2878,16 @@ struct lm_ggml_cplan lm_ggml_graph_plan(
                         const int64_t ne20 = node->src[2]->ne[0]; // DV
 
                         cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+
+                        if (node->src[6] != NULL) {
+                            // Q is also kept in F16 for the recent cells
+                            cur += sizeof(float)*ne10*n_tasks;
+                        }
+
+                        if (node->src[3] == NULL) {
+                            // the unmasked kernel keeps a tile of Q rows, outputs and scores + a tile of K and V rows (per thread)
+                            cur = MAX(cur, sizeof(float)*(LM_GGML_FA_TILE_Q*(ne10 + ne20 + 2*LM_GGML_FA_TILE_KV + 2) + LM_GGML_FA_TILE_KV*(ne10 + ne20))*n_tasks);
+                        }
                     } break;
                 case LM_GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -2823,6 +2934,409 @@ struct lm_ggml_cplan lm_ggml_graph_plan(
     return cplan;
 }
 
+//
+// graph execution plan
+//
+
+static bool lm_ggml_cpu_op_is_empty(const struct lm_ggml_tensor * node) {
+    switch (node->op) {
+        case LM_GGML_OP_NONE:
+        case LM_GGML_OP_RESHAPE:
+        case LM_GGML_OP_VIEW:
+        case LM_GGML_OP_PERMUTE:
+        case LM_GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return lm_ggml_is_empty(node);
+    }
+}
+
+// ops that only access their sources and destination, have no internal barriers and use at most
+// a per-thread slice of the work buffer (wdata is set in that case)
+static bool lm_ggml_cpu_op_is_local(const struct lm_ggml_tensor * node, bool * wdata) {
+    *wdata = false;
+
+    switch (node->op) {
+        case LM_GGML_OP_DUP:
+        case LM_GGML_OP_CPY:
+        case LM_GGML_OP_CONT:
+        case LM_GGML_OP_ADD:
+        case LM_GGML_OP_ADD1:
+        case LM_GGML_OP_ROPE:
+        case LM_GGML_OP_SOFT_MAX:
+            *wdata = true;
+            return true;
+        case LM_GGML_OP_SUB:
+        case LM_GGML_OP_MUL:
+        case LM_GGML_OP_DIV:
+        case LM_GGML_OP_SCALE:
+        case LM_GGML_OP_SQR:
+        case LM_GGML_OP_SQRT:
+        case LM_GGML_OP_NORM:
+        case LM_GGML_OP_RMS_NORM:
+        case LM_GGML_OP_GET_ROWS:
+        case LM_GGML_OP_SET_ROWS:
+        case LM_GGML_OP_UNARY:
+        case LM_GGML_OP_GLU:
+            return true;
+        default:
+            return lm_ggml_cpu_op_is_empty(node);
+    }
+}
+
+static bool lm_ggml_cpu_tensors_overlap(const struct lm_ggml_tensor * a, const struct lm_ggml_tensor * b) {
+    if (a == NULL || b == NULL || a->data == NULL || b->data == NULL) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + lm_ggml_nbytes(b) && b0 < a0 + lm_ggml_nbytes(a);
+}
+
+// b must not start before a is complete if it reads what a writes or writes what a reads or writes
+static bool lm_ggml_cpu_nodes_conflict(const struct lm_ggml_tensor * a, const struct lm_ggml_tensor * b) {
+    if (lm_ggml_cpu_tensors_overlap(a, b)) {
+        return true;
+    }
+
+    for (int i = 0; i < LM_GGML_MAX_SRC; i++) {
+        if (lm_ggml_cpu_tensors_overlap(a->src[i], b) || lm_ggml_cpu_tensors_overlap(a, b->src[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int lm_ggml_cpu_plan_group(const struct lm_ggml_cgraph * cgraph, const struct lm_ggml_cpu_node_plan * plan, int i, struct lm_ggml_tensor ** group) {
+    int n = 0;
+
+    group[n++] = cgraph->nodes[i];
+
+    for (int f = 0; f < LM_GGML_CPU_MAX_FUSED; f++) {
+        if (plan[i].fused[f] >= 0) {
+            group[n++] = cgraph->nodes[plan[i].fused[f]];
+        }
+    }
+
+    return n;
+}
+
+static bool lm_ggml_cpu_groups_conflict(const struct lm_ggml_cgraph * cgraph, const struct lm_ggml_cpu_node_plan * plan, int a, int b) {
+    struct lm_ggml_tensor * ga[1 + LM_GGML_CPU_MAX_FUSED];
+    struct lm_ggml_tensor * gb[1 + LM_GGML_CPU_MAX_FUSED];
+
+    const int na = lm_ggml_cpu_plan_group(cgraph, plan, a, ga);
+    const int nb = lm_ggml_cpu_plan_group(cgraph, plan, b, gb);
+
+    for (int i = 0; i < na; i++) {
+        for (int j = 0; j < nb; j++) {
+            if (lm_ggml_cpu_nodes_conflict(ga[i], gb[j])) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool lm_ggml_cpu_is_f32_rows(const struct lm_ggml_tensor * t) {
+    return t->type == LM_GGML_TYPE_F32 && t->nb[0] == sizeof(float);
+}
+
+// src is broadcast to dst along the rows only
+static bool lm_ggml_cpu_is_row_bcast(const struct lm_ggml_tensor * src, const struct lm_ggml_tensor * dst) {
+    return lm_ggml_cpu_is_f32_rows(src) && src->ne[0] == dst->ne[0] && lm_ggml_can_repeat(src, dst);
+}
+
+static void lm_ggml_cpu_plan_fusion(const struct lm_ggml_cgraph * cgraph, int i, struct lm_ggml_cpu_node_plan * np) {
+    const int n_nodes = cgraph->n_nodes;
+
+    struct lm_ggml_tensor * node = cgraph->nodes[i];
+
+    // [ADD ->] RMS_NORM [-> MUL] - the residual add before the norm and the weight multiplication after it
+    {
+        struct lm_ggml_tensor * add  = NULL;
+        struct lm_ggml_tensor * norm = node;
+        struct lm_ggml_tensor * mul  = NULL;
+
+        int j = i;
+
+        if (node->op == LM_GGML_OP_ADD && i + 1 < n_nodes) {
+            struct lm_ggml_tensor * next = cgraph->nodes[i + 1];
+
+            if (next->op == LM_GGML_OP_RMS_NORM && next->src[0] == node &&
+                lm_ggml_cpu_is_f32_rows(node) && lm_ggml_cpu_is_f32_rows(node->src[0]) &&
+                lm_ggml_are_same_shape(node->src[0], node) && node->src[1] != node &&
+                lm_ggml_cpu_is_row_bcast(node->src[1], node)) {
+                add  = node;
+                norm = next;
+                j    = i + 1;
+            }
+        }
+
+        if (norm->op == LM_GGML_OP_RMS_NORM && lm_ggml_cpu_is_f32_rows(norm) && lm_ggml_cpu_is_f32_rows(norm->src[0]) &&
+            lm_ggml_are_same_shape(norm->src[0], norm)) {
+            if (j + 1 < n_nodes) {
+                struct lm_ggml_tensor * next = cgraph->nodes[j + 1];
+
+                if (next->op == LM_GGML_OP_MUL && next->src[0] == norm && next->src[1] != norm && next->src[1] != add &&
+                    lm_ggml_cpu_is_f32_rows(next) && lm_ggml_are_same_shape(next, norm) &&
+                    lm_ggml_cpu_is_row_bcast(next->src[1], next)) {
+                    mul = next;
+                }
+            }
+
+            if (add || mul) {
+                np->fusion   = LM_GGML_CPU_FUSION_RMS_NORM;
+                np->fused[0] = i + 1;
+                np->fused[1] = add && mul ? i + 2 : -1;
+                return;
+            }
+        }
+    }
+
+    // ROPE -> RESHAPE -> SET_ROWS - the KV store is emitted after the V projection, so it is pulled forward
+    // to the rope as long as the nodes in between do not touch what it reads or writes
+    if (node->op == LM_GGML_OP_ROPE && node->type == LM_GGML_TYPE_F32 && node->src[0]->type == LM_GGML_TYPE_F32 &&
+        lm_ggml_is_contiguous(node) && node->ne[3] == 1) {
+        for (int r = i + 1; r + 1 < n_nodes && r <= i + LM_GGML_CPU_NODE_RING; r++) {
+            struct lm_ggml_tensor * rs = cgraph->nodes[r];
+            struct lm_ggml_tensor * sr = cgraph->nodes[r + 1];
+
+            if (rs->op != LM_GGML_OP_RESHAPE || rs->src[0] != node) {
+                continue;
+            }
+
+            if (sr->op != LM_GGML_OP_SET_ROWS || sr->src[0] != rs) {
+                return;
+            }
+
+            const struct lm_ggml_tensor * idxs = sr->src[1];
+
+            if (rs->ne[0] != node->ne[0]*node->ne[1] || rs->ne[1] != node->ne[2] ||
+                idxs->type != LM_GGML_TYPE_I64 || idxs->ne[0] != node->ne[2] || lm_ggml_nelements(idxs) != idxs->ne[0] ||
+                sr->ne[0] != rs->ne[0] || sr->ne[2] != 1 || sr->ne[3] != 1 ||
+                node->ne[0] % lm_ggml_blck_size(sr->type) != 0 ||
+                lm_ggml_get_type_traits_cpu(sr->type)->from_float == NULL) {
+                return;
+            }
+
+            for (int m = i + 1; m < r; m++) {
+                if (lm_ggml_cpu_nodes_conflict(cgraph->nodes[m], sr) || lm_ggml_cpu_nodes_conflict(cgraph->nodes[m], rs)) {
+                    return;
+                }
+            }
+
+            np->fusion   = LM_GGML_CPU_FUSION_ROPE_ROWS;
+            np->fused[0] = r;
+            np->fused[1] = r + 1;
+            return;
+        }
+    }
+}
+
+// stores the keys of the graph and returns true if they match the ones the current plan was built for
+static bool lm_ggml_cpu_plan_keys_update(struct lm_ggml_threadpool * tp, const struct lm_ggml_cgraph * cgraph) {
+    const int n_nodes = cgraph->n_nodes;
+
+    bool match = tp->plan_n_nodes == n_nodes &&
+                 tp->plan_deps    == lm_ggml_cpu_graph_deps &&
+                 tp->plan_fusion  == lm_ggml_cpu_graph_fusion;
+
+    for (int i = 0; i < n_nodes; i++) {
+        const struct lm_ggml_tensor * node = cgraph->nodes[i];
+
+        struct lm_ggml_cpu_plan_key key;
+        memset(&key, 0, sizeof(key));
+
+        key.node = node;
+        key.data = node->data;
+        for (int s = 0; s < LM_GGML_MAX_SRC; s++) {
+            key.src[s]      = node->src[s];
+            key.src_data[s] = node->src[s] ? node->src[s]->data : NULL;
+            key.src_size[s] = node->src[s] ? lm_ggml_nbytes(node->src[s]) : 0;
+        }
+        for (int d = 0; d < LM_GGML_MAX_DIMS; d++) {
+            key.ne[d] = node->ne[d];
+            key.nb[d] = node->nb[d];
+        }
+        key.op   = node->op;
+        key.type = node->type;
+
+        if (match && memcmp(&tp->plan_keys[i], &key, sizeof(key)) != 0) {
+            match = false;
+        }
+        tp->plan_keys[i] = key;
+    }
+
+    tp->plan_n_nodes = n_nodes;
+    tp->plan_deps    = lm_ggml_cpu_graph_deps;
+    tp->plan_fusion  = lm_ggml_cpu_graph_fusion;
+
+    return match;
+}
+
+static void lm_ggml_graph_compute_plan(struct lm_ggml_threadpool * tp, const struct lm_ggml_cgraph * cgraph) {
+    const int n_nodes = cgraph->n_nodes;
+
+    if (tp->plan_size < n_nodes) {
+        free(tp->plan);
+        free(tp->plan_keys);
+        tp->plan         = malloc(sizeof(struct lm_ggml_cpu_node_plan) * n_nodes);
+        tp->plan_keys    = malloc(sizeof(struct lm_ggml_cpu_plan_key) * n_nodes);
+        tp->plan_size    = n_nodes;
+        tp->plan_n_nodes = -1;
+        LM_GGML_ASSERT(tp->plan != NULL && tp->plan_keys != NULL);
+    }
+
+    for (int i = 0; i < LM_GGML_CPU_NODE_RING; i++) {
+        atomic_store_explicit(&tp->node_done[i].n_done,  0, memory_order_relaxed);
+        atomic_store_explicit(&tp->node_done[i].n_chunk, 0, memory_order_relaxed);
+    }
+
+    // the decode graphs are reused between the tokens, the dependency and fusion analysis only runs when the graph changed
+    if (lm_ggml_cpu_plan_keys_update(tp, cgraph)) {
+        return;
+    }
+
+    struct lm_ggml_cpu_node_plan * plan = tp->plan;
+
+    for (int i = 0; i < n_nodes; i++) {
+        plan[i].seq    = 0;
+        plan[i].dep    = -1;
+        plan[i].fusion = LM_GGML_CPU_FUSION_NONE;
+        plan[i].sync   = false;
+        for (int f = 0; f < LM_GGML_CPU_MAX_FUSED; f++) {
+            plan[i].fused[f] = -1;
+        }
+    }
+
+    // graph index of the group executed with each of the last sequence numbers
+    int32_t recent[LM_GGML_CPU_NODE_RING];
+
+    int32_t n_seq     = 0;
+    int32_t last_sync = -1;
+
+    for (int i = 0; i < n_nodes; i++) {
+        struct lm_ggml_cpu_node_plan * np = &plan[i];
+
+        // views and members of an earlier fused group
+        if (np->seq < 0 || lm_ggml_cpu_op_is_empty(cgraph->nodes[i])) {
+            np->seq = -1;
+            continue;
+        }
+
+        if (lm_ggml_cpu_graph_fusion) {
+            lm_ggml_cpu_plan_fusion(cgraph, i, np);
+
+            for (int f = 0; f < LM_GGML_CPU_MAX_FUSED; f++) {
+                if (np->fused[f] >= 0) {
+                    plan[np->fused[f]].seq = -1;
+                }
+            }
+        }
+
+        struct lm_ggml_tensor * group[1 + LM_GGML_CPU_MAX_FUSED];
+        const int n_group = lm_ggml_cpu_plan_group(cgraph, plan, i, group);
+
+        bool local = true;
+        bool wdata = false;
+
+        for (int g = 0; g < n_group; g++) {
+            bool w = false;
+            local = local && lm_ggml_cpu_op_is_local(group[g], &w);
+            wdata = wdata || w;
+        }
+
+        np->seq  = n_seq;
+        np->sync = !local;
+
+        if (np->sync) {
+            np->dep   = n_seq - 1;
+            last_sync = n_seq;
+        } else {
+            // per-thread scratch slices can overlap the shared scratch of the last sync node
+            np->dep = wdata ? last_sync : -1;
+
+            // the most recent conflicting node is enough - all the nodes before it are complete by then
+            for (int32_t s = n_seq - 1; s > np->dep && s > n_seq - LM_GGML_CPU_NODE_RING; s--) {
+                if (lm_ggml_cpu_groups_conflict(cgraph, plan, recent[s % LM_GGML_CPU_NODE_RING], i)) {
+                    np->dep = s;
+                    break;
+                }
+            }
+
+            // the completion counter is shared with the node LM_GGML_CPU_NODE_RING steps back
+            np->dep = MAX(np->dep, n_seq - LM_GGML_CPU_NODE_RING);
+        }
+
+        recent[n_seq % LM_GGML_CPU_NODE_RING] = i;
+        n_seq++;
+    }
+}
+
+// a node at which all threads stop consistently when the graph is aborted after node `last`:
+// a sync node is entered only once all nodes before it are complete, so no thread can be inside
+// the first sync node that follows a node the calling thread has not executed yet
+static int lm_ggml_graph_compute_abort_node(const struct lm_ggml_cgraph * cgraph, const struct lm_ggml_cpu_node_plan * plan, int last) {
+    int i = last + 1;
+
+    while (i < cgraph->n_nodes && plan[i].seq < 0) {
+        i++;
+    }
+
+    for (i = i + 1; i < cgraph->n_nodes; i++) {
+        if (plan[i].seq >= 0 && plan[i].sync) {
+            return i;
+        }
+    }
+
+    return cgraph->n_nodes;
+}
+
+static inline void lm_ggml_graph_compute_wait_seq(struct lm_ggml_threadpool * tp, int32_t seq, int n_threads) {
+    atomic_int * n_done = &tp->node_done[seq % LM_GGML_CPU_NODE_RING].n_done;
+
+    const int n_target = n_threads*(seq/LM_GGML_CPU_NODE_RING + 1);
+
+    while (atomic_load_explicit(n_done, memory_order_acquire) < n_target) {
+        lm_ggml_thread_cpu_relax();
+    }
+}
+
+static inline void lm_ggml_graph_compute_done_seq(struct lm_ggml_threadpool * tp, int32_t seq) {
+    atomic_fetch_add_explicit(&tp->node_done[seq % LM_GGML_CPU_NODE_RING].n_done, 1, memory_order_release);
+}
+
+static void lm_ggml_graph_compute_node(struct lm_ggml_compute_params * params, const struct lm_ggml_cgraph * cgraph, const struct lm_ggml_cpu_node_plan * plan, int node_n) {
+    const struct lm_ggml_cpu_node_plan * np = &plan[node_n];
+
+    switch ((enum lm_ggml_cpu_fusion) np->fusion) {
+        case LM_GGML_CPU_FUSION_RMS_NORM:
+            {
+                struct lm_ggml_tensor * group[1 + LM_GGML_CPU_MAX_FUSED];
+                const int n_group = lm_ggml_cpu_plan_group(cgraph, plan, node_n, group);
+
+                struct lm_ggml_tensor * add  = group[0]->op == LM_GGML_OP_ADD ? group[0] : NULL;
+                struct lm_ggml_tensor * norm = add ? group[1] : group[0];
+                struct lm_ggml_tensor * mul  = group[n_group - 1]->op == LM_GGML_OP_MUL ? group[n_group - 1] : NULL;
+
+                lm_ggml_compute_forward_add_rms_norm_mul(params, add, norm, mul);
+            } break;
+        case LM_GGML_CPU_FUSION_ROPE_ROWS:
+            {
+                lm_ggml_compute_forward_rope_set_rows(params, cgraph->nodes[node_n], cgraph->nodes[np->fused[1]]);
+            } break;
+        case LM_GGML_CPU_FUSION_NONE:
+            {
+                lm_ggml_compute_forward(params, cgraph->nodes[node_n]);
+            } break;
+    }
+}
+
 static thread_ret_t lm_ggml_graph_compute_thread(void * data) {
     struct lm_ggml_compute_state * state = (struct lm_ggml_compute_state *) data;
     struct lm_ggml_threadpool    * tp    = state->threadpool;
@@ -2830,6 +3344,8 @@ static thread_ret_t lm_ggml_graph_compute_thread(void * data) {
     const struct lm_ggml_cgraph * cgraph = tp->cgraph;
     const struct lm_ggml_cplan  * cplan  = tp->cplan;
 
+    const struct lm_ggml_cpu_node_plan * plan = tp->plan;
+
     set_numa_thread_affinity(state->ith);
 
     struct lm_ggml_compute_params params = {
@@ -2838,20 +3354,44 @@ static thread_ret_t lm_ggml_graph_compute_thread(void * data) {
         /*.wsize     =*/ cplan->work_size,
         /*.wdata     =*/ cplan->work_data,
         /*.threadpool=*/ tp,
+        /*.seq       =*/ -1,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
-        struct lm_ggml_tensor * node = cgraph->nodes[node_n];
+    const bool deps = tp->plan_deps && params.nth > 1;
 
-        lm_ggml_compute_forward(&params, node);
+    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
+        const struct lm_ggml_cpu_node_plan * np = &plan[node_n];
+
+        if (np->seq < 0) {
+            continue;
+        }
+
+        if (deps && np->dep >= 0) {
+            lm_ggml_graph_compute_wait_seq(tp, np->dep, params.nth);
+        }
+
+        // checked after the wait, so that the abort node set by thread 0 is visible here
+        const int abort = atomic_load_explicit(&tp->abort, memory_order_relaxed);
+        if (abort >= 0 && node_n >= abort) {
+            break;
+        }
+
+        params.seq = np->seq;
+
+        lm_ggml_graph_compute_node(&params, cgraph, plan, node_n);
+
+        if (deps) {
+            lm_ggml_graph_compute_done_seq(tp, np->seq);
+        }
 
         if (state->ith == 0 && cplan->abort_callback &&
+                atomic_load_explicit(&tp->abort, memory_order_relaxed) < 0 &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
-            atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
+            atomic_store_explicit(&tp->abort, deps ? lm_ggml_graph_compute_abort_node(cgraph, plan, node_n) : node_n + 1, memory_order_relaxed);
             tp->ec    = LM_GGML_STATUS_ABORTED;
         }
 
-        if (node_n + 1 < cgraph->n_nodes) {
+        if (!deps && node_n + 1 < cgraph->n_nodes) {
             lm_ggml_barrier(state->threadpool);
         }
     }
@@ -3025,6 +3565,12 @@ static struct lm_ggml_threadpool * lm_ggml_threadpool_new_impl(
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = -1;
+        threadpool->plan             = NULL;
+        threadpool->plan_keys        = NULL;
+        threadpool->plan_size        = 0;
+        threadpool->plan_n_nodes     = -1;
+        threadpool->plan_deps        = false;
+        threadpool->plan_fusion      = false;
         threadpool->workers          = NULL;
         threadpool->n_threads_max    = tpp->n_threads;
         threadpool->n_threads_cur    = tpp->n_threads;
@@ -3107,6 +3653,8 @@ enum lm_ggml_status lm_ggml_graph_compute(struct lm_ggml_cgraph * cgraph, struct
         threadpool->ec               = LM_GGML_STATUS_SUCCESS;
     }
 
+    lm_ggml_graph_compute_plan(threadpool, cgraph);
+
 #ifdef LM_GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -3509,6 +4057,9 @@ void lm_ggml_cpu_init(void) {
     static bool is_first_call = true;
 
     if (is_first_call) {
+        lm_ggml_cpu_graph_fusion = getenv("LM_GGML_CPU_NO_FUSION")      == NULL;
+        lm_ggml_cpu_graph_deps   = getenv("LM_GGML_CPU_GRAPH_BARRIERS") == NULL;
+
         // initialize GELU, Quick GELU, SILU and EXP F32 tables
         {
             const uint64_t t_start = lm_ggml_time_us(); UNUSED(t_start);
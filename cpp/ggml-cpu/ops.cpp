@@ -1,3 +1,7 @@
+#define LM_GGML_COMMON_IMPL_CPP
+#define LM_GGML_COMMON_DECL_CPP
+#include "ggml-common.h"
+
 #include "ops.h"
 
 #include "ggml-cpu.h"
@@ -9,6 +13,24 @@
 
 #include <float.h>
 
+// row chunks per thread for the ops that schedule their rows dynamically
+#define LM_GGML_CPU_ROW_CHUNKS 4
+
+// next range of rows [ir0, ir1) for the calling thread - a thread on a slow core ends up with fewer chunks
+// instead of holding up the others at the end of the node
+static bool lm_ggml_compute_rows_next(const lm_ggml_compute_params * params, int64_t nr, int & chunk, int64_t & ir0, int64_t & ir1) {
+    const int n_chunks = (int) std::min<int64_t>(nr, (int64_t) params->nth*LM_GGML_CPU_ROW_CHUNKS);
+
+    if (!lm_ggml_threadpool_chunk_next(params, n_chunks, &chunk)) {
+        return false;
+    }
+
+    ir0 = nr*chunk/n_chunks;
+    ir1 = nr*(chunk + 1)/n_chunks;
+
+    return true;
+}
+
 // lm_ggml_compute_forward_dup
 
 static void lm_ggml_compute_forward_dup_same_cont(
@@ -3206,9 +3228,6 @@ static void lm_ggml_compute_forward_reglu_f32(
         LM_GGML_ASSERT(src0->type == src1->type);
     }
 
-    const int ith = params->ith;
-    const int nth = params->nth;
-
     const int nc = src1 ? src0->ne[0] : src0->ne[0] / 2;
     const int nr = lm_ggml_nrows(src0);
 
@@ -3217,32 +3236,30 @@ static void lm_ggml_compute_forward_reglu_f32(
 
     const int32_t swapped = lm_ggml_get_op_params_i32(dst, 1);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    int chunk = -1;
+    int64_t ir0, ir1;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t i1 = ir0; i1 < ir1; i1++) {
+            float * src0_p = (float *) (src0_d + i1*src0_o);
+            float * src1_p = (float *) (src1_d + i1*src1_o);
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * src0_p = (float *) (src0_d + i1*src0_o);
-        float * src1_p = (float *) (src1_d + i1*src1_o);
-
-        if (!src1) {
-            src0_p += swapped ? nc : 0;
-            src1_p += swapped ? 0 : nc;
-        }
+            if (!src1) {
+                src0_p += swapped ? nc : 0;
+                src1_p += swapped ? 0 : nc;
+            }
 
-        lm_ggml_vec_reglu_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), src0_p, src1_p);
+            lm_ggml_vec_reglu_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), src0_p, src1_p);
 
 #ifndef NDEBUG
-        for (int k = 0; k < nc; k++) {
-            const float x = ((float *) ((char *) dst->data + i1*( dst->nb[1])))[k];
-            LM_GGML_UNUSED(x);
-            assert(!isnan(x));
-            assert(!isinf(x));
-        }
+            for (int k = 0; k < nc; k++) {
+                const float x = ((float *) ((char *) dst->data + i1*( dst->nb[1])))[k];
+                LM_GGML_UNUSED(x);
+                assert(!isnan(x));
+                assert(!isinf(x));
+            }
 #endif
+        }
     }
 }
 
@@ -3349,9 +3366,6 @@ static void lm_ggml_compute_forward_geglu_f32(
         LM_GGML_ASSERT(src0->type == src1->type);
     }
 
-    const int ith = params->ith;
-    const int nth = params->nth;
-
     const int nc = src1 ? src0->ne[0] : src0->ne[0] / 2;
     const int nr = lm_ggml_nrows(src0);
 
@@ -3360,32 +3374,30 @@ static void lm_ggml_compute_forward_geglu_f32(
 
     const int32_t swapped = lm_ggml_get_op_params_i32(dst, 1);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    int chunk = -1;
+    int64_t ir0, ir1;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t i1 = ir0; i1 < ir1; i1++) {
+            float * src0_p = (float *) (src0_d + i1*src0_o);
+            float * src1_p = (float *) (src1_d + i1*src1_o);
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * src0_p = (float *) (src0_d + i1*src0_o);
-        float * src1_p = (float *) (src1_d + i1*src1_o);
-
-        if (!src1) {
-            src0_p += swapped ? nc : 0;
-            src1_p += swapped ? 0 : nc;
-        }
+            if (!src1) {
+                src0_p += swapped ? nc : 0;
+                src1_p += swapped ? 0 : nc;
+            }
 
-        lm_ggml_vec_geglu_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), src0_p, src1_p);
+            lm_ggml_vec_geglu_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), src0_p, src1_p);
 
 #ifndef NDEBUG
-        for (int k = 0; k < nc; k++) {
-            const float x = ((float *) ((char *) dst->data + i1*( dst->nb[1])))[k];
-            LM_GGML_UNUSED(x);
-            assert(!isnan(x));
-            assert(!isinf(x));
-        }
+            for (int k = 0; k < nc; k++) {
+                const float x = ((float *) ((char *) dst->data + i1*( dst->nb[1])))[k];
+                LM_GGML_UNUSED(x);
+                assert(!isnan(x));
+                assert(!isinf(x));
+            }
 #endif
+        }
     }
 }
 
@@ -3492,9 +3504,6 @@ static void lm_ggml_compute_forward_swiglu_f32(
         LM_GGML_ASSERT(src0->type == src1->type);
     }
 
-    const int ith = params->ith;
-    const int nth = params->nth;
-
     const int nc = src1 ? src0->ne[0] : src0->ne[0] / 2;
     const int nr = lm_ggml_nrows(src0);
 
@@ -3503,32 +3512,30 @@ static void lm_ggml_compute_forward_swiglu_f32(
 
     const int32_t swapped = lm_ggml_get_op_params_i32(dst, 1);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    int chunk = -1;
+    int64_t ir0, ir1;
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * src0_p = (float *) (src0_d + i1*src0_o);
-        float * src1_p = (float *) (src1_d + i1*src1_o);
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t i1 = ir0; i1 < ir1; i1++) {
+            float * src0_p = (float *) (src0_d + i1*src0_o);
+            float * src1_p = (float *) (src1_d + i1*src1_o);
 
-        if (!src1) {
-            src0_p += swapped ? nc : 0;
-            src1_p += swapped ? 0 : nc;
-        }
+            if (!src1) {
+                src0_p += swapped ? nc : 0;
+                src1_p += swapped ? 0 : nc;
+            }
 
-        lm_ggml_vec_swiglu_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), src0_p, src1_p);
+            lm_ggml_vec_swiglu_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), src0_p, src1_p);
 
 #ifndef NDEBUG
-        for (int k = 0; k < nc; k++) {
-            const float x = ((float *) ((char *) dst->data + i1*( dst->nb[1])))[k];
-            LM_GGML_UNUSED(x);
-            assert(!isnan(x));
-            assert(!isinf(x));
-        }
+            for (int k = 0; k < nc; k++) {
+                const float x = ((float *) ((char *) dst->data + i1*( dst->nb[1])))[k];
+                LM_GGML_UNUSED(x);
+                assert(!isnan(x));
+                assert(!isinf(x));
+            }
 #endif
+        }
     }
 }
 
@@ -3912,9 +3919,6 @@ static void lm_ggml_compute_forward_norm_f32(
 
     LM_GGML_ASSERT(src0->nb[0] == sizeof(float));
 
-    const int ith = params->ith;
-    const int nth = params->nth;
-
     LM_GGML_TENSOR_UNARY_OP_LOCALS
 
     float eps;
@@ -3922,33 +3926,39 @@ static void lm_ggml_compute_forward_norm_f32(
 
     LM_GGML_ASSERT(eps >= 0.0f);
 
-    // TODO: optimize
-    for (int64_t i03 = 0; i03 < ne03; i03++) {
-        for (int64_t i02 = 0; i02 < ne02; i02++) {
-            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
-                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+    const int64_t nr = lm_ggml_nrows(src0);
 
-                lm_ggml_float sum = 0.0;
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    sum += (lm_ggml_float)x[i00];
-                }
+    int chunk = -1;
+    int64_t ir0, ir1;
 
-                float mean = sum/ne00;
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            const int64_t i03 = ir/(ne02*ne01);
+            const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+            const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+            const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
 
-                lm_ggml_float sum2 = 0.0;
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    float v = x[i00] - mean;
-                    y[i00] = v;
-                    sum2 += (lm_ggml_float)(v*v);
-                }
+            lm_ggml_float sum = 0.0;
+            for (int64_t i00 = 0; i00 < ne00; i00++) {
+                sum += (lm_ggml_float)x[i00];
+            }
 
-                float variance = sum2/ne00;
-                const float scale = 1.0f/sqrtf(variance + eps);
+            float mean = sum/ne00;
 
-                lm_ggml_vec_scale_f32(ne00, y, scale);
+            float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+            lm_ggml_float sum2 = 0.0;
+            for (int64_t i00 = 0; i00 < ne00; i00++) {
+                float v = x[i00] - mean;
+                y[i00] = v;
+                sum2 += (lm_ggml_float)(v*v);
             }
+
+            float variance = sum2/ne00;
+            const float scale = 1.0f/sqrtf(variance + eps);
+
+            lm_ggml_vec_scale_f32(ne00, y, scale);
         }
     }
 }
@@ -3983,9 +3993,6 @@ static void lm_ggml_compute_forward_rms_norm_f32(
 
     LM_GGML_ASSERT(src0->nb[0] == sizeof(float));
 
-    const int ith = params->ith;
-    const int nth = params->nth;
-
     LM_GGML_TENSOR_UNARY_OP_LOCALS
 
     float eps;
@@ -3993,30 +4000,36 @@ static void lm_ggml_compute_forward_rms_norm_f32(
 
     LM_GGML_ASSERT(eps >= 0.0f);
 
-    // TODO: optimize
-    for (int64_t i03 = 0; i03 < ne03; i03++) {
-        for (int64_t i02 = 0; i02 < ne02; i02++) {
-            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
-                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+    const int64_t nr = lm_ggml_nrows(src0);
 
-                lm_ggml_float sum = 0.0;
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    sum += (lm_ggml_float)(x[i00] * x[i00]);
-                }
+    int chunk = -1;
+    int64_t ir0, ir1;
 
-                const float mean = sum/ne00;
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            const int64_t i03 = ir/(ne02*ne01);
+            const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+            const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+            const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
 
-                memcpy(y, x, ne00 * sizeof(float));
-                // for (int i00 = 0; i00 < ne00; i00++) {
-                //     y[i00] = x[i00];
-                // }
+            lm_ggml_float sum = 0.0;
+            for (int64_t i00 = 0; i00 < ne00; i00++) {
+                sum += (lm_ggml_float)(x[i00] * x[i00]);
+            }
 
-                const float scale = 1.0f/sqrtf(mean + eps);
+            const float mean = sum/ne00;
 
-                lm_ggml_vec_scale_f32(ne00, y, scale);
-            }
+            float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+            memcpy(y, x, ne00 * sizeof(float));
+            // for (int i00 = 0; i00 < ne00; i00++) {
+            //     y[i00] = x[i00];
+            // }
+
+            const float scale = 1.0f/sqrtf(mean + eps);
+
+            lm_ggml_vec_scale_f32(ne00, y, scale);
         }
     }
 }
@@ -4039,6 +4052,83 @@ void lm_ggml_compute_forward_rms_norm(
     }
 }
 
+// lm_ggml_compute_forward_add_rms_norm_mul
+
+void lm_ggml_compute_forward_add_rms_norm_mul(
+        const lm_ggml_compute_params * params,
+        lm_ggml_tensor * add,
+        lm_ggml_tensor * norm,
+        lm_ggml_tensor * mul) {
+
+    // add and mul are optional - each row goes through the whole chain while it is hot in cache,
+    // the intermediate results are still written out since later nodes may read them
+    const lm_ggml_tensor * src0 = norm->src[0];
+
+    LM_GGML_ASSERT(!add || src0 == add);
+    LM_GGML_ASSERT(!mul || mul->src[0] == norm);
+    LM_GGML_ASSERT(src0->type == LM_GGML_TYPE_F32 && norm->type == LM_GGML_TYPE_F32);
+
+    const int64_t ne00 = norm->ne[0];
+    const int64_t ne01 = norm->ne[1];
+    const int64_t ne02 = norm->ne[2];
+
+    const int64_t nr = lm_ggml_nrows(norm);
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    LM_GGML_ASSERT(eps >= 0.0f);
+
+    int chunk = -1;
+    int64_t ir0, ir1;
+
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            const int64_t i03 = ir/(ne02*ne01);
+            const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+            const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+            const float * x = (const float *) ((const char *) src0->data + i01*src0->nb[1] + i02*src0->nb[2] + i03*src0->nb[3]);
+
+            if (add) {
+                const lm_ggml_tensor * a0 = add->src[0];
+                const lm_ggml_tensor * a1 = add->src[1];
+
+                const float * x0 = (const float *) ((const char *) a0->data + i01*a0->nb[1] + i02*a0->nb[2] + i03*a0->nb[3]);
+                const float * x1 = (const float *) ((const char *) a1->data + (i01 % a1->ne[1])*a1->nb[1] + (i02 % a1->ne[2])*a1->nb[2] + (i03 % a1->ne[3])*a1->nb[3]);
+
+                lm_ggml_vec_add_f32(ne00, (float *) x, x0, x1);
+            }
+
+            lm_ggml_float sum = 0.0;
+            for (int64_t i00 = 0; i00 < ne00; i00++) {
+                sum += (lm_ggml_float)(x[i00] * x[i00]);
+            }
+
+            const float mean = sum/ne00;
+
+            float * y = (float *) ((char *) norm->data + i01*norm->nb[1] + i02*norm->nb[2] + i03*norm->nb[3]);
+
+            if (y != x) {
+                memcpy(y, x, ne00 * sizeof(float));
+            }
+
+            const float scale = 1.0f/sqrtf(mean + eps);
+
+            lm_ggml_vec_scale_f32(ne00, y, scale);
+
+            if (mul) {
+                const lm_ggml_tensor * m1 = mul->src[1];
+
+                float       * z = (float *) ((char *) mul->data + i01*mul->nb[1] + i02*mul->nb[2] + i03*mul->nb[3]);
+                const float * w = (const float *) ((const char *) m1->data + (i01 % m1->ne[1])*m1->nb[1] + (i02 % m1->ne[2])*m1->nb[2] + (i03 % m1->ne[3])*m1->nb[3]);
+
+                lm_ggml_vec_mul_f32(ne00, z, y, w);
+            }
+        }
+    }
+}
+
 static void lm_ggml_compute_forward_rms_norm_back_f32(
         const lm_ggml_compute_params * params,
         lm_ggml_tensor * dst) {
@@ -5519,7 +5609,6 @@ static void lm_ggml_compute_forward_soft_max_f32(
     memcpy(&max_bias, (float *) dst->op_params + 1, sizeof(float));
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     LM_GGML_TENSOR_UNARY_OP_LOCALS
 
@@ -5542,61 +5631,68 @@ static void lm_ggml_compute_forward_soft_max_f32(
 
     const bool use_f16 = (src1 && src1->type == LM_GGML_TYPE_F16);
 
-    for (int64_t i03 = 0; i03 < ne03; i03++) {
-        for (int64_t i02 = 0; i02 < ne02; i02++) {
-            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
-                const int64_t i11 = i01;
-                const int64_t i12 = i02%ne12;
-                const int64_t i13 = i03%ne13;
-
-                // ALiBi
-                const uint32_t h = i02; // head
-                const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
-
-                float * sp = (float *)((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
-                float * dp = (float *)((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3);
-
-                // broadcast the mask across rows
-                lm_ggml_fp16_t * mp_f16 = src1 ? (lm_ggml_fp16_t *)((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13) : NULL;
-                float       * mp_f32 = src1 ? (float       *)((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13) : NULL;
-
-                lm_ggml_vec_cpy_f32  (ne00, wp, sp);
-                lm_ggml_vec_scale_f32(ne00, wp, scale);
-                if (mp_f32) {
-                    if (use_f16) {
-                        for (int i = 0; i < ne00; ++i) {
-                            wp[i] += slope*LM_GGML_CPU_FP16_TO_FP32(mp_f16[i]);
-                        }
-                    } else {
-                        for (int i = 0; i < ne00; ++i) {
-                            wp[i] += slope*mp_f32[i];
-                        }
+    const int64_t nr = lm_ggml_nrows(src0);
+
+    int chunk = -1;
+    int64_t ir0, ir1;
+
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            const int64_t i03 = ir/(ne02*ne01);
+            const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+            const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+            const int64_t i11 = i01;
+            const int64_t i12 = i02%ne12;
+            const int64_t i13 = i03%ne13;
+
+            // ALiBi
+            const uint32_t h = i02; // head
+            const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+            float * sp = (float *)((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+            float * dp = (float *)((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3);
+
+            // broadcast the mask across rows
+            lm_ggml_fp16_t * mp_f16 = src1 ? (lm_ggml_fp16_t *)((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13) : NULL;
+            float       * mp_f32 = src1 ? (float       *)((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13) : NULL;
+
+            lm_ggml_vec_cpy_f32  (ne00, wp, sp);
+            lm_ggml_vec_scale_f32(ne00, wp, scale);
+            if (mp_f32) {
+                if (use_f16) {
+                    for (int i = 0; i < ne00; ++i) {
+                        wp[i] += slope*LM_GGML_CPU_FP16_TO_FP32(mp_f16[i]);
+                    }
+                } else {
+                    for (int i = 0; i < ne00; ++i) {
+                        wp[i] += slope*mp_f32[i];
                     }
                 }
+            }
 
 #ifndef NDEBUG
-                for (int i = 0; i < ne00; ++i) {
-                    //printf("p[%d] = %f\n", i, p[i]);
-                    assert(!isnan(wp[i]));
-                }
+            for (int i = 0; i < ne00; ++i) {
+                //printf("p[%d] = %f\n", i, p[i]);
+                assert(!isnan(wp[i]));
+            }
 #endif
 
-                float max = -INFINITY;
-                lm_ggml_vec_max_f32(ne00, &max, wp);
+            float max = -INFINITY;
+            lm_ggml_vec_max_f32(ne00, &max, wp);
 
-                lm_ggml_float sum = lm_ggml_vec_soft_max_f32(ne00, dp, wp, max);
-                assert(sum > 0.0);
+            lm_ggml_float sum = lm_ggml_vec_soft_max_f32(ne00, dp, wp, max);
+            assert(sum > 0.0);
 
-                sum = 1.0/sum;
-                lm_ggml_vec_scale_f32(ne00, dp, sum);
+            sum = 1.0/sum;
+            lm_ggml_vec_scale_f32(ne00, dp, sum);
 
 #ifndef NDEBUG
-                for (int i = 0; i < ne00; ++i) {
-                    assert(!isnan(dp[i]));
-                    assert(!isinf(dp[i]));
-                }
-#endif
+            for (int i = 0; i < ne00; ++i) {
+                assert(!isnan(dp[i]));
+                assert(!isinf(dp[i]));
             }
+#endif
         }
     }
 }
@@ -5950,10 +6046,13 @@ static void lm_ggml_mrope_cache_init(
     }
 }
 
+// rows: optional SET_ROWS node that stores the result (reshaped to one row per token) - each rotated
+//       head is converted into its slot right after it is computed, while it is still in cache
 static void lm_ggml_compute_forward_rope_f32(
         const lm_ggml_compute_params * params,
         lm_ggml_tensor * dst,
-        const bool forward) {
+        const bool forward,
+        lm_ggml_tensor * rows = nullptr) {
 
     const lm_ggml_tensor * src0 = dst->src[0];
     const lm_ggml_tensor * src1 = dst->src[1];
@@ -5984,23 +6083,12 @@ static void lm_ggml_compute_forward_rope_f32(
     LM_GGML_ASSERT(nb00 == sizeof(float));
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     const int nr = lm_ggml_nrows(dst);
 
     LM_GGML_ASSERT(n_dims <= ne0);
     LM_GGML_ASSERT(n_dims % 2 == 0);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    // row index used to determine which thread to use
-    int ir = 0;
-
     const float theta_scale = powf(freq_base, -2.0f/n_dims);
 
     float corr_dims[2];
@@ -6032,105 +6120,125 @@ static void lm_ggml_compute_forward_rope_f32(
 
     const int32_t * pos = (const int32_t *) src1->data;
 
-    for (int64_t i3 = 0; i3 < ne3; i3++) { // batch
-        for (int64_t i2 = 0; i2 < ne2; i2++) { // seq-len
+    lm_ggml_from_float_t const from_float_rows = rows ? lm_ggml_get_type_traits_cpu(rows->type)->from_float : nullptr;
 
-            float * cache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
-            if (!is_mrope) {
-                const int64_t p = pos[i2];
-                lm_ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
-            }
-            else {
-                const int64_t p_t = pos[i2];
-                const int64_t p_h = pos[i2 + ne2];
-                const int64_t p_w = pos[i2 + ne2 * 2];
-                const int64_t p_e = pos[i2 + ne2 * 3];
-                lm_ggml_mrope_cache_init(
-                    p_t, p_h, p_w, p_e, sections, is_vision,
-                    freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
-            }
+    float * cache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
 
-            for (int64_t i1 = 0; i1 < ne1; i1++) { // attn-heads
-                if (ir++ < ir0) continue;
-                if (ir   > ir1) break;
+    // the cache only depends on the position, it is filled again when a row of another one comes up
+    int64_t i2_cache = -1;
 
-                if (is_neox || is_mrope) {
-                    if (is_vision){
-                        for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
-                            const int64_t ic = i0/2;
+    int chunk = -1;
+    int64_t ir0, ir1;
 
-                            const float cos_theta = cache[i0 + 0];
-                            const float sin_theta = cache[i0 + 1];
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            const int64_t i3 = ir/(ne2*ne1);                // batch
+            const int64_t i2 = (ir - i3*ne2*ne1)/ne1;       // seq-len
+            const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);  // attn-heads
 
-                            const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + ic*nb00);
-                            float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + ic*nb0);
-
-                            const float x0 = src[0];
-                            const float x1 = src[n_dims];
+            if (i2 != i2_cache) {
+                if (!is_mrope) {
+                    const int64_t p = pos[i2];
+                    lm_ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                }
+                else {
+                    const int64_t p_t = pos[i2];
+                    const int64_t p_h = pos[i2 + ne2];
+                    const int64_t p_w = pos[i2 + ne2 * 2];
+                    const int64_t p_e = pos[i2 + ne2 * 3];
+                    lm_ggml_mrope_cache_init(
+                        p_t, p_h, p_w, p_e, sections, is_vision,
+                        freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                }
+                i2_cache = i2;
+            }
 
-                            dst_data[0]      = x0*cos_theta - x1*sin_theta;
-                            dst_data[n_dims] = x0*sin_theta + x1*cos_theta;
-                        }
-                    } else {
-                        for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
-                            const int64_t ic = i0/2;
+            if (is_neox || is_mrope) {
+                if (is_vision){
+                    for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
+                        const int64_t ic = i0/2;
 
-                            const float cos_theta = cache[i0 + 0];
-                            const float sin_theta = cache[i0 + 1];
+                        const float cos_theta = cache[i0 + 0];
+                        const float sin_theta = cache[i0 + 1];
 
-                            const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + ic*nb00);
-                            float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + ic*nb0);
+                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + ic*nb00);
+                        float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + ic*nb0);
 
-                            const float x0 = src[0];
-                            const float x1 = src[n_dims/2];
+                        const float x0 = src[0];
+                        const float x1 = src[n_dims];
 
-                            dst_data[0]        = x0*cos_theta - x1*sin_theta;
-                            dst_data[n_dims/2] = x0*sin_theta + x1*cos_theta;
-                        }
+                        dst_data[0]      = x0*cos_theta - x1*sin_theta;
+                        dst_data[n_dims] = x0*sin_theta + x1*cos_theta;
                     }
                 } else {
                     for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
+                        const int64_t ic = i0/2;
+
                         const float cos_theta = cache[i0 + 0];
                         const float sin_theta = cache[i0 + 1];
 
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                              float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + ic*nb00);
+                        float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + ic*nb0);
 
                         const float x0 = src[0];
-                        const float x1 = src[1];
+                        const float x1 = src[n_dims/2];
 
-                        dst_data[0] = x0*cos_theta - x1*sin_theta;
-                        dst_data[1] = x0*sin_theta + x1*cos_theta;
+                        dst_data[0]        = x0*cos_theta - x1*sin_theta;
+                        dst_data[n_dims/2] = x0*sin_theta + x1*cos_theta;
                     }
                 }
+            } else {
+                for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
+                    const float cos_theta = cache[i0 + 0];
+                    const float sin_theta = cache[i0 + 1];
 
-                if (is_vision) {
-                    for (int64_t i0 = n_dims; i0 < ne0; i0 += 2) {
-                        const int64_t ic = i0/2;
+                    const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                          float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
 
-                        const float cos_theta = cache[i0 + 0];
-                        const float sin_theta = cache[i0 + 1];
+                    const float x0 = src[0];
+                    const float x1 = src[1];
 
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + ic*nb00);
-                        float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + ic*nb0);
+                    dst_data[0] = x0*cos_theta - x1*sin_theta;
+                    dst_data[1] = x0*sin_theta + x1*cos_theta;
+                }
+            }
 
-                        const float x0 = src[0];
-                        const float x1 = src[n_dims];
+            if (is_vision) {
+                for (int64_t i0 = n_dims; i0 < ne0; i0 += 2) {
+                    const int64_t ic = i0/2;
 
-                        dst_data[0]      = x0*cos_theta - x1*sin_theta;
-                        dst_data[n_dims] = x0*sin_theta + x1*cos_theta;
-                    }
-                } else {
-                    // fill the remain channels with data from src tensor
-                    for (int64_t i0 = n_dims; i0 < ne0; i0 += 2) {
-                        const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
-                        float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+                    const float cos_theta = cache[i0 + 0];
+                    const float sin_theta = cache[i0 + 1];
 
-                        dst_data[0] = src[0];
-                        dst_data[1] = src[1];
-                    }
+                    const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + ic*nb00);
+                    float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + ic*nb0);
+
+                    const float x0 = src[0];
+                    const float x1 = src[n_dims];
+
+                    dst_data[0]      = x0*cos_theta - x1*sin_theta;
+                    dst_data[n_dims] = x0*sin_theta + x1*cos_theta;
+                }
+            } else {
+                // fill the remain channels with data from src tensor
+                for (int64_t i0 = n_dims; i0 < ne0; i0 += 2) {
+                    const float * const src = (float *)((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01 + i0*nb00);
+                    float * dst_data  = (float *)((char *)  dst->data + i3*nb3  + i2*nb2  + i1*nb1  + i0*nb0);
+
+                    dst_data[0] = src[0];
+                    dst_data[1] = src[1];
                 }
             }
+
+            if (rows) {
+                const int64_t i_row = *(const int64_t *) ((const char *) rows->src[1]->data + i2*rows->src[1]->nb[0]);
+
+                LM_GGML_ASSERT(i_row >= 0 && i_row < rows->ne[1]);
+
+                from_float_rows(
+                        (const float *) ((char *) dst->data + i3*nb3 + i2*nb2 + i1*nb1),
+                                        ((char *) rows->data + i_row*rows->nb[1] + lm_ggml_row_size(rows->type, i1*ne0)), ne0);
+            }
         }
     }
 }
@@ -6342,6 +6450,19 @@ void lm_ggml_compute_forward_rope(
     }
 }
 
+// lm_ggml_compute_forward_rope_set_rows
+
+void lm_ggml_compute_forward_rope_set_rows(
+        const lm_ggml_compute_params * params,
+        lm_ggml_tensor * rope,
+        lm_ggml_tensor * rows) {
+
+    LM_GGML_ASSERT(rope->src[0]->type == LM_GGML_TYPE_F32);
+    LM_GGML_ASSERT(rope->type == LM_GGML_TYPE_F32);
+
+    lm_ggml_compute_forward_rope_f32(params, rope, true, rows);
+}
+
 // lm_ggml_compute_forward_rope_back
 
 void lm_ggml_compute_forward_rope_back(
@@ -7972,6 +8093,314 @@ void lm_ggml_compute_forward_argsort(
 
 // lm_ggml_compute_forward_flash_attn_ext
 
+// y += v*dequantize(x), accumulates straight from the quantized blocks of a V row
+// so the dequantized row is never written to a temporary buffer
+typedef void (*lm_ggml_vec_mad_q_t)(const int64_t n, float * LM_GGML_RESTRICT y, const void * LM_GGML_RESTRICT vx, const float v);
+
+// y[0..15] += d*q[0..15], the quants are widened in registers
+#if defined(__ARM_NEON) && defined(__aarch64__)
+static inline void lm_ggml_vec_mad_i8x16(float * LM_GGML_RESTRICT y, const int8x16_t q, const float32x4_t vd) {
+    const int16x8_t q0 = vmovl_s8(vget_low_s8 (q));
+    const int16x8_t q1 = vmovl_s8(vget_high_s8(q));
+
+    vst1q_f32(y +  0, vfmaq_f32(vld1q_f32(y +  0), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q0))), vd));
+    vst1q_f32(y +  4, vfmaq_f32(vld1q_f32(y +  4), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q0))), vd));
+    vst1q_f32(y +  8, vfmaq_f32(vld1q_f32(y +  8), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q1))), vd));
+    vst1q_f32(y + 12, vfmaq_f32(vld1q_f32(y + 12), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q1))), vd));
+}
+#elif defined(__SSE4_1__)
+static inline void lm_ggml_vec_mad_i8x16(float * LM_GGML_RESTRICT y, const __m128i q, const __m128 vd) {
+    const __m128 f0 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(q));
+    const __m128 f1 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(q,  4)));
+    const __m128 f2 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(q,  8)));
+    const __m128 f3 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(q, 12)));
+
+    _mm_storeu_ps(y +  0, _mm_add_ps(_mm_loadu_ps(y +  0), _mm_mul_ps(f0, vd)));
+    _mm_storeu_ps(y +  4, _mm_add_ps(_mm_loadu_ps(y +  4), _mm_mul_ps(f1, vd)));
+    _mm_storeu_ps(y +  8, _mm_add_ps(_mm_loadu_ps(y +  8), _mm_mul_ps(f2, vd)));
+    _mm_storeu_ps(y + 12, _mm_add_ps(_mm_loadu_ps(y + 12), _mm_mul_ps(f3, vd)));
+}
+#endif
+
+// y[0..15] += d*q[0..15] + m, for the types with a block minimum
+#if defined(__ARM_NEON) && defined(__aarch64__)
+static inline void lm_ggml_vec_mad_i8x16_m(float * LM_GGML_RESTRICT y, const int8x16_t q, const float32x4_t vd, const float32x4_t vm) {
+    const int16x8_t q0 = vmovl_s8(vget_low_s8 (q));
+    const int16x8_t q1 = vmovl_s8(vget_high_s8(q));
+
+    vst1q_f32(y +  0, vfmaq_f32(vaddq_f32(vld1q_f32(y +  0), vm), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q0))), vd));
+    vst1q_f32(y +  4, vfmaq_f32(vaddq_f32(vld1q_f32(y +  4), vm), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q0))), vd));
+    vst1q_f32(y +  8, vfmaq_f32(vaddq_f32(vld1q_f32(y +  8), vm), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q1))), vd));
+    vst1q_f32(y + 12, vfmaq_f32(vaddq_f32(vld1q_f32(y + 12), vm), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q1))), vd));
+}
+#elif defined(__SSE4_1__)
+static inline void lm_ggml_vec_mad_i8x16_m(float * LM_GGML_RESTRICT y, const __m128i q, const __m128 vd, const __m128 vm) {
+    const __m128 f0 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(q));
+    const __m128 f1 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(q,  4)));
+    const __m128 f2 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(q,  8)));
+    const __m128 f3 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(q, 12)));
+
+    _mm_storeu_ps(y +  0, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(y +  0), vm), _mm_mul_ps(f0, vd)));
+    _mm_storeu_ps(y +  4, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(y +  4), vm), _mm_mul_ps(f1, vd)));
+    _mm_storeu_ps(y +  8, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(y +  8), vm), _mm_mul_ps(f2, vd)));
+    _mm_storeu_ps(y + 12, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(y + 12), vm), _mm_mul_ps(f3, vd)));
+}
+#endif
+
+static void lm_ggml_vec_mad_q8_0(const int64_t n, float * LM_GGML_RESTRICT y, const void * LM_GGML_RESTRICT vx, const float v) {
+    const block_q8_0 * LM_GGML_RESTRICT x = (const block_q8_0 *) vx;
+    const int64_t nb = n/QK8_0;
+
+    for (int64_t ib = 0; ib < nb; ++ib) {
+        const float d = v*LM_GGML_CPU_FP16_TO_FP32(x[ib].d);
+        float * LM_GGML_RESTRICT yb = y + ib*QK8_0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        const float32x4_t vd = vdupq_n_f32(d);
+        lm_ggml_vec_mad_i8x16(yb,      vld1q_s8(x[ib].qs),      vd);
+        lm_ggml_vec_mad_i8x16(yb + 16, vld1q_s8(x[ib].qs + 16), vd);
+#elif defined(__SSE4_1__)
+        const __m128 vd = _mm_set1_ps(d);
+        lm_ggml_vec_mad_i8x16(yb,      _mm_loadu_si128((const __m128i *) x[ib].qs),        vd);
+        lm_ggml_vec_mad_i8x16(yb + 16, _mm_loadu_si128((const __m128i *) (x[ib].qs + 16)), vd);
+#else
+        for (int j = 0; j < QK8_0; ++j) {
+            yb[j] += d*x[ib].qs[j];
+        }
+#endif
+    }
+}
+
+static void lm_ggml_vec_mad_q4_0(const int64_t n, float * LM_GGML_RESTRICT y, const void * LM_GGML_RESTRICT vx, const float v) {
+    const block_q4_0 * LM_GGML_RESTRICT x = (const block_q4_0 *) vx;
+    const int64_t nb = n/QK4_0;
+
+    for (int64_t ib = 0; ib < nb; ++ib) {
+        const float d = v*LM_GGML_CPU_FP16_TO_FP32(x[ib].d);
+        float * LM_GGML_RESTRICT yb = y + ib*QK4_0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        const float32x4_t vd = vdupq_n_f32(d);
+        const uint8x16_t qs = vld1q_u8(x[ib].qs);
+        const int8x16_t  q0 = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(qs, vdupq_n_u8(0x0F))), vdupq_n_s8(8));
+        const int8x16_t  q1 = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(qs, 4)),              vdupq_n_s8(8));
+        lm_ggml_vec_mad_i8x16(yb,           q0, vd);
+        lm_ggml_vec_mad_i8x16(yb + QK4_0/2, q1, vd);
+#elif defined(__SSE4_1__)
+        const __m128  vd  = _mm_set1_ps(d);
+        const __m128i m4  = _mm_set1_epi8(0x0F);
+        const __m128i qs  = _mm_loadu_si128((const __m128i *) x[ib].qs);
+        const __m128i q0  = _mm_sub_epi8(_mm_and_si128(qs, m4),                    _mm_set1_epi8(8));
+        const __m128i q1  = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(qs, 4), m4), _mm_set1_epi8(8));
+        lm_ggml_vec_mad_i8x16(yb,           q0, vd);
+        lm_ggml_vec_mad_i8x16(yb + QK4_0/2, q1, vd);
+#else
+        for (int j = 0; j < QK4_0/2; ++j) {
+            yb[j          ] += d*((x[ib].qs[j] & 0x0F) - 8);
+            yb[j + QK4_0/2] += d*((x[ib].qs[j] >>   4) - 8);
+        }
+#endif
+    }
+}
+
+static void lm_ggml_vec_mad_q5_0(const int64_t n, float * LM_GGML_RESTRICT y, const void * LM_GGML_RESTRICT vx, const float v) {
+    const block_q5_0 * LM_GGML_RESTRICT x = (const block_q5_0 *) vx;
+    const int64_t nb = n/QK5_0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    // bit j of each group of 8 quants
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t vbits = vld1q_u8(bits);
+#elif defined(__SSE4_1__)
+    const __m128i vbits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+#endif
+
+    for (int64_t ib = 0; ib < nb; ++ib) {
+        const float d = v*LM_GGML_CPU_FP16_TO_FP32(x[ib].d);
+        float * LM_GGML_RESTRICT yb = y + ib*QK5_0;
+
+        uint32_t qh;
+        memcpy(&qh, x[ib].qh, sizeof(qh));
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        // 5th bit of quant j is bit j of qh, spread to 0x10 of each byte
+        const uint8x16_t h0 = vandq_u8(vtstq_u8(vcombine_u8(vdup_n_u8(qh      ), vdup_n_u8(qh >>  8)), vbits), vdupq_n_u8(0x10));
+        const uint8x16_t h1 = vandq_u8(vtstq_u8(vcombine_u8(vdup_n_u8(qh >> 16), vdup_n_u8(qh >> 24)), vbits), vdupq_n_u8(0x10));
+
+        const float32x4_t vd = vdupq_n_f32(d);
+        const uint8x16_t qs = vld1q_u8(x[ib].qs);
+        const int8x16_t  q0 = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vandq_u8(qs, vdupq_n_u8(0x0F)), h0)), vdupq_n_s8(16));
+        const int8x16_t  q1 = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(qs, 4),              h1)), vdupq_n_s8(16));
+        lm_ggml_vec_mad_i8x16(yb,           q0, vd);
+        lm_ggml_vec_mad_i8x16(yb + QK5_0/2, q1, vd);
+#elif defined(__SSE4_1__)
+        // 5th bit of quant j is bit j of qh, spread to 0x10 of each byte
+        const __m128i vqh = _mm_cvtsi32_si128((int) qh);
+        const __m128i b0  = _mm_shuffle_epi8(vqh, _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1));
+        const __m128i b1  = _mm_shuffle_epi8(vqh, _mm_setr_epi8(2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3));
+        const __m128i h0  = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(b0, vbits), vbits), _mm_set1_epi8(0x10));
+        const __m128i h1  = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(b1, vbits), vbits), _mm_set1_epi8(0x10));
+
+        const __m128  vd  = _mm_set1_ps(d);
+        const __m128i m4  = _mm_set1_epi8(0x0F);
+        const __m128i qs  = _mm_loadu_si128((const __m128i *) x[ib].qs);
+        const __m128i q0  = _mm_sub_epi8(_mm_or_si128(_mm_and_si128(qs, m4),                    h0), _mm_set1_epi8(16));
+        const __m128i q1  = _mm_sub_epi8(_mm_or_si128(_mm_and_si128(_mm_srli_epi16(qs, 4), m4), h1), _mm_set1_epi8(16));
+        lm_ggml_vec_mad_i8x16(yb,           q0, vd);
+        lm_ggml_vec_mad_i8x16(yb + QK5_0/2, q1, vd);
+#else
+        for (int j = 0; j < QK5_0/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            yb[j          ] += d*(((x[ib].qs[j] & 0x0F) | xh_0) - 16);
+            yb[j + QK5_0/2] += d*(((x[ib].qs[j] >>   4) | xh_1) - 16);
+        }
+#endif
+    }
+}
+
+static void lm_ggml_vec_mad_q4_1(const int64_t n, float * LM_GGML_RESTRICT y, const void * LM_GGML_RESTRICT vx, const float v) {
+    const block_q4_1 * LM_GGML_RESTRICT x = (const block_q4_1 *) vx;
+    const int64_t nb = n/QK4_1;
+
+    for (int64_t ib = 0; ib < nb; ++ib) {
+        const float d = v*LM_GGML_CPU_FP16_TO_FP32(x[ib].data.data.d);
+        const float m = v*LM_GGML_CPU_FP16_TO_FP32(x[ib].data.data.m);
+        float * LM_GGML_RESTRICT yb = y + ib*QK4_1;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        const float32x4_t vd = vdupq_n_f32(d);
+        const float32x4_t vm = vdupq_n_f32(m);
+        const uint8x16_t qs = vld1q_u8(x[ib].qs);
+        const int8x16_t  q0 = vreinterpretq_s8_u8(vandq_u8(qs, vdupq_n_u8(0x0F)));
+        const int8x16_t  q1 = vreinterpretq_s8_u8(vshrq_n_u8(qs, 4));
+        lm_ggml_vec_mad_i8x16_m(yb,           q0, vd, vm);
+        lm_ggml_vec_mad_i8x16_m(yb + QK4_1/2, q1, vd, vm);
+#elif defined(__SSE4_1__)
+        const __m128  vd  = _mm_set1_ps(d);
+        const __m128  vm  = _mm_set1_ps(m);
+        const __m128i m4  = _mm_set1_epi8(0x0F);
+        const __m128i qs  = _mm_loadu_si128((const __m128i *) x[ib].qs);
+        const __m128i q0  = _mm_and_si128(qs, m4);
+        const __m128i q1  = _mm_and_si128(_mm_srli_epi16(qs, 4), m4);
+        lm_ggml_vec_mad_i8x16_m(yb,           q0, vd, vm);
+        lm_ggml_vec_mad_i8x16_m(yb + QK4_1/2, q1, vd, vm);
+#else
+        for (int j = 0; j < QK4_1/2; ++j) {
+            yb[j          ] += d*(x[ib].qs[j] & 0x0F) + m;
+            yb[j + QK4_1/2] += d*(x[ib].qs[j] >>   4) + m;
+        }
+#endif
+    }
+}
+
+static void lm_ggml_vec_mad_q5_1(const int64_t n, float * LM_GGML_RESTRICT y, const void * LM_GGML_RESTRICT vx, const float v) {
+    const block_q5_1 * LM_GGML_RESTRICT x = (const block_q5_1 *) vx;
+    const int64_t nb = n/QK5_1;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    // bit j of each group of 8 quants
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t vbits = vld1q_u8(bits);
+#elif defined(__SSE4_1__)
+    const __m128i vbits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+#endif
+
+    for (int64_t ib = 0; ib < nb; ++ib) {
+        const float d = v*LM_GGML_CPU_FP16_TO_FP32(x[ib].data.data.d);
+        const float m = v*LM_GGML_CPU_FP16_TO_FP32(x[ib].data.data.m);
+        float * LM_GGML_RESTRICT yb = y + ib*QK5_1;
+
+        uint32_t qh;
+        memcpy(&qh, x[ib].qh, sizeof(qh));
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        const uint8x16_t h0 = vandq_u8(vtstq_u8(vcombine_u8(vdup_n_u8(qh      ), vdup_n_u8(qh >>  8)), vbits), vdupq_n_u8(0x10));
+        const uint8x16_t h1 = vandq_u8(vtstq_u8(vcombine_u8(vdup_n_u8(qh >> 16), vdup_n_u8(qh >> 24)), vbits), vdupq_n_u8(0x10));
+
+        const float32x4_t vd = vdupq_n_f32(d);
+        const float32x4_t vm = vdupq_n_f32(m);
+        const uint8x16_t qs = vld1q_u8(x[ib].qs);
+        const int8x16_t  q0 = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(qs, vdupq_n_u8(0x0F)), h0));
+        const int8x16_t  q1 = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(qs, 4),              h1));
+        lm_ggml_vec_mad_i8x16_m(yb,           q0, vd, vm);
+        lm_ggml_vec_mad_i8x16_m(yb + QK5_1/2, q1, vd, vm);
+#elif defined(__SSE4_1__)
+        const __m128i vqh = _mm_cvtsi32_si128((int) qh);
+        const __m128i b0  = _mm_shuffle_epi8(vqh, _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1));
+        const __m128i b1  = _mm_shuffle_epi8(vqh, _mm_setr_epi8(2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3));
+        const __m128i h0  = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(b0, vbits), vbits), _mm_set1_epi8(0x10));
+        const __m128i h1  = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(b1, vbits), vbits), _mm_set1_epi8(0x10));
+
+        const __m128  vd  = _mm_set1_ps(d);
+        const __m128  vm  = _mm_set1_ps(m);
+        const __m128i m4  = _mm_set1_epi8(0x0F);
+        const __m128i qs  = _mm_loadu_si128((const __m128i *) x[ib].qs);
+        const __m128i q0  = _mm_or_si128(_mm_and_si128(qs, m4),                    h0);
+        const __m128i q1  = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(qs, 4), m4), h1);
+        lm_ggml_vec_mad_i8x16_m(yb,           q0, vd, vm);
+        lm_ggml_vec_mad_i8x16_m(yb + QK5_1/2, q1, vd, vm);
+#else
+        for (int j = 0; j < QK5_1/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            yb[j          ] += d*((x[ib].qs[j] & 0x0F) | xh_0) + m;
+            yb[j + QK5_1/2] += d*((x[ib].qs[j] >>   4) | xh_1) + m;
+        }
+#endif
+    }
+}
+
+static void lm_ggml_vec_mad_iq4_nl(const int64_t n, float * LM_GGML_RESTRICT y, const void * LM_GGML_RESTRICT vx, const float v) {
+    const block_iq4_nl * LM_GGML_RESTRICT x = (const block_iq4_nl *) vx;
+    const int64_t nb = n/QK4_NL;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const int8x16_t values = vld1q_s8(kvalues_iq4nl);
+#elif defined(__SSE4_1__)
+    const __m128i values = _mm_loadu_si128((const __m128i *) kvalues_iq4nl);
+#endif
+
+    for (int64_t ib = 0; ib < nb; ++ib) {
+        const float d = v*LM_GGML_CPU_FP16_TO_FP32(x[ib].d);
+        float * LM_GGML_RESTRICT yb = y + ib*QK4_NL;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        // the nibbles index the non-linear grid
+        const float32x4_t vd = vdupq_n_f32(d);
+        const uint8x16_t qs = vld1q_u8(x[ib].qs);
+        const int8x16_t  q0 = vqtbl1q_s8(values, vandq_u8(qs, vdupq_n_u8(0x0F)));
+        const int8x16_t  q1 = vqtbl1q_s8(values, vshrq_n_u8(qs, 4));
+        lm_ggml_vec_mad_i8x16(yb,            q0, vd);
+        lm_ggml_vec_mad_i8x16(yb + QK4_NL/2, q1, vd);
+#elif defined(__SSE4_1__)
+        // the nibbles index the non-linear grid
+        const __m128  vd  = _mm_set1_ps(d);
+        const __m128i m4  = _mm_set1_epi8(0x0F);
+        const __m128i qs  = _mm_loadu_si128((const __m128i *) x[ib].qs);
+        const __m128i q0  = _mm_shuffle_epi8(values, _mm_and_si128(qs, m4));
+        const __m128i q1  = _mm_shuffle_epi8(values, _mm_and_si128(_mm_srli_epi16(qs, 4), m4));
+        lm_ggml_vec_mad_i8x16(yb,            q0, vd);
+        lm_ggml_vec_mad_i8x16(yb + QK4_NL/2, q1, vd);
+#else
+        for (int j = 0; j < QK4_NL/2; ++j) {
+            yb[j           ] += d*kvalues_iq4nl[x[ib].qs[j] & 0x0F];
+            yb[j + QK4_NL/2] += d*kvalues_iq4nl[x[ib].qs[j] >>   4];
+        }
+#endif
+    }
+}
+
+static lm_ggml_vec_mad_q_t lm_ggml_get_vec_mad_q(enum lm_ggml_type type) {
+    switch (type) {
+        case LM_GGML_TYPE_Q8_0:   return lm_ggml_vec_mad_q8_0;
+        case LM_GGML_TYPE_Q4_0:   return lm_ggml_vec_mad_q4_0;
+        case LM_GGML_TYPE_Q4_1:   return lm_ggml_vec_mad_q4_1;
+        case LM_GGML_TYPE_Q5_0:   return lm_ggml_vec_mad_q5_0;
+        case LM_GGML_TYPE_Q5_1:   return lm_ggml_vec_mad_q5_1;
+        case LM_GGML_TYPE_IQ4_NL: return lm_ggml_vec_mad_iq4_nl;
+        default:                  return nullptr;
+    }
+}
+
 static void lm_ggml_compute_forward_flash_attn_ext_f16(
         const lm_ggml_compute_params * params,
         const lm_ggml_tensor * q,
@@ -7990,7 +8419,6 @@ static void lm_ggml_compute_forward_flash_attn_ext_f16(
     LM_GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     const int64_t DK = nek0;
     const int64_t DV = nev0;
@@ -8028,12 +8456,8 @@ static void lm_ggml_compute_forward_flash_attn_ext_f16(
     // total rows in q
     const int nr = neq1*neq2*neq3;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    int chunk = -1;
+    int64_t ir0, ir1;
 
     float scale         = 1.0f;
     float max_bias      = 0.0f;
@@ -8057,137 +8481,458 @@ static void lm_ggml_compute_forward_flash_attn_ext_f16(
     lm_ggml_from_float_t const q_to_vec_dot   = lm_ggml_get_type_traits_cpu(k_vec_dot_type)->from_float;
     lm_ggml_vec_dot_t    const kq_vec_dot     = lm_ggml_get_type_traits_cpu(k->type)->vec_dot;
     lm_ggml_to_float_t   const v_to_float     = lm_ggml_get_type_traits(v->type)->to_float;
+    lm_ggml_vec_mad_q_t  const v_mad_q        = lm_ggml_get_vec_mad_q(v->type);
 
     LM_GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
     LM_GGML_ASSERT((v->type == LM_GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
 
+    // optional F16 copies of the recently stored cells, see lm_ggml_flash_attn_ext_add_recent()
+    const lm_ggml_tensor * k_recent = dst->src[4];
+    const lm_ggml_tensor * v_recent = dst->src[5];
+    const int32_t * recent = dst->src[6] ? (const int32_t *) dst->src[6]->data : NULL;
+
+    lm_ggml_vec_dot_t const kq_vec_dot_recent = lm_ggml_get_type_traits_cpu(LM_GGML_TYPE_F16)->vec_dot;
+
     // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            // q indices
+            const int iq3 = ir/(neq2*neq1);
+            const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+            const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+            const uint32_t h = iq2; // head index
+            const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
 
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
+            float S = 0.0f;      // sum
+            float M = -INFINITY; // maximum KQ value
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
-        lm_ggml_fp16_t * VKQ16 = (lm_ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
-        lm_ggml_fp16_t * Q_q   = (lm_ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
+            float       * VKQ32 = (float       *) params->wdata + ith*((recent ? 2 : 1)*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
+            float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
+            lm_ggml_fp16_t * VKQ16 = (lm_ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
+            lm_ggml_fp16_t * Q_q   = (lm_ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
+            lm_ggml_fp16_t * Q_r   = (lm_ggml_fp16_t *) (VKQ32 + 2*DV + DK); // (temporary) buffer for Q converted to FP16 for the recent cells
 
-        if (v->type == LM_GGML_TYPE_F16) {
-            memset(VKQ16, 0, DV*sizeof(lm_ggml_fp16_t));
-        } else {
-            memset(VKQ32, 0, DV*sizeof(float));
-        }
+            if (v->type == LM_GGML_TYPE_F16) {
+                memset(VKQ16, 0, DV*sizeof(lm_ggml_fp16_t));
+            } else {
+                memset(VKQ32, 0, DV*sizeof(float));
+            }
 
-        const lm_ggml_fp16_t * mp = mask ? (lm_ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) : NULL;
+            const lm_ggml_fp16_t * mp = mask ? (lm_ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) : NULL;
 
-        // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+            // k indices
+            const int ik3 = iq3 / rk3;
+            const int ik2 = iq2 / rk2;
 
-        // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+            // v indices
+            const int iv3 = iq3 / rv3;
+            const int iv2 = iq2 / rv2;
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, DK);
+            const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+            q_to_vec_dot(pq, Q_q, DK);
 
-        // online softmax / attention
-        // loop over n_kv and n_head_kv
-        // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*LM_GGML_CPU_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
+            if (recent) {
+                lm_ggml_cpu_fp32_to_fp16(pq, Q_r, DK);
             }
 
-            float s; // KQ value
+            // online softmax / attention
+            // loop over n_kv and n_head_kv
+            // ref: https://arxiv.org/pdf/2112.05682.pdf
+            for (int64_t ic = 0; ic < nek1; ++ic) {
+                const float mv = mp ? slope*LM_GGML_CPU_FP16_TO_FP32(mp[ic]) : 0.0f;
+                if (mv == -INFINITY) {
+                    continue;
+                }
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
+                // slot of the F16 copy of this cell, or -1 if only the cache row holds it
+                const int32_t ir = recent ? recent[ic] : -1;
 
-            s = s*scale; // scale KQ value
+                float s; // KQ value
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
-            }
+                if (ir >= 0) {
+                    const char * k_data = (const char *) k_recent->data + (ir*k_recent->nb[1] + ik2*k_recent->nb[2] + ik3*k_recent->nb[3]);
+                    kq_vec_dot_recent(DK, &s, 0, k_data, 0, Q_r, 0, 1);
+                } else {
+                    const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
+                    kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
+                }
 
-            s += mv; // apply mask
+                s = s*scale; // scale KQ value
 
-            const float Mold = M;
+                if (logit_softcap != 0.0f) {
+                    s = logit_softcap*tanhf(s);
+                }
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+                s += mv; // apply mask
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                const float Mold = M;
 
-            if (v->type == LM_GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
+                float vs = 1.0f; // post-softmax KQ value, expf(s - M)
 
-                    // V = V*expf(Mold - M)
-                    lm_ggml_vec_scale_f16(DV, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+                const char * v_data = ir >= 0
+                    ? ((const char *) v_recent->data + (ir*v_recent->nb[1] + iv2*v_recent->nb[2] + iv3*v_recent->nb[3]))
+                    : ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
 
-                // V += v*expf(s - M)
-                lm_ggml_vec_mad_f16(DV, VKQ16, (const lm_ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                if (v->type == LM_GGML_TYPE_F16) {
+                    if (s > M) {
+                        // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                        M = s;
+                        ms = expf(Mold - M);
 
-                    // V = V*expf(Mold - M)
-                    lm_ggml_vec_scale_f32(DV, VKQ32, ms);
+                        // V = V*expf(Mold - M)
+                        lm_ggml_vec_scale_f16(DV, VKQ16, ms);
+                    } else {
+                        // no new maximum, ms == 1.0f, vs != 1.0f
+                        vs = expf(s - M);
+                    }
+
+                    // V += v*expf(s - M)
+                    lm_ggml_vec_mad_f16(DV, VKQ16, (const lm_ggml_fp16_t *) v_data, vs);
                 } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                    if (s > M) {
+                        // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                        M = s;
+                        ms = expf(Mold - M);
+
+                        // V = V*expf(Mold - M)
+                        lm_ggml_vec_scale_f32(DV, VKQ32, ms);
+                    } else {
+                        // no new maximum, ms == 1.0f, vs != 1.0f
+                        vs = expf(s - M);
+                    }
+
+                    // V += v*expf(s - M)
+                    if (ir >= 0) {
+                        lm_ggml_cpu_fp16_to_fp32((const lm_ggml_fp16_t *) v_data, V32, DV);
+                        lm_ggml_vec_mad_f32(DV, VKQ32, V32, vs);
+                    } else if (v_mad_q) {
+                        v_mad_q(DV, VKQ32, v_data, vs);
+                    } else if (v_to_float) {
+                        v_to_float(v_data, V32, DV);
+                        lm_ggml_vec_mad_f32(DV, VKQ32, V32, vs);
+                    } else {
+                        // V is F32
+                        lm_ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
+                    }
                 }
 
-                // V += v*expf(s - M)
-                if (v_to_float) {
-                    v_to_float(v_data, V32, DV);
-                    lm_ggml_vec_mad_f32(DV, VKQ32, V32, vs);
-                } else {
-                    // V is F32
-                    lm_ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
+                S = S*ms + vs; // scale and increment sum with partial sum
+            }
+
+            if (v->type == LM_GGML_TYPE_F16) {
+                for (int64_t d = 0; d < DV; ++d) {
+                    VKQ32[d] = LM_GGML_CPU_FP16_TO_FP32(VKQ16[d]);
                 }
             }
 
-            S = S*ms + vs; // scale and increment sum with partial sum
+            // V /= S
+            const float S_inv = 1.0f/S;
+            lm_ggml_vec_scale_f32(DV, VKQ32, S_inv);
+
+            // dst indices
+            const int i1 = iq1;
+            const int i2 = iq2;
+            const int i3 = iq3;
+
+            // original
+            //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
         }
+    }
+}
+
+// register-blocked pieces of the unmasked flash attention kernel below
+// the fixed width SIMD paths keep the accumulators in registers, SVE and plain C use the vec helpers
+#if defined(LM_GGML_SIMD) && !defined(__ARM_FEATURE_SVE)
+#define LM_GGML_FA_TILE_SIMD
+#endif
 
-        if (v->type == LM_GGML_TYPE_F16) {
-            for (int64_t d = 0; d < DV; ++d) {
-                VKQ32[d] = LM_GGML_CPU_FP16_TO_FP32(VKQ16[d]);
+// ST[j][i] = sum_d QT[d][i]*k[j][d] for the LM_GGML_FA_TILE_Q rows of QT ([DK][LM_GGML_FA_TILE_Q], Q transposed)
+// the Q rows are the vector lanes, so no horizontal sums are needed and K is read one scalar at a time
+static void lm_ggml_fa_tile_kq(int64_t DK, int64_t nk, const float * LM_GGML_RESTRICT QT, const float * const * k, float * LM_GGML_RESTRICT ST) {
+    constexpr int64_t BQ = LM_GGML_FA_TILE_Q;
+#if defined(LM_GGML_FA_TILE_SIMD)
+    constexpr int NV = BQ/LM_GGML_F32_EPR; // vectors per column of QT
+    constexpr int NU = 4;                 // K rows per step
+    static_assert(BQ % LM_GGML_F32_EPR == 0, "LM_GGML_FA_TILE_Q must be a multiple of the SIMD width");
+
+    int64_t j = 0;
+    for (; j + NU <= nk; j += NU) {
+        LM_GGML_F32_VEC acc[NU][NV];
+        for (int u = 0; u < NU; ++u) {
+            for (int v = 0; v < NV; ++v) {
+                acc[u][v] = LM_GGML_F32_VEC_ZERO;
             }
         }
+        for (int64_t d = 0; d < DK; ++d) {
+            LM_GGML_F32_VEC q[NV];
+            for (int v = 0; v < NV; ++v) {
+                q[v] = LM_GGML_F32_VEC_LOAD(QT + d*BQ + v*LM_GGML_F32_EPR);
+            }
+            for (int u = 0; u < NU; ++u) {
+                const LM_GGML_F32_VEC kv = LM_GGML_F32_VEC_SET1(k[j + u][d]);
+                for (int v = 0; v < NV; ++v) {
+                    acc[u][v] = LM_GGML_F32_VEC_FMA(acc[u][v], q[v], kv);
+                }
+            }
+        }
+        for (int u = 0; u < NU; ++u) {
+            for (int v = 0; v < NV; ++v) {
+                LM_GGML_F32_VEC_STORE(ST + (j + u)*BQ + v*LM_GGML_F32_EPR, acc[u][v]);
+            }
+        }
+    }
+    for (; j < nk; ++j) {
+        LM_GGML_F32_VEC acc[NV];
+        for (int v = 0; v < NV; ++v) {
+            acc[v] = LM_GGML_F32_VEC_ZERO;
+        }
+        for (int64_t d = 0; d < DK; ++d) {
+            const LM_GGML_F32_VEC kv = LM_GGML_F32_VEC_SET1(k[j][d]);
+            for (int v = 0; v < NV; ++v) {
+                acc[v] = LM_GGML_F32_VEC_FMA(acc[v], LM_GGML_F32_VEC_LOAD(QT + d*BQ + v*LM_GGML_F32_EPR), kv);
+            }
+        }
+        for (int v = 0; v < NV; ++v) {
+            LM_GGML_F32_VEC_STORE(ST + j*BQ + v*LM_GGML_F32_EPR, acc[v]);
+        }
+    }
+#else
+    for (int64_t j = 0; j < nk; ++j) {
+        float * st = ST + j*BQ;
+        memset(st, 0, BQ*sizeof(float));
+        for (int64_t d = 0; d < DK; ++d) {
+            lm_ggml_vec_mad_f32(BQ, st, QT + d*BQ, k[j][d]);
+        }
+    }
+#endif
+}
 
-        // V /= S
-        const float S_inv = 1.0f/S;
-        lm_ggml_vec_scale_f32(DV, VKQ32, S_inv);
+// o[0:DV] += sum_j p[j]*v[j][0:DV], the accumulator stays in registers across the whole K/V tile
+static void lm_ggml_fa_tile_pv(int64_t DV, int64_t nk, const float * LM_GGML_RESTRICT p, const float * const * v, float * LM_GGML_RESTRICT o) {
+#if defined(LM_GGML_FA_TILE_SIMD)
+    int64_t d = 0;
+    for (; d + LM_GGML_F32_STEP <= DV; d += LM_GGML_F32_STEP) {
+        LM_GGML_F32_VEC acc[LM_GGML_F32_ARR];
+        for (int r = 0; r < LM_GGML_F32_ARR; ++r) {
+            acc[r] = LM_GGML_F32_VEC_LOAD(o + d + r*LM_GGML_F32_EPR);
+        }
+        for (int64_t j = 0; j < nk; ++j) {
+            const LM_GGML_F32_VEC pj = LM_GGML_F32_VEC_SET1(p[j]);
+            for (int r = 0; r < LM_GGML_F32_ARR; ++r) {
+                acc[r] = LM_GGML_F32_VEC_FMA(acc[r], LM_GGML_F32_VEC_LOAD(v[j] + d + r*LM_GGML_F32_EPR), pj);
+            }
+        }
+        for (int r = 0; r < LM_GGML_F32_ARR; ++r) {
+            LM_GGML_F32_VEC_STORE(o + d + r*LM_GGML_F32_EPR, acc[r]);
+        }
+    }
+    for (; d + LM_GGML_F32_EPR <= DV; d += LM_GGML_F32_EPR) {
+        LM_GGML_F32_VEC acc = LM_GGML_F32_VEC_LOAD(o + d);
+        for (int64_t j = 0; j < nk; ++j) {
+            acc = LM_GGML_F32_VEC_FMA(acc, LM_GGML_F32_VEC_LOAD(v[j] + d), LM_GGML_F32_VEC_SET1(p[j]));
+        }
+        LM_GGML_F32_VEC_STORE(o + d, acc);
+    }
+    for (; d < DV; ++d) {
+        float acc = o[d];
+        for (int64_t j = 0; j < nk; ++j) {
+            acc += p[j]*v[j][d];
+        }
+        o[d] = acc;
+    }
+#else
+    for (int64_t j = 0; j < nk; ++j) {
+        lm_ggml_vec_mad_f32(DV, o, v[j], p[j]);
+    }
+#endif
+}
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
+// unmasked (non-causal, fixed length) attention, e.g. the vision encoders: a tile of Q rows is scored against
+// a tile of K/V rows at a time, so each K/V row is loaded and converted once per tile instead of once per
+// query row, and the online softmax rescales the accumulators once per tile instead of once per new maximum
+static void lm_ggml_compute_forward_flash_attn_ext_f16_tiled(
+        const lm_ggml_compute_params * params,
+        const lm_ggml_tensor * q,
+        const lm_ggml_tensor * k,
+        const lm_ggml_tensor * v,
+        lm_ggml_tensor * dst) {
+
+    LM_GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+
+    LM_GGML_ASSERT(ne0 == DV);
+    LM_GGML_ASSERT(ne2 == N);
+
+    // the Q rows are read as F32
+    LM_GGML_ASSERT(q->type == LM_GGML_TYPE_F32);
+
+    // input tensor rows must be contiguous
+    LM_GGML_ASSERT(nbq0 == lm_ggml_type_size(q->type));
+    LM_GGML_ASSERT(nbk0 == lm_ggml_type_size(k->type));
+    LM_GGML_ASSERT(nbv0 == lm_ggml_type_size(v->type));
 
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+    LM_GGML_ASSERT(neq0 == DK);
+    LM_GGML_ASSERT(nev0 == DV);
 
-        // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+    // dst cannot be transposed or permuted
+    LM_GGML_ASSERT(nb0 == sizeof(float));
+    LM_GGML_ASSERT(nb0 <= nb1);
+    LM_GGML_ASSERT(nb1 <= nb2);
+    LM_GGML_ASSERT(nb2 <= nb3);
+
+    // broadcast factors
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    float scale         = 1.0f;
+    float logit_softcap = 0.0f;
+
+    // max_bias only applies through the mask
+    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+
+    if (logit_softcap != 0) {
+        scale /= logit_softcap;
+    }
+
+    lm_ggml_to_float_t const k_to_float = lm_ggml_get_type_traits(k->type)->to_float;
+    lm_ggml_to_float_t const v_to_float = lm_ggml_get_type_traits(v->type)->to_float;
+
+    LM_GGML_ASSERT((k->type == LM_GGML_TYPE_F32 || k_to_float) && "fattn: unsupported K-type");
+    LM_GGML_ASSERT((v->type == LM_GGML_TYPE_F32 || v_to_float) && "fattn: unsupported V-type");
+
+    const int64_t BQ = LM_GGML_FA_TILE_Q;
+    const int64_t BK = LM_GGML_FA_TILE_KV;
+
+    float * O   = (float *) params->wdata + ith*(BQ*(DK + DV + 2*BK + 2) + BK*(DK + DV) + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulators
+    float * S   = O   + BQ*DV; // softmax numerators of the current tile
+    float * ST  = S   + BQ*BK; // KQ values of the current tile, transposed
+    float * QT  = ST  + BK*BQ; // scaled FP32 Q rows, transposed
+    float * K32 = QT  + DK*BQ; // FP32 K rows of the current tile (K types other than F32)
+    float * V32 = K32 + BK*DK; // FP32 V rows of the current tile (V types other than F32)
+    float * M   = V32 + BK*DV; // maximum KQ value per row
+    float * L   = M   + BQ;    // sum per row
+
+    const float * k_rows[LM_GGML_FA_TILE_KV];
+    const float * v_rows[LM_GGML_FA_TILE_KV];
+
+    // F32 rows are used in place, the others are converted once per tile
+    auto row_to_f32 = [](const lm_ggml_tensor * t, lm_ggml_to_float_t to_float, const char * data, float * dst32, int64_t n) -> const float * {
+        if (t->type == LM_GGML_TYPE_F32) {
+            return (const float *) data;
+        }
+        if (t->type == LM_GGML_TYPE_F16) {
+            lm_ggml_cpu_fp16_to_fp32((const lm_ggml_fp16_t *) data, dst32, n);
+        } else {
+            to_float(data, dst32, n);
+        }
+        return dst32;
+    };
+
+    // work units are tiles of Q rows of one head
+    const int64_t nq_tiles = (N + BQ - 1)/BQ;
+    const int64_t nr = nq_tiles*neq2*neq3;
+
+    int chunk = -1;
+    int64_t ir0, ir1;
+
+    while (lm_ggml_compute_rows_next(params, nr, chunk, ir0, ir1)) {
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            // q indices
+            const int64_t iq3 = ir/(neq2*nq_tiles);
+            const int64_t iq2 = (ir - iq3*neq2*nq_tiles)/nq_tiles;
+            const int64_t iq1 = (ir - iq3*neq2*nq_tiles - iq2*nq_tiles)*BQ;
+            const int64_t nq  = std::min(BQ, N - iq1);
+
+            // k and v indices
+            const int64_t ik3 = iq3/rk3;
+            const int64_t ik2 = iq2/rk2;
+            const int64_t iv3 = iq3/rv3;
+            const int64_t iv2 = iq2/rv2;
+
+            // rows past the end of Q are zero and their results are dropped
+            memset(QT, 0, DK*BQ*sizeof(float));
+            for (int64_t i = 0; i < nq; ++i) {
+                const float * pq = (const float *) ((const char *) q->data + ((iq1 + i)*nbq1 + iq2*nbq2 + iq3*nbq3));
+                for (int64_t d = 0; d < DK; ++d) {
+                    QT[d*BQ + i] = pq[d]*scale;
+                }
+                M[i] = -INFINITY;
+                L[i] = 0.0f;
+            }
+            memset(O, 0, nq*DV*sizeof(float));
+
+            for (int64_t ic0 = 0; ic0 < nek1; ic0 += BK) {
+                const int64_t nk = std::min(BK, nek1 - ic0);
+
+                for (int64_t j = 0; j < nk; ++j) {
+                    const char * k_data = (const char *) k->data + ((ic0 + j)*nbk1 + ik2*nbk2 + ik3*nbk3);
+                    const char * v_data = (const char *) v->data + ((ic0 + j)*nbv1 + iv2*nbv2 + iv3*nbv3);
+                    k_rows[j] = row_to_f32(k, k_to_float, k_data, K32 + j*DK, DK);
+                    v_rows[j] = row_to_f32(v, v_to_float, v_data, V32 + j*DV, DV);
+                }
+
+                // S = scale*K*Q
+                lm_ggml_fa_tile_kq(DK, nk, QT, k_rows, ST);
+
+                // online softmax, one rescale per tile
+                for (int64_t i = 0; i < nq; ++i) {
+                    float * s = S + i*BK;
+                    for (int64_t j = 0; j < nk; ++j) {
+                        s[j] = ST[j*BQ + i];
+                    }
+
+                    if (logit_softcap != 0.0f) {
+                        for (int64_t j = 0; j < nk; ++j) {
+                            s[j] = logit_softcap*tanhf(s[j]);
+                        }
+                    }
+
+                    float smax = -INFINITY;
+                    lm_ggml_vec_max_f32(nk, &smax, s);
+
+                    const float Mnew = std::max(M[i], smax);
+                    const float ms   = expf(M[i] - Mnew);
+                    if (ms != 1.0f) {
+                        lm_ggml_vec_scale_f32(DV, O + i*DV, ms);
+                    }
+
+                    L[i] = L[i]*ms + (float) lm_ggml_vec_soft_max_f32(nk, s, s, Mnew);
+                    M[i] = Mnew;
+
+                    // O += softmax(S)*V
+                    lm_ggml_fa_tile_pv(DV, nk, s, v_rows, O + i*DV);
+                }
+            }
+
+            for (int64_t i = 0; i < nq; ++i) {
+                // V /= S
+                lm_ggml_vec_scale_f32(DV, O + i*DV, 1.0f/L[i]);
+
+                // permute(0, 2, 1, 3)
+                memcpy((char *) dst->data + (iq3*ne2*ne1 + iq2 + (iq1 + i)*ne1)*nb1, O + i*DV, nb1);
+            }
+        }
     }
 }
 
@@ -8203,7 +8948,11 @@ void lm_ggml_compute_forward_flash_attn_ext(
         case LM_GGML_PREC_F32:
             {
                 // uses F32 accumulators
-                lm_ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                if (mask == NULL && dst->src[6] == NULL && q->type == LM_GGML_TYPE_F32 && q->ne[1] >= LM_GGML_FA_TILE_Q) {
+                    lm_ggml_compute_forward_flash_attn_ext_f16_tiled(params, q, k, v, dst);
+                } else {
+                    lm_ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                }
             } break;
         default:
             {
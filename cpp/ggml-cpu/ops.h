@@ -23,6 +23,10 @@ static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 // Work buffer size for im2col operations in CONV2D
 #define LM_GGML_IM2COL_WORK_SIZE (16 * 1024 * 1024)
 
+// Q rows x K/V rows per tile of the flash attention kernel for unmasked (encoder) attention
+#define LM_GGML_FA_TILE_Q  16
+#define LM_GGML_FA_TILE_KV 64
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -42,6 +46,7 @@ void lm_ggml_compute_forward_concat(const struct lm_ggml_compute_params * params
 void lm_ggml_compute_forward_silu_back(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_norm(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_rms_norm(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
+void lm_ggml_compute_forward_add_rms_norm_mul(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * add, struct lm_ggml_tensor * norm, struct lm_ggml_tensor * mul);
 void lm_ggml_compute_forward_rms_norm_back(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_group_norm(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_l2_norm(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
@@ -63,6 +68,7 @@ void lm_ggml_compute_forward_diag_mask_zero(const struct lm_ggml_compute_params
 void lm_ggml_compute_forward_soft_max(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_soft_max_ext_back(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_rope(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
+void lm_ggml_compute_forward_rope_set_rows(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * rope, struct lm_ggml_tensor * rows);
 void lm_ggml_compute_forward_rope_back(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_clamp(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_conv_transpose_1d(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
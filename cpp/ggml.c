@@ -4802,6 +4802,34 @@ enum lm_ggml_prec lm_ggml_flash_attn_ext_get_prec(
     return (enum lm_ggml_prec) prec_i32;
 }
 
+void lm_ggml_flash_attn_ext_add_recent(
+        struct lm_ggml_tensor * a,
+        struct lm_ggml_tensor * k_recent,
+        struct lm_ggml_tensor * v_recent,
+        struct lm_ggml_tensor * recent) {
+    LM_GGML_ASSERT(a->op == LM_GGML_OP_FLASH_ATTN_EXT);
+
+    const struct lm_ggml_tensor * k = a->src[1];
+    const struct lm_ggml_tensor * v = a->src[2];
+
+    LM_GGML_ASSERT(k_recent->type == LM_GGML_TYPE_F16);
+    LM_GGML_ASSERT(v_recent->type == LM_GGML_TYPE_F16);
+    LM_GGML_ASSERT(recent->type   == LM_GGML_TYPE_I32);
+
+    LM_GGML_ASSERT(k_recent->ne[0] == k->ne[0] && k_recent->ne[2] == k->ne[2] && k_recent->ne[3] == k->ne[3]);
+    LM_GGML_ASSERT(v_recent->ne[0] == v->ne[0] && v_recent->ne[2] == v->ne[2] && v_recent->ne[3] == v->ne[3]);
+    LM_GGML_ASSERT(k_recent->ne[1] == v_recent->ne[1]);
+    LM_GGML_ASSERT(lm_ggml_is_contiguous(recent) && recent->ne[0] == k->ne[1]);
+
+    // rows must be contiguous
+    LM_GGML_ASSERT(k_recent->nb[0] == lm_ggml_type_size(LM_GGML_TYPE_F16));
+    LM_GGML_ASSERT(v_recent->nb[0] == lm_ggml_type_size(LM_GGML_TYPE_F16));
+
+    a->src[4] = k_recent;
+    a->src[5] = v_recent;
+    a->src[6] = recent;
+}
+
 // lm_ggml_flash_attn_back
 
 struct lm_ggml_tensor * lm_ggml_flash_attn_back(
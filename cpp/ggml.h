@@ -2039,6 +2039,17 @@ extern "C" {
     LM_GGML_API enum lm_ggml_prec lm_ggml_flash_attn_ext_get_prec(
             const struct lm_ggml_tensor * a);
 
+    // F16 copies of some of the K/V cells, read instead of the (quantized) k and v rows:
+    // k_recent: [n_embd_k, n_recent, n_head_kv, ne3]
+    // v_recent: [n_embd_v, n_recent, n_head_kv, ne3]
+    // recent:   [n_kv] I32, the k_recent/v_recent row of each cell, or -1 to read k and v
+    // backends that do not support it read k and v for all cells
+    LM_GGML_API void lm_ggml_flash_attn_ext_add_recent(
+            struct lm_ggml_tensor * a,
+            struct lm_ggml_tensor * k_recent,
+            struct lm_ggml_tensor * v_recent,
+            struct lm_ggml_tensor * recent);
+
     // TODO: needs to be adapted to lm_ggml_flash_attn_ext
     LM_GGML_API struct lm_ggml_tensor * lm_ggml_flash_attn_back(
            struct lm_ggml_context * ctx,
@@ -0,0 +1,240 @@
+#include "rn-llama-jsi.h"
+
+#include <jsi/jsi.h>
+
+#if defined(__ANDROID__) || RNLLAMA_BUILD_FROM_SOURCE
+#include "rn-llama.h"
+#else
+#include <rnllama/rn-llama.h>
+#endif
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+using namespace facebook;
+
+namespace rnllama_jsi {
+
+// Held for the whole binding call, so removeContext can't free a context in use
+static std::mutex contexts_mutex;
+static std::unordered_map<int, rnllama::llama_rn_context *> contexts;
+
+void addContext(int id, rnllama::llama_rn_context *llama) {
+    std::lock_guard<std::mutex> lock(contexts_mutex);
+    contexts[id] = llama;
+}
+
+void removeContext(rnllama::llama_rn_context *llama) {
+    std::lock_guard<std::mutex> lock(contexts_mutex);
+    for (auto it = contexts.begin(); it != contexts.end();) {
+        if (it->second == llama) {
+            it = contexts.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+template <typename F>
+static jsi::Value withContext(jsi::Runtime &rt, const jsi::Value &id, F &&fn) {
+    if (!id.isNumber()) {
+        throw jsi::JSError(rt, "Context id must be a number");
+    }
+    std::lock_guard<std::mutex> lock(contexts_mutex);
+    auto it = contexts.find((int) id.getNumber());
+    if (it == contexts.end()) {
+        throw jsi::JSError(rt, "Context not found");
+    }
+    try {
+        return fn(it->second);
+    } catch (const jsi::JSError &) {
+        throw;
+    } catch (const std::exception &e) {
+        throw jsi::JSError(rt, e.what());
+    }
+}
+
+static std::string getString(jsi::Runtime &rt, const jsi::Value &value, const char *name) {
+    if (!value.isString()) {
+        throw jsi::JSError(rt, std::string(name) + " must be a string");
+    }
+    return value.getString(rt).utf8(rt);
+}
+
+static std::string getStringProperty(jsi::Runtime &rt, const jsi::Object &obj, const char *name) {
+    auto value = obj.getProperty(rt, name);
+    return value.isString() ? value.getString(rt).utf8(rt) : "";
+}
+
+static bool getBoolProperty(jsi::Runtime &rt, const jsi::Object &obj, const char *name, bool fallback) {
+    auto value = obj.getProperty(rt, name);
+    return value.isBool() ? value.getBool() : fallback;
+}
+
+// Int32Array over a copy of the tokens, allocated by the runtime's constructor
+static jsi::Value createInt32Array(jsi::Runtime &rt, const std::vector<llama_token> &tokens) {
+    auto ctor = rt.global().getPropertyAsFunction(rt, "Int32Array");
+    auto array = ctor.callAsConstructor(rt, (double) tokens.size()).getObject(rt);
+    if (!tokens.empty()) {
+        auto buffer = array.getPropertyAsObject(rt, "buffer").getArrayBuffer(rt);
+        memcpy(buffer.data(rt), tokens.data(), tokens.size() * sizeof(llama_token));
+    }
+    return array;
+}
+
+// Tokens from a plain array of numbers or a 32-bit typed array
+static std::vector<llama_token> getTokens(jsi::Runtime &rt, const jsi::Value &value) {
+    if (!value.isObject()) {
+        throw jsi::JSError(rt, "tokens must be an array or Int32Array");
+    }
+    auto obj = value.getObject(rt);
+    std::vector<llama_token> tokens;
+    if (obj.isArray(rt)) {
+        auto array = obj.getArray(rt);
+        size_t n = array.size(rt);
+        tokens.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            tokens[i] = (llama_token) array.getValueAtIndex(rt, i).asNumber();
+        }
+        return tokens;
+    }
+    auto buffer = obj.getProperty(rt, "buffer");
+    auto bytes_per_element = obj.getProperty(rt, "BYTES_PER_ELEMENT");
+    if (!buffer.isObject() || !buffer.getObject(rt).isArrayBuffer(rt) ||
+        !bytes_per_element.isNumber() || bytes_per_element.getNumber() != sizeof(llama_token)) {
+        throw jsi::JSError(rt, "tokens must be an array or Int32Array");
+    }
+    auto array_buffer = buffer.getObject(rt).getArrayBuffer(rt);
+    size_t offset = (size_t) obj.getProperty(rt, "byteOffset").asNumber();
+    size_t n = (size_t) obj.getProperty(rt, "length").asNumber();
+    if (offset + n * sizeof(llama_token) > array_buffer.size(rt)) {
+        throw jsi::JSError(rt, "tokens are out of the buffer bounds");
+    }
+    tokens.resize(n);
+    if (n > 0) {
+        memcpy(tokens.data(), array_buffer.data(rt) + offset, n * sizeof(llama_token));
+    }
+    return tokens;
+}
+
+static void setFunction(
+    jsi::Runtime &rt,
+    jsi::Object &module,
+    const char *name,
+    unsigned int argc,
+    jsi::HostFunctionType fn
+) {
+    auto id = jsi::PropNameID::forAscii(rt, name);
+    module.setProperty(rt, id, jsi::Function::createFromHostFunction(rt, id, argc, std::move(fn)));
+}
+
+bool install(jsi::Runtime &rt) {
+    jsi::Object module(rt);
+
+    // tokenize(contextId, text): Int32Array
+    setFunction(rt, module, "tokenize", 2, [](jsi::Runtime &rt, const jsi::Value &, const jsi::Value *args, size_t count) {
+        if (count < 2) throw jsi::JSError(rt, "tokenize expects (contextId, text)");
+        const std::string text = getString(rt, args[1], "text");
+        return withContext(rt, args[0], [&](rnllama::llama_rn_context *llama) {
+            const llama_vocab *vocab = llama_model_get_vocab(llama->model);
+            return createInt32Array(rt, common_tokenize(vocab, text, false));
+        });
+    });
+
+    // countTokens(contextId, text): number, without materializing the tokens
+    setFunction(rt, module, "countTokens", 2, [](jsi::Runtime &rt, const jsi::Value &, const jsi::Value *args, size_t count) {
+        if (count < 2) throw jsi::JSError(rt, "countTokens expects (contextId, text)");
+        const std::string text = getString(rt, args[1], "text");
+        return withContext(rt, args[0], [&](rnllama::llama_rn_context *llama) {
+            const llama_vocab *vocab = llama_model_get_vocab(llama->model);
+            const int n_tokens = llama_tokenize(vocab, text.data(), text.size(), nullptr, 0, false, false);
+            return jsi::Value(n_tokens < 0 ? -n_tokens : n_tokens);
+        });
+    });
+
+    // detokenize(contextId, tokens: number[] | Int32Array): string
+    setFunction(rt, module, "detokenize", 2, [](jsi::Runtime &rt, const jsi::Value &, const jsi::Value *args, size_t count) {
+        if (count < 2) throw jsi::JSError(rt, "detokenize expects (contextId, tokens)");
+        const std::vector<llama_token> tokens = getTokens(rt, args[1]);
+        return withContext(rt, args[0], [&](rnllama::llama_rn_context *llama) {
+            const llama_vocab *vocab = llama_model_get_vocab(llama->model);
+            const int n_vocab = llama_vocab_n_tokens(vocab);
+            std::string text;
+            for (llama_token tok : tokens) {
+                if (tok < 0 || tok >= n_vocab) {
+                    throw jsi::JSError(rt, "Invalid token: " + std::to_string(tok));
+                }
+                text += common_token_to_piece(vocab, tok);
+            }
+            return jsi::Value(jsi::String::createFromUtf8(rt, text));
+        });
+    });
+
+    // getFormattedChat(contextId, messages: string, chatTemplate: string, params): string
+    // Only the prompt is returned, grammar and tool call formats stay on the async method
+    setFunction(rt, module, "getFormattedChat", 4, [](jsi::Runtime &rt, const jsi::Value &, const jsi::Value *args, size_t count) {
+        if (count < 2) throw jsi::JSError(rt, "getFormattedChat expects (contextId, messages, chatTemplate, params)");
+        const std::string messages = getString(rt, args[1], "messages");
+        const std::string chat_template = count > 2 && args[2].isString() ? args[2].getString(rt).utf8(rt) : "";
+        jsi::Object params = count > 3 && args[3].isObject() ? args[3].getObject(rt) : jsi::Object(rt);
+        const bool jinja = getBoolProperty(rt, params, "jinja", false);
+        const std::string json_schema = getStringProperty(rt, params, "json_schema");
+        const std::string tools = getStringProperty(rt, params, "tools");
+        const bool parallel_tool_calls = getBoolProperty(rt, params, "parallel_tool_calls", false);
+        const std::string tool_choice = getStringProperty(rt, params, "tool_choice");
+        const bool enable_thinking = getBoolProperty(rt, params, "enable_thinking", true);
+        return withContext(rt, args[0], [&](rnllama::llama_rn_context *llama) {
+            std::string prompt;
+            if (jinja) {
+                prompt = llama->getFormattedChatWithJinja(
+                    messages, chat_template, json_schema, tools, parallel_tool_calls, tool_choice, enable_thinking
+                ).prompt;
+            } else {
+                prompt = llama->getFormattedChat(messages, chat_template);
+            }
+            return jsi::Value(jsi::String::createFromUtf8(rt, prompt));
+        });
+    });
+
+    // getModelInfo(contextId): { desc, size, nEmbd, nParams, metadata }
+    // The chat template capabilities are left to the model details returned by initContext
+    setFunction(rt, module, "getModelInfo", 1, [](jsi::Runtime &rt, const jsi::Value &, const jsi::Value *args, size_t count) {
+        if (count < 1) throw jsi::JSError(rt, "getModelInfo expects (contextId)");
+        return withContext(rt, args[0], [&](rnllama::llama_rn_context *llama) {
+            jsi::Object metadata(rt);
+            const int n_meta = llama_model_meta_count(llama->model);
+            for (int i = 0; i < n_meta; i++) {
+                char key[256];
+                llama_model_meta_key_by_index(llama->model, i, key, sizeof(key));
+                char val[4096];
+                llama_model_meta_val_str_by_index(llama->model, i, val, sizeof(val));
+                metadata.setProperty(rt, key, jsi::String::createFromUtf8(rt, val));
+            }
+
+            char desc[1024];
+            llama_model_desc(llama->model, desc, sizeof(desc));
+
+            jsi::Object info(rt);
+            info.setProperty(rt, "desc", jsi::String::createFromUtf8(rt, desc));
+            info.setProperty(rt, "size", (double) llama_model_size(llama->model));
+            info.setProperty(rt, "nEmbd", (double) llama_model_n_embd(llama->model));
+            info.setProperty(rt, "nParams", (double) llama_model_n_params(llama->model));
+            info.setProperty(rt, "metadata", std::move(metadata));
+            return jsi::Value(rt, info);
+        });
+    });
+
+    // isPredicting(contextId): boolean
+    setFunction(rt, module, "isPredicting", 1, [](jsi::Runtime &rt, const jsi::Value &, const jsi::Value *args, size_t count) {
+        if (count < 1) throw jsi::JSError(rt, "isPredicting expects (contextId)");
+        return withContext(rt, args[0], [&](rnllama::llama_rn_context *llama) {
+            return jsi::Value(llama->is_predicting.load());
+        });
+    });
+
+    rt.global().setProperty(rt, "__rnllamaJSI", std::move(module));
+    return true;
+}
+
+}
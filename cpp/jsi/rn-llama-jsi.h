@@ -0,0 +1,29 @@
+#ifndef RNLLAMA_JSI_H
+#define RNLLAMA_JSI_H
+
+namespace facebook {
+namespace jsi {
+class Runtime;
+}
+}
+
+namespace rnllama {
+struct llama_rn_context;
+}
+
+// Synchronous bindings for cheap read-only calls (tokenize, detokenize, token counting,
+// chat formatting, model metadata), installed as global.__rnllamaJSI on the JS thread. They only read the
+// model, vocab and chat templates, so they run beside a completion on the worker threads.
+namespace rnllama_jsi {
+
+// Install the bindings into the runtime, must be called on the JS thread
+bool install(facebook::jsi::Runtime &runtime);
+
+// Make a context reachable from the bindings by its JS context id
+void addContext(int id, rnllama::llama_rn_context *llama);
+// Unregister a context before it is freed, waits for a binding call in progress
+void removeContext(rnllama::llama_rn_context *llama);
+
+}
+
+#endif /* RNLLAMA_JSI_H */
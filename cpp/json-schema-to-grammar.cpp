@@ -4,7 +4,9 @@
 #include "nlohmann/json.hpp"
 
 #include <algorithm>
+#include <list>
 #include <map>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <string>
@@ -959,11 +961,36 @@ std::string json_schema_to_grammar(const json & schema, bool force_gbnf) {
 #else
     (void)force_gbnf;
 #endif // LLAMA_USE_LLGUIDANCE
-    return build_grammar([&](const common_grammar_builder & callbacks) {
+
+    // agents send the same tool schemas on every turn, so remember the last few
+    // conversions (most recently used first); failed conversions throw and are not cached
+    static const size_t max_cached = 16;
+    static std::mutex mutex;
+    static std::list<std::pair<std::string, std::string>> cache;
+
+    const std::string key = schema.dump();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = cache.begin(); it != cache.end(); ++it) {
+            if (it->first == key) {
+                cache.splice(cache.begin(), cache, it);
+                return it->second;
+            }
+        }
+    }
+
+    std::string grammar = build_grammar([&](const common_grammar_builder & callbacks) {
         auto copy = schema;
         callbacks.resolve_refs(copy);
         callbacks.add_schema("", copy);
     });
+
+    std::lock_guard<std::mutex> lock(mutex);
+    cache.emplace_front(key, grammar);
+    if (cache.size() > max_cached) {
+        cache.pop_back();
+    }
+    return grammar;
 }
 
 std::string build_grammar(const std::function<void(const common_grammar_builder &)> & cb, const common_grammar_options & options) {
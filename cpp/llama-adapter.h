@@ -4,6 +4,7 @@
 
 #include "ggml-cpp.h"
 
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -74,3 +75,6 @@ struct llama_adapter_lora {
 };
 
 using llama_adapter_loras = std::unordered_map<llama_adapter_lora *, float>;
+
+// adapters applied only to the tokens of one sequence, on top of the adapters of the context
+using llama_adapter_loras_seq = std::map<llama_seq_id, llama_adapter_loras>;
@@ -3,6 +3,7 @@
 #include "llama-impl.h"
 #include "llama-batch.h"
 #include "llama-io.h"
+#include "llama-memory-hybrid.h"
 #include "llama-memory.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
@@ -191,6 +192,7 @@ llama_context::llama_context(
         llama_memory_params params_mem = {
             /*.type_k   =*/ params.type_k,
             /*.type_v   =*/ params.type_v,
+            /*.n_recent =*/ params.n_kv_recent,
             /*.swa_full =*/ params.swa_full,
         };
 
@@ -263,6 +265,10 @@ llama_context::llama_context(
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, lm_ggml_backend_sched_get_n_copies(sched.get()));
         }
+
+        // the scheduler cycles through the graph copies when pipelining, so the graph cannot be kept
+        const char * LLAMA_GRAPH_REUSE_DISABLE = getenv("LLAMA_GRAPH_REUSE_DISABLE");
+        graph_reuse = !pipeline_parallel && !(LLAMA_GRAPH_REUSE_DISABLE && atoi(LLAMA_GRAPH_REUSE_DISABLE));
     }
 
     // reserve worst-case graph
@@ -626,18 +632,24 @@ void llama_context::set_embeddings(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.embeddings = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_causal_attn(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.causal_attn = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_warmup(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.warmup = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_adapter_lora(
@@ -646,6 +658,8 @@ void llama_context::set_adapter_lora(
     LLAMA_LOG_DEBUG("%s: adapter = %p, scale = %f\n", __func__, (void *) adapter, scale);
 
     loras[adapter] = scale;
+
+    graph_reuse_reset();
 }
 
 bool llama_context::rm_adapter_lora(
@@ -655,6 +669,7 @@ bool llama_context::rm_adapter_lora(
     auto pos = loras.find(adapter);
     if (pos != loras.end()) {
         loras.erase(pos);
+        graph_reuse_reset();
         return true;
     }
 
@@ -665,6 +680,31 @@ void llama_context::clear_adapter_lora() {
     LLAMA_LOG_DEBUG("%s: call\n", __func__);
 
     loras.clear();
+
+    graph_reuse_reset();
+}
+
+void llama_context::set_adapter_lora_seq(
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, adapter = %p, scale = %f\n", __func__, seq_id, (void *) adapter, scale);
+
+    loras_seq[seq_id][adapter] = scale;
+
+    graph_reuse_reset();
+}
+
+void llama_context::clear_adapter_lora_seq(llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d\n", __func__, seq_id);
+
+    if (seq_id < 0) {
+        loras_seq.clear();
+    } else {
+        loras_seq.erase(seq_id);
+    }
+
+    graph_reuse_reset();
 }
 
 bool llama_context::apply_adapter_cvec(
@@ -675,43 +715,66 @@ bool llama_context::apply_adapter_cvec(
                 int32_t   il_end) {
     LLAMA_LOG_DEBUG("%s: il_start = %d, il_end = %d\n", __func__, il_start, il_end);
 
+    graph_reuse_reset();
+
     return cvec.apply(model, data, len, n_embd, il_start, il_end);
 }
 
-llm_graph_result_ptr llama_context::process_ubatch(const llama_ubatch & ubatch, llm_graph_type gtype, llama_memory_context_i * mctx, lm_ggml_status & ret) {
+llm_graph_result_i * llama_context::process_ubatch(const llama_ubatch & ubatch, llm_graph_type gtype, llama_memory_context_i * mctx, lm_ggml_status & ret) {
     if (mctx && !mctx->apply()) {
         LLAMA_LOG_ERROR("%s: failed to apply memory context\n", __func__);
         ret = LM_GGML_STATUS_FAILED;
         return nullptr;
     }
 
-    auto * gf = graph_init();
-    if (!gf) {
-        LLAMA_LOG_ERROR("%s: failed to initialize graph\n", __func__);
-        ret = LM_GGML_STATUS_FAILED;
-        return nullptr;
-    }
+    // in steady-state decoding the ubatch shape repeats, so the previous graph and its allocation can be kept
+    // as-is - the memory context is rebound by can_reuse() and only the inputs need to be set again
+    const bool can_reuse =
+        graph_reuse && gf_res_prev && gtype == LLM_GRAPH_TYPE_DECODER && gf_type_prev == gtype &&
+        gf_res_prev->can_reuse(ubatch, mctx, n_outputs);
 
-    auto res = graph_build(ctx_compute.get(), gf, ubatch, gtype, mctx);
-    if (!res) {
-        LLAMA_LOG_ERROR("%s: failed to build graph\n", __func__);
-        ret = LM_GGML_STATUS_FAILED;
-        return nullptr;
-    }
+    auto * gf = gf_prev;
+
+    if (can_reuse) {
+        n_reused++;
+    } else {
+        lm_ggml_backend_sched_reset(sched.get());
 
-    // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (lm_ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+        gf = graph_init();
+        if (!gf) {
+            LLAMA_LOG_ERROR("%s: failed to initialize graph\n", __func__);
+            ret = LM_GGML_STATUS_FAILED;
+            return nullptr;
+        }
 
-    if (!lm_ggml_backend_sched_alloc_graph(sched.get(), gf)) {
-        LLAMA_LOG_ERROR("%s: failed to allocate graph\n", __func__);
-        ret = LM_GGML_STATUS_ALLOC_FAILED;
-        return nullptr;
+        auto res = graph_build(ctx_compute.get(), gf, ubatch, gtype, mctx);
+        if (!res) {
+            LLAMA_LOG_ERROR("%s: failed to build graph\n", __func__);
+            ret = LM_GGML_STATUS_FAILED;
+            return nullptr;
+        }
+
+        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (lm_ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+        if (!lm_ggml_backend_sched_alloc_graph(sched.get(), gf)) {
+            LLAMA_LOG_ERROR("%s: failed to allocate graph\n", __func__);
+            ret = LM_GGML_STATUS_ALLOC_FAILED;
+            return nullptr;
+        }
+
+        gf_res_prev  = std::move(res);
+        gf_prev      = gf;
+        gf_type_prev = gtype;
     }
 
+    auto * res = gf_res_prev.get();
+
     res->set_inputs(&ubatch);
 
     const auto status = graph_compute(gf, ubatch.n_tokens > 1);
     if (status != LM_GGML_STATUS_SUCCESS) {
         LLAMA_LOG_ERROR("%s: failed to compute graph, compute status: %d\n", __func__, status);
+        graph_reuse_reset();
         ret = status;
         return nullptr;
     }
@@ -1005,7 +1068,6 @@ int llama_context::decode(const llama_batch & batch_inp) {
             n_outputs = n_outputs_new;
         }
 
-        lm_ggml_backend_sched_reset(sched.get());
         lm_ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
 
         lm_ggml_status status;
@@ -1192,7 +1254,10 @@ int llama_context::decode(const llama_batch & batch_inp) {
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    lm_ggml_backend_sched_reset(sched.get());
+    // when the graph is kept for reuse, the allocation must survive until the next ubatch
+    if (!graph_reuse) {
+        lm_ggml_backend_sched_reset(sched.get());
+    }
 
     return 0;
 }
@@ -1280,6 +1345,9 @@ int32_t llama_context::graph_max_nodes() const {
 }
 
 lm_ggml_cgraph * llama_context::graph_init() {
+    // the tensors of the previous graph live in ctx_compute
+    graph_reuse_reset();
+
     lm_ggml_init_params params = {
         /*.mem_size   =*/ buf_compute_meta.size(),
         /*.mem_buffer =*/ buf_compute_meta.data(),
@@ -1291,6 +1359,11 @@ lm_ggml_cgraph * llama_context::graph_init() {
     return lm_ggml_new_graph_custom(ctx_compute.get(), graph_max_nodes(), false);
 }
 
+void llama_context::graph_reuse_reset() {
+    gf_res_prev.reset();
+    gf_prev = nullptr;
+}
+
 lm_ggml_cgraph * llama_context::graph_reserve(uint32_t n_tokens, uint32_t n_seqs, uint32_t n_outputs, const llama_memory_context_i * mctx) {
     LLAMA_LOG_DEBUG("%s: reserving a graph for ubatch with n_tokens = %4u, n_seqs = %2u, n_outputs = %4u\n", __func__, n_tokens, n_seqs, n_outputs);
 
@@ -1348,6 +1421,7 @@ llm_graph_result_ptr llama_context::graph_build(
                 /*.backend_cpu =*/ backend_cpu,
                 /*.cvec        =*/ &cvec,
                 /*.loras       =*/ &loras,
+                /*.loras_seq   =*/ &loras_seq,
                 /*.mctx        =*/ mctx,
                 /*.cross       =*/ &cross,
                 /*.n_outputs   =*/ n_outputs,
@@ -1583,30 +1657,30 @@ size_t llama_context::state_set_data(const uint8_t * src, size_t size) {
     }
 }
 
-size_t llama_context::state_seq_get_size(llama_seq_id seq_id) {
+size_t llama_context::state_seq_get_size(llama_seq_id seq_id, llama_state_seq_flags flags) {
     llama_io_write_dummy io;
     try {
-        return state_seq_write_data(io, seq_id);
+        return state_seq_write_data(io, seq_id, flags);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error getting state size: %s\n", __func__, err.what());
         return 0;
     }
 }
 
-size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, size_t size) {
+size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, size_t size, llama_state_seq_flags flags) {
     llama_io_write_buffer io(dst, size);
     try {
-        return state_seq_write_data(io, seq_id);
+        return state_seq_write_data(io, seq_id, flags);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error saving state: %s\n", __func__, err.what());
         return 0;
     }
 }
 
-size_t llama_context::state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size) {
+size_t llama_context::state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size, llama_state_seq_flags flags) {
     llama_io_read_buffer io(src, size);
     try {
-        return state_seq_read_data(io, seq_id);
+        return state_seq_read_data(io, seq_id, flags);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading state: %s\n", __func__, err.what());
         return 0;
@@ -1897,21 +1971,31 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
     return io.n_bytes();
 }
 
-size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id) {
+size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id, llama_state_seq_flags flags) {
     LM_GGML_UNUSED(seq_id);
 
     if (memory) {
-        memory->state_write(io, seq_id);
+        auto * mem_hybrid = dynamic_cast<llama_memory_hybrid *>(memory.get());
+        if ((flags & LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) && mem_hybrid) {
+            mem_hybrid->get_mem_recr()->state_write(io, seq_id);
+        } else {
+            memory->state_write(io, seq_id);
+        }
     }
 
     return io.n_bytes();
 }
 
-size_t llama_context::state_seq_read_data(llama_io_read_i & io, llama_seq_id seq_id) {
+size_t llama_context::state_seq_read_data(llama_io_read_i & io, llama_seq_id seq_id, llama_state_seq_flags flags) {
     LM_GGML_UNUSED(seq_id);
 
     if (memory) {
-        memory->state_read(io, seq_id);
+        auto * mem_hybrid = dynamic_cast<llama_memory_hybrid *>(memory.get());
+        if ((flags & LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) && mem_hybrid) {
+            mem_hybrid->get_mem_recr()->state_read(io, seq_id);
+        } else {
+            memory->state_read(io, seq_id);
+        }
     }
 
     return io.n_bytes();
@@ -1930,6 +2014,7 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.t_eval_ms   = 1e-3 * t_eval_us;
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
+    data.n_reused    = std::max(0, n_reused);
 
     return data;
 }
@@ -1938,6 +2023,7 @@ void llama_context::perf_reset() {
     t_start_us  = lm_ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+    n_reused    = 0;
 }
 
 //
@@ -2179,6 +2265,7 @@ llama_context_params llama_context_default_params() {
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ LM_GGML_TYPE_F16,
         /*.type_v                      =*/ LM_GGML_TYPE_F16,
+        /*.n_kv_recent                 =*/ 0,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
         /*.embeddings                  =*/ false,
@@ -2371,6 +2458,26 @@ void llama_clear_adapter_lora(llama_context * ctx) {
     ctx->clear_adapter_lora();
 }
 
+int32_t llama_set_adapter_lora_seq(
+            llama_context * ctx,
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale) {
+    if (seq_id < 0 || seq_id >= (llama_seq_id) ctx->get_cparams().n_seq_max) {
+        return -1;
+    }
+
+    ctx->set_adapter_lora_seq(seq_id, adapter, scale);
+
+    return 0;
+}
+
+void llama_clear_adapter_lora_seq(
+            llama_context * ctx,
+            llama_seq_id seq_id) {
+    ctx->clear_adapter_lora_seq(seq_id);
+}
+
 int32_t llama_apply_adapter_cvec(
         llama_context * ctx,
                  const float * data,
@@ -2734,6 +2841,22 @@ size_t llama_state_seq_set_data(llama_context * ctx, const uint8_t * src, size_t
     return ctx->state_seq_set_data(seq_id, src, size);
 }
 
+size_t llama_state_seq_get_size_ext(llama_context * ctx, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    return ctx->state_seq_get_size(seq_id, flags);
+}
+
+size_t llama_state_seq_get_data_ext(llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    ctx->synchronize();
+
+    return ctx->state_seq_get_data(seq_id, dst, size, flags);
+}
+
+size_t llama_state_seq_set_data_ext(llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    ctx->synchronize();
+
+    return ctx->state_seq_set_data(seq_id, src, size, flags);
+}
+
 size_t llama_state_seq_save_file(llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
     ctx->synchronize();
 
@@ -2807,6 +2930,7 @@ void llama_perf_context_print(const llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
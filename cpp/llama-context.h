@@ -85,6 +85,13 @@ struct llama_context {
 
     void clear_adapter_lora();
 
+    void set_adapter_lora_seq(
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale);
+
+    void clear_adapter_lora_seq(llama_seq_id seq_id);
+
     bool apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -96,7 +103,8 @@ struct llama_context {
     // if memory_context is provided, it will be applied first to the context's memory
     // ret contains the status of the graph computation
     // returns nullptr only if ret != LM_GGML_STATUS_SUCCESS
-    llm_graph_result_ptr process_ubatch(
+    // the result is owned by the context and stays valid until the next graph is built
+    llm_graph_result_i * process_ubatch(
                 const llama_ubatch & ubatch,
                     llm_graph_type   gtype,
             llama_memory_context_i * mctx,
@@ -113,9 +121,9 @@ struct llama_context {
     size_t state_get_data(      uint8_t * dst, size_t size);
     size_t state_set_data(const uint8_t * src, size_t size);
 
-    size_t state_seq_get_size(llama_seq_id seq_id);
-    size_t state_seq_get_data(llama_seq_id seq_id,       uint8_t * dst, size_t size);
-    size_t state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size);
+    size_t state_seq_get_size(llama_seq_id seq_id, llama_state_seq_flags flags = 0);
+    size_t state_seq_get_data(llama_seq_id seq_id,       uint8_t * dst, size_t size, llama_state_seq_flags flags = 0);
+    size_t state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size, llama_state_seq_flags flags = 0);
 
     bool state_load_file(
             const char * filepath,
@@ -191,8 +199,12 @@ public:
     int32_t graph_max_nodes() const;
 
     // zero-out inputs and create the ctx_compute for the compute graph
+    // invalidates the graph kept for reuse
     lm_ggml_cgraph * graph_init();
 
+    // drop the graph kept for reuse - must be called whenever a change would alter the graph topology
+    void graph_reuse_reset();
+
     // returns the result of lm_ggml_backend_sched_graph_compute_async execution
     lm_ggml_status graph_compute(lm_ggml_cgraph * gf, bool batched);
 
@@ -213,8 +225,8 @@ private:
     size_t state_write_data(llama_io_write_i & io);
     size_t state_read_data (llama_io_read_i  & io);
 
-    size_t state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id);
-    size_t state_seq_read_data (llama_io_read_i  & io, llama_seq_id seq_id);
+    size_t state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id, llama_state_seq_flags flags = 0);
+    size_t state_seq_read_data (llama_io_read_i  & io, llama_seq_id seq_id, llama_state_seq_flags flags = 0);
 
     //
     // members
@@ -225,6 +237,7 @@ private:
     llama_cparams       cparams;
     llama_adapter_cvec  cvec;
     llama_adapter_loras loras;
+    llama_adapter_loras_seq loras_seq;
 
     llama_cross cross; // TODO: tmp for handling cross-attention - need something better probably
 
@@ -260,6 +273,13 @@ private:
 
     lm_ggml_context_ptr ctx_compute;
 
+    // the last decoder graph, kept so that ubatches of the same shape can skip the build and allocation
+    bool graph_reuse = true;
+
+    llm_graph_result_ptr gf_res_prev;
+    lm_ggml_cgraph *     gf_prev      = nullptr;
+    llm_graph_type       gf_type_prev = LLM_GRAPH_TYPE_DEFAULT;
+
     // training
     lm_ggml_opt_context_t opt_ctx = nullptr;
 
@@ -294,4 +314,5 @@ private:
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+    mutable int32_t n_reused = 0; // number of times the previous graph was reused
 };
@@ -6,6 +6,9 @@
 
 #include <cmath>
 #include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 
 //
@@ -973,7 +976,7 @@ struct llama_grammar * llama_grammar_init_impl(
     };
 }
 
-struct llama_grammar * llama_grammar_init_impl(
+static struct llama_grammar * llama_grammar_init_uncached(
         const struct llama_vocab * vocab,
                       const char * grammar_str,
                       const char * grammar_root,
@@ -1078,6 +1081,75 @@ struct llama_grammar * llama_grammar_init_impl(
     };
 }
 
+// key of a compiled grammar; the rules and stacks do not depend on the vocab,
+// so it is not part of the key and is rebound on every clone
+struct llama_grammar_cache_key {
+    std::string grammar;
+    std::string root;
+    bool lazy;
+    std::vector<std::string> trigger_patterns;
+    std::vector<llama_token> trigger_tokens;
+
+    bool operator==(const llama_grammar_cache_key & other) const {
+        return lazy == other.lazy && root == other.root &&
+               trigger_tokens == other.trigger_tokens && trigger_patterns == other.trigger_patterns &&
+               grammar == other.grammar;
+    }
+};
+
+struct llama_grammar * llama_grammar_init_impl(
+        const struct llama_vocab * vocab,
+                      const char * grammar_str,
+                      const char * grammar_root,
+                              bool lazy,
+                     const char ** trigger_patterns,
+                            size_t num_trigger_patterns,
+               const llama_token * trigger_tokens,
+                            size_t num_trigger_tokens) {
+    // parsing, the left recursion check and building the initial stacks are repeated for
+    // the same grammar on every completion and on every sampler reset; keep the last few
+    // compiled grammars (most recently used first) and hand out clones of them instead
+    using cache_entry = std::pair<llama_grammar_cache_key, std::unique_ptr<llama_grammar, decltype(&llama_grammar_free_impl)>>;
+    static const size_t max_cached = 16;
+    static std::mutex mutex;
+    static std::list<cache_entry> cache;
+
+    llama_grammar_cache_key key { grammar_str, grammar_root, lazy, {}, {} };
+    for (size_t i = 0; i < num_trigger_patterns; i++) {
+        LM_GGML_ASSERT(trigger_patterns != nullptr);
+        key.trigger_patterns.emplace_back(trigger_patterns[i]);
+    }
+    if (num_trigger_tokens > 0) {
+        LM_GGML_ASSERT(trigger_tokens != nullptr);
+        key.trigger_tokens.assign(trigger_tokens, trigger_tokens + num_trigger_tokens);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = cache.begin(); it != cache.end(); ++it) {
+            if (it->first == key) {
+                cache.splice(cache.begin(), cache, it);
+                auto * result = llama_grammar_clone_impl(*it->second);
+                result->vocab = vocab;
+                return result;
+            }
+        }
+    }
+
+    auto * result = llama_grammar_init_uncached(vocab, grammar_str, grammar_root, lazy,
+            trigger_patterns, num_trigger_patterns, trigger_tokens, num_trigger_tokens);
+    if (result == nullptr) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    cache.emplace_front(std::move(key), cache_entry::second_type(llama_grammar_clone_impl(*result), llama_grammar_free_impl));
+    if (cache.size() > max_cached) {
+        cache.pop_back();
+    }
+    return result;
+}
+
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
     if (grammar == nullptr) {
         return;
@@ -1100,15 +1172,33 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
     };
 
     // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                        result->stacks[is][ie] =  &result->rules[ir0][ir1];
-                    }
-                }
+    // each rule is a separate allocation, so look up the owning rule by address instead
+    // of scanning every element of every rule for every stack element
+    std::vector<std::pair<const llama_grammar_element *, size_t>> rule_starts;
+    rule_starts.reserve(grammar.rules.size());
+    for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
+        if (!grammar.rules[ir0].empty()) {
+            rule_starts.emplace_back(grammar.rules[ir0].data(), ir0);
+        }
+    }
+    std::sort(rule_starts.begin(), rule_starts.end(), [](const auto & a, const auto & b) {
+        return std::less<const llama_grammar_element *>()(a.first, b.first);
+    });
+
+    for (auto & stack : result->stacks) {
+        for (auto & elem : stack) {
+            auto it = std::upper_bound(rule_starts.begin(), rule_starts.end(), elem, [](const llama_grammar_element * p, const auto & start) {
+                return std::less<const llama_grammar_element *>()(p, start.first);
+            });
+            if (it == rule_starts.begin()) {
+                continue;
+            }
+            --it;
+            const auto & rule = grammar.rules[it->second];
+            if (!std::less<const llama_grammar_element *>()(elem, rule.data() + rule.size())) {
+                continue;
             }
+            elem = &result->rules[it->second][elem - rule.data()];
         }
     }
 
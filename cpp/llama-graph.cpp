@@ -9,6 +9,7 @@
 #include "llama-memory-hybrid.h"
 #include "llama-memory-recurrent.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -28,6 +29,16 @@ void llm_graph_input_embd::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_embd::can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) {
+    LM_GGML_UNUSED(mctx);
+
+    if (ubatch.token) {
+        return tokens && tokens->ne[0] == ubatch.n_tokens;
+    }
+
+    return embd && embd->ne[1] == ubatch.n_tokens;
+}
+
 void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
     if (ubatch->pos && pos) {
         const int64_t n_tokens = ubatch->n_tokens;
@@ -50,6 +61,12 @@ void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_pos::can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) {
+    LM_GGML_UNUSED(mctx);
+
+    return pos && pos->ne[0] == (int64_t) ubatch.n_tokens*n_pos_per_embd;
+}
+
 void llm_graph_input_attn_temp::set_input(const llama_ubatch * ubatch) {
     if (ubatch->pos && attn_scale) {
         const int64_t n_tokens = ubatch->n_tokens;
@@ -66,6 +83,12 @@ void llm_graph_input_attn_temp::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_attn_temp::can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) {
+    LM_GGML_UNUSED(mctx);
+
+    return attn_scale && attn_scale->ne[2] == ubatch.n_tokens;
+}
+
 void llm_graph_input_pos_bucket::set_input(const llama_ubatch * ubatch) {
     if (pos_bucket) {
         const int64_t n_tokens = ubatch->n_tokens;
@@ -118,6 +141,14 @@ void llm_graph_input_out_ids::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_out_ids::can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) {
+    LM_GGML_UNUSED(ubatch);
+    LM_GGML_UNUSED(mctx);
+
+    // the number of outputs is checked by llm_graph_result::can_reuse
+    return out_ids && out_ids->ne[0] == n_outputs;
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -284,21 +315,73 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
     mctx->set_input_k_idxs(self_k_idxs, ubatch);
     mctx->set_input_v_idxs(self_v_idxs, ubatch);
 
+    if (self_recent_idxs) {
+        mctx->set_input_recent_idxs(self_recent_idxs, ubatch);
+        mctx->set_input_kv_recent(self_kv_recent);
+    }
+
     mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
 }
 
+bool llm_graph_input_attn_kv_unified::can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) {
+    const auto * mctx_new = static_cast<const llama_kv_cache_unified_context *>(mctx);
+
+    // without lm_ggml_set_rows() the KV store views are offset by the head of the slot
+    bool res = mctx_new->get_supports_set_rows();
+
+    res &= self_k_idxs->ne[0] == ubatch.n_tokens;
+    res &= self_v_idxs->ne[0] == ubatch.n_tokens;
+
+    res &= self_kq_mask->ne[0] == mctx_new->get_n_kv();
+    res &= self_kq_mask->ne[1] == LM_GGML_PAD(ubatch.n_tokens, LM_GGML_KQ_MASK_PAD);
+
+    this->mctx = mctx_new;
+
+    return res;
+}
+
 void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch) {
     mctx->get_base()->set_input_k_idxs(self_k_idxs, ubatch);
     mctx->get_base()->set_input_v_idxs(self_v_idxs, ubatch);
 
+    if (self_recent_idxs) {
+        mctx->get_base()->set_input_recent_idxs(self_recent_idxs, ubatch);
+        mctx->get_base()->set_input_kv_recent(self_kv_recent);
+    }
+
     mctx->get_base()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
 
     mctx->get_swa()->set_input_k_idxs(self_k_idxs_swa, ubatch);
     mctx->get_swa()->set_input_v_idxs(self_v_idxs_swa, ubatch);
 
+    if (self_recent_idxs_swa) {
+        mctx->get_swa()->set_input_recent_idxs(self_recent_idxs_swa, ubatch);
+        mctx->get_swa()->set_input_kv_recent(self_kv_recent_swa);
+    }
+
     mctx->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn);
 }
 
+bool llm_graph_input_attn_kv_unified_iswa::can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) {
+    const auto * mctx_new = static_cast<const llama_kv_cache_unified_iswa_context *>(mctx);
+
+    bool res = mctx_new->get_base()->get_supports_set_rows() && mctx_new->get_swa()->get_supports_set_rows();
+
+    res &= self_k_idxs->ne[0] == ubatch.n_tokens;
+    res &= self_v_idxs->ne[0] == ubatch.n_tokens;
+    res &= self_kq_mask->ne[0] == mctx_new->get_base()->get_n_kv();
+    res &= self_kq_mask->ne[1] == LM_GGML_PAD(ubatch.n_tokens, LM_GGML_KQ_MASK_PAD);
+
+    res &= self_k_idxs_swa->ne[0] == ubatch.n_tokens;
+    res &= self_v_idxs_swa->ne[0] == ubatch.n_tokens;
+    res &= self_kq_mask_swa->ne[0] == mctx_new->get_swa()->get_n_kv();
+    res &= self_kq_mask_swa->ne[1] == LM_GGML_PAD(ubatch.n_tokens, LM_GGML_KQ_MASK_PAD);
+
+    this->mctx = mctx_new;
+
+    return res;
+}
+
 void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
     LM_GGML_ASSERT(cross_kq_mask);
 
@@ -361,6 +444,92 @@ void llm_graph_input_one::set_input(const llama_ubatch * ubatch) {
     lm_ggml_backend_tensor_set(one, &f_one, 0, sizeof(float));
 }
 
+llm_graph_input_lora_seq::llm_graph_input_lora_seq(const llama_adapter_loras_seq & loras_seq, int32_t n_outputs) :
+    loras_seq(loras_seq), n_outputs(n_outputs) {
+    for (const auto & it : loras_seq) {
+        for (const auto & lora : it.second) {
+            if (std::find(adapters.begin(), adapters.end(), lora.first) == adapters.end()) {
+                adapters.push_back(lora.first);
+            }
+        }
+    }
+    scale.resize(adapters.size(), nullptr);
+    scale_out.resize(adapters.size(), nullptr);
+}
+
+void llm_graph_input_lora_seq::set_input(const llama_ubatch * ubatch) {
+    const int64_t n_tokens = ubatch->n_tokens;
+
+    std::vector<float> data(n_tokens);
+    std::vector<float> data_out;
+
+    for (size_t ia = 0; ia < adapters.size(); ++ia) {
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            data[i] = 0.0f;
+
+            const auto it = loras_seq.find(ubatch->seq_id[i][0]);
+            if (it != loras_seq.end()) {
+                const auto lora = it->second.find(adapters[ia]);
+                if (lora != it->second.end()) {
+                    data[i] = lora->second;
+                }
+            }
+        }
+
+        if (scale[ia]) {
+            lm_ggml_backend_tensor_set(scale[ia], data.data(), 0, n_tokens*sizeof(float));
+        }
+
+        if (scale_out[ia]) {
+            // same row order as llm_graph_input_out_ids
+            data_out.clear();
+            for (int64_t i = 0; i < n_tokens; ++i) {
+                if (n_outputs == n_tokens || ubatch->output[i]) {
+                    data_out.push_back(data[i]);
+                }
+            }
+            LM_GGML_ASSERT((int64_t) data_out.size() == scale_out[ia]->ne[0]);
+            lm_ggml_backend_tensor_set(scale_out[ia], data_out.data(), 0, data_out.size()*sizeof(float));
+        }
+    }
+}
+
+bool llm_graph_input_lora_seq::can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) {
+    LM_GGML_UNUSED(mctx);
+
+    // changing the sequence adapters drops the previous graph, only the shape is checked here
+    for (const auto * t : scale) {
+        if (t && t->ne[0] != ubatch.n_tokens) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//
+// llm_graph_result
+//
+
+bool llm_graph_result::can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx, uint32_t n_outputs) {
+    if (ubatch.n_tokens     != this->n_tokens     ||
+        ubatch.n_seq_tokens != this->n_seq_tokens ||
+        ubatch.n_seqs       != this->n_seqs       ||
+        ubatch.equal_seqs   != this->equal_seqs   ||
+        n_outputs           != this->n_outputs) {
+        return false;
+    }
+
+    // all inputs are visited, so that they are rebound to the new memory context
+    bool res = true;
+
+    for (auto & input : inputs) {
+        res &= input->can_reuse(ubatch, mctx);
+    }
+
+    return res;
+}
+
 //
 // llm_graph_context
 //
@@ -400,10 +569,21 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     backend_cpu      (params.backend_cpu),
     cvec             (params.cvec),
     loras            (params.loras),
+    loras_seq        (params.loras_seq),
     mctx             (params.mctx),
     cross            (params.cross),
     cb_func          (params.cb),
     res              (std::make_unique<llm_graph_result>()) {
+        res->n_tokens     = ubatch.n_tokens;
+        res->n_seq_tokens = ubatch.n_seq_tokens;
+        res->n_seqs       = ubatch.n_seqs;
+        res->n_outputs    = n_outputs;
+        res->equal_seqs   = ubatch.equal_seqs;
+
+        if (loras_seq && !loras_seq->empty()) {
+            inp_lora_seq = static_cast<llm_graph_input_lora_seq *>(res->add_input(
+                        std::make_unique<llm_graph_input_lora_seq>(*loras_seq, n_outputs)));
+        }
     }
 
 void llm_graph_context::cb(lm_ggml_tensor * cur, const char * name, int il) const {
@@ -441,9 +621,60 @@ lm_ggml_tensor * llm_graph_context::build_lora_mm(
         res = lm_ggml_add(ctx0, res, ab_cur);
     }
 
+    if (inp_lora_seq) {
+        for (size_t ia = 0; ia < inp_lora_seq->adapters.size(); ++ia) {
+            llama_adapter_lora * adapter = inp_lora_seq->adapters[ia];
+            llama_adapter_lora_weight * lw = adapter->get_weight(w);
+            if (lw == nullptr) {
+                continue;
+            }
+
+            lm_ggml_tensor * ab_cur = lm_ggml_mul_mat(
+                    ctx0, lw->b,
+                    lm_ggml_mul_mat(ctx0, lw->a, cur)
+                    );
+
+            ab_cur = lm_ggml_scale(ctx0, ab_cur, lw->get_scale(adapter->alpha, 1.0f));
+            ab_cur = lm_ggml_mul(ctx0, ab_cur, build_lora_seq_scale(ia, ab_cur, false));
+            res = lm_ggml_add(ctx0, res, ab_cur);
+        }
+    }
+
     return res;
 }
 
+lm_ggml_tensor * llm_graph_context::build_lora_seq_scale(
+          size_t   ia,
+          lm_ggml_tensor * cur,
+            bool   expert_dim) const {
+    const int64_t n_rows = expert_dim ? cur->ne[2]*cur->ne[3] : cur->ne[1]*cur->ne[2]*cur->ne[3];
+
+    lm_ggml_tensor * inp = nullptr;
+    if (n_rows == n_tokens) {
+        if (!inp_lora_seq->scale[ia]) {
+            inp_lora_seq->scale[ia] = lm_ggml_new_tensor_1d(ctx0, LM_GGML_TYPE_F32, n_tokens);
+            lm_ggml_set_input(inp_lora_seq->scale[ia]);
+        }
+        inp = inp_lora_seq->scale[ia];
+    } else if (n_rows == n_outputs) {
+        // the rows were selected with inp_out_ids
+        if (!inp_lora_seq->scale_out[ia]) {
+            inp_lora_seq->scale_out[ia] = lm_ggml_new_tensor_1d(ctx0, LM_GGML_TYPE_F32, n_outputs);
+            lm_ggml_set_input(inp_lora_seq->scale_out[ia]);
+        }
+        inp = inp_lora_seq->scale_out[ia];
+    } else {
+        LM_GGML_ABORT("sequence LoRA applied to %d rows, expected %d tokens or %d outputs",
+                (int) n_rows, (int) n_tokens, (int) n_outputs);
+    }
+
+    if (expert_dim) {
+        return lm_ggml_reshape_4d(ctx0, inp, 1, 1, cur->ne[2], cur->ne[3]);
+    }
+
+    return lm_ggml_reshape_4d(ctx0, inp, 1, cur->ne[1], cur->ne[2], cur->ne[3]);
+}
+
 lm_ggml_tensor * llm_graph_context::build_lora_mm_id(
           lm_ggml_tensor * w,   // lm_ggml_tensor * as
           lm_ggml_tensor * cur, // lm_ggml_tensor * b
@@ -469,6 +700,30 @@ lm_ggml_tensor * llm_graph_context::build_lora_mm_id(
         res = lm_ggml_add(ctx0, res, ab_cur);
     }
 
+    if (inp_lora_seq) {
+        for (size_t ia = 0; ia < inp_lora_seq->adapters.size(); ++ia) {
+            llama_adapter_lora * adapter = inp_lora_seq->adapters[ia];
+            llama_adapter_lora_weight * lw = adapter->get_weight(w);
+            if (lw == nullptr) {
+                continue;
+            }
+
+            const float alpha = adapter->alpha;
+            const float rank  = (float) lw->b->ne[0];
+            const float scale = alpha ? alpha / rank : 1.0f;
+
+            lm_ggml_tensor * ab_cur = lm_ggml_mul_mat_id(
+                    ctx0, lw->b,
+                    lm_ggml_mul_mat_id(ctx0, lw->a, cur, ids),
+                    ids
+                    );
+
+            ab_cur = lm_ggml_scale(ctx0, ab_cur, scale);
+            ab_cur = lm_ggml_mul(ctx0, ab_cur, build_lora_seq_scale(ia, ab_cur, true));
+            res = lm_ggml_add(ctx0, res, ab_cur);
+        }
+    }
+
     return res;
 }
 
@@ -830,6 +1085,24 @@ lm_ggml_tensor * llm_graph_context::build_inp_embd(lm_ggml_tensor * tok_embd) co
 
             cur = lm_ggml_add(ctx0, cur, inpL_delta);
         }
+
+        if (inp_lora_seq) {
+            for (size_t ia = 0; ia < inp_lora_seq->adapters.size(); ++ia) {
+                llama_adapter_lora * adapter = inp_lora_seq->adapters[ia];
+                llama_adapter_lora_weight * lw = adapter->get_weight(tok_embd);
+                if (lw == nullptr) {
+                    continue;
+                }
+
+                lm_ggml_tensor * inpL_delta = lm_ggml_scale(ctx0, lm_ggml_mul_mat(
+                            ctx0, lw->b, // non-transposed lora_b
+                            lm_ggml_get_rows(ctx0, lw->a, inp->tokens)
+                            ), lw->get_scale(adapter->alpha, 1.0f));
+                inpL_delta = lm_ggml_mul(ctx0, inpL_delta, build_lora_seq_scale(ia, inpL_delta, false));
+
+                cur = lm_ggml_add(ctx0, cur, inpL_delta);
+            }
+        }
     } else {
         inp->embd = lm_ggml_new_tensor_2d(ctx0, LM_GGML_TYPE_F32, n_embd, ubatch.n_tokens);
         lm_ggml_set_input(inp->embd);
@@ -1029,6 +1302,9 @@ lm_ggml_tensor * llm_graph_context::build_attn_mha(
          lm_ggml_tensor * kq_b,
          lm_ggml_tensor * kq_mask,
          lm_ggml_tensor * v_mla,
+         lm_ggml_tensor * k_recent,
+         lm_ggml_tensor * v_recent,
+         lm_ggml_tensor * kv_recent,
              float     kq_scale) const {
     const bool v_trans = v->nb[1] > v->nb[2];
 
@@ -1064,6 +1340,13 @@ lm_ggml_tensor * llm_graph_context::build_attn_mha(
 
         lm_ggml_flash_attn_ext_set_prec(cur, LM_GGML_PREC_F32);
 
+        if (k_recent && v_recent && kv_recent) {
+            lm_ggml_flash_attn_ext_add_recent(cur,
+                    lm_ggml_permute(ctx0, k_recent, 0, 2, 1, 3),
+                    lm_ggml_permute(ctx0, v_recent, 0, 2, 1, 3),
+                    kv_recent);
+        }
+
         if (v_mla) {
 #if 0
             // v_mla can be applied as a matrix-vector multiplication with broadcasting across dimension 3 == n_tokens.
@@ -1176,7 +1459,7 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     lm_ggml_tensor * k = k_cur;
     lm_ggml_tensor * v = v_cur;
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, nullptr, nullptr, nullptr, kq_scale);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1207,6 +1490,9 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
         inp->self_k_idxs = mctx_cur->build_input_k_idxs(ctx0, ubatch);
         inp->self_v_idxs = mctx_cur->build_input_v_idxs(ctx0, ubatch);
 
+        inp->self_recent_idxs = mctx_cur->build_input_recent_idxs(ctx0, ubatch);
+        inp->self_kv_recent   = mctx_cur->build_input_kv_recent(ctx0);
+
         inp->self_kq_mask = lm_ggml_new_tensor_4d(ctx0, LM_GGML_TYPE_F32, n_kv, LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD), 1, 1);
         lm_ggml_set_input(inp->self_kq_mask);
 
@@ -1243,15 +1529,27 @@ lm_ggml_tensor * llm_graph_context::build_attn(
 
         lm_ggml_build_forward_expand(gf, mctx_cur->cpy_k(ctx0, k_cur, k_idxs, il));
         lm_ggml_build_forward_expand(gf, mctx_cur->cpy_v(ctx0, v_cur, v_idxs, il));
+
+        // and to the F16 copies of the recent cells, if any
+        const auto & recent_idxs = inp->get_recent_idxs();
+
+        if (recent_idxs) {
+            lm_ggml_build_forward_expand(gf, mctx_cur->cpy_k_recent(ctx0, k_cur, recent_idxs, il));
+            lm_ggml_build_forward_expand(gf, mctx_cur->cpy_v_recent(ctx0, v_cur, recent_idxs, il));
+        }
     }
 
-    const auto & kq_mask = inp->get_kq_mask();
+    const auto & kq_mask   = inp->get_kq_mask();
+    const auto & kv_recent = inp->get_kv_recent();
 
     lm_ggml_tensor * q = q_cur;
     lm_ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     lm_ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    lm_ggml_tensor * k_recent = mctx_cur->get_k_recent(ctx0, il);
+    lm_ggml_tensor * v_recent = mctx_cur->get_v_recent(ctx0, il);
+
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, k_recent, v_recent, kv_recent, kq_scale);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1300,25 +1598,39 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     const auto * mctx_cur = is_swa ? mctx_iswa->get_swa() : mctx_iswa->get_base();
 
     // optionally store to KV cache
+    const auto & recent_idxs = is_swa ? inp->get_recent_idxs_swa() : inp->get_recent_idxs();
+
     if (k_cur) {
         const auto & k_idxs = is_swa ? inp->get_k_idxs_swa() : inp->get_k_idxs();
 
         lm_ggml_build_forward_expand(gf, mctx_cur->cpy_k(ctx0, k_cur, k_idxs, il));
+
+        if (recent_idxs) {
+            lm_ggml_build_forward_expand(gf, mctx_cur->cpy_k_recent(ctx0, k_cur, recent_idxs, il));
+        }
     }
 
     if (v_cur) {
         const auto & v_idxs = is_swa ? inp->get_v_idxs_swa() : inp->get_v_idxs();
 
         lm_ggml_build_forward_expand(gf, mctx_cur->cpy_v(ctx0, v_cur, v_idxs, il));
+
+        if (recent_idxs) {
+            lm_ggml_build_forward_expand(gf, mctx_cur->cpy_v_recent(ctx0, v_cur, recent_idxs, il));
+        }
     }
 
-    const auto & kq_mask = is_swa ? inp->get_kq_mask_swa() : inp->get_kq_mask();
+    const auto & kq_mask   = is_swa ? inp->get_kq_mask_swa()   : inp->get_kq_mask();
+    const auto & kv_recent = is_swa ? inp->get_kv_recent_swa() : inp->get_kv_recent();
 
     lm_ggml_tensor * q = q_cur;
     lm_ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     lm_ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    lm_ggml_tensor * k_recent = mctx_cur->get_k_recent(ctx0, il);
+    lm_ggml_tensor * v_recent = mctx_cur->get_v_recent(ctx0, il);
+
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, k_recent, v_recent, kv_recent, kq_scale);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1373,7 +1685,7 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     lm_ggml_tensor * k = k_cur;
     lm_ggml_tensor * v = v_cur;
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, nullptr, nullptr, nullptr, kq_scale);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1426,7 +1738,7 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     lm_ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     lm_ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, nullptr, nullptr, nullptr, kq_scale);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1455,6 +1767,9 @@ llm_graph_input_attn_kv_unified_iswa * llm_graph_context::build_attn_inp_kv_unif
         inp->self_k_idxs = mctx_cur->get_base()->build_input_k_idxs(ctx0, ubatch);
         inp->self_v_idxs = mctx_cur->get_base()->build_input_v_idxs(ctx0, ubatch);
 
+        inp->self_recent_idxs = mctx_cur->get_base()->build_input_recent_idxs(ctx0, ubatch);
+        inp->self_kv_recent   = mctx_cur->get_base()->build_input_kv_recent(ctx0);
+
         inp->self_kq_mask = lm_ggml_new_tensor_4d(ctx0, LM_GGML_TYPE_F32, n_kv, LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD), 1, 1);
         lm_ggml_set_input(inp->self_kq_mask);
 
@@ -1469,6 +1784,9 @@ llm_graph_input_attn_kv_unified_iswa * llm_graph_context::build_attn_inp_kv_unif
         inp->self_k_idxs_swa = mctx_cur->get_swa()->build_input_k_idxs(ctx0, ubatch);
         inp->self_v_idxs_swa = mctx_cur->get_swa()->build_input_v_idxs(ctx0, ubatch);
 
+        inp->self_recent_idxs_swa = mctx_cur->get_swa()->build_input_recent_idxs(ctx0, ubatch);
+        inp->self_kv_recent_swa   = mctx_cur->get_swa()->build_input_kv_recent(ctx0);
+
         inp->self_kq_mask_swa = lm_ggml_new_tensor_4d(ctx0, LM_GGML_TYPE_F32, n_kv, LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD), 1, 1);
         lm_ggml_set_input(inp->self_kq_mask_swa);
 
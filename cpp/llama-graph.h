@@ -78,6 +78,14 @@ public:
     virtual ~llm_graph_input_i() = default;
 
     virtual void set_input(const llama_ubatch * ubatch) = 0;
+
+    // check if the input tensors fit the new ubatch and memory context, so that the graph can be reused
+    // the input is rebound to the new memory context - the graph must be rebuilt if any input returns false
+    virtual bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) {
+        LM_GGML_UNUSED(ubatch);
+        LM_GGML_UNUSED(mctx);
+        return false;
+    }
 };
 
 using llm_graph_input_ptr = std::unique_ptr<llm_graph_input_i>;
@@ -90,6 +98,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) override;
+
     lm_ggml_tensor * tokens = nullptr; // I32 [n_batch]
     lm_ggml_tensor * embd   = nullptr; // F32 [n_embd, n_batch]
 };
@@ -101,6 +111,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) override;
+
     lm_ggml_tensor * pos = nullptr; // I32 [n_batch]
 
     const uint32_t n_pos_per_embd = 1;
@@ -115,6 +127,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) override;
+
     lm_ggml_tensor * attn_scale = nullptr; // F32 [n_batch]
 
     const uint32_t n_attn_temp_floor_scale;
@@ -159,6 +173,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) override;
+
     lm_ggml_tensor * out_ids; // I32 [n_outputs]
 
     const llama_hparams & hparams;
@@ -249,14 +265,23 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) override;
+
     lm_ggml_tensor * get_k_idxs() const { return self_k_idxs; }
     lm_ggml_tensor * get_v_idxs() const { return self_v_idxs; }
 
+    lm_ggml_tensor * get_recent_idxs() const { return self_recent_idxs; }
+    lm_ggml_tensor * get_kv_recent()   const { return self_kv_recent; }
+
     lm_ggml_tensor * get_kq_mask() const { return self_kq_mask_cnv; }
 
     lm_ggml_tensor * self_k_idxs = nullptr; // I64 [n_batch]
     lm_ggml_tensor * self_v_idxs = nullptr; // I64 [n_batch]
 
+    // F16 copies of the recent cells, nullptr if the cache has none
+    lm_ggml_tensor * self_recent_idxs = nullptr; // I64 [n_batch]
+    lm_ggml_tensor * self_kv_recent   = nullptr; // I32 [n_kv]
+
     lm_ggml_tensor * self_kq_mask     = nullptr; // F32 [n_kv, n_batch, 1, 1]
     lm_ggml_tensor * self_kq_mask_cnv = nullptr; //     [n_kv, n_batch, 1, 1]
 
@@ -280,11 +305,18 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) override;
+
     lm_ggml_tensor * get_k_idxs()     const { return self_k_idxs; }
     lm_ggml_tensor * get_v_idxs()     const { return self_v_idxs; }
     lm_ggml_tensor * get_k_idxs_swa() const { return self_k_idxs_swa; }
     lm_ggml_tensor * get_v_idxs_swa() const { return self_v_idxs_swa; }
 
+    lm_ggml_tensor * get_recent_idxs()     const { return self_recent_idxs; }
+    lm_ggml_tensor * get_kv_recent()       const { return self_kv_recent; }
+    lm_ggml_tensor * get_recent_idxs_swa() const { return self_recent_idxs_swa; }
+    lm_ggml_tensor * get_kv_recent_swa()   const { return self_kv_recent_swa; }
+
     lm_ggml_tensor * get_kq_mask()     const { return self_kq_mask_cnv; }
     lm_ggml_tensor * get_kq_mask_swa() const { return self_kq_mask_swa_cnv; }
 
@@ -293,6 +325,12 @@ public:
     lm_ggml_tensor * self_k_idxs_swa = nullptr; // I64 [n_batch]
     lm_ggml_tensor * self_v_idxs_swa = nullptr; // I64 [n_batch]
 
+    // F16 copies of the recent cells, nullptr if the cache has none
+    lm_ggml_tensor * self_recent_idxs     = nullptr; // I64 [n_batch]
+    lm_ggml_tensor * self_kv_recent       = nullptr; // I32 [n_kv]
+    lm_ggml_tensor * self_recent_idxs_swa = nullptr; // I64 [n_batch]
+    lm_ggml_tensor * self_kv_recent_swa   = nullptr; // I32 [n_kv]
+
     lm_ggml_tensor * self_kq_mask         = nullptr; // F32 [n_kv, n_batch, 1, 1]
     lm_ggml_tensor * self_kq_mask_cnv     = nullptr; //     [n_kv, n_batch, 1, 1]
     lm_ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch, 1, 1]
@@ -360,9 +398,36 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) override {
+        LM_GGML_UNUSED(ubatch);
+        LM_GGML_UNUSED(mctx);
+        return true;
+    }
+
     lm_ggml_tensor * one = nullptr; // F32
 };
 
+// per-token scales of the adapters set for single sequences, the tokens of other sequences get 0
+class llm_graph_input_lora_seq : public llm_graph_input_i {
+public:
+    llm_graph_input_lora_seq(const llama_adapter_loras_seq & loras_seq, int32_t n_outputs);
+    virtual ~llm_graph_input_lora_seq() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx) override;
+
+    std::vector<llama_adapter_lora *> adapters;
+
+    // created on first use
+    std::vector<lm_ggml_tensor *> scale;     // F32 [n_batch] per adapter
+    std::vector<lm_ggml_tensor *> scale_out; // F32 [n_outputs] per adapter
+
+    const llama_adapter_loras_seq & loras_seq;
+
+    const int32_t n_outputs;
+};
+
 //
 // llm_graph_result
 //
@@ -383,6 +448,9 @@ public:
     virtual lm_ggml_tensor * get_embd_pooled() = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
+
+    // check if the graph can be evaluated again for the new ubatch by only setting its inputs
+    virtual bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx, uint32_t n_outputs) = 0;
 };
 
 using llm_graph_result_ptr = std::unique_ptr<llm_graph_result_i>;
@@ -403,6 +471,8 @@ public:
         }
     }
 
+    bool can_reuse(const llama_ubatch & ubatch, const llama_memory_context_i * mctx, uint32_t n_outputs) override;
+
     llm_graph_input_i * add_input(llm_graph_input_ptr input) {
         inputs.emplace_back(std::move(input));
         return inputs.back().get();
@@ -415,6 +485,13 @@ public:
     lm_ggml_tensor * t_embd_pooled = nullptr;
 
     std::vector<llm_graph_input_ptr> inputs;
+
+    // ubatch shape the graph was built for
+    uint32_t n_tokens     = 0;
+    uint32_t n_seq_tokens = 0;
+    uint32_t n_seqs       = 0;
+    uint32_t n_outputs    = 0;
+    bool     equal_seqs   = false;
 };
 
 //
@@ -438,6 +515,7 @@ struct llm_graph_params {
 
     const llama_adapter_cvec     * cvec;
     const llama_adapter_loras    * loras;
+    const llama_adapter_loras_seq * loras_seq;
     const llama_memory_context_i * mctx;
     const llama_cross            * cross;
 
@@ -493,6 +571,7 @@ struct llm_graph_context {
 
     const llama_adapter_cvec     * cvec;
     const llama_adapter_loras    * loras;
+    const llama_adapter_loras_seq * loras_seq;
     const llama_memory_context_i * mctx;
     const llama_cross            * cross;
 
@@ -500,6 +579,9 @@ struct llm_graph_context {
 
     std::unique_ptr<llm_graph_result> res;
 
+    // set when some sequence has its own adapters
+    llm_graph_input_lora_seq * inp_lora_seq = nullptr;
+
     llm_graph_context(const llm_graph_params & params);
     virtual ~llm_graph_context() = default;
 
@@ -518,6 +600,13 @@ struct llm_graph_context {
               lm_ggml_tensor * w,
               lm_ggml_tensor * cur) const;
 
+    // per-token scale of the ia-th sequence adapter, shaped to broadcast over the rows of cur
+    // with expert_dim, cur is [n, n_expert_used, n_tokens] and the scale is shared by the experts of a token
+    lm_ggml_tensor * build_lora_seq_scale(
+              size_t   ia,
+              lm_ggml_tensor * cur,
+                bool   expert_dim) const;
+
     // do mat_mul_id, while optionally apply lora
     lm_ggml_tensor * build_lora_mm_id(
               lm_ggml_tensor * w,   // lm_ggml_tensor * as
@@ -593,6 +682,9 @@ struct llm_graph_context {
              lm_ggml_tensor * kq_b,
              lm_ggml_tensor * kq_mask,
              lm_ggml_tensor * v_mla,   // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
+             lm_ggml_tensor * k_recent,  // [n_embd_head_k, n_head_k, n_recent], F16 copies of some cells of k
+             lm_ggml_tensor * v_recent,  // [n_embd_head_v, n_head_v, n_recent]
+             lm_ggml_tensor * kv_recent, // [n_kv], the k_recent/v_recent row of each cell or -1
                    float   kq_scale) const;
 
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
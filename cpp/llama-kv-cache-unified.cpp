@@ -27,12 +27,29 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                  uint32_t    n_seq_max,
                  uint32_t    n_pad,
                  uint32_t    n_swa,
-           llama_swa_type    swa_type) :
+           llama_swa_type    swa_type,
+                 uint32_t    n_recent) :
     model(model), hparams(model.hparams), v_trans(v_trans),
     n_seq_max(n_seq_max), n_pad(n_pad), n_swa(n_swa), swa_type(swa_type) {
 
     LM_GGML_ASSERT(kv_size % n_pad == 0);
 
+    const char * LLAMA_SET_ROWS = getenv("LLAMA_SET_ROWS");
+    supports_set_rows = LLAMA_SET_ROWS ? atoi(LLAMA_SET_ROWS) : 1;
+
+    // the F16 copies of the recent cells are only read by the CPU flash attention, from a quantized cache
+    if (n_recent > 0) {
+        const bool quantized = lm_ggml_is_quantized(type_k) || lm_ggml_is_quantized(type_v);
+
+        if (offload || v_trans || !supports_set_rows || !quantized) {
+            LLAMA_LOG_WARN("%s: the F16 copies of the recent cells need a quantized CPU cache with flash attention, disabling them\n", __func__);
+            n_recent = 0;
+        }
+    }
+
+    this->n_recent = std::min(n_recent, kv_size);
+    recent_cells.assign(this->n_recent, -1);
+
     // TODO: this is temporary until we support passing reuse layer filters [KV_REUSE]
     auto n_layer_cache = hparams.n_layer;
     if (model.arch == LLM_ARCH_GEMMA3N) {
@@ -45,7 +62,7 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         auto it = ctx_map.find(buft);
         if (it == ctx_map.end()) {
             lm_ggml_init_params params = {
-                /*.mem_size   =*/ size_t(2u*n_layer_cache*lm_ggml_tensor_overhead()),
+                /*.mem_size   =*/ size_t(4u*n_layer_cache*lm_ggml_tensor_overhead()),
                 /*.mem_buffer =*/ NULL,
                 /*.no_alloc   =*/ true,
             };
@@ -104,8 +121,19 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         lm_ggml_format_name(k, "cache_k_l%d", il);
         lm_ggml_format_name(v, "cache_v_l%d", il);
 
+        lm_ggml_tensor * k_recent = nullptr;
+        lm_ggml_tensor * v_recent = nullptr;
+
+        if (this->n_recent > 0) {
+            k_recent = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd_k_gqa, this->n_recent + 1);
+            v_recent = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd_v_gqa, this->n_recent + 1);
+
+            lm_ggml_format_name(k_recent, "cache_k_recent_l%d", il);
+            lm_ggml_format_name(v_recent, "cache_v_recent_l%d", il);
+        }
+
         map_layer_ids[il] = layers.size();
-        layers.push_back({ il, k, v });
+        layers.push_back({ il, k, v, k_recent, v_recent });
     }
 
     // TODO: this is temporary until we support passing reuse layer filters [KV_REUSE]
@@ -152,14 +180,15 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                 (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f), kv_size, (int) layers.size(), n_seq_max,
                 lm_ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
                 lm_ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+
+        if (this->n_recent > 0) {
+            LLAMA_LOG_INFO("%s: the last %u stored cells are also kept in F16\n", __func__, this->n_recent);
+        }
     }
 
     const char * LLAMA_KV_CACHE_DEBUG = getenv("LLAMA_KV_CACHE_DEBUG");
     debug = LLAMA_KV_CACHE_DEBUG ? atoi(LLAMA_KV_CACHE_DEBUG) : 0;
 
-    const char * LLAMA_SET_ROWS = getenv("LLAMA_SET_ROWS");
-    supports_set_rows = LLAMA_SET_ROWS ? atoi(LLAMA_SET_ROWS) : 0;
-
     if (!supports_set_rows) {
         LLAMA_LOG_WARN("%s: LLAMA_SET_ROWS=0, using old lm_ggml_cpy() method for backwards compatibility\n", __func__);
     }
@@ -168,6 +197,8 @@ llama_kv_cache_unified::llama_kv_cache_unified(
 void llama_kv_cache_unified::clear(bool data) {
     cells.reset();
 
+    std::fill(recent_cells.begin(), recent_cells.end(), -1);
+
     head = 0;
 
     if (data) {
@@ -428,6 +459,8 @@ llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const st
     // remember the old state of the cells so we can restore it in the end
     std::vector<state> states;
 
+    const std::vector<int32_t> recent_cells_old = recent_cells;
+
     bool success = true;
 
     for (const auto & ubatch : ubatches) {
@@ -457,6 +490,8 @@ llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const st
         head = it->head_old;
     }
 
+    recent_cells = recent_cells_old;
+
     if (!success) {
         return {};
     }
@@ -504,6 +539,9 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
         }
 
         cells.reset_shift();
+
+        // the F16 copies still hold the unshifted K
+        std::fill(recent_cells.begin(), recent_cells.end(), -1);
     }
 
     if (!dinfo.empty()) {
@@ -525,6 +563,8 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
 
             // reset the head so we can find the first free slot during the next ubatch
             head = 0;
+
+            std::fill(recent_cells.begin(), recent_cells.end(), -1);
         }
 
         lm_ggml_backend_sched_reset(sched);
@@ -742,6 +782,11 @@ void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_u
         for (int32_t s = 0; s < ubatch.n_seq_id[i]; s++) {
             cells.seq_add(idx, ubatch.seq_id[i][s]);
         }
+
+        // the last store into a row of the F16 copies wins
+        if (n_recent > 0) {
+            recent_cells[idx % n_recent] = idx;
+        }
     }
 
     // note: we want to preserve the invariant that all positions between [pos_min, pos_max] for each sequence
@@ -776,6 +821,10 @@ bool llama_kv_cache_unified::get_has_shift() const {
     return cells.get_has_shift();
 }
 
+bool llama_kv_cache_unified::get_supports_set_rows() const {
+    return supports_set_rows;
+}
+
 uint32_t llama_kv_cache_unified::get_n_kv() const {
     return std::min(cells.size(), std::max(n_pad, LM_GGML_PAD(cells.used_max_p1(), n_pad)));
 }
@@ -814,6 +863,63 @@ lm_ggml_tensor * llama_kv_cache_unified::get_v(lm_ggml_context * ctx, int32_t il
             0);
 }
 
+lm_ggml_tensor * llama_kv_cache_unified::get_k_recent(lm_ggml_context * ctx, int32_t il) const {
+    const int32_t ikv = map_layer_ids.at(il);
+
+    auto * k = layers[ikv].k_recent;
+    if (!k) {
+        return nullptr;
+    }
+
+    // the last row only takes the replaced stores
+    return lm_ggml_view_3d(ctx, k,
+            hparams.n_embd_head_k, hparams.n_head_kv(il), n_recent,
+            lm_ggml_row_size(k->type, hparams.n_embd_head_k),
+            lm_ggml_row_size(k->type, hparams.n_embd_k_gqa(il)),
+            0);
+}
+
+lm_ggml_tensor * llama_kv_cache_unified::get_v_recent(lm_ggml_context * ctx, int32_t il) const {
+    const int32_t ikv = map_layer_ids.at(il);
+
+    auto * v = layers[ikv].v_recent;
+    if (!v) {
+        return nullptr;
+    }
+
+    return lm_ggml_view_3d(ctx, v,
+            hparams.n_embd_head_v, hparams.n_head_kv(il), n_recent,
+            lm_ggml_row_size(v->type, hparams.n_embd_head_v),
+            lm_ggml_row_size(v->type, hparams.n_embd_v_gqa(il)),
+            0);
+}
+
+lm_ggml_tensor * llama_kv_cache_unified::cpy_k_recent(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, lm_ggml_tensor * recent_idxs, int32_t il) const {
+    const int32_t ikv = map_layer_ids.at(il);
+
+    auto * k = layers[ikv].k_recent;
+    if (!k || !recent_idxs) {
+        return nullptr;
+    }
+
+    k_cur = lm_ggml_reshape_2d(ctx, k_cur, k->ne[0], k_cur->ne[2]);
+
+    return lm_ggml_set_rows(ctx, k, k_cur, recent_idxs);
+}
+
+lm_ggml_tensor * llama_kv_cache_unified::cpy_v_recent(lm_ggml_context * ctx, lm_ggml_tensor * v_cur, lm_ggml_tensor * recent_idxs, int32_t il) const {
+    const int32_t ikv = map_layer_ids.at(il);
+
+    auto * v = layers[ikv].v_recent;
+    if (!v || !recent_idxs) {
+        return nullptr;
+    }
+
+    v_cur = lm_ggml_reshape_2d(ctx, v_cur, v->ne[0], v_cur->ne[2]);
+
+    return lm_ggml_set_rows(ctx, v, v_cur, recent_idxs);
+}
+
 lm_ggml_tensor * llama_kv_cache_unified::cpy_k(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, lm_ggml_tensor * k_idxs, int32_t il, const slot_info & sinfo) const {
     const int32_t ikv = map_layer_ids.at(il);
 
@@ -911,6 +1017,32 @@ lm_ggml_tensor * llama_kv_cache_unified::build_input_v_idxs(lm_ggml_context * ct
     return v_idxs;
 }
 
+lm_ggml_tensor * llama_kv_cache_unified::build_input_recent_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const {
+    if (n_recent == 0) {
+        return nullptr;
+    }
+
+    const uint32_t n_tokens = ubatch.n_tokens;
+
+    lm_ggml_tensor * recent_idxs = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_I64, n_tokens);
+
+    lm_ggml_set_input(recent_idxs);
+
+    return recent_idxs;
+}
+
+lm_ggml_tensor * llama_kv_cache_unified::build_input_kv_recent(lm_ggml_context * ctx, uint32_t n_kv) const {
+    if (n_recent == 0) {
+        return nullptr;
+    }
+
+    lm_ggml_tensor * kv_recent = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_I32, n_kv);
+
+    lm_ggml_set_input(kv_recent);
+
+    return kv_recent;
+}
+
 void llama_kv_cache_unified::set_input_k_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const {
     if (!supports_set_rows) {
         return;
@@ -941,6 +1073,37 @@ void llama_kv_cache_unified::set_input_v_idxs(lm_ggml_tensor * dst, const llama_
     }
 }
 
+void llama_kv_cache_unified::set_input_recent_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const {
+    const uint32_t n_tokens = ubatch->n_tokens;
+
+    LM_GGML_ASSERT(lm_ggml_backend_buffer_is_host(dst->buffer));
+    int64_t * data = (int64_t *) dst->data;
+
+    // the ubatch has already been applied, so a cell replaced within it goes to the spare row
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        const int32_t idx = sinfo.idxs.at(i);
+
+        data[i] = recent_cells[idx % n_recent] == idx ? idx % n_recent : n_recent;
+    }
+}
+
+void llama_kv_cache_unified::set_input_kv_recent(lm_ggml_tensor * dst) const {
+    LM_GGML_ASSERT(lm_ggml_backend_buffer_is_host(dst->buffer));
+    int32_t * data = (int32_t *) dst->data;
+
+    const int64_t n_kv = dst->ne[0];
+
+    std::fill(data, data + n_kv, -1);
+
+    for (uint32_t s = 0; s < n_recent; ++s) {
+        const int32_t idx = recent_cells[s];
+
+        if (idx >= 0 && idx < n_kv && !cells.is_empty(idx)) {
+            data[idx] = s;
+        }
+    }
+}
+
 void llama_kv_cache_unified::set_input_kq_mask(lm_ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
     const uint32_t n_tokens = ubatch->n_tokens;
 
@@ -1057,6 +1220,10 @@ size_t llama_kv_cache_unified::size_k_bytes() const {
 
     for (const auto & layer : layers) {
         size_k_bytes += lm_ggml_nbytes(layer.k);
+
+        if (layer.k_recent) {
+            size_k_bytes += lm_ggml_nbytes(layer.k_recent);
+        }
     }
 
     return size_k_bytes;
@@ -1067,6 +1234,10 @@ size_t llama_kv_cache_unified::size_v_bytes() const {
 
     for (const auto & layer : layers) {
         size_v_bytes += lm_ggml_nbytes(layer.v);
+
+        if (layer.v_recent) {
+            size_v_bytes += lm_ggml_nbytes(layer.v_recent);
+        }
     }
 
     return size_v_bytes;
@@ -1524,6 +1695,9 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
     res = res && state_read_meta(io, cell_count, seq_id);
     res = res && state_read_data(io, cell_count);
 
+    // the restored cells have no F16 copies
+    std::fill(recent_cells.begin(), recent_cells.end(), -1);
+
     if (!res) {
         if (seq_id == -1) {
             clear(true);
@@ -1940,6 +2114,10 @@ uint32_t llama_kv_cache_unified_context::get_n_kv() const {
     return n_kv;
 }
 
+bool llama_kv_cache_unified_context::get_supports_set_rows() const {
+    return kv->get_supports_set_rows();
+}
+
 lm_ggml_tensor * llama_kv_cache_unified_context::get_k(lm_ggml_context * ctx, int32_t il) const {
     return kv->get_k(ctx, il, n_kv);
 }
@@ -1956,6 +2134,22 @@ lm_ggml_tensor * llama_kv_cache_unified_context::cpy_v(lm_ggml_context * ctx, lm
     return kv->cpy_v(ctx, v_cur, v_idxs, il, sinfos[i_cur]);
 }
 
+lm_ggml_tensor * llama_kv_cache_unified_context::get_k_recent(lm_ggml_context * ctx, int32_t il) const {
+    return kv->get_k_recent(ctx, il);
+}
+
+lm_ggml_tensor * llama_kv_cache_unified_context::get_v_recent(lm_ggml_context * ctx, int32_t il) const {
+    return kv->get_v_recent(ctx, il);
+}
+
+lm_ggml_tensor * llama_kv_cache_unified_context::cpy_k_recent(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, lm_ggml_tensor * recent_idxs, int32_t il) const {
+    return kv->cpy_k_recent(ctx, k_cur, recent_idxs, il);
+}
+
+lm_ggml_tensor * llama_kv_cache_unified_context::cpy_v_recent(lm_ggml_context * ctx, lm_ggml_tensor * v_cur, lm_ggml_tensor * recent_idxs, int32_t il) const {
+    return kv->cpy_v_recent(ctx, v_cur, recent_idxs, il);
+}
+
 lm_ggml_tensor * llama_kv_cache_unified_context::build_input_k_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const {
     return kv->build_input_k_idxs(ctx, ubatch);
 }
@@ -1964,6 +2158,14 @@ lm_ggml_tensor * llama_kv_cache_unified_context::build_input_v_idxs(lm_ggml_cont
     return kv->build_input_v_idxs(ctx, ubatch);
 }
 
+lm_ggml_tensor * llama_kv_cache_unified_context::build_input_recent_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const {
+    return kv->build_input_recent_idxs(ctx, ubatch);
+}
+
+lm_ggml_tensor * llama_kv_cache_unified_context::build_input_kv_recent(lm_ggml_context * ctx) const {
+    return kv->build_input_kv_recent(ctx, n_kv);
+}
+
 void llama_kv_cache_unified_context::set_input_k_shift(lm_ggml_tensor * dst) const {
     kv->set_input_k_shift(dst);
 }
@@ -1976,6 +2178,14 @@ void llama_kv_cache_unified_context::set_input_v_idxs(lm_ggml_tensor * dst, cons
     kv->set_input_v_idxs(dst, ubatch, sinfos[i_cur]);
 }
 
+void llama_kv_cache_unified_context::set_input_recent_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch) const {
+    kv->set_input_recent_idxs(dst, ubatch, sinfos[i_cur]);
+}
+
+void llama_kv_cache_unified_context::set_input_kv_recent(lm_ggml_tensor * dst) const {
+    kv->set_input_kv_recent(dst);
+}
+
 void llama_kv_cache_unified_context::set_input_kq_mask(lm_ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
     kv->set_input_kq_mask(dst, ubatch, causal_attn);
 }
@@ -72,7 +72,8 @@ public:
                      uint32_t    n_seq_max,
                      uint32_t    n_pad,
                      uint32_t    n_swa,
-               llama_swa_type    swa_type);
+               llama_swa_type    swa_type,
+                     uint32_t    n_recent);
 
     ~llama_kv_cache_unified() = default;
 
@@ -115,6 +116,9 @@ public:
 
     bool get_has_shift() const;
 
+    // true if the KV stores are built with lm_ggml_set_rows() and do not depend on the slot head
+    bool get_supports_set_rows() const;
+
     //
     // graph_build API
     //
@@ -129,6 +133,14 @@ public:
     lm_ggml_tensor * cpy_k(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, lm_ggml_tensor * k_idxs, int32_t il, const slot_info & sinfo) const;
     lm_ggml_tensor * cpy_v(lm_ggml_context * ctx, lm_ggml_tensor * v_cur, lm_ggml_tensor * v_idxs, int32_t il, const slot_info & sinfo) const;
 
+    // the F16 copies of the recently stored cells, nullptr if the layer has none
+    // cell i is kept in row i % n_recent, as long as no later cell has replaced it there
+    lm_ggml_tensor * get_k_recent(lm_ggml_context * ctx, int32_t il) const;
+    lm_ggml_tensor * get_v_recent(lm_ggml_context * ctx, int32_t il) const;
+
+    lm_ggml_tensor * cpy_k_recent(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, lm_ggml_tensor * recent_idxs, int32_t il) const;
+    lm_ggml_tensor * cpy_v_recent(lm_ggml_context * ctx, lm_ggml_tensor * v_cur, lm_ggml_tensor * recent_idxs, int32_t il) const;
+
     //
     // preparation API
     //
@@ -154,9 +166,16 @@ public:
     lm_ggml_tensor * build_input_k_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const;
     lm_ggml_tensor * build_input_v_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const;
 
+    // nullptr if there are no F16 copies of the recent cells
+    lm_ggml_tensor * build_input_recent_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const;
+    lm_ggml_tensor * build_input_kv_recent  (lm_ggml_context * ctx, uint32_t n_kv) const;
+
     void set_input_k_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const;
     void set_input_v_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const;
 
+    void set_input_recent_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const;
+    void set_input_kv_recent  (lm_ggml_tensor * dst) const;
+
     void set_input_kq_mask   (lm_ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_k_shift   (lm_ggml_tensor * dst) const;
     void set_input_pos_bucket(lm_ggml_tensor * dst, const llama_ubatch * ubatch) const;
@@ -172,6 +191,11 @@ private:
 
         lm_ggml_tensor * k;
         lm_ggml_tensor * v;
+
+        // F16 copies of the recent cells, [n_embd_gqa, n_recent + 1]
+        // the last row takes the stores of cells replaced within the same ubatch and is never read
+        lm_ggml_tensor * k_recent;
+        lm_ggml_tensor * v_recent;
     };
 
     bool v_trans = true;  // the value tensor is transposed
@@ -188,6 +212,13 @@ private:
     // SWA
     const uint32_t n_swa = 0;
 
+    // number of cells with an F16 copy, 0 = disabled
+    uint32_t n_recent = 0;
+
+    // the cell held by each row of the F16 copies, -1 if none
+    // the copies are not rewritten by the K-shift, the defrag and the state read, these reset it
+    std::vector<int32_t> recent_cells;
+
     // env: LLAMA_KV_CACHE_DEBUG
     int debug = 0;
 
@@ -288,6 +319,8 @@ public:
 
     uint32_t get_n_kv() const;
 
+    bool get_supports_set_rows() const;
+
     // get views of the current state of the cache
     lm_ggml_tensor * get_k(lm_ggml_context * ctx, int32_t il) const;
     lm_ggml_tensor * get_v(lm_ggml_context * ctx, int32_t il) const;
@@ -296,12 +329,25 @@ public:
     lm_ggml_tensor * cpy_k(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, lm_ggml_tensor * k_idxs, int32_t il) const;
     lm_ggml_tensor * cpy_v(lm_ggml_context * ctx, lm_ggml_tensor * v_cur, lm_ggml_tensor * v_idxs, int32_t il) const;
 
+    // the F16 copies of the recent cells, nullptr if the layer has none
+    lm_ggml_tensor * get_k_recent(lm_ggml_context * ctx, int32_t il) const;
+    lm_ggml_tensor * get_v_recent(lm_ggml_context * ctx, int32_t il) const;
+
+    lm_ggml_tensor * cpy_k_recent(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, lm_ggml_tensor * recent_idxs, int32_t il) const;
+    lm_ggml_tensor * cpy_v_recent(lm_ggml_context * ctx, lm_ggml_tensor * v_cur, lm_ggml_tensor * recent_idxs, int32_t il) const;
+
     lm_ggml_tensor * build_input_k_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const;
     lm_ggml_tensor * build_input_v_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const;
 
+    lm_ggml_tensor * build_input_recent_idxs(lm_ggml_context * ctx, const llama_ubatch & ubatch) const;
+    lm_ggml_tensor * build_input_kv_recent  (lm_ggml_context * ctx) const;
+
     void set_input_k_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch) const;
     void set_input_v_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
+    void set_input_recent_idxs(lm_ggml_tensor * dst, const llama_ubatch * ubatch) const;
+    void set_input_kv_recent  (lm_ggml_tensor * dst) const;
+
     void set_input_k_shift   (lm_ggml_tensor * dst) const;
     void set_input_kq_mask   (lm_ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_pos_bucket(lm_ggml_tensor * dst, const llama_ubatch * ubatch) const;
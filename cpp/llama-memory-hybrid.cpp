@@ -42,7 +42,8 @@ llama_memory_hybrid::llama_memory_hybrid(
         n_seq_max,
         n_pad,
         n_swa,
-        swa_type
+        swa_type,
+        0
     )),
     mem_recr(new llama_memory_recurrent(
         model,
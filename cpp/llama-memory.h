@@ -16,6 +16,9 @@ struct llama_memory_params {
     lm_ggml_type type_k;
     lm_ggml_type type_v;
 
+    // cells also kept in F16 for the flash attention, 0 = disabled
+    uint32_t n_recent;
+
     // use full-size SWA cache
     bool swa_full;
 };
@@ -843,6 +843,7 @@ void llama_model_loader::done_getting_tensors() const {
 }
 
 void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps) {
+    this->prefetch = prefetch;
     if (use_mmap) {
         mappings.reserve(files.size());
         mmaps_used.reserve(files.size());
@@ -1023,7 +1024,13 @@ bool llama_model_loader::load_all_data(
         }
 
         if (progress_callback) {
-            if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+            // lazy mapping makes each tensor nearly free, report once per layer instead
+            int il = -1;
+            const bool report = prefetch || sscanf(lm_ggml_get_name(cur), "blk.%d.", &il) != 1 || il != il_done;
+            if (il >= 0) {
+                il_done = il;
+            }
+            if (report && !progress_callback((float) size_done / size_data, progress_callback_user_data)) {
                 return false;
             }
         }
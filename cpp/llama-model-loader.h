@@ -89,6 +89,8 @@ struct llama_model_loader {
 
     size_t size_done = 0;
     size_t size_data = 0;
+    bool   prefetch  = true; // false: lazy load, progress is reported per layer
+    int    il_done   = -1;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
     llama_model_loader(
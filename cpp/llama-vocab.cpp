@@ -8,6 +8,7 @@
 #include "unicode.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
@@ -16,8 +17,10 @@
 #include <forward_list>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <thread>
 #include <unordered_map>
 
 //
@@ -256,6 +259,11 @@ public:
         return item;
     }
 
+    // drop the elements but keep the storage for the next word
+    void clear() {
+        this->c.clear();
+    }
+
     void pop() =  delete;
 };
 
@@ -270,11 +278,55 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
     int rank;
     size_t size;
 };
 
+// word -> tokens memo shared by all BPE sessions of a vocab
+// pre-tokenized words repeat a lot in natural text, so most of them skip the merge loop entirely
+struct llm_bpe_cache {
+    static constexpr size_t n_shards     = 16;
+    static constexpr size_t max_words    = 4096; // per shard, the shard is reset when full
+    static constexpr size_t max_word_len = 64;
+
+    bool find(const std::string & word, std::vector<llama_token> & output) {
+        auto & s = shard(word);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.words.find(word);
+        if (it == s.words.end()) {
+            return false;
+        }
+        output.insert(output.end(), it->second.begin(), it->second.end());
+        return true;
+    }
+
+    void insert(const std::string & word, const llama_token * tokens, size_t n_tokens) {
+        auto & s = shard(word);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.words.size() >= max_words) {
+            s.words.clear();
+        }
+        s.words.emplace(word, std::vector<llama_token>(tokens, tokens + n_tokens));
+    }
+
+private:
+    struct cache_shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::vector<llama_token>> words;
+    };
+
+    cache_shard & shard(const std::string & word) {
+        // use a different hash than the map so that the shards do not skew its buckets
+        uint32_t h = 2166136261u;
+        for (const char c : word) {
+            h = (h ^ (uint8_t) c) * 16777619u;
+        }
+        return shards[h % n_shards];
+    }
+
+    cache_shard shards[n_shards];
+};
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) {
         LM_GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
@@ -441,7 +493,8 @@ struct llm_tokenizer_bpe : llm_tokenizer {
 };
 
 struct llm_tokenizer_bpe_session {
-    llm_tokenizer_bpe_session(const llama_vocab & vocab, const llm_tokenizer_bpe & tokenizer) : vocab(vocab), tokenizer(tokenizer) {}
+    llm_tokenizer_bpe_session(const llama_vocab & vocab, const llm_tokenizer_bpe & tokenizer, llm_bpe_cache * cache = nullptr, int n_threads = 1)
+        : vocab(vocab), tokenizer(tokenizer), cache(cache), n_threads(n_threads) {}
 
     static void append(const llama_token token_id, std::vector<llama_token> & output)  {
         output.push_back(token_id);
@@ -480,109 +533,148 @@ struct llm_tokenizer_bpe_session {
         }
     }
 
+    // texts with fewer pre-tokenized words than this are merged on the calling thread
+    static constexpr size_t n_words_parallel = 2048;
+
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
-        for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+        // words are merged independently, so long texts are cut into contiguous word ranges that are
+        // tokenized on worker sessions (each with its own symbol and queue storage) and then
+        // concatenated in order - the output is identical to the single-threaded one
+        const size_t n_words = word_collection.size();
+        const int n_workers = (int) std::min<size_t>(std::max(n_threads, 1), n_words / (n_words_parallel / 2));
+        if (n_workers <= 1 || n_words < n_words_parallel) {
+            for (const auto & word : word_collection) {
+                tokenize_word(word, output);
+            }
+            return;
+        }
 
-            int index = 0;
-            size_t offset = 0;
+        const size_t n_chunks = 4 * (size_t) n_workers;
+        std::vector<std::vector<llama_token>> chunk_output(n_chunks);
+        std::atomic<size_t> next_chunk{0};
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+        auto worker = [&](llm_tokenizer_bpe_session & session) {
+            for (size_t i = next_chunk++; i < n_chunks; i = next_chunk++) {
+                const size_t i0 = n_words * i / n_chunks;
+                const size_t i1 = n_words * (i + 1) / n_chunks;
+                chunk_output[i].reserve(i1 - i0);
+                for (size_t j = i0; j < i1; ++j) {
+                    session.tokenize_word(word_collection[j], chunk_output[i]);
+                }
             }
+        };
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
+        std::vector<std::thread> workers;
+        workers.reserve(n_workers - 1);
+        for (int i = 1; i < n_workers; ++i) {
+            workers.emplace_back([&]() {
+                llm_tokenizer_bpe_session session(vocab, tokenizer, cache);
+                worker(session);
+            });
+        }
+        worker(*this);
+        for (auto & t : workers) {
+            t.join();
+        }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        size_t n_tokens = output.size();
+        for (const auto & chunk : chunk_output) {
+            n_tokens += chunk.size();
+        }
+        output.reserve(n_tokens);
+        for (const auto & chunk : chunk_output) {
+            output.insert(output.end(), chunk.begin(), chunk.end());
+        }
+    }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        const bool use_cache = cache && word.size() <= llm_bpe_cache::max_word_len;
+        if (use_cache && cache->find(word, output)) {
+            return;
+        }
+        const size_t n_output = output.size();
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        work_queue.clear();
+        symbols.clear();
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        int index = 0;
+        size_t offset = 0;
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            offset = word.size();
+        }
+
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
+
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
+
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // the symbols of a word are contiguous, so the pair still spells the bigram text
+            // exactly when neither side has been merged with something else since it was queued
+            if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.n + right_symbol.n != bigram.size) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        // merged symbols keep their order in the vector, so the finished tokens are the non-empty ones
+        for (const auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            token_text.assign(symbol.text, symbol.n);
+            const auto token = vocab.text_to_token(token_text);
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
+            if (token == LLAMA_TOKEN_NULL) {
+                for (auto j = token_text.begin(); j != token_text.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.text_to_token(byte_str);
+                    if (token_multibyte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back(token);
                 }
+            } else {
+                output.push_back(token);
             }
         }
+
+        if (use_cache) {
+            cache->insert(word, output.data() + n_output, output.size() - n_output);
+        }
     }
 
 private:
@@ -590,8 +682,8 @@ private:
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+        left_token.assign(symbols[left].text,  symbols[left].n);
+        right_token.assign(symbols[right].text, symbols[right].n);
 
         int rank_found = -1;
 
@@ -605,7 +697,6 @@ private:
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
         bigram.size  = left_token.size() + right_token.size();
         bigram.rank  = rank_found;
 
@@ -615,9 +706,15 @@ private:
     const llama_vocab & vocab;
     const llm_tokenizer_bpe & tokenizer;
 
+    llm_bpe_cache * cache;
+    const int n_threads;
+
+    // per-session scratch, reused across words
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
+    std::string left_token;
+    std::string right_token;
+    std::string token_text;
 };
 
 //
@@ -1290,6 +1387,11 @@ struct llama_vocab::impl {
     };
     std::unordered_map<std::pair<std::string, std::string>, int, pair_hash> bpe_ranks;
 
+    // memo of pre-tokenized words for the BPE tokenizer
+    mutable llm_bpe_cache bpe_cache;
+
+    std::atomic<int32_t> n_threads{1};
+
     // set of all tokens that cause "end of generation"
     std::set<llama_token> special_eog_ids;
 
@@ -2470,7 +2572,7 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
             } break;
         case LLAMA_VOCAB_TYPE_BPE:
             {
-                llm_tokenizer_bpe_session session(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()));
+                llm_tokenizer_bpe_session session(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()), &bpe_cache, n_threads.load());
                 // it calls some other methods that are not exist in llm_tokenizer,
                 // here just cast it to bpe tokenizer object
                 if (add_special) {
@@ -3057,6 +3159,10 @@ int llama_vocab::find_bpe_rank(const std::string & token_left, const std::string
     return it->second;
 }
 
+void llama_vocab::set_n_threads(int32_t n_threads) const {
+    pimpl->n_threads = std::max(1, n_threads);
+}
+
 std::vector<std::string> llama_vocab::get_bpe_merges() const {
     std::vector<std::string> result(pimpl->bpe_ranks.size());
 
@@ -3359,6 +3465,10 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+void llama_vocab_set_n_threads(const struct llama_vocab * vocab, int32_t n_threads) {
+    vocab->set_n_threads(n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
@@ -88,6 +88,9 @@ struct llama_vocab {
 
     std::vector<char> get_precompiled_charsmap() const;
 
+    // threads used by tokenize() for long texts, the vocab itself is immutable so this is allowed on a const vocab
+    void set_n_threads(int32_t n_threads) const;
+
     int32_t tokenize(
                    const char * text,
                       int32_t   text_len,
@@ -1,5 +1,26 @@
 #include "rn-llama.h"
 #include "rn-tts.h"
+#include "llama-model.h"
+#include "llama-context.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+#ifdef _POSIX_MAPPED_FILES
+#include <sys/mman.h>
+#endif
 
 // Include multimodal support
 #include "tools/mtmd/mtmd.h"
@@ -83,6 +104,33 @@ static inline raw_buffer base64_decode(const std::string & encoded_string) {
     return ret;
 }
 
+std::string base64_encode(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    std::string ret;
+    ret.reserve((size + 2) / 3 * 4);
+
+    size_t i = 0;
+    for (; i + 2 < size; i += 3) {
+        const uint32_t n = (bytes[i] << 16) | (bytes[i + 1] << 8) | bytes[i + 2];
+        ret.push_back(base64_chars[(n >> 18) & 0x3f]);
+        ret.push_back(base64_chars[(n >> 12) & 0x3f]);
+        ret.push_back(base64_chars[(n >> 6) & 0x3f]);
+        ret.push_back(base64_chars[n & 0x3f]);
+    }
+    if (i < size) {
+        uint32_t n = bytes[i] << 16;
+        if (i + 1 < size) {
+            n |= bytes[i + 1] << 8;
+        }
+        ret.push_back(base64_chars[(n >> 18) & 0x3f]);
+        ret.push_back(base64_chars[(n >> 12) & 0x3f]);
+        ret.push_back(i + 1 < size ? base64_chars[(n >> 6) & 0x3f] : '=');
+        ret.push_back('=');
+    }
+
+    return ret;
+}
+
 static const std::vector<lm_ggml_type> kv_cache_types = {
     LM_GGML_TYPE_F32,
     LM_GGML_TYPE_F16,
@@ -104,6 +152,142 @@ lm_ggml_type kv_cache_type_from_str(const std::string & s) {
     throw std::runtime_error("Unsupported cache type: " + s);
 }
 
+ctx_shift_policy ctx_shift_policy_from_str(const std::string & s) {
+    if (s == "block") {
+        return CTX_SHIFT_POLICY_BLOCK;
+    }
+    if (s == "sink_window") {
+        return CTX_SHIFT_POLICY_SINK_WINDOW;
+    }
+    throw std::runtime_error("Unsupported context shift policy: " + s);
+}
+
+#if defined(__linux__)
+static long read_sysfs_long(const std::string & path) {
+    std::ifstream file(path);
+    long value = -1;
+    if (!(file >> value)) {
+        return -1;
+    }
+    return value;
+}
+#endif
+
+cpu_topology cpu_get_topology() {
+    cpu_topology topology;
+#if defined(__linux__)
+    std::vector<std::pair<long, int>> cores; // capacity, id
+    for (int cpu = 0; cpu < LM_GGML_MAX_N_THREADS; cpu++) {
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        struct stat st;
+        if (stat(dir.c_str(), &st) != 0) {
+            break;
+        }
+        if (read_sysfs_long(dir + "/online") == 0) {
+            continue;
+        }
+        // cpu_capacity is the scheduler's relative performance of the core (arm64),
+        // the highest frequency of the core is the next best hint
+        long capacity = read_sysfs_long(dir + "/cpu_capacity");
+        if (capacity <= 0) {
+            capacity = read_sysfs_long(dir + "/cpufreq/cpuinfo_max_freq");
+        }
+        if (capacity <= 0) {
+            return cpu_topology();
+        }
+        cores.push_back({capacity, cpu});
+    }
+    // the prime core usually has the highest id within its capacity
+    std::sort(cores.begin(), cores.end(), [](const std::pair<long, int> & a, const std::pair<long, int> & b) {
+        return a.first != b.first ? a.first > b.first : a.second > b.second;
+    });
+    for (const auto & core : cores) {
+        // cores under half the capacity of the fastest one are the LITTLE cluster
+        if (core.first*2 >= cores[0].first) {
+            topology.performance.push_back(core.second);
+        } else {
+            topology.efficiency.push_back(core.second);
+        }
+    }
+#elif defined(__APPLE__)
+    int n_levels = 0;
+    int n_perf = 0;
+    int n_eff = 0;
+    size_t len = sizeof(n_levels);
+    if (sysctlbyname("hw.nperflevels", &n_levels, &len, NULL, 0) == 0 && n_levels > 0) {
+        len = sizeof(n_perf);
+        sysctlbyname("hw.perflevel0.logicalcpu", &n_perf, &len, NULL, 0);
+        if (n_levels > 1) {
+            len = sizeof(n_eff);
+            sysctlbyname("hw.perflevel1.logicalcpu", &n_eff, &len, NULL, 0);
+        }
+    }
+    // no affinity on Apple platforms, the ids only count the cores
+    for (int i = 0; i < n_perf; i++) {
+        topology.performance.push_back(i);
+    }
+    for (int i = 0; i < n_eff; i++) {
+        topology.efficiency.push_back(n_perf + i);
+    }
+#endif
+    return topology;
+}
+
+void cpu_params_from_topology(common_params &params, int n_threads) {
+    // read once, the completions call this for every request
+    static const cpu_topology topology = cpu_get_topology();
+    const int n_perf = topology.performance.size();
+    const int n_eff = topology.efficiency.size();
+
+    int n_threads_decode;
+    int n_threads_batch;
+    if (n_threads > 0) {
+        n_threads_decode = n_threads;
+        n_threads_batch = n_threads;
+    } else if (n_eff == 0) {
+        // Use 2 threads by default on 4-core devices, 4 threads on more cores
+        const int max_threads = n_perf > 0 ? n_perf : std::max(1, (int) std::thread::hardware_concurrency());
+        n_threads_decode = max_threads == 4 ? 2 : std::min(4, max_threads);
+        n_threads_batch = n_threads_decode;
+    } else {
+        // Token generation is bound by memory bandwidth, which a few fast cores already saturate.
+        // Prompt processing scales with compute, so the LITTLE cores help out when there are few big ones
+        n_threads_decode = std::min(n_perf, 4);
+        n_threads_batch = n_perf < 4 ? std::min(n_perf + n_eff, 4) : n_perf;
+    }
+
+    std::vector<int> cores = topology.performance;
+    cores.insert(cores.end(), topology.efficiency.begin(), topology.efficiency.end());
+
+    // pin the threads to the fastest cores, threads left to the scheduler on a big.LITTLE CPU
+    // end up on the LITTLE cores and every other thread waits for them at the end of each node
+    auto set_cpu_params = [&](cpu_params &cpuparams, int n) {
+        cpuparams.n_threads = n;
+        cpuparams.mask_valid = false;
+        std::fill(std::begin(cpuparams.cpumask), std::end(cpuparams.cpumask), false);
+#if defined(__linux__)
+        if (n_eff > 0 && n <= (int) cores.size()) {
+            for (int i = 0; i < n; i++) {
+                cpuparams.cpumask[cores[i]] = true;
+            }
+            cpuparams.mask_valid = true;
+        }
+#endif
+    };
+    set_cpu_params(params.cpuparams, n_threads_decode);
+    set_cpu_params(params.cpuparams_batch, n_threads_batch);
+}
+
+static void free_threadpools(llama_context *ctx, lm_ggml_threadpool *&threadpool, lm_ggml_threadpool *&threadpool_batch) {
+    if (ctx != nullptr) {
+        llama_detach_threadpool(ctx);
+    }
+    lm_ggml_threadpool_free(threadpool_batch);
+    lm_ggml_threadpool_free(threadpool);
+    threadpool = nullptr;
+    threadpool_batch = nullptr;
+}
+
 static void llama_batch_clear(llama_batch *batch) {
     batch->n_tokens = 0;
 }
@@ -221,25 +405,64 @@ std::string tokens_to_output_formatted_string(const llama_context *ctx, const ll
 }
 
 std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end)
+{
+    return tokens_to_str(llama_model_get_vocab(llama_get_model(ctx)), begin, end);
+}
+
+std::string tokens_to_str(const llama_vocab *vocab, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end)
 {
     std::string ret;
     for (auto it = begin; it != end; ++it)
     {
-        ret += common_token_to_piece(ctx, *it);
+        ret += common_token_to_piece(vocab, *it);
     }
     return ret;
 }
 
 struct llama_rn_context_mtmd {
   mtmd_context *mtmd_ctx = nullptr;
+  size_t model_size = 0;
+};
+
+struct llama_rn_context_vocoder {
+    common_init_result init_result;
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
+    tts_type type = UNKNOWN;
 };
 
 llama_rn_context::~llama_rn_context() {
+    is_prefetch_stopped = true;
+    if (prefetch_thread.joinable()) {
+        prefetch_thread.join();
+    }
+
     if (ctx_sampling != nullptr) {
         common_sampler_free(ctx_sampling);
     }
+    clearSamplerPool();
 
+    releaseVectorStore();
     releaseMultimodal();
+
+    free_threadpools(ctx, threadpool, threadpool_batch);
+}
+
+static size_t lora_adapter_size(const llama_adapter_lora * adapter) {
+    size_t size = 0;
+    for (const auto &buf : adapter->bufs) {
+        size += lm_ggml_backend_buffer_get_size(buf.get());
+    }
+    return size;
+}
+
+// Abort the running graph on stopCompletion or when the completion deadline has passed
+static bool decode_abort_callback(void * data) {
+    auto * rn_ctx = static_cast<llama_rn_context *>(data);
+    if (!rn_ctx->is_predicting) {
+        return false;
+    }
+    return rn_ctx->is_interrupted || rn_ctx->isDeadlineExpired();
 }
 
 void llama_rn_context::rewind() {
@@ -257,6 +480,7 @@ void llama_rn_context::rewind() {
     stopped_eos = false;
     stopped_word = false;
     stopped_limit = false;
+    stopped_deadline = false;
     stopping_word = "";
     incomplete = false;
     n_remain = 0;
@@ -266,17 +490,131 @@ void llama_rn_context::rewind() {
     guide_tokens.clear();
 }
 
+static const size_t max_pooled_samplers = 4;
+
+template <typename T>
+static void append_key(std::string &key, const T &value) {
+    key.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void append_key(std::string &key, const std::string &value) {
+    append_key(key, value.size());
+    key += value;
+}
+
+// Every parameter that shapes a common_sampler, two samplers with the same key are interchangeable
+static std::string sampling_params_key(const common_params_sampling &sparams) {
+    std::string key;
+    key.reserve(256 + sparams.grammar.size());
+    append_key(key, sparams.seed);
+    append_key(key, sparams.n_prev);
+    append_key(key, sparams.n_probs);
+    append_key(key, sparams.min_keep);
+    append_key(key, sparams.top_k);
+    append_key(key, sparams.top_p);
+    append_key(key, sparams.min_p);
+    append_key(key, sparams.xtc_probability);
+    append_key(key, sparams.xtc_threshold);
+    append_key(key, sparams.typ_p);
+    append_key(key, sparams.temp);
+    append_key(key, sparams.dynatemp_range);
+    append_key(key, sparams.dynatemp_exponent);
+    append_key(key, sparams.penalty_last_n);
+    append_key(key, sparams.penalty_repeat);
+    append_key(key, sparams.penalty_freq);
+    append_key(key, sparams.penalty_present);
+    append_key(key, sparams.dry_multiplier);
+    append_key(key, sparams.dry_base);
+    append_key(key, sparams.dry_allowed_length);
+    append_key(key, sparams.dry_penalty_last_n);
+    append_key(key, sparams.mirostat);
+    append_key(key, sparams.top_n_sigma);
+    append_key(key, sparams.mirostat_tau);
+    append_key(key, sparams.mirostat_eta);
+    append_key(key, sparams.ignore_eos);
+    append_key(key, sparams.no_perf);
+    append_key(key, sparams.timing_per_token);
+    append_key(key, sparams.dry_sequence_breakers.size());
+    for (const auto &breaker : sparams.dry_sequence_breakers) {
+        append_key(key, breaker);
+    }
+    append_key(key, sparams.samplers.size());
+    for (const auto &type : sparams.samplers) {
+        append_key(key, type);
+    }
+    append_key(key, sparams.grammar);
+    append_key(key, sparams.grammar_lazy);
+    append_key(key, sparams.grammar_triggers.size());
+    for (const auto &trigger : sparams.grammar_triggers) {
+        append_key(key, trigger.type);
+        append_key(key, trigger.value);
+        append_key(key, trigger.token);
+    }
+    append_key(key, sparams.preserved_tokens.size());
+    for (const auto &token : sparams.preserved_tokens) {
+        append_key(key, token);
+    }
+    append_key(key, sparams.logit_bias.size());
+    for (const auto &bias : sparams.logit_bias) {
+        append_key(key, bias.token);
+        append_key(key, bias.bias);
+    }
+    return key;
+}
+
+common_sampler * llama_rn_context::acquireSampler(const common_params_sampling &sparams, std::string &key) {
+    key = sampling_params_key(sparams);
+    std::lock_guard<std::mutex> lock(sampler_pool_mutex);
+    for (auto it = sampler_pool.begin(); it != sampler_pool.end(); ++it) {
+        if (it->first == key) {
+            common_sampler *smpl = it->second;
+            sampler_pool.erase(it);
+            // clears the token history, reseeds the RNG and restores the initial grammar stacks
+            common_sampler_reset(smpl);
+            return smpl;
+        }
+    }
+    return common_sampler_init(model, sparams);
+}
+
+void llama_rn_context::releaseSampler(common_sampler *smpl, const std::string &key) {
+    if (smpl == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sampler_pool_mutex);
+    sampler_pool.emplace_front(key, smpl);
+    if (sampler_pool.size() > max_pooled_samplers) {
+        common_sampler_free(sampler_pool.back().second);
+        sampler_pool.pop_back();
+    }
+}
+
+void llama_rn_context::clearSamplerPool() {
+    std::lock_guard<std::mutex> lock(sampler_pool_mutex);
+    for (auto &entry : sampler_pool) {
+        common_sampler_free(entry.second);
+    }
+    sampler_pool.clear();
+}
+
 bool llama_rn_context::initSampling() {
     if (ctx_sampling != nullptr) {
-        common_sampler_free(ctx_sampling);
+        releaseSampler(ctx_sampling, ctx_sampling_key);
+        ctx_sampling = nullptr;
     }
-    ctx_sampling = common_sampler_init(model, params.sampling);
+    ctx_sampling = acquireSampler(params.sampling, ctx_sampling_key);
     return ctx_sampling != nullptr;
 }
 
 bool llama_rn_context::loadModel(common_params &params_)
 {
     params = params_;
+    // without mmap, or with mlock, the weights are resident after the load anyway and nothing is prefetched
+    const bool lazy_load = params.use_lazy_load && params.use_mmap && !params.use_mlock;
+    if (lazy_load) {
+        // the warmup run would fault in every weight before returning
+        params.warmup = false;
+    }
     llama_init = common_init_from_params(params);
     model = llama_init.model.get();
     ctx = llama_init.context.get();
@@ -287,16 +625,346 @@ bool llama_rn_context::loadModel(common_params &params_)
     }
     templates = common_chat_templates_init(model, params.chat_template);
     n_ctx = llama_n_ctx(ctx);
+    has_recurrent_state = llama_model_is_recurrent(model) || llama_model_is_hybrid(model);
+    // long documents (RAG imports) are tokenized on the batch threads
+    llama_vocab_set_n_threads(llama_model_get_vocab(model), params.cpuparams_batch.n_threads);
+    cparams_resident = common_context_params_to_llama(params);
+    cparams_resident.abort_callback = decode_abort_callback;
+    cparams_resident.abort_callback_data = this;
+    llama_set_abort_callback(ctx, decode_abort_callback, this);
+    // adapters loaded by common_init_from_params are owned by the registry from now on
+    for (size_t i = 0; i < llama_init.lora.size() && i < params.lora_adapters.size(); ++i) {
+        lora_adapter_entry entry;
+        entry.adapter = std::move(llama_init.lora[i]);
+        entry.size = lora_adapter_size(entry.adapter.get());
+        lora_registry[params.lora_adapters[i].path] = std::move(entry);
+    }
+    llama_init.lora.clear();
+    if (!params.lora_init_without_apply) {
+        lora = params.lora_adapters;
+        for (const auto &la : lora) {
+            lora_registry[la.path].n_refs++;
+        }
+    }
+    attachThreadpools();
 
     // Initialize context shift flag
     LOG_INFO("ctx_shift: %s", params.ctx_shift ? "enabled" : "disabled");
 
+    if (lazy_load) {
+        prefetchModelLayers();
+    }
+
     // We can uncomment for debugging or after this fix: https://github.com/ggerganov/llama.cpp/pull/11101
     // LOG_INFO("%s\n", common_params_get_system_info(params).c_str());
 
     return true;
 }
 
+// Host weight ranges grouped by layer in graph order (token embeddings, then blk.0, blk.1, ...)
+// cpu_only skips the host buffers shared with a GPU backend (e.g. Metal on unified memory)
+static std::map<int, std::vector<std::pair<uint8_t *, size_t>>> get_host_weight_layers(const llama_model * model, bool cpu_only) {
+    std::map<int, std::vector<std::pair<uint8_t *, size_t>>> layers;
+    for (const auto & it : model->tensors_by_name) {
+        lm_ggml_tensor * tensor = it.second;
+        if (tensor->data == nullptr || tensor->buffer == nullptr || !lm_ggml_backend_buffer_is_host(tensor->buffer)) {
+            continue;
+        }
+        if (lm_ggml_backend_buffer_get_usage(tensor->buffer) != LM_GGML_BACKEND_BUFFER_USAGE_WEIGHTS) {
+            // private copies such as the merged LoRA weights are not backed by the model file
+            continue;
+        }
+        if (cpu_only) {
+            lm_ggml_backend_dev_t dev = lm_ggml_backend_buft_get_device(lm_ggml_backend_buffer_get_type(tensor->buffer));
+            if (dev != nullptr && lm_ggml_backend_dev_type(dev) != LM_GGML_BACKEND_DEVICE_TYPE_CPU) {
+                continue;
+            }
+        }
+        int il = 0;
+        if (sscanf(it.first.c_str(), "blk.%d.", &il) != 1) {
+            il = it.first.rfind("token_embd", 0) == 0 ? -1 : INT_MAX;
+        }
+        layers[il].push_back({(uint8_t *) tensor->data, lm_ggml_nbytes(tensor)});
+    }
+    return layers;
+}
+
+// Read the lazily mapped weights ahead in graph order on a background thread,
+// so the first prefill finds the early layers resident
+void llama_rn_context::prefetchModelLayers() {
+#ifdef _POSIX_MAPPED_FILES
+    auto layers = get_host_weight_layers(model, false);
+
+    is_prefetch_stopped = false;
+    prefetch_thread = std::thread([this, layers = std::move(layers)]() {
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        const int64_t t_start_us = lm_ggml_time_us();
+        size_t n_layers = 0;
+        for (const auto & layer : layers) {
+            for (const auto & range : layer.second) {
+                const uintptr_t first = (uintptr_t) range.first;
+                const uintptr_t last = first + range.second;
+                const uintptr_t first_page = first & ~(page_size - 1);
+                madvise((void *) first_page, last - first_page, MADV_WILLNEED);
+            }
+            // touch the pages so the layer is resident before the next one is requested
+            for (const auto & range : layer.second) {
+                const uintptr_t first = (uintptr_t) range.first;
+                const uintptr_t last = first + range.second;
+                for (uintptr_t p = first; p < last; p = (p & ~(page_size - 1)) + page_size) {
+                    (void) *(volatile uint8_t *) p;
+                }
+                if (is_prefetch_stopped) {
+                    return;
+                }
+            }
+            n_layers++;
+        }
+        LOG_INFO("prefetched %zu layers in %.2f ms", n_layers, (lm_ggml_time_us() - t_start_us) / 1000.0);
+    });
+#endif
+}
+
+llama_rn_context_footprint llama_rn_context::getFootprint() const {
+    llama_rn_context_footprint footprint;
+    footprint.suspended = is_suspended;
+    if (model == nullptr) {
+        return footprint;
+    }
+    footprint.weights = llama_model_size(model);
+#ifdef _POSIX_MAPPED_FILES
+    if (params.use_mmap) {
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        std::vector<unsigned char> pages;
+        for (const auto & layer : get_host_weight_layers(model, false)) {
+            for (const auto & range : layer.second) {
+                const uintptr_t first_page = (uintptr_t) range.first & ~(page_size - 1);
+                const uintptr_t last = (uintptr_t) range.first + range.second;
+                pages.resize((last - first_page + page_size - 1) / page_size);
+                if (mincore((void *) first_page, last - first_page, pages.data()) != 0) {
+                    continue;
+                }
+                for (const auto page : pages) {
+                    footprint.weights_resident += (page & 1) ? page_size : 0;
+                }
+            }
+        }
+    } else {
+        footprint.weights_resident = footprint.weights;
+    }
+#else
+    footprint.weights_resident = footprint.weights;
+#endif
+    if (ctx != nullptr) {
+        footprint.kv = llama_state_seq_get_size(ctx, 0);
+        lm_ggml_backend_sched_t sched = ctx->get_sched();
+        for (int i = 0; i < lm_ggml_backend_sched_get_n_backends(sched); ++i) {
+            footprint.compute += lm_ggml_backend_sched_get_buffer_size(sched, lm_ggml_backend_sched_get_backend(sched, i));
+        }
+    }
+    if (mtmd_wrapper != nullptr) {
+        footprint.multimodal = mtmd_wrapper->model_size;
+    }
+    for (const auto &ckpt : checkpoints) {
+        footprint.kv += ckpt.state.size();
+    }
+    for (const auto &it : lora_registry) {
+        footprint.lora += it.second.size;
+    }
+    for (const auto &buf : lora_merged_bufs) {
+        footprint.lora += lm_ggml_backend_buffer_get_size(buf.get());
+    }
+    if (vocoder_wrapper != nullptr) {
+        footprint.vocoder = llama_model_size(vocoder_wrapper->model);
+        lm_ggml_backend_sched_t sched = vocoder_wrapper->ctx->get_sched();
+        for (int i = 0; i < lm_ggml_backend_sched_get_n_backends(sched); ++i) {
+            footprint.vocoder += lm_ggml_backend_sched_get_buffer_size(sched, lm_ggml_backend_sched_get_backend(sched, i));
+        }
+    }
+    return footprint;
+}
+
+// Give memory back under OS memory pressure. The mmapped weights are clean file pages,
+// so dropping them only costs page faults on the next evaluation. Suspending saves the
+// KV cache of the cached tokens to state_path and frees the llama_context, ensureResident
+// restores it on the next call.
+bool llama_rn_context::releaseResidency(residency_level level, const std::string &state_path) {
+    // never waits for a call in progress, a busy context is released on the next signal
+    context_lock lock(this, std::try_to_lock);
+    if (!lock.owns_lock() || model == nullptr || is_predicting) {
+        return false;
+    }
+
+    if (level >= RESIDENCY_SUSPEND && !is_suspended) {
+        bool saved = false;
+        if (!state_path.empty() && !embd.empty()) {
+            saved = llama_state_seq_save_file(ctx, state_path.c_str(), 0, embd.data(), embd.size()) > 0;
+            if (!saved) {
+                LOG_WARNING("failed to save the KV cache to %s, the prompt will be evaluated again", state_path.c_str());
+            }
+        }
+        if (!saved) {
+            embd.clear();
+            evicted_spans.clear();
+            mtmd_bitmap_past_hashes.clear();
+        }
+        suspended_state_path = saved ? state_path : "";
+        llama_init.context.reset();
+        ctx = nullptr;
+        is_suspended = true;
+        LOG_INFO("suspended context, %zu cached tokens %s", embd.size(), saved ? "saved" : "dropped");
+    }
+
+    // each pooled sampler holds a candidate array of the vocab size
+    clearSamplerPool();
+
+    const size_t lora_bytes = releaseUnusedLoraAdapters();
+    if (lora_bytes > 0) {
+        LOG_INFO("released %.2f MiB of unused lora adapters", lora_bytes / 1024.0 / 1024.0);
+    }
+
+    if (!checkpoints.empty()) {
+        size_t checkpoint_bytes = 0;
+        for (const auto &ckpt : checkpoints) {
+            checkpoint_bytes += ckpt.state.size();
+        }
+        checkpoints.clear();
+        checkpoints.shrink_to_fit();
+        LOG_INFO("released %.2f MiB of recurrent checkpoints", checkpoint_bytes / 1024.0 / 1024.0);
+    }
+
+#ifdef _POSIX_MAPPED_FILES
+    if (params.use_mmap && !params.use_mlock) {
+        // the prefetch would fault the pages in again
+        is_prefetch_stopped = true;
+        if (prefetch_thread.joinable()) {
+            prefetch_thread.join();
+        }
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        size_t n_bytes = 0;
+        for (const auto & layer : get_host_weight_layers(model, true)) {
+            for (const auto & range : layer.second) {
+                const uintptr_t first_page = (uintptr_t) range.first & ~(page_size - 1);
+                const uintptr_t last = (uintptr_t) range.first + range.second;
+                if (madvise((void *) first_page, last - first_page, MADV_DONTNEED) == 0) {
+                    n_bytes += range.second;
+                }
+            }
+        }
+        LOG_INFO("released %.2f MiB of mmapped weights", n_bytes / 1024.0 / 1024.0);
+    }
+#endif
+    return true;
+}
+
+void llama_rn_context::ensureResident() {
+    context_lock lock(this);
+    if (!is_suspended) {
+        return;
+    }
+    llama_context * lctx = llama_init_from_model(model, cparams_resident);
+    if (lctx == nullptr) {
+        throw std::runtime_error("Failed to restore the context after it was suspended");
+    }
+    llama_init.context.reset(lctx);
+    ctx = lctx;
+    is_suspended = false;
+    attachThreadpools();
+    common_set_adapter_lora(ctx, lora);
+
+    if (!suspended_state_path.empty()) {
+        std::vector<llama_token> state_tokens(embd.size());
+        size_t n_token_count = 0;
+        if (llama_state_seq_load_file(ctx, suspended_state_path.c_str(), 0, state_tokens.data(), state_tokens.size(), &n_token_count) == 0 ||
+            n_token_count != embd.size()) {
+            LOG_WARNING("failed to restore the KV cache from %s, the prompt will be evaluated again", suspended_state_path.c_str());
+            llama_memory_clear(llama_get_memory(ctx), true);
+            embd.clear();
+            evicted_spans.clear();
+            mtmd_bitmap_past_hashes.clear();
+        }
+        std::remove(suspended_state_path.c_str());
+        suspended_state_path.clear();
+    }
+    LOG_INFO("restored context, %zu cached tokens", embd.size());
+}
+
+context_lock::context_lock(llama_rn_context *llama) : llama(llama), lock(llama->ctx_mutex) {
+    enter();
+}
+
+context_lock::context_lock(llama_rn_context *llama, std::try_to_lock_t) : llama(llama), lock(llama->ctx_mutex, std::try_to_lock) {
+    if (lock.owns_lock()) {
+        enter();
+    }
+}
+
+void context_lock::enter() {
+    if (llama->ctx_lock_depth++ > 0) {
+        return;
+    }
+#if defined(__linux__)
+    has_affinity = sched_getaffinity(0, sizeof(affinity), &affinity) == 0;
+#endif
+}
+
+context_lock::~context_lock() {
+    if (!lock.owns_lock() || --llama->ctx_lock_depth > 0) {
+        return;
+    }
+    // the next call resumes the pools and pins its own thread
+    if (llama->threadpool != nullptr) {
+        lm_ggml_threadpool_pause(llama->threadpool);
+    }
+    if (llama->threadpool_batch != nullptr) {
+        lm_ggml_threadpool_pause(llama->threadpool_batch);
+    }
+#if defined(__linux__)
+    if (has_affinity) {
+        sched_setaffinity(0, sizeof(affinity), &affinity);
+    }
+#endif
+}
+
+// Threads stay alive between the decode calls instead of being spawned for every graph.
+// The pools start paused and the context pauses the idle one when switching between generation and prompt processing
+void llama_rn_context::attachThreadpools() {
+    if (ctx == nullptr) {
+        return;
+    }
+    if (threadpool == nullptr) {
+        lm_ggml_threadpool_params tpp = lm_ggml_threadpool_params_from_cpu_params(params.cpuparams);
+        lm_ggml_threadpool_params tpp_batch = lm_ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
+        LOG_INFO("cpu threads: %d for generation, %d for prompt processing%s",
+            tpp.n_threads, tpp_batch.n_threads, params.cpuparams.mask_valid ? ", pinned to the fastest cores" : "");
+        tpp.paused = true;
+        tpp_batch.paused = true;
+        threadpool = lm_ggml_threadpool_new(&tpp);
+        if (!lm_ggml_threadpool_params_match(&tpp, &tpp_batch)) {
+            threadpool_batch = lm_ggml_threadpool_new(&tpp_batch);
+        }
+    }
+    llama_attach_threadpool(ctx, threadpool, threadpool_batch);
+}
+
+void llama_rn_context::setThreads(int n_threads) {
+    context_lock lock(this);
+    const int n_threads_prev = params.cpuparams.n_threads;
+    const int n_threads_batch_prev = params.cpuparams_batch.n_threads;
+    cpu_params_from_topology(params, n_threads);
+    if (params.cpuparams.n_threads == n_threads_prev && params.cpuparams_batch.n_threads == n_threads_batch_prev) {
+        return;
+    }
+    cparams_resident.n_threads = params.cpuparams.n_threads;
+    cparams_resident.n_threads_batch = params.cpuparams_batch.n_threads;
+    free_threadpools(ctx, threadpool, threadpool_batch);
+    if (ctx != nullptr) {
+        llama_set_n_threads(ctx, params.cpuparams.n_threads, params.cpuparams_batch.n_threads);
+        llama_vocab_set_n_threads(llama_model_get_vocab(model), params.cpuparams_batch.n_threads);
+        attachThreadpools();
+    }
+}
+
 bool llama_rn_context::validateModelChatTemplate(bool use_jinja, const char *name) const {
     const char * tmpl = llama_model_chat_template(model, name);
     if (tmpl == nullptr) {
@@ -356,26 +1024,118 @@ std::string llama_rn_context::getFormattedChat(
     }
 }
 
-void llama_rn_context::truncatePrompt(std::vector<llama_token> &prompt_tokens) {
-    const int n_left = n_ctx - params.n_keep;
-    const int n_block_size = n_left / 2;
-    const int erased_blocks = (prompt_tokens.size() - params.n_keep - n_block_size) / n_block_size;
+ctx_shift_span llama_rn_context::getEvictionSpan(const std::vector<llama_token> &tokens, size_t n_tokens) const {
+    ctx_shift_span span;
+    size_t n_sink = params.n_keep + 1;
+    size_t n_discard = 0;
+    if (shift_policy == CTX_SHIFT_POLICY_SINK_WINDOW) {
+        n_sink = std::max(n_sink, (size_t) std::max(shift_n_sink, 0));
+        if (n_tokens > n_sink) {
+            n_discard = std::max<size_t>((n_tokens - n_sink) / 4, 1);
+        }
+    } else if (n_tokens > n_sink) {
+        n_discard = (n_tokens - n_sink) / 2;
+    }
+    if (n_discard == 0) {
+        return span;
+    }
 
-    // Keep n_keep tokens at start of prompt (at most n_ctx - 4)
-    std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + params.n_keep);
+    span.p0 = n_sink;
+    span.p1 = n_sink + n_discard;
 
-    new_tokens.insert(new_tokens.end(), prompt_tokens.begin() + params.n_keep + erased_blocks * n_block_size, prompt_tokens.end());
+    // media chunks are stored as runs of LLAMA_TOKEN_NULL, evict them as a whole
+    if (span.p0 < n_tokens && tokens[span.p0] == LLAMA_TOKEN_NULL) {
+        size_t run_start = span.p0;
+        while (run_start > 0 && tokens[run_start - 1] == LLAMA_TOKEN_NULL) {
+            run_start--;
+        }
+        if (run_start >= n_sink) {
+            span.p0 = run_start;
+        } else {
+            // the chunk overlaps the kept tokens, keep it too
+            while (span.p0 < n_tokens && tokens[span.p0] == LLAMA_TOKEN_NULL) {
+                span.p0++;
+            }
+        }
+    }
+    while (span.p1 > 0 && span.p1 < n_tokens && tokens[span.p1] == LLAMA_TOKEN_NULL && tokens[span.p1 - 1] == LLAMA_TOKEN_NULL) {
+        span.p1++;
+    }
+    if (span.p1 > n_tokens) {
+        span.p1 = n_tokens;
+    }
+    if (span.p1 <= span.p0) {
+        span.p0 = span.p1 = 0;
+    }
+    return span;
+}
 
-    LOG_INFO("input truncated, n_ctx: %d, n_keep: %d, n_left: %d, old_size: %d, new_size: %d",
+bool llama_rn_context::truncatePrompt(std::vector<llama_token> &prompt_tokens) {
+    const size_t old_size = prompt_tokens.size();
+    while (prompt_tokens.size() >= (size_t) n_ctx) {
+        const ctx_shift_span span = getEvictionSpan(prompt_tokens, prompt_tokens.size());
+        if (span.p1 == span.p0) {
+            return false;
+        }
+        prompt_tokens.erase(prompt_tokens.begin() + span.p0, prompt_tokens.begin() + span.p1);
+        evicted_spans.push_back(span);
+    }
+
+    LOG_INFO("input truncated, n_ctx: %d, n_keep: %d, old_size: %d, new_size: %d",
         n_ctx,
         params.n_keep,
-        n_left,
-        prompt_tokens.size(),
-        new_tokens.size()
+        (int) old_size,
+        (int) prompt_tokens.size()
     );
 
     truncated = true;
-    prompt_tokens = new_tokens;
+    return true;
+}
+
+bool llama_rn_context::shiftContext() {
+    auto * kv = llama_get_memory(ctx);
+    if (!llama_memory_can_shift(kv)) {
+        LOG_WARNING("context shift is not supported by the memory of this model");
+        return false;
+    }
+
+    const ctx_shift_span span = getEvictionSpan(embd, n_past);
+    if (span.p1 == span.p0) {
+        return false;
+    }
+    const int n_discard = span.p1 - span.p0;
+
+    llama_memory_seq_rm (kv, 0, span.p0, span.p1);
+    llama_memory_seq_add(kv, 0, span.p1, n_past, -n_discard);
+
+    size_t n_media_evicted = 0;
+    for (size_t i = span.p0; i < span.p1; i++) {
+        if (embd[i] == LLAMA_TOKEN_NULL && (i == span.p0 || embd[i - 1] != LLAMA_TOKEN_NULL)) {
+            n_media_evicted++;
+        }
+    }
+    if (n_media_evicted > 0) {
+        size_t n_media_before = 0;
+        for (size_t i = 0; i < span.p0; i++) {
+            if (embd[i] == LLAMA_TOKEN_NULL && (i == 0 || embd[i - 1] != LLAMA_TOKEN_NULL)) {
+                n_media_before++;
+            }
+        }
+        if (n_media_before < mtmd_bitmap_past_hashes.size()) {
+            auto first = mtmd_bitmap_past_hashes.begin() + n_media_before;
+            auto last = mtmd_bitmap_past_hashes.begin() + std::min(n_media_before + n_media_evicted, mtmd_bitmap_past_hashes.size());
+            mtmd_bitmap_past_hashes.erase(first, last);
+        }
+    }
+
+    embd.erase(embd.begin() + span.p0, embd.begin() + span.p1);
+    evicted_spans.push_back(span);
+
+    n_past -= n_discard;
+    truncated = true;
+
+    LOG_VERBOSE("context shifted, evicted: [%zu, %zu), new n_past: %d, new size: %d", span.p0, span.p1, n_past, (int) embd.size());
+    return true;
 }
 
 void llama_rn_context::loadPrompt(const std::vector<std::string> &media_paths) {
@@ -400,24 +1160,44 @@ void llama_rn_context::loadPrompt(const std::vector<std::string> &media_paths) {
         }
         params.n_keep = std::min(n_ctx - 4, params.n_keep);
 
+        // Replay the previous evictions so the shifted KV cache is reused instead of re-evaluated
+        if (!evicted_spans.empty()) {
+            std::vector<llama_token> shifted_tokens = text_tokens;
+            size_t n_replayed = 0;
+            for (const auto & span : evicted_spans) {
+                if (span.p1 > shifted_tokens.size()) {
+                    break;
+                }
+                shifted_tokens.erase(shifted_tokens.begin() + span.p0, shifted_tokens.begin() + span.p1);
+                n_replayed++;
+            }
+            if (n_replayed == evicted_spans.size() && common_part(embd, shifted_tokens) > common_part(embd, text_tokens)) {
+                text_tokens = shifted_tokens;
+                truncated = true;
+            } else {
+                evicted_spans.clear();
+            }
+        }
+
         // Handle truncation if needed
-        if (num_prompt_tokens >= (size_t)n_ctx) {
-            if (!params.ctx_shift) {
+        if (text_tokens.size() >= (size_t)n_ctx) {
+            if (!params.ctx_shift || !truncatePrompt(text_tokens)) {
                 context_full = true;
                 return;
             }
-            truncatePrompt(text_tokens);
-            num_prompt_tokens = text_tokens.size();
-            LM_GGML_ASSERT(num_prompt_tokens < (size_t)n_ctx);
+            LM_GGML_ASSERT(text_tokens.size() < (size_t)n_ctx);
         }
+        num_prompt_tokens = text_tokens.size();
 
         // Update sampling context
         for (auto & token : text_tokens) {
             common_sampler_accept(ctx_sampling, token, false);
         }
 
-        // compare the evaluated prompt with the new prompt
-        n_past = common_part(embd, text_tokens);
+        // compare the evaluated prompt with the new prompt,
+        // the last token sampled by the previous completion is in embd but was never evaluated
+        auto * kv = llama_get_memory(ctx);
+        n_past = std::min(common_part(embd, text_tokens), (size_t) (llama_memory_seq_pos_max(kv, 0) + 1));
 
         embd = text_tokens;
         if (n_past == num_prompt_tokens) {
@@ -425,9 +1205,16 @@ void llama_rn_context::loadPrompt(const std::vector<std::string> &media_paths) {
             n_past--;
         }
 
+        // checkpoints past the common prefix belong to the previous prompt
+        while (!checkpoints.empty() && checkpoints.back().pos > n_past) {
+            checkpoints.pop_back();
+        }
+
         // Manage KV cache
-        auto * kv = llama_get_memory(ctx);
-        llama_memory_seq_rm(kv, 0, n_past, -1);
+        if (!llama_memory_seq_rm(kv, 0, n_past, -1)) {
+            // the recurrent state can't be partially erased
+            n_past = restoreCheckpoint();
+        }
 
         LOG_VERBOSE("prompt ingested, n_past: %d, cached: %s, to_eval: %s",
             n_past,
@@ -459,6 +1246,119 @@ void llama_rn_context::beginCompletion() {
 
 void llama_rn_context::endCompletion() {
     is_predicting = false;
+    t_deadline_us = 0;
+}
+
+void llama_rn_context::setDeadline(int deadline_ms, int step_budget_ms) {
+    t_deadline_us = deadline_ms > 0 ? lm_ggml_time_us() + (int64_t) deadline_ms * 1000 : 0;
+    step_budget_us = step_budget_ms > 0 ? (int64_t) step_budget_ms * 1000 : 0;
+}
+
+bool llama_rn_context::isDeadlineExpired() const {
+    return t_deadline_us > 0 && lm_ggml_time_us() >= t_deadline_us;
+}
+
+int llama_rn_context::decodePromptStep() {
+    int n_eval = std::min((int) embd.size() - n_past, params.n_batch);
+    if (n_eval > 1 && step_budget_us > 0 && t_prefill_token_us > 0) {
+        // shrink the step so a single decode stays within the latency budget
+        const int n_min = std::min(32, params.n_batch);
+        const int n_budget = (int) (step_budget_us / t_prefill_token_us);
+        n_eval = std::min(n_eval, std::max(n_budget, n_min));
+    }
+    const llama_pos pos_checkpoint = nextCheckpointPos();
+    if (pos_checkpoint > n_past) {
+        // end the step on the checkpoint so the state can be saved there
+        n_eval = std::min(n_eval, (int) (pos_checkpoint - n_past));
+    }
+
+    auto * mem = llama_get_memory(ctx);
+    const llama_pos pos_max = llama_memory_seq_pos_max(mem, 0);
+    const int64_t t_start_us = lm_ggml_time_us();
+
+    const int ret = llama_decode(ctx, llama_batch_get_one(&embd[n_past], n_eval));
+    if (ret == 0) {
+        if (n_eval > 1) {
+            const double t_token_us = (double) (lm_ggml_time_us() - t_start_us) / n_eval;
+            t_prefill_token_us = t_prefill_token_us > 0 ? 0.7 * t_prefill_token_us + 0.3 * t_token_us : t_token_us;
+        }
+        n_past += n_eval;
+        if (n_past == pos_checkpoint) {
+            saveCheckpoint();
+        }
+    } else if (ret == 2) {
+        // llama_decode only removed the aborted ubatch, the previous ubatches of the step are kept
+        n_past += std::max(0, (int) (llama_memory_seq_pos_max(mem, 0) - pos_max));
+        embd.resize(n_past);
+        stopped_deadline = !is_interrupted && isDeadlineExpired();
+        LOG_INFO("Decoding %s at n_past: %d", stopped_deadline ? "deadline exceeded" : "interrupted", n_past);
+    }
+    return ret;
+}
+
+// Recurrent checkpoints are taken every checkpoint_interval tokens, at the message boundaries
+// of the chat template (control tokens) and before the last prompt token, which is where a
+// regenerated reply or the next turn of the chat diverges from the cached tokens.
+llama_pos llama_rn_context::nextCheckpointPos() const {
+    if (!has_recurrent_state || checkpoint_max <= 0) {
+        return -1;
+    }
+    const llama_pos n_tokens = embd.size();
+    llama_pos pos = checkpoint_interval > 0 ? (n_past / checkpoint_interval + 1) * checkpoint_interval : n_tokens;
+    const llama_pos pos_prompt_end = (llama_pos) num_prompt_tokens - 1;
+    if (pos_prompt_end > n_past) {
+        pos = std::min(pos, pos_prompt_end);
+    }
+    // skip the boundaries close to the previous checkpoint, every split shrinks a prompt step
+    const llama_pos pos_last = checkpoints.empty() ? 0 : checkpoints.back().pos;
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    for (llama_pos p = std::max(n_past + 1, pos_last + 32); p < std::min(pos, n_tokens); ++p) {
+        if (embd[p] != LLAMA_TOKEN_NULL && llama_vocab_is_control(vocab, embd[p])) {
+            pos = p;
+            break;
+        }
+    }
+    return pos <= n_tokens ? pos : -1;
+}
+
+void llama_rn_context::saveCheckpoint() {
+    while (!checkpoints.empty() && checkpoints.back().pos >= n_past) {
+        checkpoints.pop_back();
+    }
+    recurrent_checkpoint ckpt;
+    if ((int) checkpoints.size() >= checkpoint_max) {
+        // reuse the buffer of the oldest checkpoint, the states have the same size
+        ckpt.state = std::move(checkpoints.front().state);
+        checkpoints.erase(checkpoints.begin());
+    }
+    // only the recurrent part of a hybrid model, the KV cells of the attention layers can be removed
+    const size_t size = llama_state_seq_get_size_ext(ctx, 0, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+    ckpt.state.resize(size);
+    if (size == 0 || llama_state_seq_get_data_ext(ctx, ckpt.state.data(), size, 0, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) != size) {
+        LOG_WARNING("failed to save the recurrent state at n_past: %d", n_past);
+        return;
+    }
+    ckpt.pos = n_past;
+    checkpoints.push_back(std::move(ckpt));
+    LOG_VERBOSE("recurrent checkpoint at n_past: %d, size: %zu", n_past, size);
+}
+
+llama_pos llama_rn_context::restoreCheckpoint() {
+    auto * mem = llama_get_memory(ctx);
+    while (!checkpoints.empty()) {
+        const auto & ckpt = checkpoints.back();
+        // the attention cells of a hybrid model are removed after the restored recurrent state
+        if (ckpt.pos <= n_past &&
+            llama_state_seq_set_data_ext(ctx, ckpt.state.data(), ckpt.state.size(), 0, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) == ckpt.state.size() &&
+            llama_memory_seq_rm(mem, 0, ckpt.pos, -1)) {
+            LOG_INFO("restored the recurrent checkpoint at %d, n_past: %d", ckpt.pos, n_past);
+            return ckpt.pos;
+        }
+        checkpoints.pop_back();
+    }
+    LOG_INFO("no recurrent checkpoint before n_past: %d, the prompt will be evaluated again", n_past);
+    llama_memory_seq_rm(mem, 0, -1, -1);
+    return 0;
 }
 
 completion_token_output llama_rn_context::nextToken()
@@ -470,46 +1370,33 @@ completion_token_output llama_rn_context::nextToken()
     {
         if (!params.ctx_shift) {
             // If context shifting is disabled, stop generation
-            LOG_WARNING("context full, n_ctx: %d, tokens: %d", params.n_ctx, embd.size());
+            LOG_WARNING("context full, n_ctx: %d, tokens: %d", params.n_ctx, (int) embd.size());
             has_next_token = false;
             context_full = true;
             return result;
         }
 
-        // Shift context
-
-        const int n_left    = n_past - params.n_keep - 1;
-        const int n_discard = n_left/2;
-
-        auto * kv = llama_get_memory(ctx);
-        llama_memory_seq_rm (kv, 0, params.n_keep + 1            , params.n_keep + n_discard + 1);
-        llama_memory_seq_add(kv, 0, params.n_keep + 1 + n_discard, n_past, -n_discard);
-
-        for (size_t i = params.n_keep + 1 + n_discard; i < embd.size(); i++)
-        {
-            embd[i - n_discard] = embd[i];
+        if (!shiftContext()) {
+            LOG_WARNING("context full, unable to shift, n_ctx: %d, tokens: %d", params.n_ctx, (int) embd.size());
+            has_next_token = false;
+            context_full = true;
+            return result;
         }
-        embd.resize(embd.size() - n_discard);
-
-        n_past -= n_discard;
-        truncated = true;
-
-        LOG_VERBOSE("context shifted, new n_past: %d, new size: %d", n_past, embd.size());
     }
 
     bool tg = true;
     while (n_past < embd.size())
     {
-        int n_eval = (int)embd.size() - n_past;
-        tg = n_eval == 1;
-        if (n_eval > params.n_batch)
+        tg = (int)embd.size() - n_past == 1;
+        const int ret = decodePromptStep();
+        if (ret == 2)
         {
-            n_eval = params.n_batch;
+            has_next_token = false;
+            return result;
         }
-        if (llama_decode(ctx, llama_batch_get_one(&embd[n_past], n_eval)))
+        if (ret != 0)
         {
-            LOG_ERROR("failed to eval, n_eval: %d, n_past: %d, n_threads: %d, embd: %s",
-                n_eval,
+            LOG_ERROR("failed to eval, n_past: %d, n_threads: %d, embd: %s",
                 n_past,
                 params.cpuparams.n_threads,
                 tokens_to_str(ctx, embd.cbegin() + n_past, embd.cend()).c_str()
@@ -517,7 +1404,6 @@ completion_token_output llama_rn_context::nextToken()
             has_next_token = false;
             return result;
         }
-        n_past += n_eval;
 
         if(is_interrupted) {
             LOG_INFO("Decoding Interrupted");
@@ -675,44 +1561,458 @@ completion_token_output llama_rn_context::doCompletion()
         stopped_limit = true;
     }
 
-    LOG_VERBOSE("next token, token: %s, token_text: %s, has_next_token: %d, n_remain: %d, num_tokens_predicted: %d, stopped_eos: %d, stopped_word: %d, stopped_limit: %d, stopping_word: %s",
-        common_token_to_piece(ctx, token_with_probs.tok),
-        tokens_to_output_formatted_string(ctx, token_with_probs.tok).c_str(),
-        has_next_token,
-        n_remain,
-        num_tokens_predicted,
-        stopped_eos,
-        stopped_word,
-        stopped_limit,
-        stopping_word.c_str()
-    );
-    return token_with_probs;
+    LOG_VERBOSE("next token, token: %s, token_text: %s, has_next_token: %d, n_remain: %d, num_tokens_predicted: %d, stopped_eos: %d, stopped_word: %d, stopped_limit: %d, stopping_word: %s",
+        common_token_to_piece(ctx, token_with_probs.tok),
+        tokens_to_output_formatted_string(ctx, token_with_probs.tok).c_str(),
+        has_next_token,
+        n_remain,
+        num_tokens_predicted,
+        stopped_eos,
+        stopped_word,
+        stopped_limit,
+        stopping_word.c_str()
+    );
+    return token_with_probs;
+}
+
+void partial_emitter::push(const std::string &text, std::vector<completion_token_output> &&probs, size_t n_tokens) {
+    pending.text += text;
+    pending.probs.insert(pending.probs.end(), std::make_move_iterator(probs.begin()), std::make_move_iterator(probs.end()));
+    pending.n_tokens += n_tokens;
+
+    const int64_t t_now_us = lm_ggml_time_us();
+    const bool window_done = t_now_us - t_last_emit_us >= interval_us ||
+        (max_tokens > 0 && pending.n_tokens >= max_tokens);
+    if (!window_done || (busy && busy())) {
+        return;
+    }
+    emitPending();
+    t_last_emit_us = t_now_us;
+}
+
+void partial_emitter::flush() {
+    emitPending();
+}
+
+void partial_emitter::emitPending() {
+    if (pending.text.empty() && pending.probs.empty()) {
+        return;
+    }
+    emit(pending);
+    pending = completion_partial();
+}
+
+void llama_rn_context::generate(partial_emitter *emitter) {
+    size_t sent_count = 0;
+    size_t sent_token_probs_index = 0;
+    size_t n_tokens_unsent = 0;
+
+    while (has_next_token && !is_interrupted) {
+        const completion_token_output token_with_probs = doCompletion();
+        if (token_with_probs.tok == -1 || incomplete) {
+            continue;
+        }
+        n_tokens_unsent++;
+        const std::string token_text = common_token_to_piece(ctx, token_with_probs.tok);
+
+        size_t pos = std::min(sent_count, generated_text.size());
+
+        const std::string str_test = generated_text.substr(pos);
+        bool is_stop_full = false;
+        size_t stop_pos = findStoppingStrings(str_test, token_text.size(), STOP_FULL);
+        if (stop_pos != std::string::npos) {
+            is_stop_full = true;
+            generated_text.erase(generated_text.begin() + pos + stop_pos, generated_text.end());
+            pos = std::min(sent_count, generated_text.size());
+        } else {
+            stop_pos = findStoppingStrings(str_test, token_text.size(), STOP_PARTIAL);
+        }
+
+        if (
+            stop_pos == std::string::npos ||
+            // Send rest of the text if we are at the end of the generation
+            (!has_next_token && !is_stop_full && stop_pos > 0)
+        ) {
+            const std::string to_send = generated_text.substr(pos, std::string::npos);
+            sent_count += to_send.size();
+            if (emitter == nullptr) {
+                continue;
+            }
+
+            std::vector<completion_token_output> probs_output;
+            if (params.sampling.n_probs > 0) {
+                const std::vector<llama_token> to_send_toks = common_tokenize(ctx, to_send, false);
+                size_t probs_pos = std::min(sent_token_probs_index, generated_token_probs.size());
+                size_t probs_stop_pos = std::min(sent_token_probs_index + to_send_toks.size(), generated_token_probs.size());
+                if (probs_pos < probs_stop_pos) {
+                    probs_output = std::vector<completion_token_output>(generated_token_probs.begin() + probs_pos, generated_token_probs.begin() + probs_stop_pos);
+                }
+                sent_token_probs_index = probs_stop_pos;
+            }
+            emitter->push(to_send, std::move(probs_output), n_tokens_unsent);
+            n_tokens_unsent = 0;
+        }
+    }
+
+    if (emitter != nullptr) {
+        emitter->flush();
+    }
+}
+
+std::vector<completion_branch_output> llama_rn_context::doBranchedCompletion(
+    int n_branches,
+    const std::vector<std::vector<common_adapter_lora_info>> &branch_lora
+)
+{
+    std::vector<completion_branch_output> outputs;
+
+    const int n_seq_max = (int) llama_n_seq_max(ctx);
+    if (n_branches > n_seq_max) {
+        LOG_WARNING("n_branches (%d) exceeds n_parallel (%d), clamping", n_branches, n_seq_max);
+        n_branches = n_seq_max;
+    }
+    if (n_branches < 1) {
+        n_branches = 1;
+    }
+
+    // evaluate the remaining prompt tokens in seq 0, the last logits are shared by all branches
+    while (n_past < (llama_pos) embd.size()) {
+        const int ret = decodePromptStep();
+        if (ret != 0) {
+            if (ret != 2) {
+                LOG_ERROR("failed to eval, n_past: %d", n_past);
+            }
+            has_next_token = false;
+            return outputs;
+        }
+        if (is_interrupted) {
+            LOG_INFO("Decoding Interrupted");
+            embd.resize(n_past);
+            has_next_token = false;
+            return outputs;
+        }
+    }
+
+    // adapters of each branch, set on its sequence so all branches still share one batch.
+    // Set after the prompt so the shared prompt KV stays free of any branch adapter, and
+    // detached on every exit so seq 0 of the later completions doesn't keep them.
+    struct branch_lora_scope {
+        llama_rn_context *llama;
+        std::vector<std::string> paths;
+        ~branch_lora_scope() {
+            if (paths.empty()) {
+                return;
+            }
+            llama_clear_adapter_lora_seq(llama->ctx, -1);
+            for (const auto &path : paths) {
+                llama->releaseLoraAdapter(path);
+            }
+        }
+    } branch_lora_set{this, {}};
+    std::vector<std::string> &branch_lora_paths = branch_lora_set.paths;
+    for (int i = 0; i < n_branches && i < (int) branch_lora.size(); ++i) {
+        for (const auto &la : branch_lora[i]) {
+            llama_adapter_lora * adapter = acquireLoraAdapter(la.path);
+            if (adapter == nullptr) {
+                throw std::runtime_error("Failed to load lora adapter: " + la.path);
+            }
+            branch_lora_paths.push_back(la.path);
+            llama_set_adapter_lora_seq(ctx, i, adapter, la.scale);
+        }
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    auto * kv = llama_get_memory(ctx);
+    const llama_pos n_past_fork = n_past;
+
+    std::vector<common_sampler *> samplers(n_branches, nullptr);
+    std::vector<std::string> sampler_keys(n_branches);
+    samplers[0] = ctx_sampling;
+    for (int i = 1; i < n_branches; ++i) {
+        // the unified KV cache shares the prompt cells between sequences, no data is copied
+        llama_memory_seq_rm(kv, i, -1, -1);
+        llama_memory_seq_cp(kv, 0, i, -1, -1);
+
+        common_params_sampling branch_sparams = params.sampling;
+        if (branch_sparams.seed != LLAMA_DEFAULT_SEED) {
+            branch_sparams.seed += i;
+        }
+        samplers[i] = acquireSampler(branch_sparams, sampler_keys[i]);
+        for (auto & token : embd) {
+            if (token != LLAMA_TOKEN_NULL) {
+                common_sampler_accept(samplers[i], token, false);
+            }
+        }
+    }
+
+    outputs.resize(n_branches);
+    std::vector<int32_t> i_batch(n_branches, -1);
+    std::vector<bool> active(n_branches, true);
+    for (int i = 0; i < n_branches; ++i) {
+        outputs[i].seq_id = i;
+    }
+
+    llama_batch batch = llama_batch_init(n_branches, 0, 1);
+    bool decode_failed = false;
+    bool fork_failed = false;
+
+    // branch 0 decodes on seq 0, which the later completions reuse as their prefix
+    const bool main_lora = !branch_lora.empty() && !branch_lora[0].empty();
+
+    if (!branch_lora_paths.empty() && n_past_fork > 0) {
+        // the shared prompt logits were computed without the branch adapters,
+        // decode the last prompt token again in every branch with its own adapters
+        bool forked = true;
+        for (int i = 0; i < n_branches; ++i) {
+            forked &= llama_memory_seq_rm(kv, i, n_past_fork - 1, -1);
+        }
+        if (forked) {
+            for (int i = 0; i < n_branches; ++i) {
+                i_batch[i] = batch.n_tokens;
+                llama_batch_add(&batch, embd[n_past_fork - 1], n_past_fork - 1, { i }, true);
+            }
+            const int ret = llama_decode(ctx, batch);
+            if (ret == 2) {
+                stopped_deadline = !is_interrupted && isDeadlineExpired();
+                LOG_INFO("Decoding branches %s at n_past: %d", stopped_deadline ? "deadline exceeded" : "interrupted", n_past_fork);
+            } else if (ret != 0) {
+                LOG_WARNING("failed to decode branches, n_branches: %d, n_past: %d", n_branches, n_past_fork);
+            }
+            if (ret != 0) {
+                decode_failed = true;
+                fork_failed = true;
+            }
+        } else {
+            LOG_WARNING("cannot fork the last prompt token, the first branch token is sampled without the branch adapters");
+        }
+    }
+
+    while (!is_interrupted && !decode_failed) {
+        llama_batch_clear(&batch);
+
+        for (int i = 0; i < n_branches; ++i) {
+            if (!active[i]) {
+                continue;
+            }
+            auto & out = outputs[i];
+
+            const llama_token new_token_id = common_sampler_sample(samplers[i], ctx, i_batch[i]);
+            common_sampler_accept(samplers[i], new_token_id, true);
+            out.tokens.push_back(new_token_id);
+
+            if (llama_vocab_is_eog(vocab, new_token_id)) {
+                out.stopped_eos = true;
+                active[i] = false;
+                continue;
+            }
+
+            const std::string token_text = common_token_to_piece(ctx, new_token_id);
+            out.text += token_text;
+
+            for (const std::string &word : params.antiprompt) {
+                const size_t tmp = word.size() + token_text.size();
+                const size_t from_pos = out.text.size() > tmp ? out.text.size() - tmp : 0;
+                const size_t pos = out.text.find(word, from_pos);
+                if (pos != std::string::npos) {
+                    out.stopping_word = word;
+                    out.stopped_word = true;
+                    out.text.erase(pos);
+                    break;
+                }
+            }
+            if (out.stopped_word) {
+                active[i] = false;
+                continue;
+            }
+
+            if (params.n_predict != -1 && (int) out.tokens.size() >= params.n_predict) {
+                out.stopped_limit = true;
+                active[i] = false;
+                continue;
+            }
+
+            i_batch[i] = batch.n_tokens;
+            llama_batch_add(&batch, new_token_id, n_past_fork + (llama_pos) out.tokens.size() - 1, { i }, true);
+        }
+
+        if (batch.n_tokens == 0) {
+            break;
+        }
+
+        const int ret = llama_decode(ctx, batch);
+        if (ret == 2) {
+            // aborted by stopCompletion or the deadline, the tokens of this step were not decoded
+            stopped_deadline = !is_interrupted && isDeadlineExpired();
+            LOG_INFO("Decoding branches %s at n_past: %d", stopped_deadline ? "deadline exceeded" : "interrupted", n_past_fork);
+            decode_failed = true;
+            break;
+        }
+        if (ret != 0) {
+            LOG_WARNING("failed to decode branches, n_branches: %d, n_past: %d", n_branches, n_past_fork);
+            // 1: no KV slot for the batch
+            context_full = ret == 1;
+            decode_failed = true;
+        }
+    }
+
+    llama_batch_free(batch);
+
+    // drop the extra branches, seq 0 continues with branch 0
+    for (int i = 1; i < n_branches; ++i) {
+        llama_memory_seq_rm(kv, i, -1, -1);
+        releaseSampler(samplers[i], sampler_keys[i]);
+    }
+
+    const auto & main_branch = outputs[0];
+    generated_text = main_branch.text;
+    stopped_eos = main_branch.stopped_eos;
+    stopped_word = main_branch.stopped_word;
+    stopped_limit = main_branch.stopped_limit;
+    stopping_word = main_branch.stopping_word;
+    num_tokens_predicted = main_branch.tokens.size();
+
+    // the last sampled token of branch 0 is only decoded if the branch was still active
+    const size_t n_decoded = active[0] && !decode_failed ? main_branch.tokens.size() : std::max<size_t>(main_branch.tokens.size(), 1) - 1;
+    embd.insert(embd.end(), main_branch.tokens.begin(), main_branch.tokens.end());
+    n_past = n_past_fork + (llama_pos) n_decoded;
+    if (fork_failed) {
+        // the last prompt token was removed from seq 0 and is evaluated again by the next prompt
+        n_past = n_past_fork - 1;
+    } else if (main_lora) {
+        // the cells of seq 0 from the re-decoded prompt token on hold branch 0's adapter activations,
+        // drop them so the next completion reuses a prefix computed without any adapter
+        n_past = std::max(n_past_fork - 1, 0);
+        if (!llama_memory_seq_rm(kv, 0, n_past, -1)) {
+            llama_memory_seq_rm(kv, 0, -1, -1);
+            n_past = 0;
+        }
+        while (!checkpoints.empty() && checkpoints.back().pos > n_past) {
+            checkpoints.pop_back();
+        }
+    }
+    if (fork_failed || main_lora) {
+        embd.resize(n_past);
+    }
+    n_remain = 0;
+    has_next_token = false;
+
+    return outputs;
+}
+
+int llama_rn_context::embeddingDims(const embedding_params &eparams) const
+{
+    const int n_embd = llama_model_n_embd(model);
+    if (eparams.n_dims <= 0 || eparams.n_dims > n_embd) {
+        return n_embd;
+    }
+    return eparams.n_dims;
+}
+
+size_t llama_rn_context::embeddingOutputSize(const embedding_params &eparams) const
+{
+    const size_t n_dims = embeddingDims(eparams);
+    switch (eparams.quant) {
+        case EMBEDDING_QUANT_INT8:
+            return n_dims;
+        case EMBEDDING_QUANT_BINARY:
+            return (n_dims + 7) / 8;
+        default:
+            return n_dims * sizeof(float);
+    }
 }
 
-std::vector<float> llama_rn_context::getEmbedding(common_params &embd_params)
+embedding_output llama_rn_context::embed(const std::string &text, const embedding_params &eparams, void *out)
 {
-    static const int n_embd = llama_model_n_embd(llama_get_model(ctx));
-    if (!embd_params.embedding)
-    {
-        LOG_WARNING("embedding disabled, embedding: %s", embd_params.embedding);
-        return std::vector<float>(n_embd, 0.0f);
+    if (!params.embedding) {
+        throw std::runtime_error("embedding disabled");
+    }
+    if (is_predicting) {
+        throw std::runtime_error("context is busy with a completion");
     }
-    float *data;
 
     const enum llama_pooling_type pooling_type = llama_pooling_type(ctx);
-    printf("pooling_type: %d\n", pooling_type);
-    if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
-        data = llama_get_embeddings(ctx);
-    } else {
-        data = llama_get_embeddings_seq(ctx, 0);
+    if (pooling_type == LLAMA_POOLING_TYPE_RANK) {
+        throw std::runtime_error("rank pooling produces scores, use rerank");
+    }
+
+    embedding_output result;
+    result.n_dims = embeddingDims(eparams);
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    result.tokens = common_tokenize(vocab, text, true, true);
+    const int n_tokens = result.tokens.size();
+    if (n_tokens == 0) {
+        throw std::runtime_error("empty input");
+    }
+    if (n_tokens > (int) llama_n_ctx(ctx)) {
+        throw std::runtime_error("input is too long, n_tokens: " + std::to_string(n_tokens) + ", n_ctx: " + std::to_string(llama_n_ctx(ctx)));
+    }
+    // pooled embeddings need the whole sequence in one ubatch
+    const bool pooled = pooling_type != LLAMA_POOLING_TYPE_NONE;
+    if (pooled && n_tokens > (int) llama_n_ubatch(ctx)) {
+        throw std::runtime_error("input is too long for the physical batch size, n_tokens: " + std::to_string(n_tokens) + ", n_ubatch: " + std::to_string(llama_n_ubatch(ctx)));
+    }
+
+    // the KV cache no longer matches the cached prompt
+    llama_memory_clear(llama_get_memory(ctx), false);
+    embd.clear();
+    evicted_spans.clear();
+    checkpoints.clear();
+    mtmd_bitmap_past_hashes.clear();
+    n_past = 0;
+
+    const int n_batch = pooled ? n_tokens : std::min(n_tokens, (int) llama_n_batch(ctx));
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    for (int i = 0; i < n_tokens; i += n_batch) {
+        llama_batch_clear(&batch);
+        const int n_eval = std::min(n_batch, n_tokens - i);
+        for (int j = 0; j < n_eval; ++j) {
+            // without pooling only the last token is read
+            llama_batch_add(&batch, result.tokens[i + j], i + j, { 0 }, pooled || i + j == n_tokens - 1);
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            llama_batch_free(batch);
+            throw std::runtime_error("failed to decode the embedding input");
+        }
     }
+    llama_batch_free(batch);
 
-    if (!data) {
-        return std::vector<float>(n_embd, 0.0f);
+    const float *data = pooled ? llama_get_embeddings_seq(ctx, 0) : llama_get_embeddings_ith(ctx, -1);
+    if (data == nullptr) {
+        throw std::runtime_error("failed to get the embeddings");
     }
-    std::vector<float> embedding(data, data + n_embd), out(data, data + n_embd);
-    common_embd_normalize(embedding.data(), out.data(), n_embd, embd_params.embd_normalize);
-    return out;
+
+    // truncate before normalizing, matryoshka prefixes are renormalized
+    const int n_dims = result.n_dims;
+    if (eparams.quant == EMBEDDING_QUANT_NONE) {
+        common_embd_normalize(data, static_cast<float *>(out), n_dims, eparams.normalize);
+        return result;
+    }
+
+    std::vector<float> values(n_dims);
+    common_embd_normalize(data, values.data(), n_dims, eparams.normalize);
+
+    if (eparams.quant == EMBEDDING_QUANT_INT8) {
+        float amax = 0.0f;
+        for (float v : values) {
+            amax = std::max(amax, std::fabs(v));
+        }
+        result.scale = amax / 127.0f;
+        const float id = amax > 0.0f ? 127.0f / amax : 0.0f;
+        int8_t *q = static_cast<int8_t *>(out);
+        for (int i = 0; i < n_dims; ++i) {
+            q[i] = (int8_t) std::lround(values[i] * id);
+        }
+    } else {
+        uint8_t *bits = static_cast<uint8_t *>(out);
+        std::fill(bits, bits + (n_dims + 7) / 8, 0);
+        for (int i = 0; i < n_dims; ++i) {
+            if (values[i] > 0.0f) {
+                bits[i / 8] |= 0x80 >> (i % 8);
+            }
+        }
+    }
+    return result;
 }
 
 // Helper function to format rerank task: [BOS]query[EOS][SEP]doc[EOS]
@@ -766,6 +2066,7 @@ std::vector<float> llama_rn_context::rerank(const std::string &query, const std:
     for (size_t i = 0; i < documents.size(); ++i) {
         rewind();
         embd = {};
+        evicted_spans.clear();
 
         const std::string & document = documents[i];
 
@@ -811,6 +2112,7 @@ std::string llama_rn_context::bench(int pp, int tg, int pl, int nr)
     }
 
     is_predicting = true;
+    is_interrupted = false;
 
     double pp_avg = 0;
     double tg_avg = 0;
@@ -911,24 +2213,385 @@ std::string llama_rn_context::bench(int pp, int tg, int pl, int nr)
         std::string("]");
 }
 
+llama_adapter_lora * llama_rn_context::acquireLoraAdapter(const std::string &path) {
+    auto it = lora_registry.find(path);
+    if (it == lora_registry.end()) {
+        llama_adapter_lora_ptr adapter(llama_adapter_lora_init(model, path.c_str()));
+        if (adapter == nullptr) {
+            LOG_ERROR("failed to load lora adapter '%s'", path.c_str());
+            return nullptr;
+        }
+        lora_adapter_entry entry;
+        entry.size = lora_adapter_size(adapter.get());
+        entry.adapter = std::move(adapter);
+        it = lora_registry.emplace(path, std::move(entry)).first;
+    }
+    it->second.n_refs++;
+    return it->second.adapter.get();
+}
+
+void llama_rn_context::releaseLoraAdapter(const std::string &path) {
+    auto it = lora_registry.find(path);
+    if (it != lora_registry.end() && it->second.n_refs > 0) {
+        it->second.n_refs--;
+    }
+}
+
+// Free the adapters that are not part of any active set, returns the released bytes
+size_t llama_rn_context::releaseUnusedLoraAdapters() {
+    size_t n_bytes = 0;
+    for (auto it = lora_registry.begin(); it != lora_registry.end();) {
+        if (it->second.n_refs == 0) {
+            n_bytes += it->second.size;
+            it = lora_registry.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return n_bytes;
+}
+
+// Swap the active adapter set, adapters already in the registry are not loaded again.
+// The previous set stays active if any adapter of the new one fails to load.
 int llama_rn_context::applyLoraAdapters(std::vector<common_adapter_lora_info> lora) {
-    for (auto &la : lora) {
-        la.ptr = llama_adapter_lora_init(model, la.path.c_str());
-        if (la.ptr == nullptr) {
-            LOG_ERROR("failed to apply lora adapter '%s'\n", la.path.c_str());
+    for (size_t i = 0; i < lora.size(); ++i) {
+        lora[i].ptr = acquireLoraAdapter(lora[i].path);
+        if (lora[i].ptr == nullptr) {
+            for (size_t j = 0; j < i; ++j) {
+                releaseLoraAdapter(lora[j].path);
+            }
             return -1;
         }
     }
+    for (const auto &la : this->lora) {
+        releaseLoraAdapter(la.path);
+    }
     this->lora = lora;
-    common_set_adapter_lora(ctx, lora);
+    common_set_adapter_lora(ctx, this->lora);
     return 0;
 }
 
 void llama_rn_context::removeLoraAdapters() {
+    for (const auto &la : this->lora) {
+        releaseLoraAdapter(la.path);
+    }
     this->lora.clear();
     common_set_adapter_lora(ctx, this->lora); // apply empty list
 }
 
+// Scratch buffers of a merge worker, reused across the row blocks and tensors it merges
+struct lora_merge_scratch {
+    std::vector<uint8_t> raw;
+    std::vector<float> rows;
+    std::vector<float> a;
+    std::vector<float> b;
+};
+
+// rows of a base weight dequantized at once, bounds the f32 scratch of each worker to 4 MiB
+static const int64_t lora_merge_block_elements = 1 << 20;
+
+// Dequantize n_rows rows of t starting at row i0 into out
+static void lora_tensor_rows_to_f32(const lm_ggml_tensor * t, int64_t i0, int64_t n_rows, std::vector<float> &out, std::vector<uint8_t> &raw) {
+    const size_t row_size = lm_ggml_row_size(t->type, t->ne[0]);
+    out.resize(n_rows * t->ne[0]);
+    if (t->type == LM_GGML_TYPE_F32) {
+        lm_ggml_backend_tensor_get(t, out.data(), i0 * row_size, n_rows * row_size);
+        return;
+    }
+    raw.resize(n_rows * row_size);
+    lm_ggml_backend_tensor_get(t, raw.data(), i0 * row_size, raw.size());
+    lm_ggml_get_type_traits(t->type)->to_float(raw.data(), out.data(), out.size());
+}
+
+// Dequantize w block by block, add the scaled B*A products of the adapters and quantize back to the type of w into dst
+static bool merge_lora_tensor(const lm_ggml_tensor * w, lm_ggml_tensor * dst, const std::vector<common_adapter_lora_info> &lora, lora_merge_scratch &scratch) {
+    const int64_t n_in = w->ne[0];
+    const int64_t n_out = w->ne[1];
+    const size_t row_size = lm_ggml_row_size(w->type, n_in);
+    const int64_t block_rows = std::max<int64_t>(1, lora_merge_block_elements / n_in);
+
+    struct lora_merge_weight {
+        int64_t rank;
+        float scale;
+        size_t a_off;
+        size_t b_off;
+    };
+    std::vector<lora_merge_weight> weights;
+    scratch.a.clear();
+    scratch.b.clear();
+    for (const auto &la : lora) {
+        const llama_adapter_lora_weight * lw = la.ptr->get_weight(const_cast<lm_ggml_tensor *>(w));
+        if (lw == nullptr) {
+            continue;
+        }
+        const int64_t rank = lw->b->ne[0];
+        if (lw->a->ne[0] != n_in || lw->a->ne[1] != rank || lw->b->ne[1] != n_out) {
+            LOG_ERROR("lora shape mismatch for %s", lm_ggml_get_name(w));
+            return false;
+        }
+        // the low-rank factors are small next to w, they are dequantized whole
+        std::vector<float> tmp;
+        const size_t a_off = scratch.a.size();
+        const size_t b_off = scratch.b.size();
+        lora_tensor_rows_to_f32(lw->a, 0, rank, tmp, scratch.raw);
+        scratch.a.insert(scratch.a.end(), tmp.begin(), tmp.end());
+        lora_tensor_rows_to_f32(lw->b, 0, n_out, tmp, scratch.raw);
+        scratch.b.insert(scratch.b.end(), tmp.begin(), tmp.end());
+        weights.push_back({ rank, lw->get_scale(la.ptr->alpha, la.scale), a_off, b_off });
+    }
+
+    for (int64_t o0 = 0; o0 < n_out; o0 += block_rows) {
+        const int64_t n_rows = std::min(block_rows, n_out - o0);
+        lora_tensor_rows_to_f32(w, o0, n_rows, scratch.rows, scratch.raw);
+
+        for (const auto &lw : weights) {
+            const float * a = scratch.a.data() + lw.a_off;
+            const float * b = scratch.b.data() + lw.b_off;
+            for (int64_t o = 0; o < n_rows; ++o) {
+                float * row = scratch.rows.data() + o * n_in;
+                for (int64_t r = 0; r < lw.rank; ++r) {
+                    const float c = lw.scale * b[(o0 + o) * lw.rank + r];
+                    const float * a_row = a + r * n_in;
+                    for (int64_t i = 0; i < n_in; ++i) {
+                        row[i] += c * a_row[i];
+                    }
+                }
+            }
+        }
+
+        scratch.raw.resize(n_rows * row_size);
+        lm_ggml_quantize_chunk(w->type, scratch.rows.data(), scratch.raw.data(), 0, n_rows, n_in, nullptr);
+        lm_ggml_backend_tensor_set(dst, scratch.raw.data(), o0 * row_size, n_rows * row_size);
+    }
+    return true;
+}
+
+// size and modification time of a file, so a file replaced in place does not match its old merge
+static std::string lora_merge_file_key(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return "-1:-1";
+    }
+    return std::to_string((long long) st.st_size) + ":" + std::to_string((long long) st.st_mtime);
+}
+
+static std::string lora_merge_cache_key(const std::string &model_path, const std::vector<common_adapter_lora_info> &lora) {
+    std::string key = model_path + ":" + lora_merge_file_key(model_path);
+    for (const auto &la : lora) {
+        key += "|" + la.path + ":" + std::to_string(la.scale) + ":" + lora_merge_file_key(la.path);
+    }
+    return key;
+}
+
+// Read the merged weights written by a previous merge of the same model and adapters
+static bool load_lora_merge_cache(const std::string &path, const std::string &key, const std::vector<lm_ggml_tensor *> &copies) {
+    lm_ggml_context * meta = nullptr;
+    lm_gguf_init_params gguf_params = { /*.no_alloc =*/ true, /*.ctx =*/ &meta };
+    lm_gguf_context * gguf = lm_gguf_init_from_file(path.c_str(), gguf_params);
+    if (gguf == nullptr) {
+        return false;
+    }
+    bool ok = false;
+    const int64_t key_id = lm_gguf_find_key(gguf, "rnllama.lora_merge.key");
+    if (key_id >= 0 && key == lm_gguf_get_val_str(gguf, key_id) && lm_gguf_get_n_tensors(gguf) == (int64_t) copies.size()) {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> buf;
+        ok = file.good();
+        for (size_t i = 0; ok && i < copies.size(); ++i) {
+            lm_ggml_tensor * copy = copies[i];
+            const int64_t tensor_id = lm_gguf_find_tensor(gguf, lm_ggml_get_name(copy));
+            const lm_ggml_tensor * cached = tensor_id >= 0 ? lm_ggml_get_tensor(meta, lm_ggml_get_name(copy)) : nullptr;
+            if (cached == nullptr || cached->type != copy->type || !lm_ggml_are_same_shape(cached, copy)) {
+                ok = false;
+                break;
+            }
+            buf.resize(lm_ggml_nbytes(copy));
+            file.seekg(lm_gguf_get_data_offset(gguf) + lm_gguf_get_tensor_offset(gguf, tensor_id));
+            file.read((char *) buf.data(), buf.size());
+            ok = file.good();
+            if (ok) {
+                lm_ggml_backend_tensor_set(copy, buf.data(), 0, buf.size());
+            }
+        }
+    }
+    lm_gguf_free(gguf);
+    lm_ggml_free(meta);
+    return ok;
+}
+
+int llama_rn_context::mergeLoraAdapters(std::vector<common_adapter_lora_info> lora_merge, const std::string &cache_path) {
+    context_lock lock(this);
+    if (is_predicting) {
+        LOG_ERROR("cannot merge lora adapters while predicting");
+        return -1;
+    }
+    unmergeLoraAdapters();
+    if (lora_merge.empty()) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < lora_merge.size(); ++i) {
+        lora_merge[i].ptr = acquireLoraAdapter(lora_merge[i].path);
+        if (lora_merge[i].ptr == nullptr) {
+            for (size_t j = 0; j < i; ++j) {
+                releaseLoraAdapter(lora_merge[j].path);
+            }
+            return -1;
+        }
+    }
+    auto release_merge_adapters = [&]() {
+        for (const auto &la : lora_merge) {
+            releaseLoraAdapter(la.path);
+        }
+    };
+
+    // base weights modified by any of the adapters
+    std::vector<lm_ggml_tensor *> targets;
+    for (const auto &it : model->tensors_by_name) {
+        lm_ggml_tensor * w = it.second;
+        bool affected = false;
+        for (const auto &la : lora_merge) {
+            affected |= la.ptr->get_weight(w) != nullptr;
+        }
+        if (!affected) {
+            continue;
+        }
+        // token_embd adapters are stored transposed and only work as get_rows on the unmerged weight
+        if (w == model->tok_embd) {
+            release_merge_adapters();
+            throw std::runtime_error("Merging lora adapters into token_embd is not supported, apply them instead");
+        }
+        // repacked CPU weights can't be read back, some quant types can't be produced without an imatrix
+        if (w->extra != nullptr || w->buffer == nullptr || lm_ggml_n_dims(w) > 2 ||
+            (lm_ggml_get_type_traits(w->type)->to_float == nullptr && w->type != LM_GGML_TYPE_F32) ||
+            lm_ggml_quantize_requires_imatrix(w->type)) {
+            LOG_ERROR("cannot merge lora adapters into %s (%s)", it.first.c_str(), lm_ggml_type_name(w->type));
+            release_merge_adapters();
+            return -1;
+        }
+        targets.push_back(w);
+    }
+
+    // private copies in the default buffer type of the device holding each weight
+    std::map<lm_ggml_backend_buffer_type_t, std::vector<size_t>> targets_by_buft;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        lm_ggml_backend_dev_t dev = lm_ggml_backend_buft_get_device(lm_ggml_backend_buffer_get_type(targets[i]->buffer));
+        lm_ggml_backend_buffer_type_t buft = dev != nullptr ? lm_ggml_backend_dev_buffer_type(dev) : lm_ggml_backend_cpu_buffer_type();
+        targets_by_buft[buft].push_back(i);
+    }
+    std::vector<lm_ggml_tensor *> copies(targets.size(), nullptr);
+    for (const auto &it : targets_by_buft) {
+        lm_ggml_init_params ctx_params = { it.second.size() * lm_ggml_tensor_overhead(), nullptr, true };
+        lm_ggml_context_ptr ctx_copy(lm_ggml_init(ctx_params));
+        for (size_t i : it.second) {
+            copies[i] = lm_ggml_dup_tensor(ctx_copy.get(), targets[i]);
+            lm_ggml_set_name(copies[i], lm_ggml_get_name(targets[i]));
+        }
+        lm_ggml_backend_buffer_ptr buf(lm_ggml_backend_alloc_ctx_tensors_from_buft(ctx_copy.get(), it.first));
+        if (buf == nullptr) {
+            LOG_ERROR("failed to allocate the merged lora weights");
+            lora_merged_ctxs.clear();
+            lora_merged_bufs.clear();
+            release_merge_adapters();
+            return -1;
+        }
+        lora_merged_ctxs.push_back(std::move(ctx_copy));
+        lora_merged_bufs.push_back(std::move(buf));
+    }
+
+    const std::string cache_key = lora_merge_cache_key(params.model.path, lora_merge);
+    const int64_t t_start_us = lm_ggml_time_us();
+    const bool cached = !cache_path.empty() && load_lora_merge_cache(cache_path, cache_key, copies);
+    if (!cached) {
+        std::atomic<size_t> next{0};
+        std::atomic<bool> failed{false};
+        auto worker = [&]() {
+            lora_merge_scratch scratch;
+            for (size_t i = next++; i < targets.size() && !failed; i = next++) {
+                if (!merge_lora_tensor(targets[i], copies[i], lora_merge, scratch)) {
+                    failed = true;
+                }
+            }
+        };
+        const int n_threads = std::max(1, std::min(params.cpuparams_batch.n_threads, (int) targets.size()));
+        std::vector<std::thread> workers;
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto &t : workers) {
+            t.join();
+        }
+        if (failed) {
+            lora_merged_ctxs.clear();
+            lora_merged_bufs.clear();
+            release_merge_adapters();
+            return -1;
+        }
+
+        if (!cache_path.empty()) {
+            lm_gguf_context * gguf = lm_gguf_init_empty();
+            lm_gguf_set_val_str(gguf, "rnllama.lora_merge.key", cache_key.c_str());
+            for (const auto * copy : copies) {
+                lm_gguf_add_tensor(gguf, copy);
+            }
+            if (!lm_gguf_write_to_file(gguf, cache_path.c_str(), false)) {
+                LOG_WARNING("failed to write the merged lora cache to %s", cache_path.c_str());
+            }
+            lm_gguf_free(gguf);
+        }
+    }
+    LOG_INFO("merged lora adapters into %zu tensors in %.2f ms%s",
+        targets.size(), (lm_ggml_time_us() - t_start_us) / 1000.0, cached ? " (cached)" : "");
+
+    for (size_t i = 0; i < targets.size(); ++i) {
+        lora_merged_tensors.push_back({ targets[i], targets[i]->data, targets[i]->buffer });
+        targets[i]->data = copies[i]->data;
+        targets[i]->buffer = copies[i]->buffer;
+    }
+
+    // the merged adapters are not needed at runtime anymore
+    for (auto it = lora.begin(); it != lora.end();) {
+        const bool merged = std::any_of(lora_merge.begin(), lora_merge.end(), [&](const common_adapter_lora_info &la) {
+            return la.path == it->path;
+        });
+        if (merged) {
+            releaseLoraAdapter(it->path);
+            it = lora.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    release_merge_adapters();
+    for (auto &la : lora_merge) {
+        la.ptr = nullptr;
+    }
+    lora_merged = lora_merge;
+    if (ctx != nullptr) {
+        // also drops the graph kept for reuse, it references the previous weights
+        common_set_adapter_lora(ctx, lora);
+    }
+    return 0;
+}
+
+void llama_rn_context::unmergeLoraAdapters() {
+    context_lock lock(this);
+    if (lora_merged_tensors.empty()) {
+        return;
+    }
+    for (auto &mt : lora_merged_tensors) {
+        mt.tensor->data = mt.data;
+        mt.tensor->buffer = mt.buffer;
+    }
+    lora_merged_tensors.clear();
+    lora_merged_bufs.clear();
+    lora_merged_ctxs.clear();
+    lora_merged.clear();
+    if (ctx != nullptr) {
+        common_set_adapter_lora(ctx, lora);
+    }
+}
+
 std::vector<common_adapter_lora_info> llama_rn_context::getLoadedLoraAdapters() {
     return this->lora;
 }
@@ -961,6 +2624,10 @@ bool llama_rn_context::initMultimodal(const std::string &mmproj_path, bool use_g
     }
     mtmd_wrapper = new llama_rn_context_mtmd();
     mtmd_wrapper->mtmd_ctx = mtmd_ctx;
+    struct stat mmproj_stat;
+    if (stat(mmproj_path.c_str(), &mmproj_stat) == 0) {
+        mtmd_wrapper->model_size = mmproj_stat.st_size;
+    }
 
     has_multimodal = true;
 
@@ -971,15 +2638,17 @@ bool llama_rn_context::initMultimodal(const std::string &mmproj_path, bool use_g
              uses_mrope ? 1 : 0,
              uses_non_causal ? 1 : 0);
 
-    // Disable context shifting when multimodal is enabled
-    // This is because an media chunk may contain multiple tokens
-    // and context shifting could break the media representation
-    params.ctx_shift = false;
+    // Media chunks are evicted as whole spans by shiftContext, but with M-RoPE
+    // the positions of a media chunk don't match its token count, so the
+    // KV positions can't be shifted by token index
+    if (uses_mrope) {
+        params.ctx_shift = false;
+        LOG_INFO("Context shifting disabled for M-RoPE multimodal model");
+    }
 
     // params.n_cache_reuse = 0;
 
     LOG_INFO("Multimodal context initialized successfully with mmproj: %s", mmproj_path.c_str());
-    LOG_INFO("Context shifting disabled for multimodal support");
     return true;
 }
 
@@ -1206,6 +2875,211 @@ mtmd_tokenize_result tokenizeWithMedia(llama_rn_context_mtmd *mtmd_wrapper, cons
 
     return result;
 }
+// Encodes the media chunks of a prompt on a worker thread while the LLM prefills the chunks before them.
+// The image chunks of one media (overview and slices) are encoded together, and the embeddings are
+// handed to the LLM through a bounded queue. While both stages run, the prompt processing threads
+// are split between them.
+class media_encode_pipeline {
+public:
+    media_encode_pipeline(mtmd_context *mtmd_ctx, const mtmd_input_chunks *chunks, size_t first_chunk, int n_embd, int n_threads)
+        : mtmd_ctx(mtmd_ctx), chunks(chunks), n_embd(n_embd), n_threads_total(std::max(1, n_threads)) {
+        const size_t num_chunks = mtmd_input_chunks_size(chunks);
+        for (size_t i = first_chunk; i < num_chunks; i++) {
+            auto chunk = mtmd_input_chunks_get(chunks, i);
+            auto type = mtmd_input_chunk_get_type(chunk);
+            if (type == MTMD_INPUT_CHUNK_TYPE_TEXT || (!groups.empty() && groups.back().chunk_idx.back() >= i)) {
+                continue;
+            }
+            group g;
+            // the first group can only overlap with prefill if there is text to decode before it
+            g.overlaps_prefill = !groups.empty() || i > first_chunk;
+            g.chunk_idx.push_back(i);
+            if (type == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+                const std::string id = chunk_id(chunk);
+                for (size_t j = i + 1; j < num_chunks; j++) {
+                    auto next = mtmd_input_chunks_get(chunks, j);
+                    auto next_type = mtmd_input_chunk_get_type(next);
+                    if (next_type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                        continue; // separators between slices
+                    }
+                    if (next_type != MTMD_INPUT_CHUNK_TYPE_IMAGE || chunk_id(next) != id) {
+                        break;
+                    }
+                    g.chunk_idx.push_back(j);
+                }
+            }
+            groups.push_back(std::move(g));
+        }
+
+        // there is nothing to overlap with a single core, the groups are then encoded on demand
+        async = n_threads_total > 1 && !groups.empty();
+        if (async) {
+            worker = std::thread([this]() { run(); });
+        }
+    }
+
+    ~media_encode_pipeline() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            cv.notify_all();
+            worker.join();
+        }
+        mtmd_set_n_threads(mtmd_ctx, n_threads_total);
+    }
+
+    // embeddings of media chunk i, waits for the encoder if needed, nullptr if encoding failed
+    float * get(size_t i) {
+        while (!current || i > current->chunk_idx.back()) {
+            current = next_encoded();
+            if (!current || !current->ok) {
+                return nullptr;
+            }
+        }
+        for (size_t k = 0; k < current->chunk_idx.size(); k++) {
+            if (current->chunk_idx[k] == i) {
+                return current->embd.data() + current->embd_offset[k];
+            }
+        }
+        return nullptr;
+    }
+
+    // number of threads the LLM can use right now without competing with the encoder
+    int n_threads_llm() const {
+        const int n_enc = n_threads_encoding.load();
+        return n_enc > 0 ? std::max(1, n_threads_total - n_enc) : n_threads_total;
+    }
+
+private:
+    struct group {
+        std::vector<size_t> chunk_idx;
+        bool overlaps_prefill = false;
+    };
+
+    struct encoded {
+        std::vector<size_t> chunk_idx;
+        std::vector<size_t> embd_offset;
+        std::vector<float> embd;
+        bool ok = false;
+    };
+
+    // at most this many encoded groups wait for the LLM, this bounds the memory held by embeddings
+    static constexpr size_t max_queued = 2;
+
+    static std::string chunk_id(const mtmd_input_chunk *chunk) {
+        const char *id = mtmd_input_chunk_get_id(chunk);
+        return id ? id : "";
+    }
+
+    std::unique_ptr<encoded> encode(const group &g, int n_threads) {
+        std::unique_ptr<encoded> res(new encoded);
+        res->chunk_idx = g.chunk_idx;
+
+        std::vector<const mtmd_input_chunk *> group_chunks;
+        size_t n_tokens = 0;
+        for (size_t idx : g.chunk_idx) {
+            auto chunk = mtmd_input_chunks_get(chunks, idx);
+            res->embd_offset.push_back(n_tokens * n_embd);
+            n_tokens += mtmd_input_chunk_get_n_tokens(chunk);
+            group_chunks.push_back(chunk);
+        }
+
+        int64_t t_start = lm_ggml_time_ms();
+        mtmd_set_n_threads(mtmd_ctx, n_threads);
+        int32_t ret = mtmd_input_chunk_get_type(group_chunks[0]) == MTMD_INPUT_CHUNK_TYPE_IMAGE
+            ? mtmd_encode_chunks(mtmd_ctx, group_chunks.data(), group_chunks.size())
+            : mtmd_encode_chunk(mtmd_ctx, group_chunks[0]);
+        if (ret != 0) {
+            LOG_ERROR("Failed to encode media chunk %zu", g.chunk_idx[0]);
+            return res;
+        }
+        LOG_INFO("[DEBUG] Encoded %zu media chunks with %d threads in %d ms",
+            group_chunks.size(), n_threads, (int) (lm_ggml_time_ms() - t_start));
+
+        const float *embd = mtmd_get_output_embd(mtmd_ctx);
+        res->embd.assign(embd, embd + n_tokens * n_embd);
+        res->ok = true;
+        return res;
+    }
+
+    void run() {
+        for (const group &g : groups) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stop || queue.size() < max_queued; });
+                if (stop) {
+                    break;
+                }
+            }
+
+            // the encoder is usually the longer stage, it gets the larger half of the threads
+            const int n_threads = g.overlaps_prefill ? (n_threads_total + 1) / 2 : n_threads_total;
+            n_threads_encoding = n_threads;
+            std::unique_ptr<encoded> res = encode(g, n_threads);
+            n_threads_encoding = 0;
+
+            const bool ok = res->ok;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(std::move(res));
+            }
+            cv.notify_all();
+            if (!ok) {
+                break;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        cv.notify_all();
+    }
+
+    std::unique_ptr<encoded> next_encoded() {
+        if (!async) {
+            if (next_group >= groups.size()) {
+                return nullptr;
+            }
+            return encode(groups[next_group++], n_threads_total);
+        }
+
+        std::unique_ptr<encoded> res;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return finished || !queue.empty(); });
+            if (queue.empty()) {
+                return nullptr;
+            }
+            res = std::move(queue.front());
+            queue.pop_front();
+        }
+        cv.notify_all();
+        return res;
+    }
+
+    mtmd_context *mtmd_ctx;
+    const mtmd_input_chunks *chunks;
+    const int n_embd;
+    const int n_threads_total;
+
+    std::vector<group> groups;
+    size_t next_group = 0; // on-demand mode only
+    bool async = false;
+
+    std::unique_ptr<encoded> current;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::unique_ptr<encoded>> queue;
+    std::atomic<int> n_threads_encoding{0};
+    bool stop = false;
+    bool finished = false;
+};
+
 void llama_rn_context::processMedia(
     const std::string &prompt,
     const std::vector<std::string> &media_paths
@@ -1300,6 +3174,24 @@ void llama_rn_context::processMedia(
 
     size_t num_chunks = mtmd_input_chunks_size(chunks);
 
+    size_t first_chunk = 0;
+    while (n_past >= 0 && first_chunk < chunk_pos.size() && chunk_pos[first_chunk] < (size_t) n_past) {
+        first_chunk++;
+    }
+
+    // media chunks are encoded ahead on a worker thread while the chunks before them are decoded,
+    // the LLM gives up part of its prompt processing threads while the encoder runs
+    const int n_threads_batch = params.cpuparams_batch.n_threads;
+    int n_threads_llm = n_threads_batch;
+    auto set_llm_threads = [&](int n) {
+        if (n != n_threads_llm) {
+            llama_set_n_threads(ctx, params.cpuparams.n_threads, n);
+            n_threads_llm = n;
+        }
+    };
+    std::unique_ptr<media_encode_pipeline> media(new media_encode_pipeline(
+        mtmd_wrapper->mtmd_ctx, chunks, first_chunk, llama_model_n_embd(model), n_threads_batch));
+
     for (size_t i = 0; i < chunk_pos.size(); i++) {
 
         LOG_INFO("[DEBUG] Evaluating chunk %zu: n_past=%d, chunk_pos=%zu", i, n_past, chunk_pos[i]);
@@ -1309,17 +3201,43 @@ void llama_rn_context::processMedia(
             bool chunk_logits_last = (i == num_chunks - 1);
             auto chunk = mtmd_input_chunks_get(chunks, i);
 
-            int32_t res = mtmd_helper_eval_chunk_single(
-                mtmd_wrapper->mtmd_ctx,
-                ctx,
-                chunk,
-                n_past,
-                0,
-                params.n_batch,
-                chunk_logits_last,
-                &new_n_past
-            );
+            int32_t res;
+            if (mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                float * embd = media->get(i);
+                if (embd == nullptr) {
+                    media.reset();
+                    set_llm_threads(n_threads_batch);
+                    mtmd_input_chunks_free(chunks);
+                    throw std::runtime_error("Failed to encode media");
+                }
+
+                set_llm_threads(media->n_threads_llm());
+                res = mtmd_helper_decode_image_chunk(
+                    mtmd_wrapper->mtmd_ctx,
+                    ctx,
+                    chunk,
+                    embd,
+                    n_past,
+                    0,
+                    params.n_batch,
+                    &new_n_past
+                );
+            } else {
+                set_llm_threads(media->n_threads_llm());
+                res = mtmd_helper_eval_chunk_single(
+                    mtmd_wrapper->mtmd_ctx,
+                    ctx,
+                    chunk,
+                    n_past,
+                    0,
+                    params.n_batch,
+                    chunk_logits_last,
+                    &new_n_past
+                );
+            }
             if (res != 0) {
+                media.reset();
+                set_llm_threads(n_threads_batch);
                 mtmd_input_chunks_free(chunks);
                 throw std::runtime_error("Failed to evaluate chunks");
             }
@@ -1327,6 +3245,10 @@ void llama_rn_context::processMedia(
         }
     }
 
+    // the worker reads the chunks, it has to be joined before they are freed
+    media.reset();
+    set_llm_threads(n_threads_batch);
+
     if (n_past == all_tokens.size() && n_past > 0 && all_tokens[n_past - 1] != LLAMA_TOKEN_NULL) {
         // we have to evaluate at least 1 token to generate logits.
         n_past--;
@@ -1334,6 +3256,7 @@ void llama_rn_context::processMedia(
 
     // Update embd with all tokens (both text and media)
     embd = all_tokens;
+    evicted_spans.clear();
 
     mtmd_bitmap_past_hashes = bitmap_hashes;
 
@@ -1352,6 +3275,8 @@ void llama_rn_context::processMedia(
 
 llama_rn_tokenize_result llama_rn_context::tokenize(const std::string &text, const std::vector<std::string> &media_paths) {
     if (media_paths.size() > 0) {
+        // text alone only needs the vocab, media goes through the multimodal context
+        context_lock lock(this);
         if (!isMultimodalEnabled()) {
             throw std::runtime_error("Multimodal is not enabled but media paths are provided");
         }
@@ -1367,7 +3292,7 @@ llama_rn_tokenize_result llama_rn_context::tokenize(const std::string &text, con
         return tokenize_result;
     }
     std::vector<llama_token> text_tokens;
-    text_tokens = common_tokenize(ctx, text, false);
+    text_tokens = common_tokenize(llama_model_get_vocab(model), text, false);
     llama_rn_tokenize_result tokenize_result = {
         .tokens = text_tokens,
         .has_media = false,
@@ -1400,24 +3325,20 @@ void llama_rn_context::releaseMultimodal() {
     }
 }
 
-struct llama_rn_context_vocoder {
-    common_init_result init_result;
-    llama_model *model = nullptr;
-    llama_context *ctx = nullptr;
-    tts_type type = UNKNOWN;
-};
-
 bool llama_rn_context::initVocoder(const std::string &vocoder_model_path) {
     if (vocoder_wrapper != nullptr) {
         return true;
     }
-    params.model.path = vocoder_model_path;
-    params.embedding = true;
-    params.ctx_shift = false;
-    params.n_ubatch = params.n_batch;
+    // keep the params of the main model intact, ensureResident and the samplers still use them
+    common_params vocoder_params = params;
+    vocoder_params.model.path = vocoder_model_path;
+    vocoder_params.embedding = true;
+    vocoder_params.ctx_shift = false;
+    vocoder_params.n_ubatch = vocoder_params.n_batch;
+    vocoder_params.lora_adapters.clear();
 
     llama_rn_context_vocoder *wrapper = new llama_rn_context_vocoder{
-        .init_result = common_init_from_params(params),
+        .init_result = common_init_from_params(vocoder_params),
     };
 
     wrapper->model = wrapper->init_result.model.get();
@@ -1906,4 +3827,109 @@ std::vector<float> llama_rn_context::decodeAudioTokens(const std::vector<llama_t
     return embd_to_audio(embd, n_codes, n_embd, params.cpuparams.n_threads);
 }
 
+void llama_rn_context::initVectorStore(const std::string &path, vector_store_params vparams) {
+    if (!params.embedding) {
+        throw std::runtime_error("embedding disabled but required for the vector store");
+    }
+    releaseVectorStore();
+    // a new store defaults to the full embedding size, an existing one keeps the dimensions of its header
+    struct stat st;
+    if (vparams.n_dims <= 0 && (stat(path.c_str(), &st) != 0 || st.st_size == 0)) {
+        vparams.n_dims = llama_model_n_embd(model);
+    }
+    vstore = vector_store::open(path, vparams);
+    if (vstore->n_dims() > llama_model_n_embd(model)) {
+        vstore.reset();
+        throw std::runtime_error("vector store has more dimensions than the model embeddings");
+    }
+    LOG_INFO("opened vector store %s, %zu rows, %d dims", path.c_str(), vstore->size(), vstore->n_dims());
+}
+
+bool llama_rn_context::isVectorStoreEnabled() const {
+    return vstore != nullptr;
+}
+
+std::vector<int64_t> llama_rn_context::addToVectorStore(
+    const std::vector<std::string> &texts,
+    const std::vector<int64_t> &keys,
+    bool store_text
+) {
+    if (vstore == nullptr) {
+        throw std::runtime_error("vector store is not initialized");
+    }
+    if (!keys.empty() && keys.size() != texts.size()) {
+        throw std::runtime_error("keys and texts have different sizes");
+    }
+
+    embedding_params eparams;
+    eparams.n_dims = vstore->n_dims();
+    std::vector<float> embd(vstore->n_dims());
+    std::vector<int64_t> result;
+    result.reserve(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        embed(texts[i], eparams, embd.data());
+        const std::string &text = store_text ? texts[i] : "";
+        if (keys.empty()) {
+            result.push_back(vstore->add(embd.data(), text));
+        } else {
+            vstore->add(keys[i], embd.data(), text);
+            result.push_back(keys[i]);
+        }
+    }
+    return result;
+}
+
+std::vector<vector_store_result> llama_rn_context::searchVectorStore(
+    const std::string &query,
+    int k,
+    int n_probe,
+    llama_rn_context *rerank_ctx,
+    int n_rerank
+) {
+    if (vstore == nullptr) {
+        throw std::runtime_error("vector store is not initialized");
+    }
+
+    embedding_params eparams;
+    eparams.n_dims = vstore->n_dims();
+    std::vector<float> embd(vstore->n_dims());
+    embed(query, eparams, embd.data());
+
+    std::vector<vector_store_result> results = vstore->search(embd.data(), rerank_ctx ? std::max(k, n_rerank) : k, n_probe);
+    if (rerank_ctx != nullptr && !results.empty()) {
+        std::vector<std::string> documents;
+        documents.reserve(results.size());
+        for (const auto &res : results) {
+            if (!vstore->hasText(res.row)) {
+                throw std::runtime_error("rerank needs the texts stored with the vectors");
+            }
+            documents.push_back(vstore->text(res.row));
+        }
+        // the caller holds this context, waiting on another one could deadlock with a search the other way round
+        context_lock rerank_lock(rerank_ctx, std::try_to_lock);
+        if (!rerank_lock.owns_lock() || rerank_ctx->is_predicting) {
+            throw std::runtime_error("Rerank context is busy");
+        }
+        rerank_ctx->ensureResident();
+        const std::vector<float> scores = rerank_ctx->rerank(query, documents);
+        for (size_t i = 0; i < results.size() && i < scores.size(); ++i) {
+            results[i].score = scores[i];
+        }
+        std::stable_sort(results.begin(), results.end(), [](const vector_store_result &a, const vector_store_result &b) {
+            return a.score > b.score;
+        });
+    }
+    if ((int) results.size() > k) {
+        results.resize(k);
+    }
+    return results;
+}
+
+void llama_rn_context::releaseVectorStore() {
+    if (vstore != nullptr) {
+        vstore->sync();
+        vstore.reset();
+    }
+}
+
 }
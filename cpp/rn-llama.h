@@ -4,19 +4,28 @@
 #include <sstream>
 #include <iostream>
 #include <thread>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
 #include <codecvt>
 #include "anyascii.h"
 #include "chat.h"
 #include "common.h"
 #include "ggml.h"
+#include "ggml-cpp.h"
 #include "gguf.h"
 #include "llama.h"
 #include "llama-impl.h"
 #include "sampling.h"
+#include "rn-vector-store.h"
 #include "nlohmann/json.hpp"
 #if defined(__ANDROID__)
 #include <android/log.h>
 #endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 using json = nlohmann::ordered_json;
 
@@ -25,9 +34,13 @@ namespace rnllama {
 std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token);
 
 std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end);
+std::string tokens_to_str(const llama_vocab *vocab, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end);
 
 lm_ggml_type kv_cache_type_from_str(const std::string & s);
 
+// Base64 of a raw buffer, used to move tensors across the bridges in one string
+std::string base64_encode(const void *data, size_t size);
+
 enum stop_type
 {
     STOP_FULL,
@@ -47,6 +60,48 @@ struct completion_token_output
     llama_token tok;
 };
 
+// text and token probabilities generated since the previous partial completion
+struct completion_partial
+{
+    std::string text;
+    std::vector<completion_token_output> probs;
+    size_t n_tokens = 0;
+};
+
+// Coalesces the partial completions of a generation for the bridges. Deltas are merged
+// until interval_us has elapsed since the previous emit (or max_tokens are pending), and
+// while the bridge reports the previous partial is still on its way to JS, so a slow UI
+// receives fewer, larger updates instead of a growing queue.
+struct partial_emitter
+{
+    int64_t interval_us = 0; // minimum time between two emits, 0 to emit every piece
+    size_t max_tokens = 0;   // emit once this many tokens are pending within the interval, 0 for no limit
+    std::function<void(const completion_partial &)> emit;
+    std::function<bool()> busy; // optional backpressure of the bridge
+
+    void push(const std::string &text, std::vector<completion_token_output> &&probs, size_t n_tokens);
+    // Emit what is pending regardless of the interval and backpressure, at the end of the generation
+    void flush();
+
+private:
+    completion_partial pending;
+    int64_t t_last_emit_us = 0;
+
+    void emitPending();
+};
+
+// output of a single branch forked from the prompt by doBranchedCompletion
+struct completion_branch_output
+{
+    llama_seq_id seq_id = 0;
+    std::string text;
+    std::vector<llama_token> tokens;
+    bool stopped_eos = false;
+    bool stopped_word = false;
+    bool stopped_limit = false;
+    std::string stopping_word;
+};
+
 struct llama_rn_context_mtmd;
 
 struct llama_rn_context_vocoder;
@@ -59,6 +114,90 @@ struct llama_rn_tokenize_result {
     std::vector<size_t> chunk_pos_media; // media only
 };
 
+// Policy used to pick the tokens evicted when the context is full
+enum ctx_shift_policy {
+    CTX_SHIFT_POLICY_BLOCK = 0,       // keep n_keep tokens, discard half of the remaining tokens
+    CTX_SHIFT_POLICY_SINK_WINDOW = 1, // keep the attention sink tokens, discard the oldest quarter of the recent window
+};
+
+ctx_shift_policy ctx_shift_policy_from_str(const std::string & s);
+
+// CPU cores grouped by capacity (cpufreq on Linux / Android, perf levels on Apple), fastest first
+struct cpu_topology {
+    std::vector<int> performance; // cores the inference threads run on
+    std::vector<int> efficiency;  // the slower cluster(s) of a big.LITTLE CPU
+};
+
+cpu_topology cpu_get_topology();
+
+// Set the thread counts and affinity for token generation (cpuparams) and prompt processing (cpuparams_batch)
+// from the topology read on the first call, n_threads > 0 overrides the automatic choice for both
+void cpu_params_from_topology(common_params &params, int n_threads);
+
+// Span of token positions [p0, p1) evicted from the context
+struct ctx_shift_span {
+    size_t p0 = 0;
+    size_t p1 = 0;
+};
+
+// Recurrent state of seq 0 after evaluating the first pos tokens of embd
+struct recurrent_checkpoint {
+    llama_pos pos = 0;
+    std::vector<uint8_t> state;
+};
+
+// Memory held by a context, in bytes
+struct llama_rn_context_footprint {
+    size_t weights = 0;          // model weights
+    size_t weights_resident = 0; // mmapped weights currently resident in RAM
+    size_t kv = 0;               // KV / recurrent state of the cached tokens and its checkpoints
+    size_t compute = 0;          // compute buffers
+    size_t multimodal = 0;       // mmproj side model
+    size_t lora = 0;             // LoRA adapters loaded in the registry
+    size_t vocoder = 0;          // vocoder side model and its buffers
+    bool suspended = false;
+};
+
+// Element type of the embeddings returned by embed
+enum embedding_quant_type {
+    EMBEDDING_QUANT_NONE = 0,   // float32
+    EMBEDDING_QUANT_INT8 = 1,   // int8, value = q * scale with scale = max |x| / 127
+    EMBEDDING_QUANT_BINARY = 2, // 1 bit per dimension set for x > 0, packed MSB first
+};
+
+struct embedding_params {
+    int normalize = 2; // see common_embd_normalize, -1 for none
+    int n_dims = 0;    // keep the first n_dims dimensions (matryoshka truncation), 0 for all
+    embedding_quant_type quant = EMBEDDING_QUANT_NONE;
+};
+
+struct embedding_output {
+    int n_dims = 0;
+    float scale = 1.0f; // dequantization scale of int8 embeddings
+    std::vector<llama_token> tokens;
+};
+
+// How much memory releaseResidency gives back under memory pressure
+enum residency_level {
+    RESIDENCY_TRIM = 1,    // drop the idle mmapped weights from RAM, they are faulted in again from the file, free unused LoRA adapters and recurrent checkpoints
+    RESIDENCY_SUSPEND = 2, // also serialize the KV cache to disk and free the KV and compute buffers
+};
+
+// LoRA adapter loaded once per model, shared by every adapter set that references it
+struct lora_adapter_entry {
+    llama_adapter_lora_ptr adapter;
+    size_t size = 0;
+    int n_refs = 0;
+};
+
+// Base weight replaced by a private copy with LoRA adapters merged in
+struct lora_merged_tensor {
+    lm_ggml_tensor *tensor = nullptr;
+    // original data of the model tensor, restored by unmergeLoraAdapters
+    void *data = nullptr;
+    lm_ggml_backend_buffer_t buffer = nullptr;
+};
+
 enum tts_type {
     UNKNOWN = -1,
     OUTETTS_V0_2 = 1,
@@ -67,8 +206,14 @@ enum tts_type {
 
 // Main context class
 struct llama_rn_context {
-    bool is_predicting = false;
-    bool is_interrupted = false;
+    // Serializes the calls that use ctx (and the state around it) across the bridge threads.
+    // Recursive so ensureResident and the other guarded methods can run under a bridge call.
+    std::recursive_mutex ctx_mutex;
+    // nesting of the context_lock scopes held by the owning thread
+    int ctx_lock_depth = 0;
+
+    std::atomic<bool> is_predicting{false};
+    std::atomic<bool> is_interrupted{false};
     bool has_next_token = false;
     std::string generated_text;
     std::vector<completion_token_output> generated_token_probs;
@@ -81,6 +226,15 @@ struct llama_rn_context {
     std::vector<std::string> mtmd_bitmap_past_hashes;
 
     std::vector<llama_token> embd;
+    // spans evicted from embd in order, replayed on the next prompt to reuse the shifted KV cache
+    std::vector<ctx_shift_span> evicted_spans;
+    ctx_shift_policy shift_policy = CTX_SHIFT_POLICY_BLOCK;
+    int shift_n_sink = 4;
+    // recurrent state can't be partially erased, prefix reuse rolls back to the nearest checkpoint
+    bool has_recurrent_state = false;
+    std::vector<recurrent_checkpoint> checkpoints;
+    int checkpoint_interval = 256;
+    int checkpoint_max = 8;
     common_params params;
     common_init_result llama_init;
 
@@ -91,21 +245,54 @@ struct llama_rn_context {
     float loading_progress = 0;
     bool is_load_interrupted = false;
 
+    // background prefetch of the lazily mapped weights
+    std::thread prefetch_thread;
+    std::atomic<bool> is_prefetch_stopped{false};
+
     llama_context *ctx = nullptr;
     common_sampler *ctx_sampling = nullptr;
+    std::string ctx_sampling_key;
+    // configured samplers by parameter fingerprint, most recently used first,
+    // reset and handed out again instead of rebuilding the chain and grammar
+    std::list<std::pair<std::string, common_sampler *>> sampler_pool;
+    std::mutex sampler_pool_mutex;
+
+    // persistent CPU threadpools for token generation and prompt processing
+    lm_ggml_threadpool *threadpool = nullptr;
+    lm_ggml_threadpool *threadpool_batch = nullptr;
     common_chat_templates_ptr templates;
 
     int n_ctx;
 
+    // set while the llama_context is freed under memory pressure, ensureResident recreates it
+    bool is_suspended = false;
+    std::string suspended_state_path;
+    llama_context_params cparams_resident;
+
     bool context_full = false;
     bool truncated = false;
     bool stopped_eos = false;
     bool stopped_word = false;
     bool stopped_limit = false;
+    bool stopped_deadline = false;
     std::string stopping_word;
     bool incomplete = false;
 
+    // completion deadline checked by the decode abort callback, 0 for none
+    int64_t t_deadline_us = 0;
+    // per-step latency budget for prompt processing, 0 to always decode n_batch tokens per step
+    int64_t step_budget_us = 0;
+    // moving average of the prefill cost per token, used to size the steps under the budget
+    double t_prefill_token_us = 0;
+
     std::vector<common_adapter_lora_info> lora;
+    // adapters by path, unreferenced ones stay loaded until released under memory pressure
+    std::map<std::string, lora_adapter_entry> lora_registry;
+    // adapters merged into private copies of the affected base weights
+    std::vector<common_adapter_lora_info> lora_merged;
+    std::vector<lora_merged_tensor> lora_merged_tensors;
+    std::vector<lm_ggml_context_ptr> lora_merged_ctxs;
+    std::vector<lm_ggml_backend_buffer_ptr> lora_merged_bufs;
 
     llama_rn_context_mtmd *mtmd_wrapper = nullptr;
     bool has_multimodal = false;
@@ -113,11 +300,26 @@ struct llama_rn_context {
     llama_rn_context_vocoder *vocoder_wrapper = nullptr;
     bool has_vocoder = false;
 
+    // store of the embeddings computed by this context
+    std::unique_ptr<vector_store> vstore;
+
     ~llama_rn_context();
 
     void rewind();
     bool initSampling();
+    // Take a sampler for sparams from the pool or create one, key receives its fingerprint
+    common_sampler * acquireSampler(const common_params_sampling &sparams, std::string &key);
+    void releaseSampler(common_sampler *smpl, const std::string &key);
+    void clearSamplerPool();
     bool loadModel(common_params &params_);
+    void prefetchModelLayers();
+    void attachThreadpools();
+    void setThreads(int n_threads);
+    void setDeadline(int deadline_ms, int step_budget_ms);
+    bool isDeadlineExpired() const;
+    llama_rn_context_footprint getFootprint() const;
+    bool releaseResidency(residency_level level, const std::string &state_path);
+    void ensureResident();
     bool validateModelChatTemplate(bool use_jinja, const char *name) const;
     common_chat_params getFormattedChatWithJinja(
       const std::string &messages,
@@ -132,19 +334,52 @@ struct llama_rn_context {
       const std::string &messages,
       const std::string &chat_template
     ) const;
-    void truncatePrompt(std::vector<llama_token> &prompt_tokens);
+    ctx_shift_span getEvictionSpan(const std::vector<llama_token> &tokens, size_t n_tokens) const;
+    bool truncatePrompt(std::vector<llama_token> &prompt_tokens);
+    bool shiftContext();
     void loadPrompt(const std::vector<std::string> &media_paths);
     void setGuideTokens(const std::vector<llama_token> &tokens);
     void beginCompletion();
     void endCompletion();
+    // Decode the next prompt step from n_past, returns the llama_decode status.
+    // An aborted step keeps the ubatches completed before the abort.
+    int decodePromptStep();
+    // Position where the next recurrent checkpoint is taken, -1 for none
+    llama_pos nextCheckpointPos() const;
+    void saveCheckpoint();
+    // Roll seq 0 back to the latest checkpoint not past n_past, returns the restored position
+    llama_pos restoreCheckpoint();
     completion_token_output nextToken();
     size_t findStoppingStrings(const std::string &text, const size_t last_token_size, const stop_type type);
     completion_token_output doCompletion();
-    std::vector<float> getEmbedding(common_params &embd_params);
+    // Generate until the completion stops, trimming the stop strings from generated_text.
+    // The text (with probabilities if n_probs is set) is pushed to emitter when not null.
+    void generate(partial_emitter *emitter);
+    // Fork the evaluated prompt to n_branches KV sequences and decode them in lockstep.
+    // Branch 0 is kept in seq 0 and written back to generated_text / embd.
+    // branch_lora[i] are extra adapters of branch i, applied to its sequence only.
+    std::vector<completion_branch_output> doBranchedCompletion(
+        int n_branches,
+        const std::vector<std::vector<common_adapter_lora_info>> &branch_lora = {}
+    );
+    // Number of dimensions and bytes of the embeddings produced with eparams
+    int embeddingDims(const embedding_params &eparams) const;
+    size_t embeddingOutputSize(const embedding_params &eparams) const;
+    // Embed text into out (embeddingOutputSize bytes). Decodes on its own without the sampler
+    // or completion state, the cached prompt of the previous completion is dropped.
+    embedding_output embed(const std::string &text, const embedding_params &eparams, void *out);
     std::vector<float> rerank(const std::string &query, const std::vector<std::string> &documents);
     std::string bench(int pp, int tg, int pl, int nr);
+    llama_adapter_lora * acquireLoraAdapter(const std::string &path);
+    void releaseLoraAdapter(const std::string &path);
+    size_t releaseUnusedLoraAdapters();
     int applyLoraAdapters(std::vector<common_adapter_lora_info> lora);
     void removeLoraAdapters();
+    // Merge adapters into copies of the base weights they modify, the other weights stay mmapped.
+    // The merged weights are read from / written to cache_path when it is not empty.
+    // Throws for adapters that can't be merged (token_embd), returns -1 on other failures.
+    int mergeLoraAdapters(std::vector<common_adapter_lora_info> lora, const std::string &cache_path);
+    void unmergeLoraAdapters();
     std::vector<common_adapter_lora_info> getLoadedLoraAdapters();
 
     // Multimodal methods
@@ -170,6 +405,50 @@ struct llama_rn_context {
     std::vector<float> decodeAudioTokens(const std::vector<llama_token> &tokens);
     bool isVocoderEnabled() const;
     void releaseVocoder();
+
+    // Vector store methods
+    // Open the store at path, n_dims defaults to n_embd (or the first n_dims of matryoshka embeddings)
+    void initVectorStore(const std::string &path, vector_store_params vparams);
+    bool isVectorStoreEnabled() const;
+    // Embed texts and append them, keys default to the row index. Returns the keys.
+    std::vector<int64_t> addToVectorStore(
+        const std::vector<std::string> &texts,
+        const std::vector<int64_t> &keys,
+        bool store_text
+    );
+    // Top k rows for the query. With rerank_ctx the best max(k, n_rerank) rows are
+    // reranked by their stored text with rerank_ctx->rerank.
+    std::vector<vector_store_result> searchVectorStore(
+        const std::string &query,
+        int k,
+        int n_probe,
+        llama_rn_context *rerank_ctx = nullptr,
+        int n_rerank = 0
+    );
+    void releaseVectorStore();
+};
+
+// Holds ctx_mutex for a bridge call, taken by every entry point that touches the context.
+// The try_to_lock form never waits, for callers that skip or reject a busy context.
+// A resumed threadpool pins the calling thread to its cores, so the outermost scope
+// pauses the pools and gives the (shared AsyncTask / GCD) thread its affinity back.
+struct context_lock {
+    explicit context_lock(llama_rn_context *llama);
+    context_lock(llama_rn_context *llama, std::try_to_lock_t);
+    ~context_lock();
+    context_lock(const context_lock &) = delete;
+    context_lock &operator=(const context_lock &) = delete;
+    bool owns_lock() const { return lock.owns_lock(); }
+
+private:
+    void enter();
+
+    llama_rn_context *llama;
+    std::unique_lock<std::recursive_mutex> lock;
+#if defined(__linux__)
+    cpu_set_t affinity;
+    bool has_affinity = false;
+#endif
 };
 
 // Logging macros
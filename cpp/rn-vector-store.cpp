@@ -0,0 +1,510 @@
+#include "rn-vector-store.h"
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace rnllama {
+
+static const char vector_store_magic[4] = { 'R', 'N', 'V', 'S' };
+static const char vector_index_magic[4] = { 'R', 'N', 'V', 'I' };
+static const uint32_t vector_store_version = 1;
+static const size_t vector_store_min_capacity = 1024;
+
+struct vector_store_header {
+    char magic[4];
+    uint32_t version;
+    int32_t n_dims;
+    int32_t quant;
+    uint64_t n_rows;
+    uint64_t text_size;
+    int64_t next_key; // 0 in the stores written before it was added
+};
+
+struct vector_store::row_meta {
+    int64_t key;
+    uint64_t text_offset;
+    uint32_t text_len;
+    int32_t list; // inverted list of the row, -1 before the store is indexed
+};
+
+static size_t vector_size(vector_store_quant quant, int n_dims) {
+    switch (quant) {
+        case VECTOR_STORE_Q8:
+            return lm_ggml_row_size(LM_GGML_TYPE_Q8_0, n_dims);
+        case VECTOR_STORE_BINARY:
+            // whole 64-bit words for popcount
+            return (n_dims + 63) / 64 * sizeof(uint64_t);
+        default:
+            return n_dims * sizeof(float);
+    }
+}
+
+static float dot_f32(int n, const float *a, const float *b) {
+    float s = 0.0f;
+    lm_ggml_get_type_traits_cpu(LM_GGML_TYPE_F32)->vec_dot(n, &s, 0, a, 0, b, 0, 1);
+    return s;
+}
+
+static void pack_bits(const float *embd, int n_dims, uint64_t *dst) {
+    std::fill(dst, dst + (n_dims + 63) / 64, 0);
+    for (int i = 0; i < n_dims; ++i) {
+        if (embd[i] > 0.0f) {
+            dst[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+
+vector_store::~vector_store() {
+    unmap();
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (fd_text >= 0) {
+        close(fd_text);
+    }
+}
+
+std::unique_ptr<vector_store> vector_store::open(const std::string &path, const vector_store_params &params) {
+    lm_ggml_cpu_init();
+
+    std::unique_ptr<vector_store> store(new vector_store());
+    store->path = path;
+
+    vector_store_header header = {};
+    struct stat st;
+    const bool exists = stat(path.c_str(), &st) == 0 && st.st_size > 0;
+    store->fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (store->fd < 0) {
+        throw std::runtime_error("failed to open vector store: " + path);
+    }
+
+    if (exists) {
+        if (pread(store->fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+            memcmp(header.magic, vector_store_magic, sizeof(header.magic)) != 0) {
+            throw std::runtime_error("not a vector store: " + path);
+        }
+        if (header.version != vector_store_version) {
+            throw std::runtime_error("unsupported vector store version: " + std::to_string(header.version));
+        }
+        if (params.n_dims > 0 && params.n_dims != header.n_dims) {
+            throw std::runtime_error("vector store has " + std::to_string(header.n_dims) + " dimensions, requested " + std::to_string(params.n_dims));
+        }
+        if (params.quant != VECTOR_STORE_QUANT_AUTO && params.quant != header.quant) {
+            throw std::runtime_error("vector store has quant type " + std::to_string(header.quant) + ", requested " + std::to_string(params.quant));
+        }
+    } else {
+        const vector_store_quant quant = params.quant == VECTOR_STORE_QUANT_AUTO ? VECTOR_STORE_Q8 : params.quant;
+        if (params.n_dims <= 0) {
+            throw std::runtime_error("n_dims is required to create a vector store");
+        }
+        if (quant == VECTOR_STORE_Q8 && params.n_dims % lm_ggml_blck_size(LM_GGML_TYPE_Q8_0) != 0) {
+            throw std::runtime_error("int8 vectors need a multiple of 32 dimensions, n_dims: " + std::to_string(params.n_dims));
+        }
+        memcpy(header.magic, vector_store_magic, sizeof(header.magic));
+        header.version = vector_store_version;
+        header.n_dims = params.n_dims;
+        header.quant = quant;
+    }
+
+    store->dims = header.n_dims;
+    store->type = (vector_store_quant) header.quant;
+    store->vec_size = vector_size(store->type, store->dims);
+    store->stride = (store->vec_size + 7) / 8 * 8 + sizeof(row_meta);
+    store->n_rows = header.n_rows;
+    store->text_size = header.text_size;
+    store->next_key = header.next_key;
+
+    store->map(std::max(vector_store_min_capacity, store->n_rows));
+    if (!exists) {
+        memcpy(store->base, &header, sizeof(header));
+    }
+    if (store->next_key == 0) {
+        // older stores don't track it, continue after their largest key
+        for (size_t i = 0; i < store->n_rows; ++i) {
+            store->next_key = std::max(store->next_key, store->meta(i)->key + 1);
+        }
+    }
+
+    store->fd_text = ::open((path + ".txt").c_str(), O_RDWR | O_CREAT, 0644);
+    if (store->fd_text < 0) {
+        throw std::runtime_error("failed to open vector store texts: " + path + ".txt");
+    }
+
+    store->loadIndex();
+    return store;
+}
+
+void vector_store::map(size_t n_capacity) {
+    // the old mapping stays in place until the new one exists, so a failed growth leaves the store usable
+    const size_t size = header_size + n_capacity * stride;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < size) {
+        if (ftruncate(fd, size) != 0) {
+            throw std::runtime_error("failed to grow vector store: " + path);
+        }
+    }
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("failed to map vector store: " + path);
+    }
+    unmap();
+    base = static_cast<uint8_t *>(addr);
+    mapped = size;
+    capacity = n_capacity;
+}
+
+void vector_store::unmap() {
+    if (base != nullptr) {
+        msync(base, mapped, MS_ASYNC);
+        munmap(base, mapped);
+        base = nullptr;
+        mapped = 0;
+    }
+}
+
+void vector_store::writeHeader() {
+    auto *header = reinterpret_cast<vector_store_header *>(base);
+    header->n_rows = n_rows;
+    header->text_size = text_size;
+    header->next_key = next_key;
+}
+
+vector_store::row_meta * vector_store::meta(size_t i) const {
+    return reinterpret_cast<row_meta *>(row(i) + stride - sizeof(row_meta));
+}
+
+void vector_store::encode(const float *embd, uint8_t *dst) const {
+    switch (type) {
+        case VECTOR_STORE_Q8:
+            lm_ggml_get_type_traits_cpu(LM_GGML_TYPE_Q8_0)->from_float(embd, dst, dims);
+            break;
+        case VECTOR_STORE_BINARY:
+            pack_bits(embd, dims, reinterpret_cast<uint64_t *>(dst));
+            break;
+        default:
+            memcpy(dst, embd, dims * sizeof(float));
+            break;
+    }
+}
+
+void vector_store::decode(const uint8_t *src, float *dst) const {
+    switch (type) {
+        case VECTOR_STORE_Q8:
+            lm_ggml_get_type_traits(LM_GGML_TYPE_Q8_0)->to_float(src, dst, dims);
+            break;
+        case VECTOR_STORE_BINARY: {
+            const float v = 1.0f / std::sqrt((float) dims);
+            const uint64_t *bits = reinterpret_cast<const uint64_t *>(src);
+            for (int i = 0; i < dims; ++i) {
+                dst[i] = (bits[i / 64] >> (i % 64)) & 1 ? v : -v;
+            }
+            break;
+        }
+        default:
+            memcpy(dst, src, dims * sizeof(float));
+            break;
+    }
+}
+
+int vector_store::nearestList(const float *embd) const {
+    int best = 0;
+    float best_score = -INFINITY;
+    const int n_lists = lists.size();
+    for (int l = 0; l < n_lists; ++l) {
+        const float score = dot_f32(dims, embd, centroids.data() + (size_t) l * dims);
+        if (score > best_score) {
+            best_score = score;
+            best = l;
+        }
+    }
+    return best;
+}
+
+size_t vector_store::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return n_rows;
+}
+
+int vector_store::n_lists() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lists.size();
+}
+
+size_t vector_store::add(int64_t key, const float *embd, const std::string &text) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return append(key, embd, text);
+}
+
+int64_t vector_store::add(const float *embd, const std::string &text) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const int64_t key = next_key;
+    append(key, embd, text);
+    return key;
+}
+
+size_t vector_store::append(int64_t key, const float *embd, const std::string &text) {
+    if (n_rows == capacity) {
+        map(capacity * 2);
+    }
+
+    row_meta m = { key, text_size, (uint32_t) text.size(), -1 };
+    if (!text.empty()) {
+        if (pwrite(fd_text, text.data(), text.size(), text_size) != (ssize_t) text.size()) {
+            throw std::runtime_error("failed to write vector store text: " + path + ".txt");
+        }
+        text_size += text.size();
+    }
+    if (!lists.empty()) {
+        m.list = nearestList(embd);
+        lists[m.list].push_back(n_rows);
+    }
+
+    encode(embd, row(n_rows));
+    *meta(n_rows) = m;
+    n_rows++;
+    if (key >= next_key && key < INT64_MAX) {
+        next_key = key + 1;
+    }
+    writeHeader();
+    return n_rows - 1;
+}
+
+std::vector<vector_store_result> vector_store::search(const float *query, int k, int n_probe) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<vector_store_result> results;
+    if (k <= 0 || n_rows == 0) {
+        return results;
+    }
+
+    // the query is encoded like the rows so the SIMD dot products of ggml apply
+    std::vector<uint8_t> q;
+    const lm_ggml_type_traits_cpu *traits = nullptr;
+    if (type == VECTOR_STORE_Q8) {
+        traits = lm_ggml_get_type_traits_cpu(LM_GGML_TYPE_Q8_0);
+        q.resize(lm_ggml_row_size(traits->vec_dot_type, dims));
+        lm_ggml_get_type_traits_cpu(traits->vec_dot_type)->from_float(query, q.data(), dims);
+    } else if (type == VECTOR_STORE_BINARY) {
+        q.resize(vec_size);
+        pack_bits(query, dims, reinterpret_cast<uint64_t *>(q.data()));
+    } else {
+        traits = lm_ggml_get_type_traits_cpu(LM_GGML_TYPE_F32);
+    }
+    const void *q_data = type == VECTOR_STORE_F32 ? static_cast<const void *>(query) : q.data();
+
+    auto score = [&](size_t i) {
+        if (type == VECTOR_STORE_BINARY) {
+            const uint64_t *a = reinterpret_cast<const uint64_t *>(row(i));
+            const uint64_t *b = reinterpret_cast<const uint64_t *>(q_data);
+            int n_diff = 0;
+            for (size_t w = 0; w < vec_size / sizeof(uint64_t); ++w) {
+                n_diff += __builtin_popcountll(a[w] ^ b[w]);
+            }
+            return 1.0f - 2.0f * n_diff / dims;
+        }
+        float s = 0.0f;
+        traits->vec_dot(dims, &s, 0, row(i), 0, q_data, 0, 1);
+        return s;
+    };
+
+    // min-heap of the best k rows
+    using scored_row = std::pair<float, size_t>;
+    std::priority_queue<scored_row, std::vector<scored_row>, std::greater<scored_row>> best;
+    auto consider = [&](size_t i) {
+        const float s = score(i);
+        if ((int) best.size() < k) {
+            best.emplace(s, i);
+        } else if (s > best.top().first) {
+            best.pop();
+            best.emplace(s, i);
+        }
+    };
+
+    if (lists.empty()) {
+        for (size_t i = 0; i < n_rows; ++i) {
+            consider(i);
+        }
+    } else {
+        const int n_lists = lists.size();
+        if (n_probe <= 0) {
+            n_probe = std::max(1, n_lists / 8);
+        }
+        n_probe = std::min(n_probe, n_lists);
+        std::vector<scored_row> list_scores(n_lists);
+        for (int l = 0; l < n_lists; ++l) {
+            list_scores[l] = { dot_f32(dims, query, centroids.data() + (size_t) l * dims), l };
+        }
+        std::partial_sort(list_scores.begin(), list_scores.begin() + n_probe, list_scores.end(), std::greater<scored_row>());
+        for (int p = 0; p < n_probe; ++p) {
+            for (uint32_t i : lists[list_scores[p].second]) {
+                consider(i);
+            }
+        }
+    }
+
+    results.resize(best.size());
+    for (size_t i = results.size(); i-- > 0; best.pop()) {
+        const size_t r = best.top().second;
+        results[i] = { meta(r)->key, best.top().first, r };
+    }
+    return results;
+}
+
+bool vector_store::hasText(size_t row) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return row < n_rows && meta(row)->text_len > 0;
+}
+
+std::string vector_store::text(size_t row) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (row >= n_rows) {
+        return "";
+    }
+    const row_meta *m = meta(row);
+    std::string result(m->text_len, '\0');
+    if (m->text_len > 0 && pread(fd_text, &result[0], m->text_len, m->text_offset) != (ssize_t) m->text_len) {
+        throw std::runtime_error("failed to read vector store text: " + path + ".txt");
+    }
+    return result;
+}
+
+// Spherical k-means over a sample of the rows, every row is then assigned to its nearest centroid
+void vector_store::buildIndex(int n_lists, int n_iter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (n_rows == 0 || n_lists <= 0) {
+        throw std::runtime_error("can't index an empty vector store");
+    }
+    n_lists = std::min<size_t>(n_lists, n_rows);
+
+    const size_t n_train = std::min<size_t>(n_rows, (size_t) n_lists * 64);
+    std::vector<float> train(n_train * dims);
+    for (size_t i = 0; i < n_train; ++i) {
+        decode(row(i * n_rows / n_train), train.data() + i * dims);
+    }
+
+    std::mt19937 rng(42);
+    std::vector<size_t> order(n_train);
+    for (size_t i = 0; i < n_train; ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+    centroids.assign((size_t) n_lists * dims, 0.0f);
+    for (int l = 0; l < n_lists; ++l) {
+        memcpy(centroids.data() + (size_t) l * dims, train.data() + order[l] * dims, dims * sizeof(float));
+    }
+    lists.assign(n_lists, {});
+
+    std::vector<int> assign(n_train, -1);
+    std::vector<int> counts(n_lists);
+    for (int iter = 0; iter < n_iter; ++iter) {
+        bool changed = false;
+        for (size_t i = 0; i < n_train; ++i) {
+            const int l = nearestList(train.data() + i * dims);
+            changed |= l != assign[i];
+            assign[i] = l;
+        }
+        if (!changed) {
+            break;
+        }
+
+        std::fill(centroids.begin(), centroids.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n_train; ++i) {
+            float *c = centroids.data() + (size_t) assign[i] * dims;
+            const float *v = train.data() + i * dims;
+            for (int d = 0; d < dims; ++d) {
+                c[d] += v[d];
+            }
+            counts[assign[i]]++;
+        }
+        for (int l = 0; l < n_lists; ++l) {
+            float *c = centroids.data() + (size_t) l * dims;
+            if (counts[l] == 0) {
+                // reseed an empty list with a random training vector
+                memcpy(c, train.data() + (rng() % n_train) * dims, dims * sizeof(float));
+                continue;
+            }
+            const float norm = std::sqrt(dot_f32(dims, c, c));
+            if (norm > 0.0f) {
+                for (int d = 0; d < dims; ++d) {
+                    c[d] /= norm;
+                }
+            }
+        }
+    }
+
+    std::vector<float> v(dims);
+    for (size_t i = 0; i < n_rows; ++i) {
+        decode(row(i), v.data());
+        const int l = nearestList(v.data());
+        meta(i)->list = l;
+        lists[l].push_back(i);
+    }
+    saveIndex();
+}
+
+void vector_store::loadIndex() {
+    FILE *f = fopen((path + ".ivf").c_str(), "rb");
+    if (f == nullptr) {
+        return;
+    }
+    char magic[4];
+    int32_t n_lists = 0;
+    int32_t n_dims = 0;
+    bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, vector_index_magic, sizeof(magic)) == 0 &&
+              fread(&n_lists, sizeof(n_lists), 1, f) == 1 && fread(&n_dims, sizeof(n_dims), 1, f) == 1 &&
+              n_lists > 0 && n_dims == dims;
+    if (ok) {
+        centroids.resize((size_t) n_lists * dims);
+        ok = fread(centroids.data(), sizeof(float), centroids.size(), f) == centroids.size();
+    }
+    fclose(f);
+    if (!ok) {
+        centroids.clear();
+        return;
+    }
+
+    lists.assign(n_lists, {});
+    std::vector<float> v(dims);
+    for (size_t i = 0; i < n_rows; ++i) {
+        row_meta *m = meta(i);
+        if (m->list < 0 || m->list >= n_lists) {
+            decode(row(i), v.data());
+            m->list = nearestList(v.data());
+        }
+        lists[m->list].push_back(i);
+    }
+}
+
+void vector_store::saveIndex() const {
+    FILE *f = fopen((path + ".ivf").c_str(), "wb");
+    if (f == nullptr) {
+        throw std::runtime_error("failed to write vector index: " + path + ".ivf");
+    }
+    const int32_t n_lists = lists.size();
+    const int32_t n_dims = dims;
+    bool ok = fwrite(vector_index_magic, 1, sizeof(vector_index_magic), f) == sizeof(vector_index_magic) &&
+              fwrite(&n_lists, sizeof(n_lists), 1, f) == 1 && fwrite(&n_dims, sizeof(n_dims), 1, f) == 1 &&
+              fwrite(centroids.data(), sizeof(float), centroids.size(), f) == centroids.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        throw std::runtime_error("failed to write vector index: " + path + ".ivf");
+    }
+}
+
+void vector_store::sync() {
+    std::lock_guard<std::mutex> lock(mutex);
+    msync(base, mapped, MS_SYNC);
+    fsync(fd_text);
+}
+
+}
@@ -0,0 +1,106 @@
+#ifndef RNVECTORSTORE_H
+#define RNVECTORSTORE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace rnllama {
+
+// Element type of the vectors in the store
+enum vector_store_quant {
+    VECTOR_STORE_QUANT_AUTO = -1, // Q8 for a new store, the type of the file for an existing one
+    VECTOR_STORE_F32 = 0,
+    VECTOR_STORE_Q8 = 1,     // ggml Q8_0 blocks, the dimensions must be a multiple of 32
+    VECTOR_STORE_BINARY = 2, // 1 bit per dimension, scored by hamming distance
+};
+
+// Unset fields (n_dims 0, quant AUTO) are taken from the file when the store exists
+struct vector_store_params {
+    int n_dims = 0;
+    vector_store_quant quant = VECTOR_STORE_QUANT_AUTO;
+};
+
+struct vector_store_result {
+    int64_t key = 0;
+    float score = 0.0f; // approximate cosine similarity for normalized vectors
+    size_t row = 0;
+};
+
+// Append-only store of normalized embeddings in a memory-mapped file, searched by
+// brute force or through an IVF index (k-means centroids with inverted lists).
+// <path> holds the header and the rows, <path>.txt the optional document texts and
+// <path>.ivf the centroids. All methods are thread safe.
+class vector_store {
+public:
+    ~vector_store();
+
+    // Open the store at path, it is created with params when it does not exist.
+    // Throws std::runtime_error when the file can't be mapped or has other parameters.
+    static std::unique_ptr<vector_store> open(const std::string &path, const vector_store_params &params);
+
+    int n_dims() const { return dims; }
+    vector_store_quant quant() const { return type; }
+    size_t size() const;
+    int n_lists() const;
+
+    // Append a normalized embedding of n_dims floats, returns its row
+    size_t add(int64_t key, const float *embd, const std::string &text);
+    // Append with a new key, above every key added so far, returns the key
+    int64_t add(const float *embd, const std::string &text);
+    // Best k rows for a normalized query, n_probe lists are scanned when the store is indexed
+    std::vector<vector_store_result> search(const float *query, int k, int n_probe) const;
+    std::string text(size_t row) const;
+    bool hasText(size_t row) const;
+
+    // Cluster the rows into n_lists inverted lists, rows added later join the nearest list
+    void buildIndex(int n_lists, int n_iter = 10);
+    // Flush the mapped rows to disk
+    void sync();
+
+private:
+    vector_store() = default;
+
+    struct row_meta;
+
+    std::string path;
+    int dims = 0;
+    vector_store_quant type = VECTOR_STORE_Q8;
+    size_t vec_size = 0; // bytes of one vector
+    size_t stride = 0;   // bytes of one row, vector followed by row_meta
+
+    int fd = -1;
+    uint8_t *base = nullptr;
+    size_t mapped = 0;
+    size_t n_rows = 0;
+    size_t capacity = 0;
+    int64_t next_key = 0;
+
+    int fd_text = -1;
+    uint64_t text_size = 0;
+
+    std::vector<float> centroids;
+    std::vector<std::vector<uint32_t>> lists;
+
+    mutable std::mutex mutex;
+
+    void map(size_t n_capacity);
+    void unmap();
+    void writeHeader();
+    size_t append(int64_t key, const float *embd, const std::string &text);
+    void loadIndex();
+    void saveIndex() const;
+    uint8_t *row(size_t i) const { return base + header_size + i * stride; }
+    row_meta *meta(size_t i) const;
+    void encode(const float *embd, uint8_t *dst) const;
+    void decode(const uint8_t *src, float *dst) const;
+    int nearestList(const float *embd) const;
+
+    static const size_t header_size = 64;
+};
+
+}
+
+#endif /* RNVECTORSTORE_H */
@@ -311,6 +311,8 @@ void common_sampler_reset(struct common_sampler * gsmpl) {
     llama_sampler_reset(gsmpl->grmr);
 
     llama_sampler_reset(gsmpl->chain);
+
+    gsmpl->prev.clear();
 }
 
 struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
@@ -27,6 +27,7 @@
 #include <array>
 #include <numeric>
 #include <functional>
+#include <thread>
 
 struct clip_logger_state g_logger_state = {LM_GGML_LOG_LEVEL_CONT, clip_log_callback_default, NULL};
 
@@ -374,12 +375,21 @@ struct clip_ctx {
     int max_nodes = 8192;
     lm_ggml_backend_sched_ptr sched;
 
+    // attention without a mask runs as lm_ggml_flash_attn_ext, cleared if the backend cannot run it
+    bool flash_attn = false;
+
+    // graph of the last encode and its input shape {nx, ny, n_batch}
+    // it stays allocated in the scheduler and is reused while the shape does not change
+    lm_ggml_cgraph * gf_prev = nullptr;
+    std::array<int, 3> gf_prev_shape = {0, 0, 0};
+
     // for debugging
     bool debug_graph = false;
     std::vector<lm_ggml_tensor *> debug_print_tensors;
 
     clip_ctx(clip_context_params & ctx_params) {
         debug_graph = std::getenv("MTMD_DEBUG_GRAPH") != nullptr;
+        flash_attn = ctx_params.flash_attn;
         backend_cpu = lm_ggml_backend_init_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
         if (!backend_cpu) {
             throw std::runtime_error("failed to initialize CPU backend");
@@ -423,8 +433,9 @@ struct clip_graph {
     const clip_model & model;
     const clip_hparams & hparams;
 
-    // we only support single image per batch
+    // all images of a batch share the size of the first one
     const clip_image_f32 & img;
+    const int n_batch;
 
     const int patch_size;
     const int n_patches_x;
@@ -441,11 +452,12 @@ struct clip_graph {
     lm_ggml_context * ctx0;
     lm_ggml_cgraph * gf;
 
-    clip_graph(clip_ctx * ctx, const clip_image_f32 & img) :
+    clip_graph(clip_ctx * ctx, const clip_image_f32 & img, int n_batch = 1) :
             ctx(ctx),
             model(ctx->model),
             hparams(model.hparams),
             img(img),
+            n_batch(n_batch),
             patch_size(hparams.patch_size),
             n_patches_x(img.nx / patch_size),
             n_patches_y(img.ny / patch_size),
@@ -476,7 +488,7 @@ struct clip_graph {
                                 nullptr);
 
         if (ctx->proj_type() == PROJECTOR_TYPE_GEMMA3) {
-            const int batch_size = 1;
+            const int batch_size = n_batch;
             LM_GGML_ASSERT(n_patches_x == n_patches_y);
             const int patches_per_image = n_patches_x;
             const int kernel_size = hparams.proj_scale_factor;
@@ -504,7 +516,7 @@ struct clip_graph {
             const int scale_factor = model.hparams.proj_scale_factor;
             const int n_embd = cur->ne[0];
             const int seq    = cur->ne[1];
-            const int bsz    = 1; // batch size, always 1 for now since we don't support batching
+            const int bsz    = n_batch;
             const int height = std::sqrt(seq);
             const int width  = std::sqrt(seq);
             LM_GGML_ASSERT(scale_factor != 0);
@@ -804,14 +816,12 @@ struct clip_graph {
     }
 
     lm_ggml_cgraph * build_minicpmv() {
-        const int batch_size = 1;
-
         LM_GGML_ASSERT(model.class_embedding == nullptr);
         const int n_pos = n_patches;
 
-        // position embeddings for the projector (not for ViT)
+        // position embeddings for the projector (not for ViT), shared by all images of the batch
         int n_output_dim = clip_n_mmproj_embd(ctx);
-        lm_ggml_tensor * pos_embed = lm_ggml_new_tensor_3d(ctx0, LM_GGML_TYPE_F32, n_output_dim, n_pos, batch_size);
+        lm_ggml_tensor * pos_embed = lm_ggml_new_tensor_3d(ctx0, LM_GGML_TYPE_F32, n_output_dim, n_pos, 1);
         lm_ggml_set_name(pos_embed, "pos_embed");
         lm_ggml_set_input(pos_embed);
 
@@ -866,9 +876,13 @@ struct clip_graph {
                 lm_ggml_mul_mat(ctx0, model.mm_model_attn_v_w, v),
                 model.mm_model_attn_v_b);
 
+            // the learned queries are the same for every image of the batch
             Q = lm_ggml_reshape_3d(ctx0, Q, d_head, n_head, num_query);
-            K = lm_ggml_reshape_3d(ctx0, K, d_head, n_head, n_pos);
-            V = lm_ggml_reshape_3d(ctx0, V, d_head, n_head, n_pos);
+            if (n_batch > 1) {
+                Q = lm_ggml_repeat_4d(ctx0, Q, d_head, n_head, num_query, n_batch);
+            }
+            K = lm_ggml_reshape_4d(ctx0, K, d_head, n_head, n_pos, n_batch);
+            V = lm_ggml_reshape_4d(ctx0, V, d_head, n_head, n_pos, n_batch);
 
             cb(Q, "resampler_Q", -1);
             cb(K, "resampler_K", -1);
@@ -1604,9 +1618,9 @@ private:
                     cb(Kcur, "Kcur_norm", il);
                 }
 
-                Qcur = lm_ggml_reshape_3d(ctx0, Qcur, d_head, n_head, n_pos);
-                Kcur = lm_ggml_reshape_3d(ctx0, Kcur, d_head, n_head, n_pos);
-                Vcur = lm_ggml_reshape_3d(ctx0, Vcur, d_head, n_head, n_pos);
+                Qcur = lm_ggml_reshape_4d(ctx0, Qcur, d_head, n_head, n_pos, n_batch);
+                Kcur = lm_ggml_reshape_4d(ctx0, Kcur, d_head, n_head, n_pos, n_batch);
+                Vcur = lm_ggml_reshape_4d(ctx0, Vcur, d_head, n_head, n_pos, n_batch);
 
                 cb(Qcur, "Qcur", il);
                 cb(Kcur, "Kcur", il);
@@ -1680,11 +1694,11 @@ private:
     }
 
     // build the input after conv2d (inp_raw --> patches)
-    // returns tensor with shape [n_embd, n_patches]
+    // returns tensor with shape [n_embd, n_patches, n_batch]
     lm_ggml_tensor * build_inp() {
         lm_ggml_tensor * inp_raw = build_inp_raw();
         lm_ggml_tensor * inp = lm_ggml_conv_2d(ctx0, model.patch_embeddings_0, inp_raw, patch_size, patch_size, 0, 0, 1, 1);
-        inp = lm_ggml_reshape_2d(ctx0, inp, n_patches, n_embd);
+        inp = lm_ggml_reshape_3d(ctx0, inp, n_patches, n_embd, n_batch);
         inp = lm_ggml_cont(ctx0, lm_ggml_transpose(ctx0, inp));
         if (model.patch_bias) {
             inp = lm_ggml_add(ctx0, inp, model.patch_bias);
@@ -1694,7 +1708,7 @@ private:
     }
 
     lm_ggml_tensor * build_inp_raw(int channels = 3) {
-        lm_ggml_tensor * inp_raw = lm_ggml_new_tensor_3d(ctx0, LM_GGML_TYPE_F32, img.nx, img.ny, channels);
+        lm_ggml_tensor * inp_raw = lm_ggml_new_tensor_4d(ctx0, LM_GGML_TYPE_F32, img.nx, img.ny, channels, n_batch);
         lm_ggml_set_name(inp_raw, "inp_raw");
         lm_ggml_set_input(inp_raw);
         return inp_raw;
@@ -1833,17 +1847,31 @@ private:
         lm_ggml_tensor * k = lm_ggml_permute(ctx0, k_cur, 0, 2, 1, 3);
         //cb(k, "k", il);
 
-        lm_ggml_tensor * v = lm_ggml_permute(ctx0, v_cur, 1, 2, 0, 3);
-        v = lm_ggml_cont(ctx0, v);
-        //cb(k, "v", il);
-
         lm_ggml_tensor * cur;
 
-        // TODO @ngxson : support flash attention
-        {
-            const auto n_tokens = q->ne[1];
-            const auto n_head   = q->ne[2];
-            // const auto n_kv     = k->ne[1]; // for flash attention
+        const auto n_tokens = q->ne[1];
+        const auto n_head   = q->ne[2];
+
+        if (ctx->flash_attn && kq_mask == nullptr) {
+            // the n_tokens x n_tokens KQ matrix of every head is never materialized,
+            // so the compute buffer stays linear in the number of patches
+            lm_ggml_tensor * v = lm_ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
+            //cb(v, "v", il);
+
+            if (ctx->backend != ctx->backend_cpu) {
+                // the GPU kernels take F16 K/V, the CPU one reads the F32 rows in place
+                k = lm_ggml_cast(ctx0, k, LM_GGML_TYPE_F16);
+                v = lm_ggml_cast(ctx0, v, LM_GGML_TYPE_F16);
+            }
+
+            cur = lm_ggml_flash_attn_ext(ctx0, q, k, v, nullptr, kq_scale, 0.0f, 0.0f);
+            lm_ggml_flash_attn_ext_set_prec(cur, LM_GGML_PREC_F32);
+
+            cur = lm_ggml_reshape_3d(ctx0, cur, cur->ne[0]*n_head, n_tokens, cur->ne[3]);
+        } else {
+            lm_ggml_tensor * v = lm_ggml_permute(ctx0, v_cur, 1, 2, 0, 3);
+            v = lm_ggml_cont(ctx0, v);
+            //cb(v, "v", il);
 
             lm_ggml_tensor * kq = lm_ggml_mul_mat(ctx0, k, q);
             // F32 may not needed for vision encoders?
@@ -1853,7 +1881,7 @@ private:
 
             lm_ggml_tensor * kqv = lm_ggml_mul_mat(ctx0, v, kq);
             cur = lm_ggml_permute(ctx0, kqv, 0, 2, 1, 3);
-            cur = lm_ggml_cont_2d(ctx0, cur, cur->ne[0]*n_head, n_tokens);
+            cur = lm_ggml_cont_3d(ctx0, cur, cur->ne[0]*n_head, n_tokens, cur->ne[3]);
         }
 
         cb(cur, "kqv_out", il);
@@ -1942,9 +1970,22 @@ private:
 
 };
 
+// projectors whose graph can encode several images of the same size at once
+static bool clip_supports_batch(const clip_ctx * ctx) {
+    switch (ctx->proj_type()) {
+        case PROJECTOR_TYPE_GEMMA3:
+        case PROJECTOR_TYPE_IDEFICS3:
+        case PROJECTOR_TYPE_MINICPMV:
+            return true;
+        default:
+            return false;
+    }
+}
+
 static lm_ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32_batch & imgs) {
-    LM_GGML_ASSERT(imgs.entries.size() == 1 && "n_batch > 1 is not supported");
-    clip_graph graph(ctx, *imgs.entries[0]);
+    const int n_batch = imgs.entries.size();
+    LM_GGML_ASSERT((n_batch == 1 || clip_supports_batch(ctx)) && "n_batch > 1 is not supported");
+    clip_graph graph(ctx, *imgs.entries[0], n_batch);
 
     lm_ggml_cgraph * res;
 
@@ -2591,6 +2632,18 @@ struct clip_model_loader {
         }
     }
 
+    // the head size of some encoders has no flash attention kernel on the GPU backends,
+    // falling back to the CPU for those nodes would cost more than the KQ matrix
+    static bool flash_attn_supported(const clip_ctx & ctx_clip, lm_ggml_cgraph * gf) {
+        for (int i = 0; i < lm_ggml_graph_n_nodes(gf); ++i) {
+            lm_ggml_tensor * node = lm_ggml_graph_node(gf, i);
+            if (node->op == LM_GGML_OP_FLASH_ATTN_EXT && !lm_ggml_backend_supports_op(ctx_clip.backend, node)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     void alloc_compute_meta(clip_ctx & ctx_clip) {
         const auto & hparams = ctx_clip.model.hparams;
         ctx_clip.buf_compute_meta.resize(ctx_clip.max_nodes * lm_ggml_tensor_overhead() + lm_ggml_graph_overhead());
@@ -2608,7 +2661,13 @@ struct clip_model_loader {
         batch.entries.push_back(std::move(img));
 
         lm_ggml_cgraph * gf = clip_image_build_graph(&ctx_clip, batch);
+        if (ctx_clip.flash_attn && !flash_attn_supported(ctx_clip, gf)) {
+            LOG_WRN("%s: flash attention is not supported by %s for this encoder, disabling it\n", __func__, lm_ggml_backend_name(ctx_clip.backend));
+            ctx_clip.flash_attn = false;
+            gf = clip_image_build_graph(&ctx_clip, batch);
+        }
         lm_ggml_backend_sched_reserve(ctx_clip.sched.get(), gf);
+        ctx_clip.gf_prev = nullptr;
 
         for (size_t i = 0; i < ctx_clip.backend_ptrs.size(); ++i) {
             lm_ggml_backend_t backend = ctx_clip.backend_ptrs[i];
@@ -3158,13 +3217,18 @@ struct llava_uhd {
 
         // resize to overview size
         clip_image_u8_ptr resized_img(clip_image_u8_init());
-        image_manipulation::bicubic_resize(*img, *resized_img, inst.overview_size.width, inst.overview_size.height);
-        output.push_back(std::move(resized_img));
         if (inst.slices.empty()) {
             // no slices, just return the resized image
+            image_manipulation::bicubic_resize(*img, *resized_img, inst.overview_size.width, inst.overview_size.height);
+            output.push_back(std::move(resized_img));
             return output;
         }
 
+        // the overview and the refined image are resized from the same source, do both at once
+        std::thread overview_worker([&]() {
+            image_manipulation::bicubic_resize(*img, *resized_img, inst.overview_size.width, inst.overview_size.height);
+        });
+
         // resize to refined size
         clip_image_u8_ptr refined_img(clip_image_u8_init());
         if (inst.padding_refined) {
@@ -3173,6 +3237,9 @@ struct llava_uhd {
             image_manipulation::bilinear_resize(*img, *refined_img, inst.refined_size.width, inst.refined_size.height);
         }
 
+        overview_worker.join();
+        output.push_back(std::move(resized_img));
+
         // create slices
         for (const auto & slice : inst.slices) {
             int x = slice.x;
@@ -3679,17 +3746,42 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     const clip_image_f32_batch & imgs = *imgs_c_ptr;
     int batch_size = imgs.entries.size();
 
-    // TODO @ngxson : implement batch size > 1 as a loop
-    //                we don't need true batching support because the cgraph will gonna be big anyway
-    if (batch_size != 1) {
-        return false; // only support batch size of 1
+    if (batch_size == 0) {
+        return false;
     }
 
-    // build the inference graph
-    ctx->debug_print_tensors.clear();
-    lm_ggml_backend_sched_reset(ctx->sched.get());
-    lm_ggml_cgraph * gf = clip_image_build_graph(ctx, imgs);
-    lm_ggml_backend_sched_alloc_graph(ctx->sched.get(), gf);
+    bool same_size = true;
+    for (const auto & entry : imgs.entries) {
+        same_size = same_size && entry->nx == imgs.entries[0]->nx && entry->ny == imgs.entries[0]->ny;
+    }
+
+    if (batch_size > 1 && (imgs.is_audio || !same_size || !clip_supports_batch(ctx))) {
+        // encode one image at a time, consecutive images of the same size still share the graph
+        const int n_mmproj_embd = clip_n_mmproj_embd(ctx);
+        for (const auto & entry : imgs.entries) {
+            if (!clip_image_encode(ctx, n_threads, entry.get(), vec)) {
+                return false;
+            }
+            vec += (size_t) clip_n_output_tokens(ctx, entry.get()) * n_mmproj_embd;
+        }
+        return true;
+    }
+
+    // build the inference graph, or reuse the previous one if the input shape is unchanged
+    const std::array<int, 3> shape = {imgs.entries[0]->nx, imgs.entries[0]->ny, batch_size};
+    lm_ggml_cgraph * gf = ctx->gf_prev;
+    if (gf == nullptr || shape != ctx->gf_prev_shape) {
+        ctx->gf_prev = nullptr;
+        ctx->debug_print_tensors.clear();
+        lm_ggml_backend_sched_reset(ctx->sched.get());
+        gf = clip_image_build_graph(ctx, imgs);
+        if (!lm_ggml_backend_sched_alloc_graph(ctx->sched.get(), gf)) {
+            LOG_ERR("%s: failed to allocate the compute graph\n", __func__);
+            return false;
+        }
+        ctx->gf_prev       = gf;
+        ctx->gf_prev_shape = shape;
+    }
 
     // set inputs
     const auto & model   = ctx->model;
@@ -3750,21 +3842,19 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
         // └─────┘ │
         //   ──────┘ x B
 
-        for (size_t i = 0; i < imgs.entries.size(); i++) {
-            const int nx = imgs.entries[i]->nx;
-            const int ny = imgs.entries[i]->ny;
-            const int n = nx * ny;
-
-            for (int b = 0; b < batch_size; b++) {
-                float * batch_entry = inp_raw.data() + b * (3*n);
-                for (int y = 0; y < ny; y++) {
-                    for (int x = 0; x < nx; x++) {
-                        size_t base_src = 3*(y * nx + x); // idx of the first channel
-                        size_t base_dst =    y * nx + x;  // idx of the first channel
-                        batch_entry[      base_dst] = imgs.entries[b]->buf[base_src    ];
-                        batch_entry[1*n + base_dst] = imgs.entries[b]->buf[base_src + 1];
-                        batch_entry[2*n + base_dst] = imgs.entries[b]->buf[base_src + 2];
-                    }
+        const int nx = imgs.entries[0]->nx;
+        const int ny = imgs.entries[0]->ny;
+        const int n = nx * ny;
+
+        for (int b = 0; b < batch_size; b++) {
+            float * batch_entry = inp_raw.data() + b * (3*n);
+            for (int y = 0; y < ny; y++) {
+                for (int x = 0; x < nx; x++) {
+                    size_t base_src = 3*(y * nx + x); // idx of the first channel
+                    size_t base_dst =    y * nx + x;  // idx of the first channel
+                    batch_entry[      base_dst] = imgs.entries[b]->buf[base_src    ];
+                    batch_entry[1*n + base_dst] = imgs.entries[b]->buf[base_src + 1];
+                    batch_entry[2*n + base_dst] = imgs.entries[b]->buf[base_src + 2];
                 }
             }
         }
@@ -4032,11 +4122,12 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     // the last node is the embedding tensor
     lm_ggml_tensor * embeddings = lm_ggml_graph_node(gf, -1);
 
-    // sanity check (only support batch size of 1 for now)
+    // sanity check, the images of a batch all have the same number of output tokens
     const int n_tokens_out = embeddings->ne[1];
     const int expected_n_tokens_out = clip_n_output_tokens(ctx, imgs.entries[0].get());
-    if (n_tokens_out != expected_n_tokens_out) {
-        LOG_ERR("%s: expected output %d tokens, got %d\n", __func__, expected_n_tokens_out, n_tokens_out);
+    if (n_tokens_out != expected_n_tokens_out || lm_ggml_nrows(embeddings) != (int64_t) n_tokens_out * batch_size) {
+        LOG_ERR("%s: expected output %d tokens x %d images, got %d x %d\n", __func__,
+                expected_n_tokens_out, batch_size, n_tokens_out, (int) (lm_ggml_nrows(embeddings) / n_tokens_out));
         LM_GGML_ABORT("Invalid number of output tokens");
     }
 
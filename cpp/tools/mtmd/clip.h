@@ -24,6 +24,7 @@ enum clip_modality {
 
 struct clip_context_params {
     bool use_gpu;
+    bool flash_attn; // use flash attention in the encoder when the backend supports it
     enum lm_ggml_log_level verbosity;
 };
 
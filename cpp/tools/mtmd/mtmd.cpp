@@ -86,8 +86,10 @@ const char * mtmd_default_marker() {
 mtmd_context_params mtmd_context_params_default() {
     mtmd_context_params params;
     params.use_gpu = true;
+    params.flash_attn = true;
     params.print_timings = true;
     params.n_threads = 4;
+    params.n_batch_image = 4;
     params.verbosity = LM_GGML_LOG_LEVEL_INFO;
     params.image_marker = MTMD_DEFAULT_IMAGE_MARKER;
     params.media_marker = mtmd_default_marker();
@@ -102,6 +104,7 @@ struct mtmd_context {
 
     bool print_timings;
     int n_threads;
+    int n_batch_image;
     std::string media_marker;
     const int n_embd_text;
 
@@ -138,6 +141,7 @@ struct mtmd_context {
         text_model   (text_model),
         print_timings(ctx_params.print_timings),
         n_threads    (ctx_params.n_threads),
+        n_batch_image(std::max(1, ctx_params.n_batch_image)),
         media_marker (ctx_params.media_marker),
         n_embd_text  (llama_model_n_embd(text_model))
     {
@@ -150,8 +154,9 @@ struct mtmd_context {
         }
 
         clip_context_params ctx_clip_params;
-        ctx_clip_params.use_gpu   = ctx_params.use_gpu;
-        ctx_clip_params.verbosity = ctx_params.verbosity;
+        ctx_clip_params.use_gpu    = ctx_params.use_gpu;
+        ctx_clip_params.flash_attn = ctx_params.flash_attn;
+        ctx_clip_params.verbosity  = ctx_params.verbosity;
         auto res = clip_init(mmproj_fname, ctx_clip_params);
         ctx_v = res.ctx_v;
         ctx_a = res.ctx_a;
@@ -766,36 +771,72 @@ int32_t mtmd_encode_chunk(mtmd_context * ctx, const mtmd_input_chunk * chunk) {
     return 1;
 }
 
+// encode the images back to back into image_embd_v
+// runs of images with the same size go through clip_image_batch_encode together, n_batch_image at a time
+static bool mtmd_encode_images(mtmd_context * ctx, const std::vector<const clip_image_f32 *> & images, size_t n_tokens) {
+    clip_ctx * ctx_clip = ctx->ctx_v;
+    const int n_mmproj_embd = clip_n_mmproj_embd(ctx_clip);
+    ctx->image_embd_v.resize(n_tokens * n_mmproj_embd);
+
+    float * embd = ctx->image_embd_v.data();
+    size_t i = 0;
+    while (i < images.size()) {
+        clip_image_f32_batch batch;
+        size_t n_batch_tokens = 0;
+        for (; i < images.size() && (int) batch.entries.size() < ctx->n_batch_image; i++) {
+            if (!batch.entries.empty() && (images[i]->nx != batch.entries[0]->nx || images[i]->ny != batch.entries[0]->ny)) {
+                break;
+            }
+            clip_image_f32_ptr img(clip_image_f32_init());
+            *img = *images[i];
+            n_batch_tokens += clip_n_output_tokens(ctx_clip, img.get());
+            batch.entries.push_back(std::move(img));
+        }
+        if (!clip_image_batch_encode(ctx_clip, ctx->n_threads, &batch, embd)) {
+            return false;
+        }
+        embd += n_batch_tokens * n_mmproj_embd;
+    }
+
+    return true;
+}
+
 int32_t mtmd_encode(mtmd_context * ctx, const mtmd_image_tokens * image_tokens) {
     clip_ctx * ctx_clip = ctx->ctx_v;
     if (!ctx_clip) {
         LOG_ERR("%s: this API does not support non-vision input, please use mtmd_encode_chunk instead\n", __func__);
         return 1;
     }
-    int n_mmproj_embd = clip_n_mmproj_embd(ctx_clip);
-    ctx->image_embd_v.resize(image_tokens->n_tokens() * n_mmproj_embd);
-    bool ok = false;
-
-    if (clip_is_llava(ctx_clip) || clip_is_minicpmv(ctx_clip) || clip_is_glm(ctx_clip)) {
-        // TODO @ngxson : llava does not support batched encoding ; this should be fixed inside clip_image_batch_encode()
-        const auto & entries = image_tokens->batch_f32.entries;
-        for (size_t i = 0; i < entries.size(); i++) {
-            int n_tokens_per_image = clip_n_output_tokens(ctx_clip, entries[i].get());
-            ok = clip_image_encode(
-                ctx_clip,
-                ctx->n_threads,
-                entries[i].get(),
-                ctx->image_embd_v.data() + i*n_mmproj_embd*n_tokens_per_image);
+
+    std::vector<const clip_image_f32 *> images;
+    for (const auto & entry : image_tokens->batch_f32.entries) {
+        images.push_back(entry.get());
+    }
+
+    return mtmd_encode_images(ctx, images, image_tokens->n_tokens()) ? 0 : 1;
+}
+
+int32_t mtmd_encode_chunks(mtmd_context * ctx, const mtmd_input_chunk ** chunks, size_t n_chunks) {
+    if (!ctx->ctx_v) {
+        LOG_ERR("%s: model does not support vision input\n", __func__);
+        return 1;
+    }
+
+    std::vector<const clip_image_f32 *> images;
+    size_t n_tokens = 0;
+    for (size_t i = 0; i < n_chunks; i++) {
+        if (chunks[i]->type != MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+            LOG_ERR("%s: chunk %zu is not an image chunk\n", __func__, i);
+            return 1;
         }
-    } else {
-        ok = clip_image_batch_encode(
-            ctx_clip,
-            ctx->n_threads,
-            &image_tokens->batch_f32,
-            ctx->image_embd_v.data());
+        const mtmd_image_tokens * image_tokens = chunks[i]->tokens_image.get();
+        for (const auto & entry : image_tokens->batch_f32.entries) {
+            images.push_back(entry.get());
+        }
+        n_tokens += image_tokens->n_tokens();
     }
 
-    return ok ? 0 : 1;
+    return mtmd_encode_images(ctx, images, n_tokens) ? 0 : 1;
 }
 
 float * mtmd_get_output_embd(mtmd_context * ctx) {
@@ -829,6 +870,10 @@ int mtmd_get_audio_bitrate(mtmd_context * ctx) {
     return 16000; // 16kHz
 }
 
+void mtmd_set_n_threads(mtmd_context * ctx, int n_threads) {
+    ctx->n_threads = std::max(1, n_threads);
+}
+
 //
 // public API functions
 //
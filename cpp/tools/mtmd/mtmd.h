@@ -77,8 +77,10 @@ typedef struct mtmd_input_text   mtmd_input_text;
 
 struct mtmd_context_params {
     bool use_gpu;
+    bool flash_attn; // encoder attention without the full KQ matrix, falls back if the backend cannot run it
     bool print_timings;
     int n_threads;
+    int n_batch_image; // max number of same-size images (slices) encoded in one graph by mtmd_encode_chunks
     enum lm_ggml_log_level verbosity;
     const char * image_marker; // deprecated, use media_marker instead
     const char * media_marker;
@@ -112,6 +114,9 @@ MTMD_API bool mtmd_support_audio(mtmd_context * ctx);
 // return -1 if audio is not supported
 MTMD_API int mtmd_get_audio_bitrate(mtmd_context * ctx);
 
+// set the number of threads used by the following encode calls
+MTMD_API void mtmd_set_n_threads(mtmd_context * ctx, int n_threads);
+
 // mtmd_bitmap
 //
 // if bitmap is image:
@@ -205,6 +210,14 @@ MTMD_API int32_t mtmd_encode(mtmd_context * ctx,
 MTMD_API int32_t mtmd_encode_chunk(mtmd_context * ctx,
                                    const mtmd_input_chunk * chunk);
 
+// encode several image chunks in one call, e.g. the overview and slices of a llava-uhd image
+// consecutive images of the same size are encoded as one batch of up to n_batch_image images
+// the output embeddings of the chunks are stored back to back, in the order of the chunks
+// returns 0 on success
+MTMD_API int32_t mtmd_encode_chunks(mtmd_context * ctx,
+                                    const mtmd_input_chunk ** chunks,
+                                    size_t n_chunks);
+
 // get output embeddings from the last encode pass
 // the reading size (in bytes) is equal to:
 // llama_model_n_embd(model) * mtmd_input_chunk_get_n_tokens(chunk) * sizeof(float)
@@ -10,8 +10,11 @@
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -220,31 +223,37 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
+static std::vector<std::string> unicode_byte_encoding_process(const std::vector<uint32_t> & cpts, const std::vector<size_t> & bpe_offsets) {
+    static const std::vector<std::string> byte_to_utf8 = [] {
+        std::vector<std::string> table(256);
+        for (const auto & it : unicode_byte_to_utf8_map()) {
+            table[it.first] = it.second;
         }
+        return table;
+    }();
+
+    std::vector<std::string> bpe_encoded_words;
+    bpe_encoded_words.reserve(bpe_offsets.size());
 
+    size_t start = 0;
+    for (const size_t offset : bpe_offsets) {
         std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
+        for (size_t i = start; i < start + offset; ++i) {
+            for (const char c : unicode_cpt_to_utf8(cpts[i])) {
+                encoded_token += byte_to_utf8[(uint8_t) c];
+            }
         }
-        bpe_encoded_words.emplace_back(encoded_token);
+        bpe_encoded_words.emplace_back(std::move(encoded_token));
+        start += offset;
     }
     return bpe_encoded_words;
 }
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -357,12 +366,11 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// QWEN2 and BAILINGMOE split single digits (\p{N}), SEED-CODER also drops the [\r\n]* after the punctuation
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, size_t max_digits = 3, bool punct_newlines = true) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -434,7 +442,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -451,7 +459,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
                     flags2 = _get_flags(++pos);
                 }
                 uint32_t cpt2 = _get_cpt(pos);
-                while (cpt2 == '\r' || cpt2 == '\n') {
+                while (punct_newlines && (cpt2 == '\r' || cpt2 == '\n')) {
                     cpt2 = _get_cpt(++pos);
                 }
                 _add_token(pos);
@@ -557,21 +565,307 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
     } else if (
             regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets);
+    } else if (
+            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+            regex_expr == "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+") {
+        // \\s*[\\r\\n] ends after the last newline of the whitespace run, like \\s*[\\r\\n]+
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1);
+    } else if (regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1, false);
     }
 
     return bpe_offsets;
 }
 
+//
+// regexes made of a sequence of character classes, such as "\\p{N}{1,3}", "\\s?\\p{L}+" or "<sentinel:[0-9]+>"
+// are compiled once and matched with backtracking on the same text as the std::regex fallback,
+// so they split exactly like std::regex without its per-character overhead
+//
+
+static const uint32_t UNICODE_REGEX_CLASS = 0xFFFFFFFF;
+
+struct unicode_regex_class {
+    bool negated = false;
+    uint64_t ascii[2] = { 0, 0 };                       // bitmap of the units below 128
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // inclusive ranges of the units above 127
+
+    void add(uint32_t first, uint32_t last) {
+        for (uint32_t c = first; c <= last && c < 128; ++c) {
+            ascii[c >> 6] |= 1ULL << (c & 63);
+        }
+        if (last >= 128) {
+            ranges.emplace_back(std::max<uint32_t>(first, 128), last);
+        }
+    }
+
+    bool contains(uint32_t c) const {
+        bool found = false;
+        if (c < 128) {
+            found = (ascii[c >> 6] >> (c & 63)) & 1;
+        } else {
+            for (const auto & range : ranges) {
+                if (range.first <= c && c <= range.second) {
+                    found = true;
+                    break;
+                }
+            }
+        }
+        return found != negated;
+    }
+};
+
+struct unicode_regex_item {
+    unicode_regex_class cls;
+    size_t n_min = 1;
+    size_t n_max = 1;
+};
+
+struct unicode_regex_seq {
+    std::vector<unicode_regex_item> items;
+    bool anchor_end = false; // trailing $
+};
+
+// the escaped character after a backslash: a literal returned in cpt, or a class added to cls
+static bool unicode_regex_parse_escape(uint32_t c, unicode_regex_class & cls, uint32_t & cpt) {
+    cpt = UNICODE_REGEX_CLASS;
+    switch (c) {
+        case 's': cls.add('\t', '\r'); cls.add(' ', ' '); return true;
+        case 'd': cls.add('0', '9'); return true;
+        case 't': cpt = '\t'; return true;
+        case 'n': cpt = '\n'; return true;
+        case 'v': cpt = '\v'; return true;
+        case 'f': cpt = '\f'; return true;
+        case 'r': cpt = '\r'; return true;
+        default: break;
+    }
+    // other letters and digits are classes, anchors or back-references
+    if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')) {
+        return false;
+    }
+    cpt = c;
+    return true;
+}
+
+static bool unicode_regex_parse_class(const std::vector<uint32_t> & pat, size_t & i, unicode_regex_class & cls) {
+    ++i; // [
+    if (i < pat.size() && pat[i] == '^') {
+        cls.negated = true;
+        ++i;
+    }
+    while (i < pat.size() && pat[i] != ']') {
+        uint32_t first = pat[i];
+        if (first == '\\') {
+            if (++i >= pat.size() || !unicode_regex_parse_escape(pat[i], cls, first)) {
+                return false;
+            }
+        } else if (first == '[') {
+            return false;
+        }
+        ++i;
+        if (first == UNICODE_REGEX_CLASS) {
+            continue;
+        }
+        uint32_t last = first;
+        if (i + 1 < pat.size() && pat[i] == '-' && pat[i + 1] != ']') {
+            last = pat[++i];
+            if (last == '\\') {
+                unicode_regex_class tmp;
+                if (++i >= pat.size() || !unicode_regex_parse_escape(pat[i], tmp, last) || last == UNICODE_REGEX_CLASS) {
+                    return false;
+                }
+            }
+            ++i;
+            if (last < first) {
+                return false;
+            }
+        }
+        cls.add(first, last);
+    }
+    if (i >= pat.size()) {
+        return false;
+    }
+    ++i; // ]
+    return true;
+}
+
+static bool unicode_regex_parse_count(const std::vector<uint32_t> & pat, size_t & i, size_t & n) {
+    size_t i_start = i;
+    n = 0;
+    while (i < pat.size() && pat[i] >= '0' && pat[i] <= '9') {
+        n = n * 10 + (pat[i++] - '0');
+    }
+    return i > i_start;
+}
+
+static bool unicode_regex_compile(const std::vector<uint32_t> & pat, unicode_regex_seq & seq) {
+    size_t i = 0;
+    while (i < pat.size()) {
+        const uint32_t c = pat[i];
+        if (c == '$' && i + 1 == pat.size()) {
+            seq.anchor_end = true;
+            break;
+        }
+        unicode_regex_item item;
+        if (c == '[') {
+            if (!unicode_regex_parse_class(pat, i, item.cls)) {
+                return false;
+            }
+        } else if (c == '\\') {
+            uint32_t cpt;
+            if (i + 1 >= pat.size() || !unicode_regex_parse_escape(pat[i + 1], item.cls, cpt)) {
+                return false;
+            }
+            if (cpt != UNICODE_REGEX_CLASS) {
+                item.cls.add(cpt, cpt);
+            }
+            i += 2;
+        } else if (c < 128 && std::strchr("()|.^$*+?{}]", (int) c) != nullptr) {
+            // groups, alternations, lookarounds and anchors need std::regex
+            return false;
+        } else {
+            item.cls.add(c, c);
+            ++i;
+        }
+
+        if (i < pat.size() && (pat[i] == '?' || pat[i] == '*' || pat[i] == '+' || pat[i] == '{')) {
+            const uint32_t q = pat[i++];
+            if (q == '?') {
+                item.n_min = 0;
+            } else if (q == '*') {
+                item.n_min = 0;
+                item.n_max = SIZE_MAX;
+            } else if (q == '+') {
+                item.n_max = SIZE_MAX;
+            } else {
+                if (!unicode_regex_parse_count(pat, i, item.n_min)) {
+                    return false;
+                }
+                item.n_max = item.n_min;
+                if (i < pat.size() && pat[i] == ',') {
+                    ++i;
+                    item.n_max = SIZE_MAX;
+                    if (i < pat.size() && pat[i] != '}' && !unicode_regex_parse_count(pat, i, item.n_max)) {
+                        return false;
+                    }
+                }
+                if (i >= pat.size() || pat[i] != '}' || item.n_max < item.n_min) {
+                    return false;
+                }
+                ++i;
+            }
+            // lazy quantifiers
+            if (i < pat.size() && pat[i] == '?') {
+                return false;
+            }
+        }
+        seq.items.push_back(std::move(item));
+    }
+
+    // empty matches would need the rules of std::regex_iterator to advance
+    for (const auto & item : seq.items) {
+        if (item.n_min > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint32_t unicode_regex_unit(char c)    { return (uint8_t) c; }
+static inline uint32_t unicode_regex_unit(wchar_t c) { return (uint32_t) c; }
+
+// end of the leftmost-greedy match of the items from i_item at pos, std::string::npos if none
+template <typename T>
+static size_t unicode_regex_seq_match(const unicode_regex_seq & seq, const T * units, size_t i_item, size_t pos, size_t end) {
+    if (i_item == seq.items.size()) {
+        return (!seq.anchor_end || pos == end) ? pos : std::string::npos;
+    }
+    const auto & item = seq.items[i_item];
+    size_t n = 0;
+    while (n < item.n_max && pos + n < end && item.cls.contains(unicode_regex_unit(units[pos + n]))) {
+        ++n;
+    }
+    if (n < item.n_min) {
+        return std::string::npos;
+    }
+    if (seq.anchor_end && i_item + 1 == seq.items.size()) {
+        // only the longest run can reach the end
+        return pos + n == end ? end : std::string::npos;
+    }
+    for (size_t k = n; ; --k) {
+        const size_t match_end = unicode_regex_seq_match(seq, units, i_item + 1, pos + k, end);
+        if (match_end != std::string::npos) {
+            return match_end;
+        }
+        if (k == item.n_min) {
+            break;
+        }
+    }
+    return std::string::npos;
+}
+
+template <typename T>
+static std::vector<size_t> unicode_regex_split_seq(const std::basic_string<T> & text, const unicode_regex_seq & seq, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+        size_t prev_end = start;
+        for (size_t pos = start; pos < end; ) {
+            const size_t match_end = unicode_regex_seq_match(seq, text.data(), 0, pos, end);
+            if (match_end == std::string::npos) {
+                ++pos;
+                continue;
+            }
+            if (pos > prev_end) {
+                bpe_offsets.emplace_back(pos - prev_end);
+            }
+            bpe_offsets.emplace_back(match_end - pos);
+            pos = prev_end = match_end;
+        }
+        if (prev_end < end) {
+            bpe_offsets.emplace_back(end - prev_end);
+        }
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
+// compiled once per regex, nullptr if the regex needs std::regex
+static const unicode_regex_seq * unicode_regex_seq_get(const std::string & regex_expr, const std::string & pattern, bool collapsed) {
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<unicode_regex_seq>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(regex_expr);
+    if (it == cache.end()) {
+        std::vector<uint32_t> pat;
+        if (collapsed) {
+            pat.assign((const uint8_t *) pattern.data(), (const uint8_t *) pattern.data() + pattern.size());
+        } else {
+            pat = unicode_cpts_from_utf8(pattern);
+        }
+        auto seq = std::make_unique<unicode_regex_seq>();
+        if (!unicode_regex_compile(pat, *seq)) {
+            seq.reset();
+        }
+        it = cache.emplace(regex_expr, std::move(seq)).first;
+    }
+    return it->second.get();
+}
+
 //
 // interface
 //
@@ -623,6 +917,21 @@ std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
     result.reserve(utf8.size());
     size_t offset = 0;
     while (offset < utf8.size()) {
+        // ASCII fast path, 8 bytes at a time while none of them has the high bit set
+        uint64_t chunk;
+        while (offset + sizeof(chunk) <= utf8.size()) {
+            std::memcpy(&chunk, utf8.data() + offset, sizeof(chunk));
+            if (chunk & 0x8080808080808080ULL) {
+                break;
+            }
+            for (size_t i = 0; i < sizeof(chunk); ++i) {
+                result.push_back((uint8_t) utf8[offset + i]);
+            }
+            offset += sizeof(chunk);
+        }
+        if (offset >= utf8.size()) {
+            break;
+        }
         try {
             result.push_back(unicode_cpt_from_utf8(utf8, offset));
         }
@@ -672,7 +981,8 @@ uint32_t unicode_tolower(uint32_t cpt) {
     return cpt;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+// use_stl skips the custom splitters and the compiled class sequences, the std::regex results they must match
+static std::vector<std::string> unicode_regex_split_impl(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_stl) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -698,24 +1008,18 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { unicode_cpt_flags::SYMBOL,      "\\\x24\\\x2B\x3C-\x3E\x5E\x60\\\x7C" }, // $+<=>^`|
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (const auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
     // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
     // ref: https://github.com/ggml-org/llama.cpp/pull/6920#issuecomment-2081479935
+    // computed on first use, the custom implementations work on the codepoints
     std::string text_collapsed;
-    if (need_collapse) {
+    bool has_collapsed = false;
+    auto collapse = [&]() {
+        if (has_collapsed) {
+            return;
+        }
+        has_collapsed = true;
         // collapse all unicode categories
         text_collapsed.resize(cpts.size());
 
@@ -738,13 +1042,16 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                 text_collapsed[i] = (char) 0xD0; // fallback
             }
         }
-    }
+    };
+
+    std::wstring wtext;
+    bool has_wtext = false;
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
     for (const auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        auto tmp = use_stl ? std::vector<size_t>() : unicode_regex_split_custom(cpts, regex_expr, bpe_offsets);
 
         if (!tmp.empty()) {
             bpe_offsets = std::move(tmp);
@@ -814,22 +1121,35 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-                bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                collapse();
+                const auto * seq = use_stl ? nullptr : unicode_regex_seq_get(regex_expr, regex_expr_collapsed, true);
+                if (seq) {
+                    bpe_offsets = unicode_regex_split_seq(text_collapsed, *seq, bpe_offsets);
+                } else {
+                    bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                }
             } else {
                 // no unicode category used, we can use std::wregex directly
-                const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
-
-                // std::wregex \s does not mach non-ASCII whitespaces, using 0x0B as fallback
-                std::wstring wtext(cpts.begin(), cpts.end());
-                for (size_t i = 0; i < wtext.size(); ++i) {
-                    if (wtext[i] > 0x7F && unicode_cpt_flags_from_cpt(wtext[i]).is_whitespace) {
-                        wtext[i] = 0x0B;
+                if (!has_wtext) {
+                    // std::wregex \s does not mach non-ASCII whitespaces, using 0x0B as fallback
+                    wtext.assign(cpts.begin(), cpts.end());
+                    for (size_t i = 0; i < wtext.size(); ++i) {
+                        if (wtext[i] > 0x7F && unicode_cpt_flags_from_cpt(wtext[i]).is_whitespace) {
+                            wtext[i] = 0x0B;
+                        }
                     }
+                    has_wtext = true;
                 }
 
                 //printf("text: %s\n", text.c_str());
                 //printf("regex_expr: %s\n", regex_expr.c_str());
-                bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                const auto * seq = use_stl ? nullptr : unicode_regex_seq_get(regex_expr, regex_expr, false);
+                if (seq) {
+                    bpe_offsets = unicode_regex_split_seq(wtext, *seq, bpe_offsets);
+                } else {
+                    const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
+                    bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                }
             }
         } catch (std::regex_error & e) {
             fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
@@ -838,17 +1158,9 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
-    std::vector<std::string> bpe_words;
-    bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
-
-    size_t start = 0;
-    for (size_t & offset : bpe_offsets) {
-        bpe_words.emplace_back();
-        for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
-        }
-        start += offset;
-    }
+    return unicode_byte_encoding_process(cpts, bpe_offsets);
+}
 
-    return unicode_byte_encoding_process(bpe_words);
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+    return unicode_regex_split_impl(text, regex_exprs, false);
 }
@@ -1,5 +1,13 @@
 #import "RNLlama.h"
 #import "RNLlamaContext.h"
+#import <UIKit/UIKit.h>
+#import <React/RCTBridge+Private.h>
+#import <jsi/jsi.h>
+#import "rn-llama-jsi.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 #ifdef RCT_NEW_ARCH_ENABLED
 #import "RNLlamaSpec.h"
@@ -8,11 +16,53 @@
 @implementation RNLlama
 
 NSMutableDictionary *llamaContexts;
+// Guards llamaContexts, a released context is deleted once the calls and blocks retaining it are done
+static std::mutex llamaContextsMutex;
 double llamaContextLimit = -1;
-dispatch_queue_t llamaDQueue;
 
 RCT_EXPORT_MODULE()
 
+// Residency levels of rn-llama.h
+static const int RESIDENCY_SUSPEND = 2;
+
+// The context stays valid for the calling method, the blocks it dispatches retain it themselves
+static RNLlamaContext *getContext(double contextId) {
+    std::lock_guard<std::mutex> lock(llamaContextsMutex);
+    return [[llamaContexts[[NSNumber numberWithDouble:contextId]] retain] autorelease];
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(onMemoryWarning)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+    }
+    return self;
+}
+
+- (void)onMemoryWarning {
+    NSArray *contexts = nil;
+    {
+        std::lock_guard<std::mutex> lock(llamaContextsMutex);
+        if (llamaContexts == nil) {
+            return;
+        }
+        contexts = [[llamaContexts allValues] retain];
+    }
+    for (RNLlamaContext *context in contexts) {
+        // Busy contexts are skipped, they are released on the next warning
+        if ([context isPredicting]) {
+            continue;
+        }
+        dispatch_async([context queue], ^{
+            [context releaseResidency:RESIDENCY_SUSPEND];
+        });
+    }
+    [contexts release];
+}
+
 RCT_EXPORT_METHOD(toggleNativeLog:(BOOL)enabled) {
     void (^onEmitLog)(NSString *level, NSString *text) = nil;
     if (enabled) {
@@ -23,6 +73,17 @@ RCT_EXPORT_METHOD(toggleNativeLog:(BOOL)enabled) {
     [RNLlamaContext toggleNativeLog:enabled onEmitLog:onEmitLog];
 }
 
+RCT_EXPORT_BLOCKING_SYNCHRONOUS_METHOD(installJSI)
+{
+    RCTCxxBridge *cxxBridge = (RCTCxxBridge *)self.bridge;
+    if (cxxBridge == nil || cxxBridge.runtime == nil) {
+        // the bridge methods are used instead
+        return @"The JS runtime is not reachable, e.g. remote debugging";
+    }
+    auto runtime = (facebook::jsi::Runtime *)cxxBridge.runtime;
+    return rnllama_jsi::install(*runtime) ? @"" : @"Failed to install the JSI bindings";
+}
+
 RCT_EXPORT_METHOD(setContextLimit:(double)limit
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
@@ -45,22 +106,21 @@ RCT_EXPORT_METHOD(initContext:(double)contextId
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
     NSNumber *contextIdNumber = [NSNumber numberWithDouble:contextId];
-    if (llamaContexts[contextIdNumber] != nil) {
-        reject(@"llama_error", @"Context already exists", nil);
-        return;
-    }
-
-    if (llamaDQueue == nil) {
-        llamaDQueue = dispatch_queue_create("com.rnllama", DISPATCH_QUEUE_SERIAL);
-    }
+    {
+        std::lock_guard<std::mutex> lock(llamaContextsMutex);
+        if (llamaContexts[contextIdNumber] != nil) {
+            reject(@"llama_error", @"Context already exists", nil);
+            return;
+        }
 
-    if (llamaContexts == nil) {
-        llamaContexts = [[NSMutableDictionary alloc] init];
-    }
+        if (llamaContexts == nil) {
+            llamaContexts = [[NSMutableDictionary alloc] init];
+        }
 
-    if (llamaContextLimit > -1 && [llamaContexts count] >= llamaContextLimit) {
-        reject(@"llama_error", @"Context limit reached", nil);
-        return;
+        if (llamaContextLimit > -1 && [llamaContexts count] >= llamaContextLimit) {
+            reject(@"llama_error", @"Context limit reached", nil);
+            return;
+        }
     }
 
     @try {
@@ -69,12 +129,18 @@ RCT_EXPORT_METHOD(initContext:(double)contextId
               [self sendEventWithName:@"@RNLlama_onInitContextProgress" body:@{ @"contextId": @(contextId), @"progress": @(progress) }];
           });
       }];
+      // initWithParams returns an owned context, the map holds the only reference from here on
+      [context autorelease];
       if (![context isModelLoaded]) {
           reject(@"llama_cpp_error", @"Failed to load the model", nil);
           return;
       }
 
-      [llamaContexts setObject:context forKey:contextIdNumber];
+      {
+          std::lock_guard<std::mutex> lock(llamaContextsMutex);
+          [llamaContexts setObject:context forKey:contextIdNumber];
+      }
+      [context bindJSIContextId:(int)contextId];
 
       resolve(@{
           @"gpu": @([context isMetalEnabled]),
@@ -93,7 +159,7 @@ RCT_EXPORT_METHOD(getFormattedChat:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -131,7 +197,7 @@ RCT_EXPORT_METHOD(loadSession:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -140,7 +206,7 @@ RCT_EXPORT_METHOD(loadSession:(double)contextId
         reject(@"llama_error", @"Context is busy", nil);
         return;
     }
-    dispatch_async(llamaDQueue, ^{
+    dispatch_async([context queue], ^{
         @try {
             @autoreleasepool {
                 resolve([context loadSession:filePath]);
@@ -157,7 +223,7 @@ RCT_EXPORT_METHOD(saveSession:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -166,7 +232,7 @@ RCT_EXPORT_METHOD(saveSession:(double)contextId
         reject(@"llama_error", @"Context is busy", nil);
         return;
     }
-    dispatch_async(llamaDQueue, ^{
+    dispatch_async([context queue], ^{
         @try {
             @autoreleasepool {
                 int count = [context saveSession:filePath size:(int)size];
@@ -191,7 +257,7 @@ RCT_EXPORT_METHOD(completion:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -200,21 +266,32 @@ RCT_EXPORT_METHOD(completion:(double)contextId
         reject(@"llama_error", @"Context is busy", nil);
         return;
     }
-    dispatch_async(llamaDQueue, ^{
+    bool emitPartialCompletion = [completionParams[@"emit_partial_completion"] boolValue];
+    // Partial completions sent but not yet handled on the JS thread, coalesced in the emitter meanwhile
+    auto pendingEvents = std::make_shared<std::atomic<int>>(0);
+    RCTBridge *bridge = self.bridge;
+    dispatch_async([context queue], ^{
         @try {
             @autoreleasepool {
                 NSDictionary* completionResult = [context completion:completionParams
-                    onToken:^(NSMutableDictionary *tokenResult) {
-                        if (![completionParams[@"emit_partial_completion"] boolValue]) return;
-                        dispatch_async(dispatch_get_main_queue(), ^{
-                            [self sendEventWithName:@"@RNLlama_onToken"
-                                body:@{
-                                    @"contextId": [NSNumber numberWithDouble:contextId],
-                                    @"tokenResult": tokenResult
-                                }
-                            ];
-                            [tokenResult release];
-                        });
+                    onToken:!emitPartialCompletion ? nil : ^(NSMutableDictionary *tokenResult) {
+                        if (bridge) pendingEvents->fetch_add(1);
+                        [self sendEventWithName:@"@RNLlama_onToken"
+                            body:@{
+                                @"contextId": [NSNumber numberWithDouble:contextId],
+                                @"tokenResult": tokenResult
+                            }
+                        ];
+                        [tokenResult release];
+                        // Queued behind the event on the JS thread, so it runs once the event is handled
+                        if (bridge) {
+                            [bridge dispatchBlock:^{
+                                pendingEvents->fetch_sub(1);
+                            } queue:RCTJSThread];
+                        }
+                    }
+                    isBusy:^bool {
+                        return pendingEvents->load() > 0;
                     }
                 ];
                 resolve(completionResult);
@@ -231,7 +308,7 @@ RCT_EXPORT_METHOD(stopCompletion:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -246,18 +323,33 @@ RCT_EXPORT_METHOD(tokenize:(double)contextId
                   withResolver:(RCTPromiseResolveBlock)resolve
                   withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
     }
-    @try {
-        NSMutableDictionary *result = [context tokenize:text imagePaths:imagePaths];
-        resolve(result);
-        [result release];
-    } @catch (NSException *exception) {
-        reject(@"llama_error", exception.reason, nil);
+    if (imagePaths.count == 0) {
+        // text is tokenized with the vocab alone, beside a running completion
+        @try {
+            NSMutableDictionary *result = [context tokenize:text imagePaths:imagePaths];
+            resolve(result);
+            [result release];
+        } @catch (NSException *exception) {
+            reject(@"llama_error", exception.reason, nil);
+        }
+        return;
     }
+    dispatch_async([context queue], ^{
+        @try {
+            @autoreleasepool {
+                NSMutableDictionary *result = [context tokenize:text imagePaths:imagePaths];
+                resolve(result);
+                [result release];
+            }
+        } @catch (NSException *exception) {
+            reject(@"llama_error", exception.reason, nil);
+        }
+    });
 }
 
 RCT_EXPORT_METHOD(detokenize:(double)contextId
@@ -265,7 +357,7 @@ RCT_EXPORT_METHOD(detokenize:(double)contextId
                   withResolver:(RCTPromiseResolveBlock)resolve
                   withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -279,17 +371,21 @@ RCT_EXPORT_METHOD(embedding:(double)contextId
                   withResolver:(RCTPromiseResolveBlock)resolve
                   withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
     }
-    @try {
-        NSDictionary *embedding = [context embedding:text params:params];
-        resolve(embedding);
-    } @catch (NSException *exception) {
-        reject(@"llama_cpp_error", exception.reason, nil);
-    }
+    dispatch_async([context queue], ^{
+        @try {
+            @autoreleasepool {
+                NSDictionary *embedding = [context embedding:text params:params];
+                resolve(embedding);
+            }
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
 }
 
 RCT_EXPORT_METHOD(rerank:(double)contextId
@@ -298,17 +394,21 @@ RCT_EXPORT_METHOD(rerank:(double)contextId
                   params:(NSDictionary *)params
                   resolver:(RCTPromiseResolveBlock)resolve
                   rejecter:(RCTPromiseRejectBlock)reject) {
-  RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+  RNLlamaContext *context = getContext(contextId);
   if (context == nil) {
     reject(@"context_not_found", @"Context not found", nil);
     return;
   }
-  @try {
-    NSArray *result = [context rerank:query documents:documents params:params];
-    resolve(result);
-  } @catch (NSException *exception) {
-    reject(@"rerank_error", exception.reason, nil);
-  }
+  dispatch_async([context queue], ^{
+    @try {
+      @autoreleasepool {
+        NSArray *result = [context rerank:query documents:documents params:params];
+        resolve(result);
+      }
+    } @catch (NSException *exception) {
+      reject(@"rerank_error", exception.reason, nil);
+    }
+  });
 }
 
 RCT_EXPORT_METHOD(bench:(double)contextId
@@ -319,17 +419,21 @@ RCT_EXPORT_METHOD(bench:(double)contextId
                   withResolver:(RCTPromiseResolveBlock)resolve
                   withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
     }
-    @try {
-        NSString *benchResults = [context bench:pp tg:tg pl:pl nr:nr];
-        resolve(benchResults);
-    } @catch (NSException *exception) {
-        reject(@"llama_cpp_error", exception.reason, nil);
-    }
+    dispatch_async([context queue], ^{
+        @try {
+            @autoreleasepool {
+                NSString *benchResults = [context bench:pp tg:tg pl:pl nr:nr];
+                resolve(benchResults);
+            }
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
 }
 
 RCT_EXPORT_METHOD(applyLoraAdapters:(double)contextId
@@ -337,7 +441,7 @@ RCT_EXPORT_METHOD(applyLoraAdapters:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -346,15 +450,17 @@ RCT_EXPORT_METHOD(applyLoraAdapters:(double)contextId
         reject(@"llama_error", @"Context is busy", nil);
         return;
     }
-    [context applyLoraAdapters:loraAdapters];
-    resolve(nil);
+    dispatch_async([context queue], ^{
+        [context applyLoraAdapters:loraAdapters];
+        resolve(nil);
+    });
 }
 
 RCT_EXPORT_METHOD(removeLoraAdapters:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -363,20 +469,68 @@ RCT_EXPORT_METHOD(removeLoraAdapters:(double)contextId
         reject(@"llama_error", @"Context is busy", nil);
         return;
     }
-    [context removeLoraAdapters];
-    resolve(nil);
+    dispatch_async([context queue], ^{
+        [context removeLoraAdapters];
+        resolve(nil);
+    });
+}
+
+RCT_EXPORT_METHOD(mergeLoraAdapters:(double)contextId
+                 withLoraAdapters:(NSArray *)loraAdapters
+                 withCachePath:(NSString *)cachePath
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    if ([context isPredicting]) {
+        reject(@"llama_error", @"Context is busy", nil);
+        return;
+    }
+    dispatch_async([context queue], ^{
+        @try {
+            [context mergeLoraAdapters:loraAdapters cachePath:cachePath];
+            resolve(nil);
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
+}
+
+RCT_EXPORT_METHOD(unmergeLoraAdapters:(double)contextId
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    if ([context isPredicting]) {
+        reject(@"llama_error", @"Context is busy", nil);
+        return;
+    }
+    dispatch_async([context queue], ^{
+        [context unmergeLoraAdapters];
+        resolve(nil);
+    });
 }
 
 RCT_EXPORT_METHOD(getLoadedLoraAdapters:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
     }
-    resolve([context getLoadedLoraAdapters]);
+    dispatch_async([context queue], ^{
+        resolve([context getLoadedLoraAdapters]);
+    });
 }
 
 RCT_EXPORT_METHOD(initMultimodal:(double)contextId
@@ -384,7 +538,7 @@ RCT_EXPORT_METHOD(initMultimodal:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -394,19 +548,21 @@ RCT_EXPORT_METHOD(initMultimodal:(double)contextId
         return;
     }
 
-    @try {
-        bool success = [context initMultimodal:params];
-        resolve(@(success));
-    } @catch (NSException *exception) {
-        reject(@"llama_cpp_error", exception.reason, nil);
-    }
+    dispatch_async([context queue], ^{
+        @try {
+            bool success = [context initMultimodal:params];
+            resolve(@(success));
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
 }
 
 RCT_EXPORT_METHOD(isMultimodalEnabled:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -419,7 +575,7 @@ RCT_EXPORT_METHOD(getMultimodalSupport:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -438,14 +594,16 @@ RCT_EXPORT_METHOD(releaseMultimodal:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
     }
 
-    [context releaseMultimodal];
-    resolve(nil);
+    dispatch_async([context queue], ^{
+        [context releaseMultimodal];
+        resolve(nil);
+    });
 }
 
 RCT_EXPORT_METHOD(initVocoder:(double)contextId
@@ -453,7 +611,7 @@ RCT_EXPORT_METHOD(initVocoder:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -463,19 +621,21 @@ RCT_EXPORT_METHOD(initVocoder:(double)contextId
         return;
     }
 
-    @try {
-        bool success = [context initVocoder:vocoderModelPath];
-        resolve(@(success));
-    } @catch (NSException *exception) {
-        reject(@"llama_cpp_error", exception.reason, nil);
-    }
+    dispatch_async([context queue], ^{
+        @try {
+            bool success = [context initVocoder:vocoderModelPath];
+            resolve(@(success));
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
 }
 
 RCT_EXPORT_METHOD(isVocoderEnabled:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -490,7 +650,7 @@ RCT_EXPORT_METHOD(getFormattedAudioCompletion:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -501,12 +661,14 @@ RCT_EXPORT_METHOD(getFormattedAudioCompletion:(double)contextId
         return;
     }
 
-    @try {
-        NSString *result = [context getFormattedAudioCompletion:speakerJsonStr textToSpeak:textToSpeak];
-        resolve(result);
-    } @catch (NSException *exception) {
-        reject(@"llama_cpp_error", exception.reason, nil);
-    }
+    dispatch_async([context queue], ^{
+        @try {
+            NSString *result = [context getFormattedAudioCompletion:speakerJsonStr textToSpeak:textToSpeak];
+            resolve(result);
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
 }
 
 RCT_EXPORT_METHOD(getAudioCompletionGuideTokens:(double)contextId
@@ -514,7 +676,7 @@ RCT_EXPORT_METHOD(getAudioCompletionGuideTokens:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -525,12 +687,14 @@ RCT_EXPORT_METHOD(getAudioCompletionGuideTokens:(double)contextId
         return;
     }
 
-    @try {
-        NSArray *guideTokens = [context getAudioCompletionGuideTokens:textToSpeak];
-        resolve(guideTokens);
-    } @catch (NSException *exception) {
-        reject(@"llama_cpp_error", exception.reason, nil);
-    }
+    dispatch_async([context queue], ^{
+        @try {
+            NSArray *guideTokens = [context getAudioCompletionGuideTokens:textToSpeak];
+            resolve(guideTokens);
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
 }
 
 RCT_EXPORT_METHOD(decodeAudioTokens:(double)contextId
@@ -538,7 +702,7 @@ RCT_EXPORT_METHOD(decodeAudioTokens:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -549,33 +713,194 @@ RCT_EXPORT_METHOD(decodeAudioTokens:(double)contextId
         return;
     }
 
-    @try {
-        NSArray *audioData = [context decodeAudioTokens:tokens];
-        resolve(audioData);
-    } @catch (NSException *exception) {
-        reject(@"llama_cpp_error", exception.reason, nil);
-    }
+    dispatch_async([context queue], ^{
+        @try {
+            @autoreleasepool {
+                NSDictionary *audioData = [context decodeAudioTokens:tokens];
+                resolve(audioData);
+            }
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
 }
 
 RCT_EXPORT_METHOD(releaseVocoder:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = getContext(contextId);
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
     }
 
-    [context releaseVocoder];
-    resolve(nil);
+    dispatch_async([context queue], ^{
+        [context releaseVocoder];
+        resolve(nil);
+    });
+}
+
+RCT_EXPORT_METHOD(getMemoryFootprint:(double)contextId
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    dispatch_async([context queue], ^{
+        resolve([context getMemoryFootprint]);
+    });
+}
+
+RCT_EXPORT_METHOD(releaseMemory:(double)contextId
+                 withLevel:(double)level
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    if ([context isPredicting]) {
+        resolve(@(NO));
+        return;
+    }
+    dispatch_async([context queue], ^{
+        @try {
+            resolve(@([context releaseResidency:(int)level]));
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
+}
+
+RCT_EXPORT_METHOD(initVectorStore:(double)contextId
+                 withPath:(NSString *)path
+                 withParams:(NSDictionary *)params
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    dispatch_async([context queue], ^{
+        @try {
+            resolve([context initVectorStore:path params:params]);
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
+}
+
+RCT_EXPORT_METHOD(vectorStoreAdd:(double)contextId
+                 withTexts:(NSArray *)texts
+                 withParams:(NSDictionary *)params
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    if ([context isPredicting]) {
+        reject(@"llama_error", @"Context is busy", nil);
+        return;
+    }
+    dispatch_async([context queue], ^{
+        @try {
+            resolve([context vectorStoreAdd:texts params:params]);
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
+}
+
+RCT_EXPORT_METHOD(vectorStoreSearch:(double)contextId
+                 withQuery:(NSString *)query
+                 withParams:(NSDictionary *)params
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    if ([context isPredicting]) {
+        reject(@"llama_error", @"Context is busy", nil);
+        return;
+    }
+    RNLlamaContext *rerankContext = nil;
+    if (params[@"rerank_context_id"] != nil) {
+        rerankContext = getContext([params[@"rerank_context_id"] doubleValue]);
+        if (rerankContext == nil) {
+            reject(@"llama_error", @"Rerank context not found", nil);
+            return;
+        }
+    }
+    dispatch_async([context queue], ^{
+        @try {
+            resolve([context vectorStoreSearch:query params:params rerankContext:rerankContext]);
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
+}
+
+RCT_EXPORT_METHOD(vectorStoreBuildIndex:(double)contextId
+                 withNLists:(double)nLists
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    dispatch_async([context queue], ^{
+        @try {
+            [context vectorStoreBuildIndex:(int)nLists];
+            resolve(nil);
+        } @catch (NSException *exception) {
+            reject(@"llama_cpp_error", exception.reason, nil);
+        }
+    });
+}
+
+RCT_EXPORT_METHOD(releaseVectorStore:(double)contextId
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNLlamaContext *context = getContext(contextId);
+    if (context == nil) {
+        reject(@"llama_error", @"Context not found", nil);
+        return;
+    }
+    dispatch_async([context queue], ^{
+        [context releaseVectorStore];
+        resolve(nil);
+    });
 }
 
 RCT_EXPORT_METHOD(releaseContext:(double)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
                  withRejecter:(RCTPromiseRejectBlock)reject)
 {
-    RNLlamaContext *context = llamaContexts[[NSNumber numberWithDouble:contextId]];
+    RNLlamaContext *context = nil;
+    {
+        // no new call can find the context once it's out of the map
+        std::lock_guard<std::mutex> lock(llamaContextsMutex);
+        NSNumber *contextIdNumber = [NSNumber numberWithDouble:contextId];
+        context = [llamaContexts[contextIdNumber] retain];
+        [llamaContexts removeObjectForKey:contextIdNumber];
+    }
     if (context == nil) {
         reject(@"llama_error", @"Context not found", nil);
         return;
@@ -584,9 +909,10 @@ RCT_EXPORT_METHOD(releaseContext:(double)contextId
       [context interruptLoad];
     }
     [context stopCompletion];
-    dispatch_barrier_sync(llamaDQueue, ^{});
+    dispatch_sync([context queue], ^{});
     [context invalidate];
-    [llamaContexts removeObjectForKey:[NSNumber numberWithDouble:contextId]];
+    // deletes the native context unless a call still retains it, then the last one does
+    [context release];
     resolve(nil);
 }
 
@@ -599,25 +925,27 @@ RCT_EXPORT_METHOD(releaseAllContexts:(RCTPromiseResolveBlock)resolve
 
 
 - (void)invalidate {
-    if (llamaContexts == nil) {
-        return;
+    [[NSNotificationCenter defaultCenter] removeObserver:self
+                                                    name:UIApplicationDidReceiveMemoryWarningNotification
+                                                  object:nil];
+
+    NSArray *contexts = nil;
+    {
+        std::lock_guard<std::mutex> lock(llamaContextsMutex);
+        if (llamaContexts == nil) {
+            return;
+        }
+        contexts = [[llamaContexts allValues] retain];
+        [llamaContexts release];
+        llamaContexts = nil;
     }
 
-    for (NSNumber *contextId in llamaContexts) {
-        RNLlamaContext *context = llamaContexts[contextId];
+    for (RNLlamaContext *context in contexts) {
         [context stopCompletion];
-        dispatch_barrier_sync(llamaDQueue, ^{});
+        dispatch_sync([context queue], ^{});
         [context invalidate];
     }
-
-    [llamaContexts removeAllObjects];
-    [llamaContexts release];
-    llamaContexts = nil;
-
-    if (llamaDQueue != nil) {
-        dispatch_release(llamaDQueue);
-        llamaDQueue = nil;
-    }
+    [contexts release];
 
     [super invalidate];
 }
@@ -23,11 +23,16 @@
     void (^onProgress)(unsigned int progress);
 
     rnllama::llama_rn_context * llama;
+
+    // Serial queue of the calls that take the context lock, so a wait on the method queue
+    // doesn't hold up stopCompletion and other contexts don't wait behind this one
+    dispatch_queue_t queue;
 }
 
 + (void)toggleNativeLog:(BOOL)enabled onEmitLog:(void (^)(NSString *level, NSString *text))onEmitLog;
 + (NSDictionary *)modelInfo:(NSString *)path skip:(NSArray *)skip;
 + (instancetype)initWithParams:(NSDictionary *)params onProgress:(void (^)(unsigned int progress))onProgress;
+- (dispatch_queue_t)queue;
 - (void)interruptLoad;
 - (bool)isMetalEnabled;
 - (NSString *)reasonNoMetal;
@@ -38,7 +43,7 @@
 - (NSDictionary *)getMultimodalSupport;
 - (bool)isMultimodalEnabled;
 - (void)releaseMultimodal;
-- (NSDictionary *)completion:(NSDictionary *)params onToken:(void (^)(NSMutableDictionary *tokenResult))onToken;
+- (NSDictionary *)completion:(NSDictionary *)params onToken:(void (^)(NSMutableDictionary *tokenResult))onToken isBusy:(bool (^)(void))isBusy;
 - (void)stopCompletion;
 - (NSDictionary *)tokenize:(NSString *)text imagePaths:(NSArray *)imagePaths;
 - (NSString *)detokenize:(NSArray *)tokens;
@@ -57,13 +62,23 @@
 - (NSString *)bench:(int)pp tg:(int)tg pl:(int)pl nr:(int)nr;
 - (void)applyLoraAdapters:(NSArray *)loraAdapters;
 - (void)removeLoraAdapters;
+- (void)mergeLoraAdapters:(NSArray *)loraAdapters cachePath:(NSString *)cachePath;
+- (void)unmergeLoraAdapters;
 - (NSArray *)getLoadedLoraAdapters;
 - (bool)initVocoder:(NSString *)vocoderModelPath;
 - (bool)isVocoderEnabled;
 - (NSString *)getFormattedAudioCompletion:(NSString *)speakerJsonStr textToSpeak:(NSString *)textToSpeak;
 - (NSArray *)getAudioCompletionGuideTokens:(NSString *)textToSpeak;
-- (NSArray *)decodeAudioTokens:(NSArray *)tokens;
+- (NSDictionary *)decodeAudioTokens:(NSArray *)tokens;
 - (void)releaseVocoder;
+- (NSDictionary *)getMemoryFootprint;
+- (bool)releaseResidency:(int)level;
+- (NSDictionary *)initVectorStore:(NSString *)path params:(NSDictionary *)params;
+- (NSArray *)vectorStoreAdd:(NSArray<NSString *> *)texts params:(NSDictionary *)params;
+- (NSArray *)vectorStoreSearch:(NSString *)query params:(NSDictionary *)params rerankContext:(RNLlamaContext *)rerankContext;
+- (void)vectorStoreBuildIndex:(int)nLists;
+- (void)releaseVectorStore;
+- (void)bindJSIContextId:(int)contextId;
 - (void)invalidate;
 
 @end
@@ -1,6 +1,18 @@
 #import "RNLlamaContext.h"
+#import "rn-llama-jsi.h"
 #import <Metal/Metal.h>
 
+// Tensor dictionary { dtype, shape, data } with the raw values in base64,
+// so large buffers cross the bridge as one string instead of an NSNumber per element
+static NSDictionary *tensorDictionary(NSString *dtype, const void *data, size_t n, size_t elem_size) {
+    NSData *bytes = [NSData dataWithBytesNoCopy:(void *)data length:n * elem_size freeWhenDone:NO];
+    return @{
+        @"dtype": dtype,
+        @"shape": @[@(n)],
+        @"data": [bytes base64EncodedStringWithOptions:0],
+    };
+}
+
 @implementation RNLlamaContext
 
 + (void)toggleNativeLog:(BOOL)enabled onEmitLog:(void (^)(NSString *level, NSString *text))onEmitLog {
@@ -148,7 +160,9 @@
 
     if (params[@"n_batch"]) defaultParams.n_batch = [params[@"n_batch"] intValue];
     if (params[@"n_ubatch"]) defaultParams.n_ubatch = [params[@"n_ubatch"] intValue];
+    if (params[@"n_parallel"]) defaultParams.n_parallel = MAX(1, [params[@"n_parallel"] intValue]);
     if (params[@"use_mmap"]) defaultParams.use_mmap = [params[@"use_mmap"] boolValue];
+    if (params[@"use_lazy_load"]) defaultParams.use_lazy_load = [params[@"use_lazy_load"] boolValue];
 
     if (params[@"pooling_type"] && [params[@"pooling_type"] isKindOfClass:[NSNumber class]]) {
       defaultParams.pooling_type = static_cast<enum llama_pooling_type>([params[@"pooling_type"] intValue]);
@@ -173,19 +187,33 @@
 
     if (params[@"cache_type_k"]) defaultParams.cache_type_k = rnllama::kv_cache_type_from_str([params[@"cache_type_k"] UTF8String]);
     if (params[@"cache_type_v"]) defaultParams.cache_type_v = rnllama::kv_cache_type_from_str([params[@"cache_type_v"] UTF8String]);
+    if (params[@"kv_recent_window"]) defaultParams.kv_recent = MAX(0, [params[@"kv_recent_window"] intValue]);
 
     int nThreads = params[@"n_threads"] ? [params[@"n_threads"] intValue] : 0;
-    const int maxThreads = (int) [[NSProcessInfo processInfo] processorCount];
-    // Use 2 threads by default on 4-core devices, 4 threads on more cores
-    const int defaultNThreads = nThreads == 4 ? 2 : MIN(4, maxThreads);
-    defaultParams.cpuparams.n_threads = nThreads > 0 ? nThreads : defaultNThreads;
+    rnllama::cpu_params_from_topology(defaultParams, nThreads);
+
+    // parsed before anything is allocated, an unknown policy fails the load
+    rnllama::ctx_shift_policy shiftPolicy = rnllama::CTX_SHIFT_POLICY_BLOCK;
+    if (params[@"ctx_shift_policy"]) {
+        try {
+            shiftPolicy = rnllama::ctx_shift_policy_from_str([params[@"ctx_shift_policy"] UTF8String]);
+        } catch (const std::exception &e) {
+            @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
+        }
+    }
 
     RNLlamaContext *context = [[RNLlamaContext alloc] init];
+    context->queue = dispatch_queue_create("com.rnllama.context", DISPATCH_QUEUE_SERIAL);
     context->llama = new rnllama::llama_rn_context();
     context->llama->is_load_interrupted = false;
     context->llama->loading_progress = 0;
     context->onProgress = onProgress;
 
+    context->llama->shift_policy = shiftPolicy;
+    if (params[@"ctx_shift_n_sink"]) context->llama->shift_n_sink = [params[@"ctx_shift_n_sink"] intValue];
+    if (params[@"ctx_checkpoint_interval"]) context->llama->checkpoint_interval = [params[@"ctx_checkpoint_interval"] intValue];
+    if (params[@"ctx_checkpoint_max"]) context->llama->checkpoint_max = [params[@"ctx_checkpoint_max"] intValue];
+
     if (params[@"use_progress_callback"] && [params[@"use_progress_callback"] boolValue]) {
         defaultParams.progress_callback = [](float progress, void * user_data) {
             RNLlamaContext *context = (__bridge RNLlamaContext *)(user_data);
@@ -205,7 +233,7 @@
         params[@"embedding"] && [params[@"embedding"] boolValue] &&
         llama_model_has_encoder(context->llama->model) && llama_model_has_decoder(context->llama->model)
     ) {
-        delete context->llama;
+        [context release];
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Embedding is not supported in encoder-decoder models" userInfo:nil];
     }
 
@@ -232,7 +260,7 @@
     if (lora.size() > 0) {
         int result = context->llama->applyLoraAdapters(lora);
         if (result != 0) {
-            delete context->llama;
+            [context release];
             @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to apply lora adapters" userInfo:nil];
         }
     }
@@ -325,7 +353,13 @@
     return llama->is_predicting;
 }
 
+- (dispatch_queue_t)queue {
+    return queue;
+}
+
 - (bool)initMultimodal:(NSDictionary *)params {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     NSString *mmproj_path = params[@"path"];
     BOOL use_gpu = params[@"use_gpu"] ? [params[@"use_gpu"] boolValue] : true;
     return llama->initMultimodal([mmproj_path UTF8String], use_gpu);
@@ -346,6 +380,7 @@
 
 - (void)releaseMultimodal {
     if (!is_model_loaded) return;
+    rnllama::context_lock lock(llama);
     llama->releaseMultimodal();
 }
 
@@ -429,7 +464,10 @@
 
 - (NSDictionary *)completion:(NSDictionary *)params
     onToken:(void (^)(NSMutableDictionary * tokenResult))onToken
+    isBusy:(bool (^)(void))isBusy
 {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     llama->rewind();
 
     //llama_reset_timings(llama->ctx);
@@ -440,11 +478,7 @@
     llama->params.sampling.seed = params[@"seed"] ? [params[@"seed"] intValue] : -1;
 
     if (params[@"n_threads"]) {
-        int nThreads = params[@"n_threads"] ? [params[@"n_threads"] intValue] : llama->params.cpuparams.n_threads;
-        const int maxThreads = (int) [[NSProcessInfo processInfo] processorCount];
-        // Use 2 threads by default on 4-core devices, 4 threads on more cores
-        const int defaultNThreads = nThreads == 4 ? 2 : MIN(4, maxThreads);
-        llama->params.cpuparams.n_threads = nThreads > 0 ? nThreads : defaultNThreads;
+        llama->setThreads([params[@"n_threads"] intValue]);
     }
     if (params[@"n_predict"]) llama->params.n_predict = [params[@"n_predict"] intValue];
     if (params[@"ignore_eos"]) llama->params.sampling.ignore_eos = [params[@"ignore_eos"] boolValue];
@@ -591,6 +625,10 @@
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to initialize sampling" userInfo:nil];
     }
 
+    llama->setDeadline(
+        params[@"deadline_ms"] ? [params[@"deadline_ms"] intValue] : 0,
+        params[@"step_budget_ms"] ? [params[@"step_budget_ms"] intValue] : 0
+    );
     llama->beginCompletion();
     try {
         // Use the unified loadPrompt function with image paths if available
@@ -620,64 +658,52 @@
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Context is full" userInfo:nil];
     }
 
-    size_t sent_count = 0;
-    size_t sent_token_probs_index = 0;
-
-    while (llama->has_next_token && !llama->is_interrupted) {
-        const rnllama::completion_token_output token_with_probs = llama->doCompletion();
-        if (token_with_probs.tok == -1 || llama->incomplete) {
-            continue;
-        }
-        const std::string token_text = common_token_to_piece(llama->ctx, token_with_probs.tok);
-
-        size_t pos = std::min(sent_count, llama->generated_text.size());
-
-        const std::string str_test = llama->generated_text.substr(pos);
-        bool is_stop_full = false;
-        size_t stop_pos =
-            llama->findStoppingStrings(str_test, token_text.size(), rnllama::STOP_FULL);
-        if (stop_pos != std::string::npos) {
-            is_stop_full = true;
-            llama->generated_text.erase(
-                llama->generated_text.begin() + pos + stop_pos,
-                llama->generated_text.end());
-            pos = std::min(sent_count, llama->generated_text.size());
-        } else {
-            is_stop_full = false;
-            stop_pos = llama->findStoppingStrings(str_test, token_text.size(),
-                rnllama::STOP_PARTIAL);
-        }
-
-        if (
-            stop_pos == std::string::npos ||
-            // Send rest of the text if we are at the end of the generation
-            (!llama->has_next_token && !is_stop_full && stop_pos > 0)
-        ) {
-            const std::string to_send = llama->generated_text.substr(pos, std::string::npos);
-
-            sent_count += to_send.size();
-
-            std::vector<rnllama::completion_token_output> probs_output = {};
-
-            NSMutableDictionary *tokenResult = [[NSMutableDictionary alloc] init];
-            tokenResult[@"token"] = [NSString stringWithUTF8String:to_send.c_str()];
-
-            if (llama->params.sampling.n_probs > 0) {
-                const std::vector<llama_token> to_send_toks = common_tokenize(llama->ctx, to_send, false);
-                size_t probs_pos = std::min(sent_token_probs_index, llama->generated_token_probs.size());
-                size_t probs_stop_pos = std::min(sent_token_probs_index + to_send_toks.size(), llama->generated_token_probs.size());
-                if (probs_pos < probs_stop_pos) {
-                    probs_output = std::vector<rnllama::completion_token_output>(llama->generated_token_probs.begin() + probs_pos, llama->generated_token_probs.begin() + probs_stop_pos);
+    std::vector<rnllama::completion_branch_output> branches;
+    int nBranches = params[@"n_branches"] ? [params[@"n_branches"] intValue] : 1;
+    if (nBranches > 1) {
+        std::vector<std::vector<common_adapter_lora_info>> branch_lora;
+        if (params[@"branch_lora"] && [params[@"branch_lora"] isKindOfClass:[NSArray class]]) {
+            for (NSArray *lora_list in params[@"branch_lora"]) {
+                std::vector<common_adapter_lora_info> adapters;
+                if ([lora_list isKindOfClass:[NSArray class]]) {
+                    for (NSDictionary *lora_adapter in lora_list) {
+                        NSString *path = lora_adapter[@"path"];
+                        if (!path) continue;
+                        common_adapter_lora_info la;
+                        la.path = [path UTF8String];
+                        la.scale = lora_adapter[@"scaled"] ? [lora_adapter[@"scaled"] floatValue] : 1.0f;
+                        adapters.push_back(la);
+                    }
                 }
-                sent_token_probs_index = probs_stop_pos;
-
-                tokenResult[@"completion_probabilities"] = [self tokenProbsToDict:probs_output];
+                branch_lora.push_back(adapters);
             }
+        }
+        // Branches are decoded in lockstep, partial completions are not emitted
+        try {
+            branches = llama->doBranchedCompletion(nBranches, branch_lora);
+        } catch (const std::exception &e) {
+            llama->endCompletion();
+            @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
+        }
+    }
 
-            onToken(tokenResult);
+    rnllama::partial_emitter emitter;
+    emitter.interval_us = params[@"emit_partial_interval"] ? (int64_t) [params[@"emit_partial_interval"] intValue] * 1000 : 0;
+    emitter.max_tokens = params[@"emit_partial_max_tokens"] ? MAX([params[@"emit_partial_max_tokens"] intValue], 0) : 0;
+    emitter.emit = [&](const rnllama::completion_partial &partial) {
+        NSMutableDictionary *tokenResult = [[NSMutableDictionary alloc] init];
+        tokenResult[@"token"] = [NSString stringWithUTF8String:partial.text.c_str()];
+        if (llama->params.sampling.n_probs > 0) {
+            tokenResult[@"completion_probabilities"] = [self tokenProbsToDict:partial.probs];
         }
+        onToken(tokenResult);
+    };
+    if (isBusy) {
+        emitter.busy = [&]() { return isBusy(); };
     }
 
+    llama->generate(onToken ? &emitter : nullptr);
+
     llama_perf_context_print(llama->ctx);
     llama->endCompletion();
 
@@ -736,9 +762,25 @@
     result[@"stopped_eos"] = @(llama->stopped_eos);
     result[@"stopped_word"] = @(llama->stopped_word);
     result[@"stopped_limit"] = @(llama->stopped_limit);
+    result[@"stopped_deadline"] = @(llama->stopped_deadline);
     result[@"stopping_word"] = [NSString stringWithUTF8String:llama->stopping_word.c_str()];
     result[@"tokens_cached"] = @(llama->n_past);
 
+    if (!branches.empty()) {
+        NSMutableArray *branchesResult = [[NSMutableArray alloc] init];
+        for (const auto &branch : branches) {
+            [branchesResult addObject:@{
+                @"text": [NSString stringWithUTF8String:branch.text.c_str()],
+                @"tokens_predicted": @(branch.tokens.size()),
+                @"stopped_eos": @(branch.stopped_eos),
+                @"stopped_word": @(branch.stopped_word),
+                @"stopped_limit": @(branch.stopped_limit),
+                @"stopping_word": [NSString stringWithUTF8String:branch.stopping_word.c_str()],
+            }];
+        }
+        result[@"branches"] = branchesResult;
+    }
+
     if (llama->isVocoderEnabled() && !llama->audio_tokens.empty()) {
         NSMutableArray *audioTokens = [[NSMutableArray alloc] init];
         for (llama_token token : llama->audio_tokens) {
@@ -757,6 +799,7 @@
         @"predicted_ms": @(timings.t_eval_ms),
         @"predicted_per_token_ms": @(timings.t_eval_ms / timings.n_eval),
         @"predicted_per_second": @(1e3 / timings.t_eval_ms * timings.n_eval),
+        @"graphs_reused": @(timings.n_reused),
     };
     return result;
 }
@@ -779,10 +822,8 @@
 
         NSMutableDictionary *result = [[NSMutableDictionary alloc] init];
 
-        result[@"tokens"] = [NSMutableArray arrayWithCapacity:tokenize_result.tokens.size()];
-        for (llama_token tok : tokenize_result.tokens) {
-            [result[@"tokens"] addObject:@(tok)];
-        }
+        const auto &toks = tokenize_result.tokens;
+        result[@"tokens"] = tensorDictionary(@"int32", toks.data(), toks.size(), sizeof(llama_token));
         result[@"has_media"] = @(tokenize_result.has_media);
 
         NSMutableArray *bitmap_hashes = [[NSMutableArray alloc] init];
@@ -816,65 +857,65 @@
     for (NSNumber *tok in tokens) {
         toks.push_back([tok intValue]);
     }
-    const std::string text = rnllama::tokens_to_str(llama->ctx, toks.cbegin(), toks.cend());
+    const std::string text = rnllama::tokens_to_str(llama_model_get_vocab(llama->model), toks.cbegin(), toks.cend());
     return [NSString stringWithUTF8String:text.c_str()];
 }
 
 - (NSDictionary *)embedding:(NSString *)text params:(NSDictionary *)params {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     if (llama->params.embedding != true) {
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Embedding is not enabled" userInfo:nil];
     }
 
-    common_params embdParams;
-    embdParams.embedding = true;
-    embdParams.embd_normalize = llama->params.embd_normalize;
-
+    rnllama::embedding_params eparams;
+    eparams.normalize = llama->params.embd_normalize;
     if (params[@"embd_normalize"] && [params[@"embd_normalize"] isKindOfClass:[NSNumber class]]) {
-        embdParams.embd_normalize = [params[@"embd_normalize"] intValue];
+        eparams.normalize = [params[@"embd_normalize"] intValue];
     }
-
-    llama->rewind();
-
-    llama_perf_context_reset(llama->ctx);
-
-    llama->params.prompt = [text UTF8String];
-
-    llama->params.n_predict = 0;
-
-    if (!llama->initSampling()) {
-        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to initialize sampling" userInfo:nil];
+    if (params[@"embd_dims"] && [params[@"embd_dims"] isKindOfClass:[NSNumber class]]) {
+        eparams.n_dims = [params[@"embd_dims"] intValue];
     }
-    llama->beginCompletion();
+    NSString *quantize = params[@"embd_quantize"];
+    if ([quantize isKindOfClass:[NSString class]]) {
+        if ([quantize isEqualToString:@"int8"]) eparams.quant = rnllama::EMBEDDING_QUANT_INT8;
+        else if ([quantize isEqualToString:@"binary"]) eparams.quant = rnllama::EMBEDDING_QUANT_BINARY;
+    }
+
+    std::vector<uint8_t> buf(llama->embeddingOutputSize(eparams));
+    rnllama::embedding_output output;
     try {
-      llama->loadPrompt({});
+        output = llama->embed([text UTF8String], eparams, buf.data());
     } catch (const std::exception &e) {
-      llama->endCompletion();
-      @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
-    } catch (const std::runtime_error& e) {
-      llama->endCompletion();
-      @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
+        @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
     }
-    llama->doCompletion();
-
-    std::vector<float> result = llama->getEmbedding(embdParams);
 
     NSMutableDictionary *resultDict = [[NSMutableDictionary alloc] init];
-    NSMutableArray *embeddingResult = [[NSMutableArray alloc] init];
-    for (float f : result) {
-        [embeddingResult addObject:@(f)];
+    switch (eparams.quant) {
+        case rnllama::EMBEDDING_QUANT_INT8:
+            resultDict[@"embedding"] = tensorDictionary(@"int8", buf.data(), buf.size(), 1);
+            resultDict[@"embd_scale"] = @(output.scale);
+            break;
+        case rnllama::EMBEDDING_QUANT_BINARY:
+            resultDict[@"embedding"] = tensorDictionary(@"uint8", buf.data(), buf.size(), 1);
+            break;
+        default:
+            resultDict[@"embedding"] = tensorDictionary(@"float32", buf.data(), output.n_dims, sizeof(float));
+            break;
     }
-    resultDict[@"embedding"] = embeddingResult;
+    resultDict[@"embd_dims"] = @(output.n_dims);
     NSMutableArray *promptTokens = [[NSMutableArray alloc] init];
-    for (llama_token tok : llama->embd) {
+    for (llama_token tok : output.tokens) {
         [promptTokens addObject:[NSString stringWithUTF8String:common_token_to_piece(llama->ctx, tok).c_str()]];
     }
     resultDict[@"prompt_tokens"] = promptTokens;
 
-    llama->endCompletion();
     return resultDict;
 }
 
 - (NSArray *)rerank:(NSString *)query documents:(NSArray<NSString *> *)documents params:(NSDictionary *)params {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     // Convert NSArray to std::vector
     std::vector<std::string> documentsVector;
     for (NSString *doc in documents) {
@@ -903,6 +944,8 @@
 }
 
 - (NSDictionary *)loadSession:(NSString *)path {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     if (!path || [path length] == 0) {
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Session path is empty" userInfo:nil];
     }
@@ -911,6 +954,8 @@
     }
 
     size_t n_token_count_out = 0;
+    llama->evicted_spans.clear();
+    llama->checkpoints.clear();
     llama->embd.resize(llama->params.n_ctx);
     if (!llama_state_load_file(llama->ctx, [path UTF8String], llama->embd.data(), llama->embd.capacity(), &n_token_count_out)) {
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to load session" userInfo:nil];
@@ -929,6 +974,8 @@
 }
 
 - (int)saveSession:(NSString *)path size:(int)size {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     if (!path || [path length] == 0) {
         @throw [NSException exceptionWithName:@"LlamaException" reason:@"Session path is empty" userInfo:nil];
     }
@@ -947,19 +994,19 @@
 }
 
 - (NSString *)bench:(int)pp tg:(int)tg pl:(int)pl nr:(int)nr {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     return [NSString stringWithUTF8String:llama->bench(pp, tg, pl, nr).c_str()];
 }
 
 - (void)applyLoraAdapters:(NSArray *)loraAdapters {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     std::vector<common_adapter_lora_info> lora_adapters;
     for (NSDictionary *loraAdapter in loraAdapters) {
         common_adapter_lora_info la;
         la.path = [loraAdapter[@"path"] UTF8String];
         la.scale = [loraAdapter[@"scaled"] doubleValue];
-        la.ptr = llama_adapter_lora_init(llama->model, la.path.c_str());
-        if (la.ptr == nullptr) {
-            @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to apply lora adapter" userInfo:nil];
-        }
         lora_adapters.push_back(la);
     }
     int result = llama->applyLoraAdapters(lora_adapters);
@@ -969,10 +1016,40 @@
 }
 
 - (void)removeLoraAdapters {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     llama->removeLoraAdapters();
 }
 
+- (void)mergeLoraAdapters:(NSArray *)loraAdapters cachePath:(NSString *)cachePath {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+    std::vector<common_adapter_lora_info> lora_adapters;
+    for (NSDictionary *loraAdapter in loraAdapters) {
+        common_adapter_lora_info la;
+        la.path = [loraAdapter[@"path"] UTF8String];
+        la.scale = loraAdapter[@"scaled"] ? [loraAdapter[@"scaled"] floatValue] : 1.0f;
+        lora_adapters.push_back(la);
+    }
+    int result;
+    try {
+        result = llama->mergeLoraAdapters(lora_adapters, cachePath ? [cachePath UTF8String] : "");
+    } catch (const std::exception &e) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
+    }
+    if (result != 0) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Failed to merge lora adapters" userInfo:nil];
+    }
+}
+
+- (void)unmergeLoraAdapters {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+    llama->unmergeLoraAdapters();
+}
+
 - (NSArray *)getLoadedLoraAdapters {
+    rnllama::context_lock lock(llama);
     std::vector<common_adapter_lora_info> loaded_lora_adapters = llama->getLoadedLoraAdapters();
     NSMutableArray *result = [[NSMutableArray alloc] init];
     for (common_adapter_lora_info &la : loaded_lora_adapters) {
@@ -985,6 +1062,7 @@
 }
 
 - (bool)initVocoder:(NSString *)vocoderModelPath {
+    rnllama::context_lock lock(llama);
     return llama->initVocoder([vocoderModelPath UTF8String]);
 }
 
@@ -993,11 +1071,15 @@
 }
 
 - (NSString *)getFormattedAudioCompletion:(NSString *)speakerJsonStr textToSpeak:(NSString *)textToSpeak {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     std::string speakerStr = speakerJsonStr ? [speakerJsonStr UTF8String] : "";
     return [NSString stringWithUTF8String:llama->getFormattedAudioCompletion(speakerStr, [textToSpeak UTF8String]).c_str()];
 }
 
 - (NSArray *)getAudioCompletionGuideTokens:(NSString *)textToSpeak {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
     std::vector<llama_token> guide_tokens = llama->getAudioCompletionGuideTokens([textToSpeak UTF8String]);
     NSMutableArray *result = [[NSMutableArray alloc] init];
     for (llama_token token : guide_tokens) {
@@ -1006,26 +1088,161 @@
     return result;
 }
 
-- (NSArray *)decodeAudioTokens:(NSArray *)tokens {
+- (NSDictionary *)decodeAudioTokens:(NSArray *)tokens {
+    rnllama::context_lock lock(llama);
     std::vector<llama_token> token_vector;
     for (NSNumber *token in tokens) {
         token_vector.push_back([token intValue]);
     }
     std::vector<float> audio_data = llama->decodeAudioTokens(token_vector);
+    return tensorDictionary(@"float32", audio_data.data(), audio_data.size(), sizeof(float));
+}
+
+- (void)releaseVocoder {
+    rnllama::context_lock lock(llama);
+    llama->releaseVocoder();
+}
+
+- (NSDictionary *)getMemoryFootprint {
+    rnllama::context_lock lock(llama);
+    rnllama::llama_rn_context_footprint footprint = llama->getFootprint();
+    return @{
+        @"weights": @(footprint.weights),
+        @"weightsResident": @(footprint.weights_resident),
+        @"kv": @(footprint.kv),
+        @"compute": @(footprint.compute),
+        @"multimodal": @(footprint.multimodal),
+        @"lora": @(footprint.lora),
+        @"vocoder": @(footprint.vocoder),
+        @"suspended": @(footprint.suspended),
+    };
+}
+
+- (bool)releaseResidency:(int)level {
+    NSString *statePath = [NSTemporaryDirectory() stringByAppendingPathComponent:
+        [NSString stringWithFormat:@"rnllama-state-%p.bin", self]];
+    return llama->releaseResidency((rnllama::residency_level) level, [statePath UTF8String]);
+}
+
+- (NSDictionary *)initVectorStore:(NSString *)path params:(NSDictionary *)params {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+    rnllama::vector_store_params vparams;
+    if (params[@"n_dims"] && [params[@"n_dims"] isKindOfClass:[NSNumber class]]) {
+        vparams.n_dims = [params[@"n_dims"] intValue];
+    }
+    NSString *quantize = params[@"quantize"];
+    if ([quantize isKindOfClass:[NSString class]]) {
+        if ([quantize isEqualToString:@"float"]) vparams.quant = rnllama::VECTOR_STORE_F32;
+        else if ([quantize isEqualToString:@"binary"]) vparams.quant = rnllama::VECTOR_STORE_BINARY;
+        else vparams.quant = rnllama::VECTOR_STORE_Q8;
+    }
+    if ([path hasPrefix:@"file://"]) {
+        path = [path substringFromIndex:7];
+    }
+    try {
+        llama->initVectorStore([path UTF8String], vparams);
+    } catch (const std::exception &e) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
+    }
+    return @{
+        @"size": @(llama->vstore->size()),
+        @"n_dims": @(llama->vstore->n_dims()),
+        @"n_lists": @(llama->vstore->n_lists()),
+    };
+}
+
+- (NSArray *)vectorStoreAdd:(NSArray<NSString *> *)texts params:(NSDictionary *)params {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+    std::vector<std::string> textsVector;
+    for (NSString *text in texts) {
+        textsVector.push_back([text UTF8String]);
+    }
+    std::vector<int64_t> keysVector;
+    if ([params[@"keys"] isKindOfClass:[NSArray class]]) {
+        for (NSNumber *key in params[@"keys"]) {
+            keysVector.push_back([key longLongValue]);
+        }
+    }
+    bool storeText = params[@"store_text"] ? [params[@"store_text"] boolValue] : true;
+
+    std::vector<int64_t> added;
+    try {
+        added = llama->addToVectorStore(textsVector, keysVector, storeText);
+    } catch (const std::exception &e) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
+    }
+    NSMutableArray *result = [[NSMutableArray alloc] initWithCapacity:added.size()];
+    for (int64_t key : added) {
+        [result addObject:@(key)];
+    }
+    return result;
+}
+
+- (NSArray *)vectorStoreSearch:(NSString *)query params:(NSDictionary *)params rerankContext:(RNLlamaContext *)rerankContext {
+    rnllama::context_lock lock(llama);
+    llama->ensureResident();
+    int k = params[@"k"] ? [params[@"k"] intValue] : 10;
+    int nProbe = params[@"n_probe"] ? [params[@"n_probe"] intValue] : 0;
+    int nRerank = params[@"n_rerank"] ? [params[@"n_rerank"] intValue] : 0;
+    rnllama::llama_rn_context *rerankLlama = nullptr;
+    if (rerankContext != nil) {
+        rerankLlama = rerankContext->llama;
+    }
+
+    std::vector<rnllama::vector_store_result> found;
     NSMutableArray *result = [[NSMutableArray alloc] init];
-    for (float sample : audio_data) {
-        [result addObject:@(sample)];
+    try {
+        found = llama->searchVectorStore([query UTF8String], k, nProbe, rerankLlama, nRerank);
+        for (const auto &res : found) {
+            NSMutableDictionary *item = [[NSMutableDictionary alloc] init];
+            item[@"key"] = @(res.key);
+            item[@"score"] = @(res.score);
+            if (llama->vstore->hasText(res.row)) {
+                item[@"text"] = [NSString stringWithUTF8String:llama->vstore->text(res.row).c_str()];
+            }
+            [result addObject:item];
+        }
+    } catch (const std::exception &e) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
     }
     return result;
 }
 
-- (void)releaseVocoder {
-    llama->releaseVocoder();
+- (void)vectorStoreBuildIndex:(int)nLists {
+    rnllama::context_lock lock(llama);
+    if (llama->vstore == nullptr) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:@"Vector store is not initialized" userInfo:nil];
+    }
+    try {
+        llama->vstore->buildIndex(nLists);
+    } catch (const std::exception &e) {
+        @throw [NSException exceptionWithName:@"LlamaException" reason:[NSString stringWithUTF8String:e.what()] userInfo:nil];
+    }
+}
+
+- (void)releaseVectorStore {
+    rnllama::context_lock lock(llama);
+    llama->releaseVectorStore();
+}
+
+- (void)bindJSIContextId:(int)contextId {
+    rnllama_jsi::addContext(contextId, llama);
 }
 
 - (void)invalidate {
-    delete llama;
+    rnllama_jsi::removeContext(llama);
     // llama_backend_free();
 }
 
+- (void)dealloc {
+    // the last call or block retaining the context is done with it
+    delete llama;
+    if (queue != nil) {
+        dispatch_release(queue);
+    }
+    [super dealloc];
+}
+
 @end
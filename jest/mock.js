@@ -3,11 +3,25 @@ const { NativeModules, DeviceEventEmitter } = require('react-native')
 if (!NativeModules.RNLlama) {
   const demoEmbedding = new Array(768).fill(0.01)
 
+  const toTensor = (dtype, values) => {
+    const data = {
+      float32: Float32Array,
+      int32: Int32Array,
+    }[dtype].from(values)
+    return {
+      dtype,
+      shape: [data.length],
+      data: Buffer.from(data.buffer).toString('base64'),
+    }
+  }
+
   const contextMap = {}
   const vocoderMap = {}
   NativeModules.RNLlama = {
     setContextLimit: jest.fn(),
 
+    installJSI: jest.fn(() => 'JSI is not available in tests'),
+
     modelInfo: jest.fn(async () => ({})),
 
     initContext: jest.fn(() =>
@@ -188,14 +202,20 @@ if (!NativeModules.RNLlama) {
     stopCompletion: jest.fn(),
 
     tokenize: jest.fn(async (_, content, imagePaths) => ({
-      tokens: content.split(''),
+      tokens: toTensor(
+        'int32',
+        content.split('').map((char) => char.charCodeAt(0)),
+      ),
       has_images: imagePaths?.length > 0,
       chunk_pos: imagePaths?.length > 0 ? [0] : [],
       chunk_pos_images: imagePaths?.length > 0 ? [0] : [],
       bitmap_hashes: imagePaths?.length > 0 ? [0] : [],
     })),
     detokenize: jest.fn(async () => ''),
-    embedding: jest.fn(async () => ({ embedding: demoEmbedding })),
+    embedding: jest.fn(async () => ({
+      embedding: toTensor('float32', demoEmbedding),
+      embd_dims: demoEmbedding.length,
+    })),
     rerank: jest.fn(async () => []),
 
     loadSession: jest.fn(async () => ({
@@ -209,6 +229,26 @@ if (!NativeModules.RNLlama) {
         '["test 3B Q4_0",1600655360,2779683840,16.211304,0.021748,38.570646,1.195800]',
     ),
 
+    getMemoryFootprint: jest.fn(async () => ({
+      weights: 0,
+      weightsResident: 0,
+      kv: 0,
+      compute: 0,
+      multimodal: 0,
+      lora: 0,
+      vocoder: 0,
+      suspended: false,
+    })),
+    releaseMemory: jest.fn(async () => true),
+
+    initVectorStore: jest.fn(async () => ({ size: 0, n_dims: 384, n_lists: 0 })),
+    vectorStoreAdd: jest.fn(async (id, texts) => texts.map((_, i) => i)),
+    vectorStoreSearch: jest.fn(async () => [
+      { key: 0, score: 0.9, text: 'mock document' },
+    ]),
+    vectorStoreBuildIndex: jest.fn(async () => {}),
+    releaseVectorStore: jest.fn(async () => {}),
+
     releaseContext: jest.fn(() => Promise.resolve()),
     releaseAllContexts: jest.fn(() => Promise.resolve()),
 
@@ -218,6 +258,8 @@ if (!NativeModules.RNLlama) {
 
     applyLoraAdapters: jest.fn(async () => {}),
     removeLoraAdapters: jest.fn(async () => {}),
+    mergeLoraAdapters: jest.fn(async () => {}),
+    unmergeLoraAdapters: jest.fn(async () => {}),
     getLoadedLoraAdapters: jest.fn(async () => []),
 
     initMultimodal: jest.fn(async (id) => {
@@ -245,7 +287,10 @@ if (!NativeModules.RNLlama) {
       textToSpeak.split('').map((char) => char.charCodeAt(0) + 1000),
     ),
     decodeAudioTokens: jest.fn(async (id, tokens) =>
-      tokens.map((token) => token - 1000).map((token) => token / 1024),
+      toTensor(
+        'float32',
+        tokens.map((token) => token - 1000).map((token) => token / 1024),
+      ),
     ),
   }
 }
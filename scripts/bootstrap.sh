@@ -346,12 +346,42 @@ patch -p0 -d ./cpp < ./scripts/patches/chat.h.patch
 patch -p0 -d ./cpp < ./scripts/patches/chat.cpp.patch
 patch -p0 -d ./cpp < ./scripts/patches/log.cpp.patch
 patch -p0 -d ./cpp < ./scripts/patches/ggml-metal.m.patch
+patch -p0 -d ./cpp < ./scripts/patches/ggml.h.patch
 patch -p0 -d ./cpp < ./scripts/patches/ggml.c.patch
 patch -p0 -d ./cpp < ./scripts/patches/ggml-quants.c.patch
 patch -p0 -d ./cpp < ./scripts/patches/llama-mmap.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-model.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-model-loader.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-model-loader.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-context.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-context.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-graph.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-graph.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-memory.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-adapter.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-kv-cache-unified.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-kv-cache-unified.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-kv-cache-unified-iswa.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-kv-cache-unified-iswa.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-memory-hybrid.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/unicode.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-vocab.h.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-vocab.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/llama-grammar.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/sampling.cpp.patch
+patch -p0 -d ./cpp < ./scripts/patches/json-schema-to-grammar.cpp.patch
+patch -p0 -d ./cpp/ggml-cpu < ./scripts/patches/ggml-cpu.c.patch
+patch -p0 -d ./cpp/ggml-cpu < ./scripts/patches/ops.cpp.patch
+patch -p0 -d ./cpp/ggml-cpu < ./scripts/patches/ops.h.patch
+patch -p0 -d ./cpp/ggml-cpu < ./scripts/patches/ggml-cpu-impl.h.patch
+patch -p0 -d ./cpp/tools/mtmd < ./scripts/patches/clip.h.patch
+patch -p0 -d ./cpp/tools/mtmd < ./scripts/patches/clip.cpp.patch
+patch -p0 -d ./cpp/tools/mtmd < ./scripts/patches/mtmd.h.patch
+patch -p0 -d ./cpp/tools/mtmd < ./scripts/patches/mtmd.cpp.patch
 patch -p0 -d ./cpp/minja < ./scripts/patches/minja.hpp.patch
 patch -p0 -d ./cpp/minja < ./scripts/patches/chat-template.hpp.patch
-rm -rf ./cpp/*.orig
+rm -rf ./cpp/*.orig ./cpp/ggml-cpu/*.orig ./cpp/tools/mtmd/*.orig ./cpp/minja/*.orig
 
 if [ "$OS" = "Darwin" ]; then
   # Build metallib (~2.6MB)
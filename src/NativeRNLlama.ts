@@ -3,6 +3,17 @@ import { TurboModuleRegistry } from 'react-native'
 
 export type NativeEmbeddingParams = {
   embd_normalize?: number
+  /**
+   * Keep only the first `embd_dims` dimensions (matryoshka truncation), renormalized. Default: `0` (all)
+   */
+  embd_dims?: number
+  /**
+   * Output element type:
+   * `'int8'` returns integers in [-127, 127] with `embd_scale` to dequantize,
+   * `'binary'` returns bytes with one bit per dimension (set if > 0, most significant bit first).
+   * Default: `'none'` (float)
+   */
+  embd_quantize?: 'none' | 'int8' | 'binary'
 }
 
 export type NativeContextParams = {
@@ -18,7 +29,16 @@ export type NativeContextParams = {
   n_ctx?: number
   n_batch?: number
   n_ubatch?: number
+  /**
+   * Number of parallel sequences (KV cache seq ids) the context can hold.
+   * Must be at least `n_branches` when using branched completion. Default: 1
+   */
+  n_parallel?: number
 
+  /**
+   * Number of CPU threads. Default: picked from the core topology, the fast cores of a big.LITTLE CPU
+   * for token generation and a few more for prompt processing, with the threads pinned to them on Android
+   */
   n_threads?: number
 
   /**
@@ -41,11 +61,24 @@ export type NativeContextParams = {
   cache_type_k?: string
   /**
    * KV cache data type for the V (Experimental in llama.cpp)
+   * Quantized V requires flash_attn. On CPU, q8_0 / q4_0 / q4_1 / q5_0 / q5_1 / iq4_nl are accumulated directly from the quantized blocks.
    */
   cache_type_v?: string
+  /**
+   * Keep the last N stored KV cells in F16 next to a quantized cache, attention reads them instead of the quantized rows.
+   * Only used with flash_attn and a quantized cache_type_k / cache_type_v kept on CPU (ignored on Metal / GPU). Default: 0 (disabled)
+   */
+  kv_recent_window?: number
 
   use_mlock?: boolean
   use_mmap?: boolean
+  /**
+   * Map the model without prefetching it and skip the warmup run, so the context is returned quickly.
+   * Weights are faulted in on first use while a background thread reads the layers ahead in graph order.
+   * Requires use_mmap and is ignored with use_mlock. Default: false
+   * The load progress callback reaches 100 once the file is mapped, before the prefetch has read the weights.
+   */
+  use_lazy_load?: boolean
   vocab_only?: boolean
 
   /**
@@ -70,6 +103,29 @@ export type NativeContextParams = {
    * Enable context shifting to handle prompts larger than context size
    */
   ctx_shift?: boolean
+  /**
+   * Policy used to evict tokens when the context is full:
+   * - `block`: keep `n_keep` tokens and discard half of the remaining tokens
+   * - `sink_window`: keep `ctx_shift_n_sink` attention sink tokens and discard the oldest quarter of the recent window
+   * The KV cache is shifted in place, media chunks are evicted as whole spans. Default: `block`
+   */
+  ctx_shift_policy?: 'block' | 'sink_window'
+  /**
+   * Number of attention sink tokens kept by the `sink_window` policy. Default: 4
+   */
+  ctx_shift_n_sink?: number
+  /**
+   * Recurrent and hybrid models (Mamba, RWKV, Jamba, ...) can't erase a part of their state,
+   * so the recurrent state is saved every `ctx_checkpoint_interval` tokens, at the message boundaries
+   * and before the last prompt token. When a new prompt diverges from the cached one,
+   * the context rolls back to the nearest checkpoint instead of evaluating the whole prompt again.
+   * Set to 0 to only keep the boundary checkpoints. Default: 256
+   */
+  ctx_checkpoint_interval?: number
+  /**
+   * Maximum number of recurrent checkpoints kept, the oldest is dropped first. 0 disables the checkpoints. Default: 8
+   */
+  ctx_checkpoint_max?: number
 
   // Embedding params
   embedding?: boolean
@@ -243,6 +299,40 @@ export type NativeCompletionParams = {
    */
   guide_tokens?: Array<number>
 
+  /**
+   * Number of branches to sample in lockstep after the prompt, each in its own forked KV sequence.
+   * The prompt (e.g. including a tool-call prefix) is evaluated once and shared by all branches.
+   * Requires `n_parallel` >= `n_branches` on context init. Partial completions are not emitted in this mode.
+   * The first branch is also returned as the main result. Default: `1`
+   */
+  n_branches?: number
+  /**
+   * Extra LoRA adapters of each branch, applied only to the KV sequence of that branch on top of the context adapters.
+   * Branches with different adapters are still decoded in the same batch.
+   */
+  branch_lora?: Array<Array<{ path: string; scaled?: number }>>
+
+  /**
+   * Stop the completion after this many milliseconds, aborting a decode that is still running.
+   * The KV cache is kept up to the last completed ubatch. Default: `0` (no deadline)
+   */
+  deadline_ms?: number
+  /**
+   * Latency budget per prompt processing step in milliseconds.
+   * The prompt is decoded in smaller chunks so a single step stays within the budget. Default: `0` (use `n_batch`)
+   */
+  step_budget_ms?: number
+  /**
+   * Minimum interval between partial completion callbacks in milliseconds.
+   * Tokens generated in between are merged into one callback with the concatenated text and probabilities.
+   * Callbacks are also merged while JS has not yet handled the previous one. Default: `0`
+   */
+  emit_partial_interval?: number
+  /**
+   * Emit a partial completion once this many tokens are merged, even within `emit_partial_interval`. Default: `0` (no limit)
+   */
+  emit_partial_max_tokens?: number
+
   emit_partial_completion: boolean
 }
 
@@ -265,6 +355,19 @@ export type NativeCompletionResultTimings = {
   predicted_ms: number
   predicted_per_token_ms: number
   predicted_per_second: number
+  /**
+   * Number of decode steps that reused the previous compute graph instead of rebuilding it
+   */
+  graphs_reused?: number
+}
+
+export type NativeCompletionBranchResult = {
+  text: string
+  tokens_predicted: number
+  stopped_eos: boolean
+  stopped_word: boolean
+  stopped_limit: boolean
+  stopping_word: string
 }
 
 export type NativeCompletionResult = {
@@ -298,16 +401,33 @@ export type NativeCompletionResult = {
   stopped_eos: boolean
   stopped_word: string
   stopped_limit: number
+  /**
+   * Whether the completion was stopped by `deadline_ms`
+   */
+  stopped_deadline?: boolean
   stopping_word: string
   tokens_cached: number
   timings: NativeCompletionResultTimings
 
   completion_probabilities?: Array<NativeCompletionTokenProb>
   audio_tokens?: Array<number>
+  /**
+   * Results of all branches when `n_branches` > 1
+   */
+  branches?: Array<NativeCompletionBranchResult>
+}
+
+/**
+ * Typed buffer transferred across the bridge as base64 of its raw little-endian values
+ */
+export type NativeTensor = {
+  dtype: 'float32' | 'int32' | 'int8' | 'uint8'
+  shape: Array<number>
+  data: string
 }
 
 export type NativeTokenizeResult = {
-  tokens: Array<number>
+  tokens: NativeTensor
   /**
    * Whether the tokenization contains images
    */
@@ -327,7 +447,15 @@ export type NativeTokenizeResult = {
 }
 
 export type NativeEmbeddingResult = {
-  embedding: Array<number>
+  /**
+   * `float32`, `int8` or `uint8` (packed bits) depending on `embd_quantize`
+   */
+  embedding: NativeTensor
+  embd_dims?: number
+  /**
+   * Dequantization scale of `int8` embeddings
+   */
+  embd_scale?: number
 }
 
 export type NativeLlamaContext = {
@@ -423,8 +551,104 @@ export type NativeRerankResult = {
   index: number
 }
 
+export type NativeVectorStoreParams = {
+  /**
+   * Number of dimensions, the first `n_dims` of the embeddings are kept (matryoshka models).
+   * Ignored when opening an existing store, its dimensions are read from the file. Default: `nEmbd` of the model
+   */
+  n_dims?: number
+  /**
+   * Storage of the vectors, an existing store with another type is rejected.
+   * `'int8'` needs a multiple of 32 dimensions, `'binary'` keeps 1 bit per dimension. Default: `'int8'` for a new store
+   */
+  quantize?: 'float' | 'int8' | 'binary'
+}
+
+export type NativeVectorStoreInfo = {
+  size: number
+  n_dims: number
+  /**
+   * Number of IVF lists, 0 when the store is searched by brute force
+   */
+  n_lists: number
+}
+
+export type NativeVectorStoreAddParams = {
+  /**
+   * Keys of the texts. Default: new keys, above every key added to the store so far
+   */
+  keys?: Array<number>
+  /**
+   * Keep the texts in the store, required to rerank the results. Default: `true`
+   */
+  store_text?: boolean
+}
+
+export type NativeVectorStoreSearchParams = {
+  /**
+   * Number of results. Default: `10`
+   */
+  k?: number
+  /**
+   * Number of IVF lists to scan when the store is indexed. Default: 1/8 of the lists
+   */
+  n_probe?: number
+  /**
+   * Context with a rerank model to rerank the best `n_rerank` results by their stored text
+   */
+  rerank_context_id?: number
+  n_rerank?: number
+}
+
+export type NativeVectorStoreResult = {
+  key: number
+  score: number
+  text?: string
+}
+
+export type NativeMemoryFootprint = {
+  /**
+   * Size of the model weights in bytes
+   */
+  weights: number
+  /**
+   * Bytes of the mmapped weights currently resident in RAM
+   */
+  weightsResident: number
+  /**
+   * Size of the KV cache / recurrent state of the cached tokens in bytes
+   */
+  kv: number
+  /**
+   * Size of the compute buffers in bytes
+   */
+  compute: number
+  /**
+   * Size of the multimodal projector in bytes
+   */
+  multimodal: number
+  /**
+   * Size of the loaded LoRA adapters in bytes, including unused ones kept for fast switching
+   */
+  lora: number
+  /**
+   * Size of the vocoder model and its buffers in bytes
+   */
+  vocoder: number
+  /**
+   * Whether the context is suspended by releaseMemory, it's restored on the next call
+   */
+  suspended: boolean
+}
+
 export interface Spec extends TurboModule {
   toggleNativeLog(enabled: boolean): Promise<void>
+  /**
+   * Install the synchronous JSI bindings as `global.__rnllamaJSI`
+   * @returns an empty string, or the reason JSI is not available
+   * (e.g. remote debugging, or the prebuilt Android libraries built without JSI)
+   */
+  installJSI(): string
   setContextLimit(limit: number): Promise<void>
 
   modelInfo(path: string, skip?: string[]): Promise<Object>
@@ -486,6 +710,12 @@ export interface Spec extends TurboModule {
     loraAdapters: Array<{ path: string; scaled?: number }>,
   ): Promise<void>
   removeLoraAdapters(contextId: number): Promise<void>
+  mergeLoraAdapters(
+    contextId: number,
+    loraAdapters: Array<{ path: string; scaled?: number }>,
+    cachePath: string,
+  ): Promise<void>
+  unmergeLoraAdapters(contextId: number): Promise<void>
   getLoadedLoraAdapters(
     contextId: number,
   ): Promise<Array<{ path: string; scaled?: number }>>
@@ -519,9 +749,31 @@ export interface Spec extends TurboModule {
   isVocoderEnabled(contextId: number): Promise<boolean>
   getFormattedAudioCompletion(contextId: number, speakerJsonStr: string, textToSpeak: string): Promise<string>
   getAudioCompletionGuideTokens(contextId: number, textToSpeak: string): Promise<Array<number>>
-  decodeAudioTokens(contextId: number, tokens: number[]): Promise<Array<number>>
+  decodeAudioTokens(contextId: number, tokens: number[]): Promise<NativeTensor>
   releaseVocoder(contextId: number): Promise<void>
 
+  getMemoryFootprint(contextId: number): Promise<NativeMemoryFootprint>
+  releaseMemory(contextId: number, level: number): Promise<boolean>
+
+  // Vector store methods
+  initVectorStore(
+    contextId: number,
+    path: string,
+    params: NativeVectorStoreParams,
+  ): Promise<NativeVectorStoreInfo>
+  vectorStoreAdd(
+    contextId: number,
+    texts: Array<string>,
+    params: NativeVectorStoreAddParams,
+  ): Promise<Array<number>>
+  vectorStoreSearch(
+    contextId: number,
+    query: string,
+    params: NativeVectorStoreSearchParams,
+  ): Promise<Array<NativeVectorStoreResult>>
+  vectorStoreBuildIndex(contextId: number, nLists: number): Promise<void>
+  releaseVectorStore(contextId: number): Promise<void>
+
   releaseContext(contextId: number): Promise<void>
 
   releaseAllContexts(): Promise<void>
@@ -1,4 +1,4 @@
-import { initLlama, releaseAllLlama } from '..'
+import { initLlama, releaseAllLlama, isJSIAvailable } from '..'
 import type { TokenData } from '..'
 
 jest.mock('..', () => require('../../jest/mock'))
@@ -21,6 +21,22 @@ test('Mock', async () => {
 
   expect(await context.bench(512, 128, 1, 3)).toMatchSnapshot('bench')
 
+  const { embedding, embedding_data: embeddingData } = await context.embedding('Test')
+  expect(embeddingData).toBeInstanceOf(Float32Array)
+  expect(embedding).toHaveLength(768)
+  expect(embedding[0]).toBeCloseTo(0.01)
+
+  const tokenizeResult = await context.tokenize('Test')
+  // the plain array is only built when read
+  expect(Object.getOwnPropertyDescriptor(tokenizeResult, 'tokens')?.get).toBeDefined()
+  const { tokens, tokens_data: tokensData } = tokenizeResult
+  expect(tokensData).toBeInstanceOf(Int32Array)
+  expect(tokens).toEqual([84, 101, 115, 116])
+  expect(tokenizeResult.tokens).toBe(tokens)
+
+  expect(isJSIAvailable()).toBe(false)
+  expect(() => context.countTokensSync('Test')).toThrow('JSI bindings are not available')
+
   await context.initMultimodal({
     path: 'mmproj-test.gguf',
   })
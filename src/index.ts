@@ -7,6 +7,7 @@ import type {
   NativeCompletionParams,
   NativeCompletionTokenProb,
   NativeCompletionResult,
+  NativeCompletionBranchResult,
   NativeTokenizeResult,
   NativeEmbeddingResult,
   NativeSessionLoadResult,
@@ -19,12 +20,21 @@ import type {
   FormattedChatResult,
   NativeImageProcessingResult,
   NativeLlamaChatMessage,
+  NativeMemoryFootprint,
+  NativeTensor,
+  NativeVectorStoreParams,
+  NativeVectorStoreInfo,
+  NativeVectorStoreAddParams,
+  NativeVectorStoreSearchParams,
+  NativeVectorStoreResult,
 } from './NativeRNLlama'
 import type {
   SchemaGrammarConverterPropOrder,
   SchemaGrammarConverterBuiltinRule,
 } from './grammar'
 import { SchemaGrammarConverter, convertJsonSchemaToGrammar } from './grammar'
+import { decodeTensor, defineLazyArray } from './tensor'
+import type { TensorArray } from './tensor'
 
 export type RNLlamaMessagePart = {
   type: string
@@ -50,6 +60,7 @@ export type {
   NativeCompletionParams,
   NativeCompletionTokenProb,
   NativeCompletionResult,
+  NativeCompletionBranchResult,
   NativeTokenizeResult,
   NativeEmbeddingResult,
   NativeSessionLoadResult,
@@ -61,6 +72,14 @@ export type {
   FormattedChatResult,
   JinjaFormattedChatResult,
   NativeImageProcessingResult,
+  NativeMemoryFootprint,
+  NativeTensor,
+  TensorArray,
+  NativeVectorStoreParams,
+  NativeVectorStoreInfo,
+  NativeVectorStoreAddParams,
+  NativeVectorStoreSearchParams,
+  NativeVectorStoreResult,
 
   // Deprecated
   SchemaGrammarConverterPropOrder,
@@ -69,6 +88,15 @@ export type {
 
 export const RNLLAMA_MTMD_DEFAULT_MEDIA_MARKER = '<__media__>'
 
+/**
+ * Levels of LlamaContext.releaseMemory, the OS memory pressure signals also release idle contexts.
+ * TRIM drops the idle mmapped weights from RAM, they are read again from the model file,
+ * and frees the LoRA adapters that are no longer applied.
+ * SUSPEND also saves the KV cache to disk and frees the KV cache and compute buffers.
+ */
+export const RNLLAMA_MEMORY_RELEASE_TRIM = 1
+export const RNLLAMA_MEMORY_RELEASE_SUSPEND = 2
+
 export { SchemaGrammarConverter, convertJsonSchemaToGrammar }
 
 const EVENT_ON_INIT_CONTEXT_PROGRESS = '@RNLlama_onInitContextProgress'
@@ -135,6 +163,25 @@ export type ContextParams = Omit<
 
 export type EmbeddingParams = NativeEmbeddingParams
 
+export type EmbeddingResult = Omit<NativeEmbeddingResult, 'embedding'> & {
+  /**
+   * Typed view of the embedding: `Float32Array`, or `Int8Array` / `Uint8Array` for `embd_quantize`
+   */
+  embedding_data: TensorArray
+  /**
+   * Plain array copy of `embedding_data`, built on first access
+   */
+  embedding: Array<number>
+}
+
+export type TokenizeResult = Omit<NativeTokenizeResult, 'tokens'> & {
+  tokens_data: Int32Array
+  /**
+   * Plain array copy of `tokens_data`, built on first access
+   */
+  tokens: Array<number>
+}
+
 export type RerankParams = {
   normalize?: number
 }
@@ -165,6 +212,11 @@ export type CompletionBaseParams = {
   tool_choice?: string
   response_format?: CompletionResponseFormat
   media_paths?: string | string[]
+  /**
+   * Name of a profile added with `registerSamplingProfile`.
+   * Its parameters are used unless they are also set in this call.
+   */
+  sampling_profile?: string
 }
 export type CompletionParams = Omit<
   NativeCompletionParams,
@@ -172,6 +224,36 @@ export type CompletionParams = Omit<
 > &
   CompletionBaseParams
 
+export type SamplingProfile = Pick<
+  NativeCompletionParams,
+  | 'n_probs'
+  | 'top_k'
+  | 'top_p'
+  | 'min_p'
+  | 'xtc_probability'
+  | 'xtc_threshold'
+  | 'typical_p'
+  | 'temperature'
+  | 'penalty_last_n'
+  | 'penalty_repeat'
+  | 'penalty_freq'
+  | 'penalty_present'
+  | 'mirostat'
+  | 'mirostat_tau'
+  | 'mirostat_eta'
+  | 'dry_multiplier'
+  | 'dry_base'
+  | 'dry_allowed_length'
+  | 'dry_penalty_last_n'
+  | 'dry_sequence_breakers'
+  | 'top_n_sigma'
+  | 'ignore_eos'
+  | 'logit_bias'
+  | 'seed'
+  | 'grammar'
+  | 'json_schema'
+>
+
 export type BenchResult = {
   modelDesc: string
   modelSize: number
@@ -182,6 +264,117 @@ export type BenchResult = {
   tgStd: number
 }
 
+type JSIFormattedChatParams = {
+  jinja?: boolean
+  json_schema?: string
+  tools?: string
+  parallel_tool_calls?: boolean
+  tool_choice?: string
+  enable_thinking?: boolean
+}
+
+export type JSIModelInfo = Pick<
+  NativeLlamaContext['model'],
+  'desc' | 'size' | 'nEmbd' | 'nParams'
+> & {
+  metadata: Record<string, string>
+}
+
+// Synchronous bindings of cpp/jsi/rn-llama-jsi.cpp
+type JSIBindings = {
+  tokenize(contextId: number, text: string): Int32Array
+  countTokens(contextId: number, text: string): number
+  detokenize(contextId: number, tokens: number[] | Int32Array): string
+  getFormattedChat(
+    contextId: number,
+    messages: string,
+    chatTemplate: string | undefined,
+    params: JSIFormattedChatParams,
+  ): string
+  getModelInfo(contextId: number): JSIModelInfo
+  isPredicting(contextId: number): boolean
+}
+
+declare global {
+  // eslint-disable-next-line vars-on-top, no-var
+  var __rnllamaJSI: JSIBindings | undefined
+}
+
+let jsiBindings: JSIBindings | null | undefined
+let jsiUnavailableReason = ''
+
+const getJSIBindings = (): JSIBindings | null => {
+  if (jsiBindings === undefined) {
+    try {
+      if (!globalThis.__rnllamaJSI) jsiUnavailableReason = RNLlama.installJSI()
+    } catch (e) {
+      // Sync methods can't be called, e.g. remote debugging
+      jsiUnavailableReason = e instanceof Error ? e.message : String(e)
+    }
+    jsiBindings = globalThis.__rnllamaJSI ?? null
+  }
+  return jsiBindings
+}
+
+const requireJSIBindings = (): JSIBindings => {
+  const bindings = getJSIBindings()
+  if (!bindings) {
+    throw new Error(
+      `JSI bindings are not available (${
+        jsiUnavailableReason || 'unknown reason'
+      }), use the async methods instead`,
+    )
+  }
+  return bindings
+}
+
+// Replace media parts by the media marker, collecting their paths
+const toNativeChatMessages = (messages: RNLlamaOAICompatibleMessage[]) => {
+  const mediaPaths: string[] = []
+  const chat = messages.map((msg) => {
+    if (Array.isArray(msg.content)) {
+      const content = msg.content.map((part) => {
+        // Handle multimodal content
+        if (part.type === 'image_url') {
+          let path = part.image_url?.url || ''
+          if (path?.startsWith('file://')) path = path.slice(7)
+          mediaPaths.push(path)
+          return {
+            type: 'text',
+            text: RNLLAMA_MTMD_DEFAULT_MEDIA_MARKER,
+          }
+        } else if (part.type === 'input_audio') {
+          const { input_audio: audio } = part
+          if (!audio) throw new Error('input_audio is required')
+
+          const { format } = audio
+          if (format != 'wav' && format != 'mp3') {
+            throw new Error(`Unsupported audio format: ${format}`)
+          }
+          if (audio.url) {
+            const path = audio.url.replace(/file:\/\//, '')
+            mediaPaths.push(path)
+          } else if (audio.data) {
+            mediaPaths.push(audio.data)
+          }
+          return {
+            type: 'text',
+            text: RNLLAMA_MTMD_DEFAULT_MEDIA_MARKER,
+          }
+        }
+        return part
+      })
+
+      return {
+        ...msg,
+        content,
+      }
+    }
+    return msg
+  }) as NativeLlamaChatMessage[]
+  return { chat, mediaPaths }
+}
+
 const getJsonSchema = (responseFormat?: CompletionResponseFormat) => {
   if (responseFormat?.type === 'json_schema') {
     return responseFormat.json_schema?.schema
@@ -201,6 +394,8 @@ export class LlamaContext {
 
   model: NativeLlamaContext['model']
 
+  samplingProfiles: Map<string, SamplingProfile> = new Map()
+
   constructor({ contextId, gpu, reasonNoGPU, model }: NativeLlamaContext) {
     this.id = contextId
     this.gpu = gpu
@@ -248,48 +443,7 @@ export class LlamaContext {
       enable_thinking?: boolean,
     },
   ): Promise<FormattedChatResult | JinjaFormattedChatResult> {
-    const mediaPaths: string[] = []
-    const chat = messages.map((msg) => {
-      if (Array.isArray(msg.content)) {
-        const content = msg.content.map((part) => {
-          // Handle multimodal content
-          if (part.type === 'image_url') {
-            let path = part.image_url?.url || ''
-            if (path?.startsWith('file://')) path = path.slice(7)
-            mediaPaths.push(path)
-            return {
-              type: 'text',
-              text: RNLLAMA_MTMD_DEFAULT_MEDIA_MARKER,
-            }
-          } else if (part.type === 'input_audio') {
-            const { input_audio: audio } = part
-            if (!audio) throw new Error('input_audio is required')
-
-            const { format } = audio
-            if (format != 'wav' && format != 'mp3') {
-              throw new Error(`Unsupported audio format: ${format}`)
-            }
-            if (audio.url) {
-              const path = audio.url.replace(/file:\/\//, '')
-              mediaPaths.push(path)
-            } else if (audio.data) {
-              mediaPaths.push(audio.data)
-            }
-            return {
-              type: 'text',
-              text: RNLLAMA_MTMD_DEFAULT_MEDIA_MARKER,
-            }
-          }
-          return part
-        })
-
-        return {
-          ...msg,
-          content,
-        }
-      }
-      return msg
-    }) as NativeLlamaChatMessage[]
+    const { chat, mediaPaths } = toNativeChatMessages(messages)
 
     const useJinja = this.isJinjaSupported() && params?.jinja
     let tmpl
@@ -340,11 +494,19 @@ export class LlamaContext {
     params: CompletionParams,
     callback?: (data: TokenData) => void,
   ): Promise<NativeCompletionResult> {
+    let profile: SamplingProfile | undefined
+    if (params.sampling_profile) {
+      profile = this.samplingProfiles.get(params.sampling_profile)
+      if (!profile)
+        throw new Error(`Unknown sampling profile: ${params.sampling_profile}`)
+    }
     const nativeParams = {
+      ...profile,
       ...params,
       prompt: params.prompt || '',
       emit_partial_completion: !!callback,
     }
+    delete nativeParams.sampling_profile
 
     if (params.messages) {
       const formattedResult = await this.getFormattedChat(
@@ -394,6 +556,15 @@ export class LlamaContext {
       nativeParams.media_paths = params.media_paths
     }
 
+    if (params.branch_lora) {
+      nativeParams.branch_lora = params.branch_lora.map((loraList) =>
+        loraList.map((l) => ({
+          path: l.path.replace(/file:\/\//, ''),
+          scaled: l.scaled,
+        })),
+      )
+    }
+
     if (nativeParams.response_format && !nativeParams.grammar) {
       const jsonSchema = getJsonSchema(params.response_format)
       if (jsonSchema) nativeParams.json_schema = JSON.stringify(jsonSchema)
@@ -423,6 +594,21 @@ export class LlamaContext {
       })
   }
 
+  /**
+   * Register named sampling parameters to use with `completion({ sampling_profile })`.
+   * The native side keeps the configured samplers of recent parameter sets and resets them
+   * instead of rebuilding, so short calls that share a profile skip the sampler setup.
+   * @param name Profile name, an existing profile with the same name is replaced
+   * @param profile Sampling parameters of the profile
+   */
+  registerSamplingProfile(name: string, profile: SamplingProfile): void {
+    this.samplingProfiles.set(name, { ...profile })
+  }
+
+  unregisterSamplingProfile(name: string): boolean {
+    return this.samplingProfiles.delete(name)
+  }
+
   stopCompletion(): Promise<void> {
     return RNLlama.stopCompletion(this.id)
   }
@@ -433,26 +619,117 @@ export class LlamaContext {
    * @param params.media_paths Array of image paths to tokenize (if multimodal is enabled)
    * @returns Promise resolving to the tokenize result
    */
-  tokenize(
+  async tokenize(
     text: string,
     {
       media_paths: mediaPaths,
     }: {
       media_paths?: string[]
     } = {},
-  ): Promise<NativeTokenizeResult> {
-    return RNLlama.tokenize(this.id, text, mediaPaths)
+  ): Promise<TokenizeResult> {
+    const { tokens, ...result } = await RNLlama.tokenize(
+      this.id,
+      text,
+      mediaPaths,
+    )
+    const tokensData = decodeTensor(tokens) as Int32Array
+    return defineLazyArray(
+      { ...result, tokens_data: tokensData },
+      'tokens',
+      tokensData,
+    )
   }
 
   detokenize(tokens: number[]): Promise<string> {
     return RNLlama.detokenize(this.id, tokens)
   }
 
-  embedding(
+  /**
+   * Tokenize the text synchronously through JSI, e.g. to count tokens while typing.
+   * Media are not supported, use `tokenize` for them.
+   * @throws Error when the JSI bindings are not available, see `isJSIAvailable`
+   * Experimental: the prebuilt Android libraries don't include JSI yet.
+   * @hidden
+   */
+  tokenizeSync(text: string): Int32Array {
+    return requireJSIBindings().tokenize(this.id, text)
+  }
+
+  /**
+   * Count the tokens of the text synchronously through JSI, without creating them
+   * Experimental: the prebuilt Android libraries don't include JSI yet.
+   * @hidden
+   */
+  countTokensSync(text: string): number {
+    return requireJSIBindings().countTokens(this.id, text)
+  }
+
+  /** @hidden */
+  detokenizeSync(tokens: number[] | Int32Array): string {
+    return requireJSIBindings().detokenize(this.id, tokens)
+  }
+
+  /**
+   * Format the chat synchronously through JSI, only the prompt is returned
+   * @hidden
+   */
+  getFormattedChatSync(
+    messages: RNLlamaOAICompatibleMessage[],
+    template?: string | null,
+    params?: {
+      jinja?: boolean
+      response_format?: CompletionResponseFormat
+      tools?: object
+      parallel_tool_calls?: object
+      tool_choice?: string
+      enable_thinking?: boolean
+    },
+  ): string {
+    const { chat } = toNativeChatMessages(messages)
+    const jsonSchema = getJsonSchema(params?.response_format)
+    return requireJSIBindings().getFormattedChat(
+      this.id,
+      JSON.stringify(chat),
+      template || undefined,
+      {
+        jinja: this.isJinjaSupported() && !!params?.jinja,
+        json_schema: jsonSchema ? JSON.stringify(jsonSchema) : undefined,
+        tools: params?.tools ? JSON.stringify(params.tools) : undefined,
+        parallel_tool_calls: !!params?.parallel_tool_calls,
+        tool_choice: params?.tool_choice,
+        enable_thinking: params?.enable_thinking ?? true,
+      },
+    )
+  }
+
+  /**
+   * Read the model description and GGUF metadata synchronously through JSI
+   * @hidden
+   */
+  getModelInfoSync(): JSIModelInfo {
+    return requireJSIBindings().getModelInfo(this.id)
+  }
+
+  /** @hidden */
+  isPredictingSync(): boolean {
+    return requireJSIBindings().isPredicting(this.id)
+  }
+
+  async embedding(
     text: string,
     params?: EmbeddingParams,
-  ): Promise<NativeEmbeddingResult> {
-    return RNLlama.embedding(this.id, text, params || {})
+  ): Promise<EmbeddingResult> {
+    const { embedding, ...result } = await RNLlama.embedding(
+      this.id,
+      text,
+      params || {},
+    )
+    const embeddingData = decodeTensor(embedding)
+    return defineLazyArray(
+      { ...result, embedding_data: embeddingData },
+      'embedding',
+      embeddingData,
+    )
   }
 
   /**
@@ -514,6 +791,35 @@ export class LlamaContext {
     return RNLlama.removeLoraAdapters(this.id)
   }
 
+  /**
+   * Merge LoRA adapters into copies of the base weights they modify, so decoding runs at base model speed.
+   * Replaces the previously merged set, the merged adapters are removed from the runtime adapters.
+   * Adapters on token_embd can't be merged, apply them with applyLoraAdapters instead.
+   * @param loraList Adapters to merge
+   * @param cachePath Optional file to cache the merged weights, reused when the model and adapters are unchanged
+   */
+  async mergeLoraAdapters(
+    loraList: Array<{ path: string; scaled?: number }>,
+    cachePath?: string,
+  ): Promise<void> {
+    const loraAdapters = loraList.map((l) => ({
+      path: l.path.replace(/file:\/\//, ''),
+      scaled: l.scaled,
+    }))
+    return RNLlama.mergeLoraAdapters(
+      this.id,
+      loraAdapters,
+      cachePath ? cachePath.replace(/file:\/\//, '') : '',
+    )
+  }
+
+  /**
+   * Restore the original base weights after mergeLoraAdapters
+   */
+  async unmergeLoraAdapters(): Promise<void> {
+    return RNLlama.unmergeLoraAdapters(this.id)
+  }
+
   async getLoadedLoraAdapters(): Promise<
     Array<{ path: string; scaled?: number }>
   > {
@@ -618,10 +924,11 @@ export class LlamaContext {
   /**
    * Decode audio tokens
    * @param tokens Array of audio tokens
-   * @returns Promise resolving to the decoded audio tokens
+   * @returns Promise resolving to the decoded audio samples
    */
-  async decodeAudioTokens(tokens: number[]): Promise<Array<number>> {
-    return await RNLlama.decodeAudioTokens(this.id, tokens)
+  async decodeAudioTokens(tokens: number[]): Promise<Float32Array> {
+    const audio = await RNLlama.decodeAudioTokens(this.id, tokens)
+    return decodeTensor(audio) as Float32Array
   }
 
   /**
@@ -632,11 +939,105 @@ export class LlamaContext {
     return await RNLlama.releaseVocoder(this.id)
   }
 
+  /**
+   * Open a vector store of this context's embeddings, created when the file does not exist.
+   * Requires `embedding: true` on context init.
+   * @param path Path of the store file
+   * @param params Dimensions and storage of the vectors
+   * @returns Promise resolving to the store info
+   */
+  async initVectorStore(
+    path: string,
+    params?: NativeVectorStoreParams,
+  ): Promise<NativeVectorStoreInfo> {
+    return await RNLlama.initVectorStore(this.id, path, params || {})
+  }
+
+  /**
+   * Embed texts and add them to the vector store, the embeddings stay native
+   * @param texts Texts to add
+   * @param params Keys of the texts and whether to keep the texts
+   * @returns Promise resolving to the keys of the added texts
+   */
+  async addToVectorStore(
+    texts: string[],
+    params?: NativeVectorStoreAddParams,
+  ): Promise<Array<number>> {
+    return await RNLlama.vectorStoreAdd(this.id, texts, params || {})
+  }
+
+  /**
+   * Search the vector store for the texts closest to the query
+   * @param query Query text
+   * @param params Number of results, IVF probes and optional rerank context
+   * @returns Promise resolving to the results, best first
+   */
+  async searchVectorStore(
+    query: string,
+    params?: Omit<NativeVectorStoreSearchParams, 'rerank_context_id'> & {
+      rerankContext?: LlamaContext
+    },
+  ): Promise<Array<NativeVectorStoreResult>> {
+    const { rerankContext, ...searchParams } = params || {}
+    return await RNLlama.vectorStoreSearch(this.id, query, {
+      ...searchParams,
+      ...(rerankContext ? { rerank_context_id: rerankContext.id } : {}),
+    })
+  }
+
+  /**
+   * Build an IVF index of the vector store for large corpora, rows added later join the nearest list
+   * @param nLists Number of lists, around sqrt(number of rows)
+   */
+  async buildVectorStoreIndex(nLists: number): Promise<void> {
+    return await RNLlama.vectorStoreBuildIndex(this.id, nLists)
+  }
+
+  async releaseVectorStore(): Promise<void> {
+    return await RNLlama.releaseVectorStore(this.id)
+  }
+
+  /**
+   * Get the memory held by the context
+   * @returns Promise resolving to the footprint in bytes
+   */
+  async getMemoryFootprint(): Promise<NativeMemoryFootprint> {
+    return await RNLlama.getMemoryFootprint(this.id)
+  }
+
+  /**
+   * Release memory of an idle context, it's restored transparently on the next call
+   * @param level RNLLAMA_MEMORY_RELEASE_TRIM or RNLLAMA_MEMORY_RELEASE_SUSPEND
+   * @returns Promise resolving to false if the context is busy
+   */
+  async releaseMemory(
+    level: number = RNLLAMA_MEMORY_RELEASE_SUSPEND,
+  ): Promise<boolean> {
+    return await RNLlama.releaseMemory(this.id, level)
+  }
+
   async release(): Promise<void> {
     return RNLlama.releaseContext(this.id)
   }
 }
 
+/**
+ * Whether the synchronous methods (`tokenizeSync`, `countTokensSync`, ...) can be used,
+ * otherwise use the async methods they mirror
+ * @hidden
+ */
+export function isJSIAvailable(): boolean {
+  return !!getJSIBindings()
+}
+
+/**
+ * Why the synchronous methods can't be used, empty when they can
+ * @hidden
+ */
+export function getJSIUnavailableReason(): string {
+  return getJSIBindings() ? '' : jsiUnavailableReason
+}
+
 export async function toggleNativeLog(enabled: boolean): Promise<void> {
   return RNLlama.toggleNativeLog(enabled)
 }
@@ -0,0 +1,87 @@
+/* eslint-disable no-bitwise */
+import type { NativeTensor } from './NativeRNLlama'
+
+// Tensors cross the bridge as base64 of their raw (little-endian) values,
+// decoded here into a typed array view over a single buffer
+
+const BASE64_CHARS =
+  'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/'
+
+const base64Lookup = new Uint8Array(256)
+for (let i = 0; i < BASE64_CHARS.length; i += 1) {
+  base64Lookup[BASE64_CHARS.charCodeAt(i)] = i
+}
+
+const sextet = (data: string, i: number): number =>
+  base64Lookup[data.charCodeAt(i)] ?? 0
+
+function base64ToBytes(data: string): Uint8Array {
+  let { length } = data
+  while (length > 0 && data[length - 1] === '=') length -= 1
+  const bytes = new Uint8Array((length * 3) >> 2)
+
+  let p = 0
+  let i = 0
+  for (; i + 4 <= length; i += 4) {
+    const n =
+      (sextet(data, i) << 18) |
+      (sextet(data, i + 1) << 12) |
+      (sextet(data, i + 2) << 6) |
+      sextet(data, i + 3)
+    bytes[p] = (n >> 16) & 0xff
+    bytes[p + 1] = (n >> 8) & 0xff
+    bytes[p + 2] = n & 0xff
+    p += 3
+  }
+  const rest = length - i
+  if (rest >= 2) {
+    const n =
+      (sextet(data, i) << 18) |
+      (sextet(data, i + 1) << 12) |
+      (rest === 3 ? sextet(data, i + 2) << 6 : 0)
+    bytes[p] = (n >> 16) & 0xff
+    if (rest === 3) bytes[p + 1] = (n >> 8) & 0xff
+  }
+  return bytes
+}
+
+export type TensorArray = Float32Array | Int32Array | Int8Array | Uint8Array
+
+export function decodeTensor(tensor: NativeTensor): TensorArray {
+  const { buffer } = base64ToBytes(tensor.data)
+  switch (tensor.dtype) {
+    case 'float32':
+      return new Float32Array(buffer)
+    case 'int32':
+      return new Int32Array(buffer)
+    case 'int8':
+      return new Int8Array(buffer)
+    case 'uint8':
+      return new Uint8Array(buffer)
+    default:
+      throw new Error(`Unsupported tensor dtype: ${tensor.dtype}`)
+  }
+}
+
+// Defines `key` as a plain array copy of `data`, built on first access only
+export function defineLazyArray<T extends object, K extends string>(
+  target: T,
+  key: K,
+  data: TensorArray,
+): T & Record<K, Array<number>> {
+  Object.defineProperty(target, key, {
+    configurable: true,
+    enumerable: true,
+    get() {
+      const value = Array.from(data)
+      Object.defineProperty(target, key, {
+        configurable: true,
+        enumerable: true,
+        writable: true,
+        value,
+      })
+      return value
+    },
+  })
+  return target as T & Record<K, Array<number>>
+}
@@ -0,0 +1,655 @@
+// Checks the CPU flash attention paths used with a quantized KV cache: the fused multiply-add kernels that
+// accumulate V straight from the quantized blocks, and the F16 copies of the recent cells attached with
+// lm_ggml_flash_attn_ext_add_recent(), also as a cache fills them across ubatches, K-shifts and defrags.
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int head_dim  = 64;
+static const int n_head    = 4;
+static const int n_head_kv = 2;
+static const int n_tokens  = 3;
+static const int n_kv      = 256;
+static const int n_recent  = 48;
+
+static const int n_embd_gqa = head_dim*n_head_kv;
+
+static std::vector<float> random_data(size_t n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    std::vector<float> out(n);
+    for (auto & v : out) {
+        v = dist(rng);
+    }
+
+    return out;
+}
+
+// fills a [n_embd_gqa, n_rows] tensor of any type from F32 rows
+static void set_rows(lm_ggml_tensor * t, const float * data) {
+    for (int64_t i = 0; i < t->ne[1]; i++) {
+        void * dst = (char *) t->data + i*t->nb[1];
+
+        if (t->type == LM_GGML_TYPE_F32) {
+            memcpy(dst, data + i*t->ne[0], t->ne[0]*sizeof(float));
+        } else {
+            lm_ggml_quantize_chunk(t->type, data + i*t->ne[0], dst, 0, 1, t->ne[0], nullptr);
+        }
+    }
+}
+
+// the rows of a [n_embd_gqa, n_rows] tensor, converted back to F32
+static std::vector<float> get_rows(const lm_ggml_tensor * t) {
+    std::vector<float> out(t->ne[0]*t->ne[1]);
+
+    for (int64_t i = 0; i < t->ne[1]; i++) {
+        const void * src = (const char *) t->data + i*t->nb[1];
+
+        if (t->type == LM_GGML_TYPE_F32) {
+            memcpy(out.data() + i*t->ne[0], src, t->ne[0]*sizeof(float));
+        } else {
+            lm_ggml_get_type_traits(t->type)->to_float(src, out.data() + i*t->ne[0], t->ne[0]);
+        }
+    }
+
+    return out;
+}
+
+// [n_embd_gqa, n_rows] -> [head_dim, n_rows, n_head_kv], the layout of the KV cache views
+static lm_ggml_tensor * kv_view(lm_ggml_context * ctx, lm_ggml_tensor * t, int64_t n_rows) {
+    lm_ggml_tensor * view = lm_ggml_view_3d(ctx, t, head_dim, n_head_kv, n_rows,
+            lm_ggml_row_size(t->type, head_dim), t->nb[1], 0);
+
+    return lm_ggml_permute(ctx, view, 0, 2, 1, 3);
+}
+
+struct fa_inputs {
+    std::vector<float> q;
+    std::vector<float> k;
+    std::vector<float> v;
+    std::vector<float> mask; // [n_kv, LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD)]
+
+    fa_inputs() :
+        q(random_data((size_t) head_dim*n_head*n_tokens, 1)),
+        k(random_data((size_t) n_embd_gqa*n_kv, 2)),
+        v(random_data((size_t) n_embd_gqa*n_kv, 3)),
+        mask((size_t) n_kv*LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD), -INFINITY) {
+        // every few cells are masked, as the empty or foreign cells of the cache
+        for (int i = 0; i < n_tokens; i++) {
+            for (int j = 0; j < n_kv; j++) {
+                mask[(size_t) i*n_kv + j] = j % 7 == 3 ? -INFINITY : 0.0f;
+            }
+        }
+    }
+};
+
+// the recent cells in a cache slot order that differs from the cell order
+struct fa_recent {
+    std::vector<float>   k;    // [n_embd_gqa, n_recent + 1], the last row is never read
+    std::vector<float>   v;
+    std::vector<int32_t> slot; // [n_kv]
+};
+
+// attention of all heads and tokens, [head_dim, n_head, n_tokens]
+static std::vector<float> flash_attn(const fa_inputs & in, lm_ggml_type type_k, lm_ggml_type type_v, const fa_recent * recent, int n_threads) {
+    lm_ggml_init_params params = {
+        /*.mem_size   =*/ 16*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    lm_ggml_context * ctx = lm_ggml_init(params);
+
+    lm_ggml_tensor * q    = lm_ggml_new_tensor_3d(ctx, LM_GGML_TYPE_F32, head_dim, n_head, n_tokens);
+    lm_ggml_tensor * k    = lm_ggml_new_tensor_2d(ctx, type_k, n_embd_gqa, n_kv);
+    lm_ggml_tensor * v    = lm_ggml_new_tensor_2d(ctx, type_v, n_embd_gqa, n_kv);
+    lm_ggml_tensor * mask = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_kv, LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD));
+
+    memcpy(q->data, in.q.data(), lm_ggml_nbytes(q));
+    set_rows(k, in.k.data());
+    set_rows(v, in.v.data());
+    lm_ggml_fp32_to_fp16_row(in.mask.data(), (lm_ggml_fp16_t *) mask->data, lm_ggml_nelements(mask));
+
+    lm_ggml_tensor * cur = lm_ggml_flash_attn_ext(ctx, lm_ggml_permute(ctx, q, 0, 2, 1, 3), kv_view(ctx, k, n_kv), kv_view(ctx, v, n_kv), mask,
+            1.0f/sqrtf(head_dim), 0.0f, 0.0f);
+    lm_ggml_flash_attn_ext_set_prec(cur, LM_GGML_PREC_F32);
+
+    if (recent) {
+        lm_ggml_tensor * k_recent = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd_gqa, n_recent + 1);
+        lm_ggml_tensor * v_recent = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd_gqa, n_recent + 1);
+        lm_ggml_tensor * slot     = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_I32, n_kv);
+
+        set_rows(k_recent, recent->k.data());
+        set_rows(v_recent, recent->v.data());
+        memcpy(slot->data, recent->slot.data(), lm_ggml_nbytes(slot));
+
+        lm_ggml_flash_attn_ext_add_recent(cur, kv_view(ctx, k_recent, n_recent), kv_view(ctx, v_recent, n_recent), slot);
+    }
+
+    lm_ggml_cgraph * gf = lm_ggml_new_graph(ctx);
+    lm_ggml_build_forward_expand(gf, cur);
+
+    lm_ggml_cplan cplan = lm_ggml_graph_plan(gf, n_threads, nullptr);
+
+    std::vector<uint8_t> work(cplan.work_size);
+    cplan.work_data = work.data();
+
+    LM_GGML_ASSERT(lm_ggml_graph_compute(gf, &cplan) == LM_GGML_STATUS_SUCCESS);
+
+    std::vector<float> out(lm_ggml_nelements(cur));
+    memcpy(out.data(), cur->data, lm_ggml_nbytes(cur));
+
+    lm_ggml_free(ctx);
+
+    return out;
+}
+
+// plain softmax(q*k^T)*v in double precision from F32 K/V rows
+static std::vector<float> attention(const fa_inputs & in, const std::vector<float> & k, const std::vector<float> & v) {
+    std::vector<float> out((size_t) head_dim*n_head*n_tokens);
+
+    for (int t = 0; t < n_tokens; t++) {
+        for (int h = 0; h < n_head; h++) {
+            const float * q  = in.q.data() + ((size_t) t*n_head + h)*head_dim;
+            const int     hk = h/(n_head/n_head_kv);
+
+            std::vector<double> w(n_kv, 0.0);
+            double w_max = -INFINITY;
+
+            for (int j = 0; j < n_kv; j++) {
+                if (in.mask[(size_t) t*n_kv + j] == -INFINITY) {
+                    continue;
+                }
+
+                double s = 0.0;
+                for (int d = 0; d < head_dim; d++) {
+                    s += (double) q[d]*k[(size_t) j*n_embd_gqa + hk*head_dim + d];
+                }
+                w[j]  = s/sqrt((double) head_dim);
+                w_max = std::max(w_max, w[j]);
+            }
+
+            double sum = 0.0;
+            for (int j = 0; j < n_kv; j++) {
+                w[j] = in.mask[(size_t) t*n_kv + j] == -INFINITY ? 0.0 : exp(w[j] - w_max);
+                sum += w[j];
+            }
+
+            for (int d = 0; d < head_dim; d++) {
+                double acc = 0.0;
+                for (int j = 0; j < n_kv; j++) {
+                    acc += w[j]*v[(size_t) j*n_embd_gqa + hk*head_dim + d];
+                }
+                out[((size_t) t*n_head + h)*head_dim + d] = acc/sum;
+            }
+        }
+    }
+
+    return out;
+}
+
+static double max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    double res = 0.0;
+    for (size_t i = 0; i < a.size(); i++) {
+        res = std::max(res, (double) fabsf(a[i] - b[i]));
+    }
+    return res;
+}
+
+// a quantized V row must give the same result as the same row dequantized to F32
+static bool test_fused_v(const fa_inputs & in, lm_ggml_type type_v, int n_threads) {
+    lm_ggml_init_params params = { 1024*1024, nullptr, false };
+    lm_ggml_context * ctx = lm_ggml_init(params);
+
+    lm_ggml_tensor * v = lm_ggml_new_tensor_2d(ctx, type_v, n_embd_gqa, n_kv);
+    set_rows(v, in.v.data());
+
+    fa_inputs in_deq = in;
+    in_deq.v = get_rows(v);
+
+    lm_ggml_free(ctx);
+
+    const double diff = max_diff(flash_attn(in, LM_GGML_TYPE_Q8_0, type_v, nullptr, n_threads), flash_attn(in_deq, LM_GGML_TYPE_Q8_0, LM_GGML_TYPE_F32, nullptr, n_threads));
+    const bool ok = diff < 1e-5;
+
+    printf("fused V %-6s, %d threads: max diff %.2e: %s\n", lm_ggml_type_name(type_v), n_threads, diff, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+// cells [n_kv - n_recent - 20, n_kv - 20) have F16 copies, stored at a rotated slot as in the cache ring
+static fa_recent make_recent(const fa_inputs & in) {
+    fa_recent res;
+
+    res.k.assign((size_t) n_embd_gqa*(n_recent + 1), 0.0f);
+    res.v.assign((size_t) n_embd_gqa*(n_recent + 1), 0.0f);
+    res.slot.assign(n_kv, -1);
+
+    for (int j = n_kv - n_recent - 20; j < n_kv - 20; j++) {
+        const int s = j % n_recent;
+
+        memcpy(res.k.data() + (size_t) s*n_embd_gqa, in.k.data() + (size_t) j*n_embd_gqa, n_embd_gqa*sizeof(float));
+        memcpy(res.v.data() + (size_t) s*n_embd_gqa, in.v.data() + (size_t) j*n_embd_gqa, n_embd_gqa*sizeof(float));
+
+        res.slot[j] = s;
+    }
+
+    return res;
+}
+
+static bool test_recent(const fa_inputs & in, lm_ggml_type type_kv, int n_threads) {
+    bool ok = true;
+
+    const fa_recent recent = make_recent(in);
+
+    // the same data in the cache and in the copies gives the same result bit for bit
+    if (type_kv == LM_GGML_TYPE_F16) {
+        const bool same = flash_attn(in, type_kv, type_kv, &recent, n_threads) == flash_attn(in, type_kv, type_kv, nullptr, n_threads);
+        printf("recent %-6s, %d threads: same as without copies: %s\n", lm_ggml_type_name(type_kv), n_threads, same ? "OK" : "FAIL");
+        return same;
+    }
+
+    // with no copies, only the cache rows are read
+    {
+        fa_recent none = recent;
+        none.slot.assign(n_kv, -1);
+
+        const bool same = flash_attn(in, type_kv, type_kv, &none, n_threads) == flash_attn(in, type_kv, type_kv, nullptr, n_threads);
+        printf("recent %-6s, %d threads: no copies: %s\n", lm_ggml_type_name(type_kv), n_threads, same ? "OK" : "FAIL");
+        ok = ok && same;
+    }
+
+    // the expected result uses the F16 rows for the cells with a copy and the quantized rows for the others
+    lm_ggml_init_params params = { 4*1024*1024, nullptr, false };
+    lm_ggml_context * ctx = lm_ggml_init(params);
+
+    lm_ggml_tensor * k_q = lm_ggml_new_tensor_2d(ctx, type_kv,           n_embd_gqa, n_kv);
+    lm_ggml_tensor * v_q = lm_ggml_new_tensor_2d(ctx, type_kv,           n_embd_gqa, n_kv);
+    lm_ggml_tensor * k_h = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd_gqa, n_kv);
+    lm_ggml_tensor * v_h = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd_gqa, n_kv);
+    set_rows(k_q, in.k.data());
+    set_rows(v_q, in.v.data());
+    set_rows(k_h, in.k.data());
+    set_rows(v_h, in.v.data());
+
+    const std::vector<float> k_cache = get_rows(k_q);
+    const std::vector<float> v_cache = get_rows(v_q);
+
+    std::vector<float> k_mixed = k_cache;
+    std::vector<float> v_mixed = v_cache;
+    {
+        const std::vector<float> k_f16 = get_rows(k_h);
+        const std::vector<float> v_f16 = get_rows(v_h);
+
+        for (int j = 0; j < n_kv; j++) {
+            if (recent.slot[j] >= 0) {
+                memcpy(k_mixed.data() + (size_t) j*n_embd_gqa, k_f16.data() + (size_t) j*n_embd_gqa, n_embd_gqa*sizeof(float));
+                memcpy(v_mixed.data() + (size_t) j*n_embd_gqa, v_f16.data() + (size_t) j*n_embd_gqa, n_embd_gqa*sizeof(float));
+            }
+        }
+    }
+
+    lm_ggml_free(ctx);
+
+    const std::vector<float> out = flash_attn(in, type_kv, type_kv, &recent, n_threads);
+
+    // Q is quantized to the K dot product type, the tolerance covers that
+    const double diff_mixed = max_diff(out, attention(in, k_mixed, v_mixed));
+    const double diff_cache = max_diff(out, attention(in, k_cache, v_cache));
+
+    // and the copies must be what was read, the 4-bit cache rows differ by much more than the tolerance
+    const bool read_ok = diff_mixed < 2e-3 && diff_cache > 4*diff_mixed;
+
+    printf("recent %-6s, %d threads: max diff %.2e, %.2e to the cache rows: %s\n",
+            lm_ggml_type_name(type_kv), n_threads, diff_mixed, diff_cache, read_ok ? "OK" : "FAIL");
+
+    return ok && read_ok;
+}
+
+// a quantized cache and its F16 copies of the recent cells, updated with the rules of llama_kv_cache_unified:
+// cell i is stored in row i % n_recent, a cell replaced within the same ubatch is stored in the spare row n_recent,
+// only the cell stored last in a row reads it, and a K-shift or a defrag drops all copies
+struct fa_cache {
+    lm_ggml_context * ctx = nullptr;
+
+    lm_ggml_tensor * k        = nullptr; // [n_embd_gqa, n_kv]
+    lm_ggml_tensor * v        = nullptr;
+    lm_ggml_tensor * k_recent = nullptr; // [n_embd_gqa, n_recent + 1], F16
+    lm_ggml_tensor * v_recent = nullptr;
+
+    std::vector<int32_t> recent_cells; // [n_recent], the cell stored last in each row, or -1
+    std::vector<bool>    used;         // [n_kv]
+
+    // the stored rows before quantization, [n_embd_gqa, n_kv]
+    std::vector<float> k_src;
+    std::vector<float> v_src;
+
+    fa_cache(lm_ggml_type type_kv) :
+        recent_cells(n_recent, -1),
+        used(n_kv, false),
+        k_src((size_t) n_embd_gqa*n_kv, 0.0f),
+        v_src((size_t) n_embd_gqa*n_kv, 0.0f) {
+        lm_ggml_init_params params = { 4*1024*1024, nullptr, false };
+        ctx = lm_ggml_init(params);
+
+        k        = lm_ggml_new_tensor_2d(ctx, type_kv,           n_embd_gqa, n_kv);
+        v        = lm_ggml_new_tensor_2d(ctx, type_kv,           n_embd_gqa, n_kv);
+        k_recent = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd_gqa, n_recent + 1);
+        v_recent = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd_gqa, n_recent + 1);
+
+        set_rows(k, k_src.data());
+        set_rows(v, v_src.data());
+        memset(k_recent->data, 0, lm_ggml_nbytes(k_recent));
+        memset(v_recent->data, 0, lm_ggml_nbytes(v_recent));
+    }
+
+    ~fa_cache() {
+        lm_ggml_free(ctx);
+    }
+
+    // stores the rows with lm_ggml_set_rows() into the cells and, if recent_idxs is given, into the F16 copies
+    void write(const std::vector<int32_t> & idxs, const float * k_cur, const float * v_cur, const std::vector<int64_t> * recent_idxs, int n_threads) {
+        const int64_t n = idxs.size();
+
+        lm_ggml_init_params params = { 4*1024*1024, nullptr, false };
+        lm_ggml_context * ctx_cur = lm_ggml_init(params);
+
+        lm_ggml_tensor * kc = lm_ggml_new_tensor_2d(ctx_cur, LM_GGML_TYPE_F32, n_embd_gqa, n);
+        lm_ggml_tensor * vc = lm_ggml_new_tensor_2d(ctx_cur, LM_GGML_TYPE_F32, n_embd_gqa, n);
+        lm_ggml_tensor * ki = lm_ggml_new_tensor_1d(ctx_cur, LM_GGML_TYPE_I64, n);
+
+        memcpy(kc->data, k_cur, lm_ggml_nbytes(kc));
+        memcpy(vc->data, v_cur, lm_ggml_nbytes(vc));
+        for (int64_t i = 0; i < n; i++) {
+            ((int64_t *) ki->data)[i] = idxs[i];
+        }
+
+        lm_ggml_cgraph * gf = lm_ggml_new_graph(ctx_cur);
+        lm_ggml_build_forward_expand(gf, lm_ggml_set_rows(ctx_cur, k, kc, ki));
+        lm_ggml_build_forward_expand(gf, lm_ggml_set_rows(ctx_cur, v, vc, ki));
+
+        if (recent_idxs) {
+            lm_ggml_tensor * ri = lm_ggml_new_tensor_1d(ctx_cur, LM_GGML_TYPE_I64, n);
+            memcpy(ri->data, recent_idxs->data(), lm_ggml_nbytes(ri));
+
+            lm_ggml_build_forward_expand(gf, lm_ggml_set_rows(ctx_cur, k_recent, kc, ri));
+            lm_ggml_build_forward_expand(gf, lm_ggml_set_rows(ctx_cur, v_recent, vc, ri));
+        }
+
+        lm_ggml_cplan cplan = lm_ggml_graph_plan(gf, n_threads, nullptr);
+
+        std::vector<uint8_t> work(cplan.work_size);
+        cplan.work_data = work.data();
+
+        LM_GGML_ASSERT(lm_ggml_graph_compute(gf, &cplan) == LM_GGML_STATUS_SUCCESS);
+
+        lm_ggml_free(ctx_cur);
+    }
+
+    // a ubatch of new tokens in the given cells
+    void store(const std::vector<int32_t> & idxs, uint32_t seed, int n_threads) {
+        const size_t n = idxs.size();
+
+        const std::vector<float> k_cur = random_data(n*n_embd_gqa, seed);
+        const std::vector<float> v_cur = random_data(n*n_embd_gqa, seed + 1);
+
+        for (size_t i = 0; i < n; i++) {
+            memcpy(k_src.data() + (size_t) idxs[i]*n_embd_gqa, k_cur.data() + i*n_embd_gqa, n_embd_gqa*sizeof(float));
+            memcpy(v_src.data() + (size_t) idxs[i]*n_embd_gqa, v_cur.data() + i*n_embd_gqa, n_embd_gqa*sizeof(float));
+
+            used[idxs[i]] = true;
+
+            recent_cells[idxs[i] % n_recent] = idxs[i];
+        }
+
+        std::vector<int64_t> recent_idxs(n);
+        for (size_t i = 0; i < n; i++) {
+            recent_idxs[i] = recent_cells[idxs[i] % n_recent] == idxs[i] ? idxs[i] % n_recent : n_recent;
+        }
+
+        write(idxs, k_cur.data(), v_cur.data(), &recent_idxs, n_threads);
+    }
+
+    void erase(int32_t i0, int32_t i1) {
+        for (int32_t i = i0; i < i1; i++) {
+            used[i] = false;
+        }
+    }
+
+    // K of every used cell changes in the cache only, as the RoPE shift does
+    void shift(int n_threads) {
+        std::vector<int32_t> idxs;
+        std::vector<float>   k_cur;
+        std::vector<float>   v_cur;
+
+        for (int32_t i = 0; i < n_kv; i++) {
+            if (!used[i]) {
+                continue;
+            }
+
+            for (int d = 0; d < n_embd_gqa; d++) {
+                k_src[(size_t) i*n_embd_gqa + d] = -0.5f*k_src[(size_t) i*n_embd_gqa + d];
+            }
+
+            idxs.push_back(i);
+            k_cur.insert(k_cur.end(), k_src.begin() + (size_t) i*n_embd_gqa, k_src.begin() + (size_t) (i + 1)*n_embd_gqa);
+            v_cur.insert(v_cur.end(), v_src.begin() + (size_t) i*n_embd_gqa, v_src.begin() + (size_t) (i + 1)*n_embd_gqa);
+        }
+
+        write(idxs, k_cur.data(), v_cur.data(), nullptr, n_threads);
+
+        std::fill(recent_cells.begin(), recent_cells.end(), -1);
+    }
+
+    // moves the used cells to the front, copying the cache rows as the defrag graph does
+    void defrag() {
+        int32_t dst = 0;
+
+        for (int32_t i = 0; i < n_kv; i++) {
+            if (!used[i]) {
+                continue;
+            }
+
+            if (i != dst) {
+                memcpy((char *) k->data + dst*k->nb[1], (const char *) k->data + i*k->nb[1], k->nb[1]);
+                memcpy((char *) v->data + dst*v->nb[1], (const char *) v->data + i*v->nb[1], v->nb[1]);
+                memcpy(k_src.data() + (size_t) dst*n_embd_gqa, k_src.data() + (size_t) i*n_embd_gqa, n_embd_gqa*sizeof(float));
+                memcpy(v_src.data() + (size_t) dst*n_embd_gqa, v_src.data() + (size_t) i*n_embd_gqa, n_embd_gqa*sizeof(float));
+
+                used[dst] = true;
+                used[i]   = false;
+            }
+
+            dst++;
+        }
+
+        std::fill(recent_cells.begin(), recent_cells.end(), -1);
+    }
+
+    // the kv_recent input: the row of each used cell that still owns one
+    std::vector<int32_t> kv_recent() const {
+        std::vector<int32_t> res(n_kv, -1);
+
+        for (int32_t s = 0; s < n_recent; s++) {
+            const int32_t idx = recent_cells[s];
+
+            if (idx >= 0 && used[idx]) {
+                res[idx] = s;
+            }
+        }
+
+        return res;
+    }
+};
+
+// attention of the query tokens over the used cells of the cache, with or without the F16 copies
+static std::vector<float> flash_attn_cache(const fa_inputs & in, const fa_cache & cache, bool with_recent, int n_threads) {
+    lm_ggml_init_params params = { 16*1024*1024, nullptr, false };
+    lm_ggml_context * ctx = lm_ggml_init(params);
+
+    lm_ggml_tensor * q    = lm_ggml_new_tensor_3d(ctx, LM_GGML_TYPE_F32, head_dim, n_head, n_tokens);
+    lm_ggml_tensor * mask = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_kv, LM_GGML_PAD(n_tokens, LM_GGML_KQ_MASK_PAD));
+
+    memcpy(q->data, in.q.data(), lm_ggml_nbytes(q));
+    lm_ggml_fp32_to_fp16_row(in.mask.data(), (lm_ggml_fp16_t *) mask->data, lm_ggml_nelements(mask));
+
+    lm_ggml_tensor * cur = lm_ggml_flash_attn_ext(ctx, lm_ggml_permute(ctx, q, 0, 2, 1, 3), kv_view(ctx, cache.k, n_kv), kv_view(ctx, cache.v, n_kv), mask,
+            1.0f/sqrtf(head_dim), 0.0f, 0.0f);
+    lm_ggml_flash_attn_ext_set_prec(cur, LM_GGML_PREC_F32);
+
+    if (with_recent) {
+        lm_ggml_tensor * kv_recent = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_I32, n_kv);
+
+        const std::vector<int32_t> rows = cache.kv_recent();
+        memcpy(kv_recent->data, rows.data(), lm_ggml_nbytes(kv_recent));
+
+        lm_ggml_flash_attn_ext_add_recent(cur, kv_view(ctx, cache.k_recent, n_recent), kv_view(ctx, cache.v_recent, n_recent), kv_recent);
+    }
+
+    lm_ggml_cgraph * gf = lm_ggml_new_graph(ctx);
+    lm_ggml_build_forward_expand(gf, cur);
+
+    lm_ggml_cplan cplan = lm_ggml_graph_plan(gf, n_threads, nullptr);
+
+    std::vector<uint8_t> work(cplan.work_size);
+    cplan.work_data = work.data();
+
+    LM_GGML_ASSERT(lm_ggml_graph_compute(gf, &cplan) == LM_GGML_STATUS_SUCCESS);
+
+    std::vector<float> out(lm_ggml_nelements(cur));
+    memcpy(out.data(), cur->data, lm_ggml_nbytes(cur));
+
+    lm_ggml_free(ctx);
+
+    return out;
+}
+
+// the window must read the same rows as an F16 cache holding the stored rows of the cells with a copy
+// and the quantized rows of the others
+static bool check_cache(const char * step, const fa_inputs & in, const fa_cache & cache, int n_threads) {
+    fa_inputs ref = in;
+
+    for (int i = 0; i < n_tokens; i++) {
+        for (int j = 0; j < n_kv; j++) {
+            ref.mask[(size_t) i*n_kv + j] = cache.used[j] ? 0.0f : -INFINITY;
+        }
+    }
+
+    const std::vector<int32_t> rows = cache.kv_recent();
+
+    ref.k = get_rows(cache.k);
+    ref.v = get_rows(cache.v);
+
+    int n_copies = 0;
+    for (int j = 0; j < n_kv; j++) {
+        if (rows[j] >= 0) {
+            memcpy(ref.k.data() + (size_t) j*n_embd_gqa, cache.k_src.data() + (size_t) j*n_embd_gqa, n_embd_gqa*sizeof(float));
+            memcpy(ref.v.data() + (size_t) j*n_embd_gqa, cache.v_src.data() + (size_t) j*n_embd_gqa, n_embd_gqa*sizeof(float));
+            n_copies++;
+        }
+    }
+
+    const std::vector<float> out      = flash_attn_cache(ref, cache, true,  n_threads);
+    const std::vector<float> out_none = flash_attn_cache(ref, cache, false, n_threads);
+
+    bool ok;
+    if (n_copies == 0) {
+        // nothing to read from the copies, the rows of the cache are read as without them
+        ok = out == out_none;
+
+        printf("recent cache %-6s, %d threads, %-24s: no copies, same as the cache: %s\n",
+                lm_ggml_type_name(cache.k->type), n_threads, step, ok ? "OK" : "FAIL");
+    } else {
+        // Q is quantized to the K dot product type, the tolerance covers that
+        const double diff      = max_diff(out, flash_attn(ref, LM_GGML_TYPE_F16, LM_GGML_TYPE_F16, nullptr, n_threads));
+        const double diff_none = max_diff(out, out_none);
+
+        ok = diff < 2e-3 && diff_none > 4*diff;
+
+        printf("recent cache %-6s, %d threads, %-24s: %3d copies, max diff %.2e to F16, %.2e to the cache: %s\n",
+                lm_ggml_type_name(cache.k->type), n_threads, step, n_copies, diff, diff_none, ok ? "OK" : "FAIL");
+    }
+
+    return ok;
+}
+
+static std::vector<int32_t> cell_range(int32_t i0, int32_t i1) {
+    std::vector<int32_t> res;
+    for (int32_t i = i0; i < i1; i++) {
+        res.push_back(i);
+    }
+    return res;
+}
+
+static bool test_recent_cache(const fa_inputs & in, lm_ggml_type type_kv, int n_threads) {
+    bool ok = true;
+
+    fa_cache cache(type_kv);
+
+    // a prompt of twice the window: the first cells of each row are replaced within the ubatch
+    cache.store(cell_range(0, 2*n_recent + 4), 10, n_threads);
+    ok = check_cache("prompt past the window", in, cache, n_threads) && ok;
+
+    // single tokens wrap around the rows one at a time
+    for (int32_t i = 2*n_recent + 4; i < 2*n_recent + 16; i++) {
+        cache.store({ i }, 20 + i, n_threads);
+    }
+    ok = check_cache("single tokens", in, cache, n_threads) && ok;
+
+    // cells freed and reused take the rows of newer cells, those read the cache again
+    cache.erase(20, 40);
+    cache.store(cell_range(20, 25), 30, n_threads);
+    ok = check_cache("reused cells", in, cache, n_threads) && ok;
+
+    // the copies hold the unshifted K
+    cache.shift(n_threads);
+    ok = check_cache("after a K-shift", in, cache, n_threads) && ok;
+
+    cache.store(cell_range(2*n_recent + 16, 2*n_recent + 18), 40, n_threads);
+    ok = check_cache("stored after the K-shift", in, cache, n_threads) && ok;
+
+    // the moved cells no longer match the rows of their copies
+    cache.defrag();
+    ok = check_cache("after a defrag", in, cache, n_threads) && ok;
+
+    int32_t n_used = 0;
+    for (int32_t i = 0; i < n_kv; i++) {
+        n_used += cache.used[i] ? 1 : 0;
+    }
+
+    cache.store(cell_range(n_used, n_used + 8), 50, n_threads);
+    ok = check_cache("stored after the defrag", in, cache, n_threads) && ok;
+
+    return ok;
+}
+
+int main() {
+    lm_ggml_cpu_init();
+
+    const fa_inputs in;
+
+    bool ok = true;
+
+    for (int n_threads : { 1, 3 }) {
+        for (lm_ggml_type type : { LM_GGML_TYPE_Q8_0, LM_GGML_TYPE_Q4_0, LM_GGML_TYPE_Q4_1, LM_GGML_TYPE_Q5_0, LM_GGML_TYPE_Q5_1, LM_GGML_TYPE_IQ4_NL }) {
+            ok = test_fused_v(in, type, n_threads) && ok;
+        }
+
+        for (lm_ggml_type type : { LM_GGML_TYPE_F16, LM_GGML_TYPE_Q4_0, LM_GGML_TYPE_IQ4_NL }) {
+            ok = test_recent(in, type, n_threads) && ok;
+        }
+
+        for (lm_ggml_type type : { LM_GGML_TYPE_Q4_0, LM_GGML_TYPE_IQ4_NL }) {
+            ok = test_recent_cache(in, type, n_threads) && ok;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
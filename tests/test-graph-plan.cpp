@@ -0,0 +1,228 @@
+// Compares the planned CPU executor (dependency waits, fused chains, plan reuse) with running the
+// same graph one node at a time, which needs neither dependency tracking nor fusion.
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+#include "ggml-impl.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+struct test_graph {
+    lm_ggml_context * ctx = nullptr;
+    lm_ggml_cgraph  * gf  = nullptr;
+
+    ~test_graph() {
+        lm_ggml_free(ctx);
+    }
+};
+
+static void compute(lm_ggml_cgraph * gf, int n_threads, lm_ggml_threadpool * tp) {
+    lm_ggml_cplan cplan = lm_ggml_graph_plan(gf, n_threads, tp);
+
+    std::vector<uint8_t> work(cplan.work_size);
+    cplan.work_data = work.data();
+
+    LM_GGML_ASSERT(lm_ggml_graph_compute(gf, &cplan) == LM_GGML_STATUS_SUCCESS);
+}
+
+static void compute_sequential(lm_ggml_cgraph * gf, int n_threads) {
+    for (int i = 0; i < lm_ggml_graph_n_nodes(gf); i++) {
+        lm_ggml_cgraph view = lm_ggml_graph_view(gf, i, i + 1);
+        compute(&view, n_threads, nullptr);
+    }
+}
+
+// inputs get the same values before every run, node outputs are poisoned so that a skipped node is noticed
+static void reset(lm_ggml_context * ctx) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    for (lm_ggml_tensor * t = lm_ggml_get_first_tensor(ctx); t; t = lm_ggml_get_next_tensor(ctx, t)) {
+        if (t->view_src != nullptr || (t->type != LM_GGML_TYPE_F32 && t->type != LM_GGML_TYPE_F16)) {
+            continue;
+        }
+
+        const int64_t n = lm_ggml_nelements(t);
+        std::vector<float> data(n);
+        for (auto & v : data) {
+            v = t->op == LM_GGML_OP_NONE ? dist(rng) : NAN;
+        }
+
+        if (t->type == LM_GGML_TYPE_F32) {
+            memcpy(t->data, data.data(), n*sizeof(float));
+        } else {
+            lm_ggml_fp32_to_fp16_row(data.data(), (lm_ggml_fp16_t *) t->data, n);
+        }
+    }
+}
+
+static std::vector<uint8_t> snapshot(lm_ggml_context * ctx) {
+    std::vector<uint8_t> out;
+
+    for (lm_ggml_tensor * t = lm_ggml_get_first_tensor(ctx); t; t = lm_ggml_get_next_tensor(ctx, t)) {
+        if (t->view_src == nullptr) {
+            const uint8_t * data = (const uint8_t *) t->data;
+            out.insert(out.end(), data, data + lm_ggml_nbytes(t));
+        }
+    }
+
+    return out;
+}
+
+static lm_ggml_context * new_context() {
+    lm_ggml_init_params params = {
+        /*.mem_size   =*/ 64*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    return lm_ggml_init(params);
+}
+
+// transformer-like layers: ADD -> RMS_NORM -> MUL, and ROPE -> RESHAPE -> SET_ROWS with the V projection
+// emitted between the rope and the KV store, as in the llama graphs
+static void build_fused(test_graph & tg) {
+    const int n_embd = 64, n_head = 4, head_dim = n_embd/n_head, n_tokens = 7, n_kv = 32, n_layer = 3;
+
+    tg.ctx = new_context();
+    lm_ggml_context * ctx = tg.ctx;
+
+    tg.gf = lm_ggml_new_graph(ctx);
+
+    lm_ggml_tensor * pos  = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_I32, n_tokens);
+    lm_ggml_tensor * idxs = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_I64, n_tokens);
+    for (int i = 0; i < n_tokens; i++) {
+        ((int32_t *) pos->data)[i]  = 5 + i;
+        ((int64_t *) idxs->data)[i] = 2*i + 3;
+    }
+
+    lm_ggml_tensor * x = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, n_embd, n_tokens);
+
+    for (int il = 0; il < n_layer; il++) {
+        lm_ggml_tensor * h      = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, n_embd, n_tokens);
+        lm_ggml_tensor * norm_w = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_F32, n_embd);
+        lm_ggml_tensor * wk     = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, n_embd, n_embd);
+        lm_ggml_tensor * wv     = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, n_embd, n_embd);
+        lm_ggml_tensor * k_l    = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd, n_kv);
+        lm_ggml_tensor * v_l    = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F16, n_embd, n_kv);
+
+        x = lm_ggml_add(ctx, x, h);
+
+        lm_ggml_tensor * cur = lm_ggml_rms_norm(ctx, x, 1e-5f);
+        cur = lm_ggml_mul(ctx, cur, norm_w);
+
+        lm_ggml_tensor * k = lm_ggml_mul_mat(ctx, wk, cur);
+        k = lm_ggml_reshape_3d(ctx, k, head_dim, n_head, n_tokens);
+        k = lm_ggml_rope(ctx, k, pos, head_dim, 0);
+        lm_ggml_build_forward_expand(tg.gf, k);
+
+        lm_ggml_tensor * v = lm_ggml_mul_mat(ctx, wv, cur);
+        lm_ggml_build_forward_expand(tg.gf, v);
+
+        lm_ggml_build_forward_expand(tg.gf, lm_ggml_set_rows(ctx, k_l, lm_ggml_reshape_2d(ctx, k, n_embd, n_tokens), idxs));
+        lm_ggml_build_forward_expand(tg.gf, lm_ggml_set_rows(ctx, v_l, v, idxs));
+
+        // a norm that only feeds the next layer's residual, without the weight multiplication
+        x = lm_ggml_add(ctx, x, lm_ggml_rms_norm(ctx, v, 1e-5f));
+    }
+
+    lm_ggml_build_forward_expand(tg.gf, x);
+}
+
+// a long chain of small nodes reading and writing earlier results, in place and through overlapping views
+// of a shared buffer, so that dependencies reach far beyond the ring of tracked nodes
+static void build_dependencies(test_graph & tg) {
+    const int ne0 = 32, ne1 = 8, n_rows = 40, n_ops = 400;
+
+    tg.ctx = new_context();
+    lm_ggml_context * ctx = tg.ctx;
+
+    tg.gf = lm_ggml_new_graph(ctx);
+
+    std::mt19937 rng(1234);
+    auto pick = [&](int n) { return (int) (rng() % n); };
+
+    lm_ggml_tensor * shared = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, ne0, n_rows);
+    lm_ggml_tensor * w      = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, ne0, ne0);
+
+    auto shared_view = [&]() {
+        return lm_ggml_view_2d(ctx, shared, ne0, ne1, shared->nb[1], pick(n_rows - ne1 + 1)*shared->nb[1]);
+    };
+
+    // a single op must not write a region it also reads at another offset, which is a race on its own
+    auto is_shared = [&](const lm_ggml_tensor * t) { return t == shared || t->view_src == shared; };
+
+    std::vector<lm_ggml_tensor *> pool;
+    for (int i = 0; i < 4; i++) {
+        pool.push_back(lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, ne0, ne1));
+    }
+
+    for (int i = 0; i < n_ops; i++) {
+        lm_ggml_tensor * a = pool[pick((int) pool.size())];
+        lm_ggml_tensor * b = pick(4) == 0 ? shared_view() : pool[pick((int) pool.size())];
+
+        lm_ggml_tensor * cur = nullptr;
+
+        switch (pick(8)) {
+            case 0:  cur = lm_ggml_add(ctx, a, b);                                     break;
+            case 1:  cur = lm_ggml_mul(ctx, a, b);                                     break;
+            case 2:  cur = lm_ggml_scale(ctx, a, 0.5f);                                break;
+            case 3:  cur = lm_ggml_rms_norm(ctx, a, 1e-5f);                            break;
+            case 4:  cur = lm_ggml_mul_mat(ctx, w, a);                                 break;
+            case 5:  cur = a->op != LM_GGML_OP_NONE && !is_shared(a) ? lm_ggml_add_inplace(ctx, a, b) : lm_ggml_sub(ctx, a, b); break;
+            case 6:  cur = !is_shared(a) ? lm_ggml_cpy(ctx, a, shared_view()) : lm_ggml_scale(ctx, a, 2.0f); break;
+            default: cur = lm_ggml_add(ctx, lm_ggml_rms_norm(ctx, a, 1e-5f), b);        break;
+        }
+
+        lm_ggml_build_forward_expand(tg.gf, cur);
+        pool.push_back(cur);
+    }
+}
+
+static bool run(const char * name, void (*build)(test_graph &), int n_threads) {
+    test_graph tg;
+    build(tg);
+
+    reset(tg.ctx);
+    compute_sequential(tg.gf, n_threads);
+    const std::vector<uint8_t> expected = snapshot(tg.ctx);
+
+    lm_ggml_threadpool_params tpp = lm_ggml_threadpool_params_default(n_threads);
+    lm_ggml_threadpool * tp = lm_ggml_threadpool_new(&tpp);
+
+    bool ok = true;
+
+    // the second run reuses the plan of the first one
+    for (int r = 0; r < 2; r++) {
+        reset(tg.ctx);
+        compute(tg.gf, n_threads, tp);
+
+        if (snapshot(tg.ctx) != expected) {
+            printf("%s, %d threads, run %d: planned execution differs from the sequential one\n", name, n_threads, r);
+            ok = false;
+        }
+    }
+
+    lm_ggml_threadpool_free(tp);
+
+    printf("%s, %d threads, %d nodes: %s\n", name, n_threads, lm_ggml_graph_n_nodes(tg.gf), ok ? "OK" : "FAIL");
+    return ok;
+}
+
+int main() {
+    lm_ggml_cpu_init();
+
+    bool ok = true;
+
+    for (int n_threads : { 1, 2, 4 }) {
+        ok = run("fused", build_fused, n_threads) && ok;
+        ok = run("dependencies", build_dependencies, n_threads) && ok;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+// Compares the pre-tokenizer splits of the custom splitters and the compiled class sequences with
+// the plain std::regex path, for the regexes of every BPE pre-tokenizer in llama-vocab.cpp.
+
+// the split paths are file-local, so the translation unit is pulled in whole
+#include "unicode.cpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct test_preset {
+    const char * name;
+    std::vector<std::string> regex_exprs;
+};
+
+// keep in sync with llm_tokenizer_bpe in llama-vocab.cpp
+static const std::vector<test_preset> & test_presets() {
+    static const std::vector<test_preset> presets = {
+        { "llama3", {
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        }},
+        { "deepseek-llm", {
+            "[\r\n]",
+            "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
+            "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
+            "\\s+$",
+            "[一-龥ࠀ-一가-퟿]+",
+            "\\p{N}+",
+        }},
+        { "deepseek3-llm", {
+            "\\p{N}{1,3}",
+            "[一-龥぀-ゟ゠-ヿ]+",
+            "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+",
+        }},
+        { "deepseek-coder", {
+            "[\r\n]",
+            "\\s?\\p{L}+",
+            "\\s?\\p{P}+",
+            "[一-龥ࠀ-一가-퟿]+",
+            "\\p{N}",
+        }},
+        { "falcon", {
+            "[\\p{P}\\$\\+<=>\\^~\\|`]+",
+            "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            "[0-9][0-9][0-9]",
+        }},
+        { "starcoder", {
+            "\\p{N}",
+            "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        }},
+        { "gpt2", {
+            "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        }},
+        { "qwen2", {
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        }},
+        { "poro", {
+            " ?[^(\\s|.,!?…。，、।۔،)]+",
+        }},
+        { "viking", {
+            " ?[^(\\s|.,!?…。，、।۔،)]+",
+            "\\p{N}",
+        }},
+        { "tekken", {
+            "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        }},
+        { "chameleon", {
+            "<sentinel:[0-9]+>",
+            "(IMGIMG)((A|B|C|D|E|F|G|H|I){1,4})Z",
+            "([\\t\\n]|    |  )",
+            "\\p{N}",
+            "[\\p{P}!-/:-@\\[-`{-~]",
+            "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        }},
+        { "gpt4o", {
+            "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        }},
+        { "superbpe", {
+            "\\p{N}+",
+            "(?=(\\d{3})+(?!\\d))",
+        }},
+        { "bailingmoe", {
+            "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
+        }},
+        { "seed-coder", {
+            "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        }},
+        { "default", {
+            "[\\p{P}\\$\\+<=>\\^~\\|]+",
+            "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            "\\p{N}+",
+            "[0-9][0-9][0-9]",
+        }},
+    };
+    return presets;
+}
+
+// pieces the random strings are built from: every script and class boundary the presets care about
+static const std::vector<std::string> & test_pieces() {
+    static const std::vector<std::string> pieces = {
+        "a", "Z", "hello", "World", "MiXeD", "x", "IMGIMG", "ABZ", "<sentinel:12>",
+        "0", "7", "42", "1234", "9999999",
+        ".", ",", "!", "?", "-", "_", "/", "(", ")", "[", "]", "\\", "$", "+", "<", "=", ">", "^", "~", "|", "`", "\"", "#",
+        " ", " ", "  ", "    ", "\t", "\n", "\r\n", "\r", "\n\n", " \n ",
+        "'s", "'S", "'t", "'re", "'VE", "'m", "'ll", "'LL", "'d", "'x", "'",
+        "é", "Ñ", "ø", "µ", "ß",
+        "Ελλάδα", "Привет", "ДОМ",
+        "中文", "一", "龥", "字",
+        "한국어", "가",
+        "ひらがな", "カタカナ", "ー",
+        "مرحبا", "۔", "،", "٣",
+        "नमस्ते", "।", "१२",
+        "\xcc\x81", // combining acute accent
+        "😀", "👍🏽", "🇺🇸",
+        "Ａ", "ｚ", "！", "１",
+        "…", "。", "，", "、", "‘", "”",
+        "\xc2\xa0",     // no-break space
+        "\xe3\x80\x80", // ideographic space
+        "\xe2\x80\xa8", // line separator
+        "½", "Ⅻ", "²",
+        "€", "©", "→",
+    };
+    return pieces;
+}
+
+static std::string random_text(std::mt19937 & rng) {
+    const auto & pieces = test_pieces();
+    std::uniform_int_distribution<size_t> n_dist(1, 24);
+    std::uniform_int_distribution<size_t> piece_dist(0, pieces.size() - 1);
+
+    std::string text;
+    const size_t n = n_dist(rng);
+    for (size_t i = 0; i < n; i++) {
+        text += pieces[piece_dist(rng)];
+    }
+    return text;
+}
+
+static void print_split(const char * label, const std::vector<std::string> & words) {
+    printf("    %s:", label);
+    for (const auto & w : words) {
+        printf(" [%s]", w.c_str());
+    }
+    printf("\n");
+}
+
+// returns the number of texts that split differently, or -1 when std::regex rejects the regexes
+static int compare_splits(const char * name, const std::vector<std::string> & regex_exprs, const std::vector<std::string> & texts) {
+    int n_mismatch = 0;
+    for (const auto & text : texts) {
+        std::vector<std::string> expected;
+        try {
+            expected = unicode_regex_split_impl(text, regex_exprs, true);
+        } catch (const std::runtime_error &) {
+            return -1;
+        }
+
+        const auto actual = unicode_regex_split_impl(text, regex_exprs, false);
+        if (expected != actual) {
+            if (n_mismatch == 0) {
+                printf("  %s: text [%s]\n", name, text.c_str());
+                print_split("std::regex", expected);
+                print_split("fast path ", actual);
+            }
+            n_mismatch++;
+        }
+    }
+    return n_mismatch;
+}
+
+int main() {
+    const int n_texts = 2000;
+
+    std::mt19937 rng(1234);
+    std::vector<std::string> texts;
+    texts.reserve(n_texts);
+    for (int i = 0; i < n_texts; i++) {
+        texts.push_back(random_text(rng));
+    }
+
+    int n_fail = 0;
+    for (const auto & preset : test_presets()) {
+        int n_mismatch = compare_splits(preset.name, preset.regex_exprs, texts);
+        if (n_mismatch < 0) {
+            // some libstdc++ builds reject the wide ranges of deepseek-llm, the other regexes are still compared alone
+            n_mismatch = 0;
+            for (const auto & regex_expr : preset.regex_exprs) {
+                const int n = compare_splits(preset.name, { regex_expr }, texts);
+                if (n < 0) {
+                    printf("%-16s skipped a regex std::regex rejects: %.32s...\n", preset.name, regex_expr.c_str());
+                } else {
+                    n_mismatch += n;
+                }
+            }
+        }
+
+        printf("%-16s %s (%d/%d mismatches)\n", preset.name, n_mismatch == 0 ? "OK" : "FAIL", n_mismatch, n_texts);
+        if (n_mismatch != 0) {
+            n_fail++;
+        }
+    }
+
+    return n_fail == 0 ? 0 : 1;
+}